@@ -0,0 +1,341 @@
+#include "bvh.h"
+
+#include "km_debug.h"
+
+#define BVH_MAX_DEPTH 64
+
+internal inline AABB EmptyAABB()
+{
+    AABB box;
+    box.min = Vec3 { 1e30f, 1e30f, 1e30f };
+    box.max = Vec3 { -1e30f, -1e30f, -1e30f };
+    return box;
+}
+
+internal inline void GrowAABB(AABB* box, Vec3 p)
+{
+    for (int e = 0; e < 3; e++) {
+        box->min.e[e] = MinFloat32(box->min.e[e], p.e[e]);
+        box->max.e[e] = MaxFloat32(box->max.e[e], p.e[e]);
+    }
+}
+
+internal inline void GrowAABB(AABB* box, AABB other)
+{
+    for (int e = 0; e < 3; e++) {
+        box->min.e[e] = MinFloat32(box->min.e[e], other.min.e[e]);
+        box->max.e[e] = MaxFloat32(box->max.e[e], other.max.e[e]);
+    }
+}
+
+// Half the surface area, which is all SAH needs
+internal inline float32 HalfArea(AABB box)
+{
+    Vec3 d = box.max - box.min;
+    if (d.x < 0.0f) {
+        return 0.0f;
+    }
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+struct BVHBin
+{
+    AABB bounds;
+    int count;
+};
+
+internal void SubdivideBVHNode(BVH* bvh, int nodeIndex,
+    const AABB* bounds, int maxLeafSize, int depth)
+{
+    int first = bvh->nodes[nodeIndex].first;
+    int count = bvh->nodes[nodeIndex].count;
+    int* primitives = bvh->primitives.data;
+
+    AABB nodeBounds = EmptyAABB();
+    AABB centroidBounds = EmptyAABB();
+    for (int i = first; i < first + count; i++) {
+        AABB b = bounds[primitives[i]];
+        GrowAABB(&nodeBounds, b);
+        GrowAABB(&centroidBounds, (b.min + b.max) * 0.5f);
+    }
+    bvh->nodes[nodeIndex].bounds = nodeBounds;
+
+    if (count <= maxLeafSize || depth >= BVH_MAX_DEPTH) {
+        return;
+    }
+
+    // Binned SAH: try BVH_SAH_BINS - 1 planes per axis over the centroids
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float32 bestCost = HalfArea(nodeBounds) * (float32)count;
+    for (int axis = 0; axis < 3; axis++) {
+        float32 cMin = centroidBounds.min.e[axis];
+        float32 cMax = centroidBounds.max.e[axis];
+        if (cMax <= cMin) {
+            continue;
+        }
+        float32 scale = (float32)BVH_SAH_BINS / (cMax - cMin);
+
+        BVHBin bins[BVH_SAH_BINS];
+        for (int b = 0; b < BVH_SAH_BINS; b++) {
+            bins[b].bounds = EmptyAABB();
+            bins[b].count = 0;
+        }
+        for (int i = first; i < first + count; i++) {
+            AABB b = bounds[primitives[i]];
+            float32 c = (b.min.e[axis] + b.max.e[axis]) * 0.5f;
+            int bin = MinInt((int)((c - cMin) * scale), BVH_SAH_BINS - 1);
+            bins[bin].count++;
+            GrowAABB(&bins[bin].bounds, b);
+        }
+
+        // Sweep from the right to get the cost of every right side
+        float32 rightArea[BVH_SAH_BINS];
+        int rightCount[BVH_SAH_BINS];
+        AABB right = EmptyAABB();
+        int rightSum = 0;
+        for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+            GrowAABB(&right, bins[b].bounds);
+            rightSum += bins[b].count;
+            rightArea[b] = HalfArea(right);
+            rightCount[b] = rightSum;
+        }
+        AABB left = EmptyAABB();
+        int leftSum = 0;
+        for (int b = 1; b < BVH_SAH_BINS; b++) {
+            GrowAABB(&left, bins[b - 1].bounds);
+            leftSum += bins[b - 1].count;
+            if (leftSum == 0 || rightCount[b] == 0) {
+                continue;
+            }
+            float32 cost = HalfArea(left) * (float32)leftSum
+                + rightArea[b] * (float32)rightCount[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    if (bestAxis == -1) {
+        // Splitting doesn't pay off, or all centroids are in one spot
+        return;
+    }
+
+    float32 cMin = centroidBounds.min.e[bestAxis];
+    float32 scale = (float32)BVH_SAH_BINS
+        / (centroidBounds.max.e[bestAxis] - cMin);
+    int i = first;
+    int j = first + count - 1;
+    while (i <= j) {
+        AABB b = bounds[primitives[i]];
+        float32 c = (b.min.e[bestAxis] + b.max.e[bestAxis]) * 0.5f;
+        int bin = MinInt((int)((c - cMin) * scale), BVH_SAH_BINS - 1);
+        if (bin < bestSplit) {
+            i++;
+        }
+        else {
+            int temp = primitives[i];
+            primitives[i] = primitives[j];
+            primitives[j] = temp;
+            j--;
+        }
+    }
+    int leftCount = i - first;
+    if (leftCount == 0 || leftCount == count) {
+        return;
+    }
+
+    int children = (int)bvh->nodes.size;
+    BVHNode child;
+    child.bounds = nodeBounds;
+    child.first = first;
+    child.count = leftCount;
+    bvh->nodes.Append(child);
+    child.first = first + leftCount;
+    child.count = count - leftCount;
+    bvh->nodes.Append(child);
+
+    bvh->nodes[nodeIndex].first = children;
+    bvh->nodes[nodeIndex].count = 0;
+    SubdivideBVHNode(bvh, children, bounds, maxLeafSize, depth + 1);
+    SubdivideBVHNode(bvh, children + 1, bounds, maxLeafSize, depth + 1);
+}
+
+void BuildBVH(BVH* bvh, const AABB* bounds, int count, int maxLeafSize)
+{
+    DEBUG_ASSERT(maxLeafSize > 0);
+
+    // Roughly what a tree with full leaves needs; grows if it isn't enough
+    bvh->nodes.Init((uint32)MaxInt(count * 2 / maxLeafSize, 1));
+    bvh->primitives.Init((uint32)MaxInt(count, 1));
+    bvh->primitiveBounds.Init((uint32)MaxInt(count, 1));
+    if (count == 0) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        bvh->primitives.Append(i);
+    }
+    BVHNode root;
+    root.bounds = EmptyAABB();
+    root.first = 0;
+    root.count = count;
+    bvh->nodes.Append(root);
+    SubdivideBVHNode(bvh, 0, bounds, maxLeafSize, 0);
+
+    for (int i = 0; i < count; i++) {
+        bvh->primitiveBounds.Append(bounds[bvh->primitives[i]]);
+    }
+}
+
+void FreeBVH(BVH* bvh)
+{
+    bvh->nodes.Free();
+    bvh->primitives.Free();
+    bvh->primitiveBounds.Free();
+    *bvh = {};
+}
+
+int QueryBVH(const BVH* bvh, AABB box, int* results, int maxResults)
+{
+    if (bvh->nodes.size == 0) {
+        return 0;
+    }
+
+    int found = 0;
+    int stack[BVH_MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BVHNode& node = bvh->nodes.data[stack[--stackSize]];
+        if (!Overlaps(node.bounds, box)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                if (Overlaps(bvh->primitiveBounds.data[i], box)) {
+                    if (found < maxResults) {
+                        results[found] = bvh->primitives.data[i];
+                    }
+                    found++;
+                }
+            }
+        }
+        else {
+            stack[stackSize++] = node.first;
+            stack[stackSize++] = node.first + 1;
+        }
+    }
+
+    return found;
+}
+
+internal inline bool32 SegmentHitsAABB(AABB box,
+    Vec3 origin, Vec3 invDir, float32 tMax)
+{
+    float32 tNear = 0.0f;
+    float32 tFar = tMax;
+    for (int e = 0; e < 3; e++) {
+        float32 t1 = (box.min.e[e] - origin.e[e]) * invDir.e[e];
+        float32 t2 = (box.max.e[e] - origin.e[e]) * invDir.e[e];
+        tNear = MaxFloat32(tNear, MinFloat32(t1, t2));
+        tFar = MinFloat32(tFar, MaxFloat32(t1, t2));
+    }
+
+    return tNear <= tFar;
+}
+
+void TraceBVHSegment(const BVH* bvh, Vec3 origin, Vec3 dir, float32 tMax,
+    BVHSegmentFunc* func, void* data)
+{
+    if (bvh->nodes.size == 0) {
+        return;
+    }
+
+    // Zero components give infinities, which the slab test handles
+    Vec3 invDir = {
+        1.0f / dir.x,
+        1.0f / dir.y,
+        1.0f / dir.z
+    };
+
+    int stack[BVH_MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BVHNode& node = bvh->nodes.data[stack[--stackSize]];
+        if (!SegmentHitsAABB(node.bounds, origin, invDir, tMax)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                func(i, origin, dir, &tMax, data);
+            }
+        }
+        else {
+            stack[stackSize++] = node.first;
+            stack[stackSize++] = node.first + 1;
+        }
+    }
+}
+
+internal inline float32 DistanceSqToAABB(AABB box, Vec3 p)
+{
+    float32 distSq = 0.0f;
+    for (int e = 0; e < 3; e++) {
+        float32 d = MaxFloat32(box.min.e[e] - p.e[e],
+            MaxFloat32(p.e[e] - box.max.e[e], 0.0f));
+        distSq += d * d;
+    }
+    return distSq;
+}
+
+void QueryBVHNearest(const BVH* bvh, Vec3 point, float32 maxDistSq,
+    BVHPointFunc* func, void* data)
+{
+    if (bvh->nodes.size == 0) {
+        return;
+    }
+
+    int stack[BVH_MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BVHNode& node = bvh->nodes.data[stack[--stackSize]];
+        if (DistanceSqToAABB(node.bounds, point) > maxDistSq) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                if (DistanceSqToAABB(bvh->primitiveBounds.data[i], point)
+                <= maxDistSq) {
+                    func(i, point, &maxDistSq, data);
+                }
+            }
+        }
+        else {
+            // Push the farther child first, so the nearer one goes next
+            int nearChild = node.first;
+            int farChild = node.first + 1;
+            if (DistanceSqToAABB(bvh->nodes.data[farChild].bounds, point)
+            < DistanceSqToAABB(bvh->nodes.data[nearChild].bounds, point)) {
+                nearChild = node.first + 1;
+                farChild = node.first;
+            }
+            stack[stackSize++] = farChild;
+            stack[stackSize++] = nearChild;
+        }
+    }
+}
+
+uint64 GetBVHMemory(const BVH* bvh)
+{
+    return bvh->nodes.capacity * sizeof(BVHNode)
+        + bvh->primitives.capacity * sizeof(int)
+        + bvh->primitiveBounds.capacity * sizeof(AABB);
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "km_math.h"
+#include "km_lib.h"
+
+#define BVH_SAH_BINS 12
+
+struct AABB
+{
+    Vec3 min;
+    Vec3 max;
+};
+
+// Leaves have count > 0 and own primitives [first, first + count).
+// Interior nodes have count == 0 and their children at first, first + 1.
+struct BVHNode
+{
+    AABB bounds;
+    int first;
+    int count;
+};
+
+// Bounding volume hierarchy over a set of primitive bounds, built with
+// binned SAH splits. Node 0 is the root.
+struct BVH
+{
+    DynamicArray<BVHNode> nodes;
+    // Primitive indices in leaf order, and their bounds in the same order
+    DynamicArray<int> primitives;
+    DynamicArray<AABB> primitiveBounds;
+};
+
+// bvh must be zeroed or freed with FreeBVH first.
+void BuildBVH(BVH* bvh, const AABB* bounds, int count, int maxLeafSize);
+void FreeBVH(BVH* bvh);
+
+// Writes the primitives whose bounds overlap box into results.
+// Returns how many there are, which can be more than maxResults.
+int QueryBVH(const BVH* bvh, AABB box, int* results, int maxResults);
+
+// Called for every leaf primitive whose bounds the segment passes through.
+// slot indexes the leaf-order arrays (primitives, primitiveBounds). The
+// callback can shorten the segment through tMax for closest-hit queries.
+#define BVH_SEGMENT_FUNC(name) void name(int slot, \
+    Vec3 origin, Vec3 dir, float32* tMax, void* data)
+typedef BVH_SEGMENT_FUNC(BVHSegmentFunc);
+
+// Walks the segment origin + t * dir, 0 <= t <= tMax, through the BVH
+void TraceBVHSegment(const BVH* bvh, Vec3 origin, Vec3 dir, float32 tMax,
+    BVHSegmentFunc* func, void* data);
+
+// Called for every leaf primitive whose bounds are within sqrt(*maxDistSq)
+// of point, nearest nodes first. The callback can tighten maxDistSq for
+// nearest-primitive queries.
+#define BVH_POINT_FUNC(name) void name(int slot, \
+    Vec3 point, float32* maxDistSq, void* data)
+typedef BVH_POINT_FUNC(BVHPointFunc);
+
+void QueryBVHNearest(const BVH* bvh, Vec3 point, float32 maxDistSq,
+    BVHPointFunc* func, void* data);
+
+// Bytes allocated for the BVH's arrays
+uint64 GetBVHMemory(const BVH* bvh);
+
+inline bool32 Overlaps(AABB a, AABB b)
+{
+    return a.min.x <= b.max.x && b.min.x <= a.max.x
+        && a.min.y <= b.max.y && b.min.y <= a.max.y
+        && a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+internal bool32 QueryCPUSupportsAVX2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool32 osxsave = (info[2] & (1 << 27)) != 0;
+    bool32 avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    // OS must save/restore the YMM registers
+    if ((_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool32 CPUSupportsAVX2()
+{
+    local_persist int avx2Supported = -1;
+    if (avx2Supported == -1) {
+        avx2Supported = QueryCPUSupportsAVX2() ? 1 : 0;
+    }
+    return avx2Supported == 1;
+}
+
+#else
+
+bool32 CPUSupportsAVX2()
+{
+    return false;
+}
+
+#endif
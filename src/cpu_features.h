@@ -0,0 +1,7 @@
+#pragma once
+
+#include "km_defines.h"
+
+// Whether the CPU and OS support AVX2, for picking a code path at runtime.
+// Always false off x86. Checked once, then cached.
+bool32 CPUSupportsAVX2();
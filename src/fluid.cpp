@@ -0,0 +1,292 @@
+#include "fluid.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "km_debug.h"
+
+#define FLUID_PI 3.14159265358979f
+// Cells per smoothing radius. Smaller cells fit the neighbor search sphere
+// tighter: two per radius halves the candidates tested, compared to one.
+#define FLUID_CELLS_PER_RADIUS 2
+
+void InitFluidGrid(FluidGrid* grid, FluidParams params, int maxParticles)
+{
+    DEBUG_ASSERT(params.smoothingRadius > 0.0f);
+    DEBUG_ASSERT(params.substeps > 0);
+
+    grid->params = params;
+    grid->origin = params.boundsMin;
+    grid->cellSize = params.smoothingRadius / FLUID_CELLS_PER_RADIUS;
+    grid->numCells = 1;
+    for (int e = 0; e < 3; e++) {
+        float32 extent = params.boundsMax.e[e] - params.boundsMin.e[e];
+        grid->dims[e] = MaxInt((int)ceilf(extent / grid->cellSize), 1);
+        grid->numCells *= grid->dims[e];
+    }
+    grid->maxParticles = maxParticles;
+
+    float32 h = params.smoothingRadius;
+    float32 h3 = h * h * h;
+    float32 h6 = h3 * h3;
+    grid->densityCoeff = params.particleMass * 315.0f
+        / (64.0f * FLUID_PI * h6 * h3);
+    grid->pressureCoeff = params.particleMass * 45.0f / (FLUID_PI * h6);
+    grid->viscosityCoeff = params.particleMass * params.viscosity * 45.0f
+        / (FLUID_PI * h6);
+
+    grid->cellCounts = (uint32*)calloc(grid->numCells, sizeof(uint32));
+    grid->cellStart = (int*)malloc(sizeof(int) * (grid->numCells + 1));
+    grid->particleCell = (int*)malloc(sizeof(int) * maxParticles);
+    grid->sorted = (int*)malloc(sizeof(int) * maxParticles);
+    grid->sortedPos = (Vec3*)malloc(sizeof(Vec3) * maxParticles);
+    grid->sortedVel = (Vec3*)malloc(sizeof(Vec3) * maxParticles);
+    grid->sortedDensity = (float32*)malloc(sizeof(float32) * maxParticles);
+    grid->sortedPressure = (float32*)malloc(sizeof(float32) * maxParticles);
+}
+
+void FreeFluidGrid(FluidGrid* grid)
+{
+    free(grid->cellCounts);
+    free(grid->cellStart);
+    free(grid->particleCell);
+    free(grid->sorted);
+    free(grid->sortedPos);
+    free(grid->sortedVel);
+    free(grid->sortedDensity);
+    free(grid->sortedPressure);
+    *grid = {};
+}
+
+// Particles outside the bounds are clamped into the edge cells. Clamping
+// preserves order, so neighbor cell ranges computed the same way still
+// cover everything within the smoothing radius.
+internal inline int GetFluidCellCoord(const FluidGrid* grid, float32 x, int e)
+{
+    int coord = (int)floorf((x - grid->origin.e[e]) / grid->cellSize);
+    return ClampInt(coord, 0, grid->dims[e] - 1);
+}
+
+// Distance along axis e from x to the cells with coordinate c.
+// Edge cells extend to infinity, since they hold everything past them.
+internal inline float32 DistanceToFluidCells(const FluidGrid* grid,
+    float32 x, int c, int e)
+{
+    float32 cellMin = grid->origin.e[e] + c * grid->cellSize;
+    if (c > 0 && x < cellMin) {
+        return cellMin - x;
+    }
+    float32 cellMax = cellMin + grid->cellSize;
+    if (c < grid->dims[e] - 1 && x > cellMax) {
+        return x - cellMax;
+    }
+    return 0.0f;
+}
+
+internal PARALLEL_FOR_FUNC(BinFluidParticles)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    for (int i = begin; i < end; i++) {
+        Vec3 p = grid->pos[i];
+        int cell = (GetFluidCellCoord(grid, p.z, 2) * grid->dims[1]
+            + GetFluidCellCoord(grid, p.y, 1)) * grid->dims[0]
+            + GetFluidCellCoord(grid, p.x, 0);
+        grid->particleCell[i] = cell;
+        AtomicAddUInt32(&grid->cellCounts[cell], 1);
+    }
+}
+
+// Exclusive prefix sum of the cell counts. Resets the counts, which the
+// scatter pass then reuses as per-cell cursors.
+internal PARALLEL_FOR_FUNC(SumFluidCells)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    int sum = 0;
+    for (int c = 0; c < grid->numCells; c++) {
+        grid->cellStart[c] = sum;
+        sum += (int)grid->cellCounts[c];
+        grid->cellCounts[c] = 0;
+    }
+    grid->cellStart[grid->numCells] = sum;
+}
+
+internal PARALLEL_FOR_FUNC(ScatterFluidParticles)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    for (int i = begin; i < end; i++) {
+        int cell = grid->particleCell[i];
+        uint32 offset = AtomicAddUInt32(&grid->cellCounts[cell], 1);
+        grid->sorted[grid->cellStart[cell] + offset] = i;
+    }
+}
+
+// The scatter fills cells in whatever order threads got there. Sorting each
+// cell by particle index makes the sums, and so the simulation,
+// independent of the thread count.
+internal PARALLEL_FOR_FUNC(SortFluidCells)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    int* sorted = grid->sorted;
+    for (int c = begin; c < end; c++) {
+        grid->cellCounts[c] = 0;
+        int cellBegin = grid->cellStart[c];
+        int cellEnd = grid->cellStart[c + 1];
+        for (int k = cellBegin + 1; k < cellEnd; k++) {
+            int index = sorted[k];
+            int j = k - 1;
+            while (j >= cellBegin && sorted[j] > index) {
+                sorted[j + 1] = sorted[j];
+                j--;
+            }
+            sorted[j + 1] = index;
+        }
+        for (int k = cellBegin; k < cellEnd; k++) {
+            grid->sortedPos[k] = grid->pos[sorted[k]];
+            grid->sortedVel[k] = grid->vel[sorted[k]];
+        }
+    }
+}
+
+// Calls body for every particle k in the cells within radius of p. Cells
+// along x are adjacent in cell order, so each (y, z) row is one range.
+#define FOR_FLUID_NEIGHBORS(grid, p, radius, body) { \
+    float32 radiusSq_ = (radius) * (radius); \
+    int x0_ = GetFluidCellCoord(grid, p.x - (radius), 0); \
+    int x1_ = GetFluidCellCoord(grid, p.x + (radius), 0); \
+    int y0_ = GetFluidCellCoord(grid, p.y - (radius), 1); \
+    int y1_ = GetFluidCellCoord(grid, p.y + (radius), 1); \
+    int z0_ = GetFluidCellCoord(grid, p.z - (radius), 2); \
+    int z1_ = GetFluidCellCoord(grid, p.z + (radius), 2); \
+    for (int z_ = z0_; z_ <= z1_; z_++) { \
+        float32 dz_ = DistanceToFluidCells(grid, p.z, z_, 2); \
+        for (int y_ = y0_; y_ <= y1_; y_++) { \
+            float32 dy_ = DistanceToFluidCells(grid, p.y, y_, 1); \
+            if (dy_ * dy_ + dz_ * dz_ >= radiusSq_) { \
+                continue; \
+            } \
+            int row_ = (z_ * grid->dims[1] + y_) * grid->dims[0]; \
+            int rowEnd_ = grid->cellStart[row_ + x1_ + 1]; \
+            for (int k = grid->cellStart[row_ + x0_]; k < rowEnd_; k++) { \
+                body \
+            } \
+        } \
+    } \
+}
+
+internal PARALLEL_FOR_FUNC(ComputeFluidDensity)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    float32 h = grid->params.smoothingRadius;
+    float32 h2 = h * h;
+    const Vec3* sortedPos = grid->sortedPos;
+    for (int j = begin; j < end; j++) {
+        Vec3 p = sortedPos[j];
+        float32 density = 0.0f;
+        FOR_FLUID_NEIGHBORS(grid, p, h,
+            Vec3 d = p - sortedPos[k];
+            float32 r2 = Dot(d, d);
+            if (r2 < h2) {
+                float32 w = h2 - r2;
+                density += w * w * w;
+            }
+        )
+        density *= grid->densityCoeff;
+        grid->sortedDensity[j] = density;
+        grid->sortedPressure[j] = MaxFloat32(grid->params.stiffness
+            * (density - grid->params.restDensity), 0.0f);
+    }
+}
+
+internal PARALLEL_FOR_FUNC(ApplyFluidForces)
+{
+    FluidGrid* grid = (FluidGrid*)data;
+    float32 h = grid->params.smoothingRadius;
+    float32 h2 = h * h;
+    const Vec3* sortedPos = grid->sortedPos;
+    const Vec3* sortedVel = grid->sortedVel;
+    const float32* sortedDensity = grid->sortedDensity;
+    const float32* sortedPressure = grid->sortedPressure;
+    for (int j = begin; j < end; j++) {
+        Vec3 p = sortedPos[j];
+        Vec3 v = sortedVel[j];
+        float32 pressure = sortedPressure[j];
+        Vec3 pressureAccel = Vec3::zero;
+        Vec3 viscosityAccel = Vec3::zero;
+        FOR_FLUID_NEIGHBORS(grid, p, h,
+            Vec3 d = p - sortedPos[k];
+            float32 r2 = Dot(d, d);
+            // Also skips the particle itself
+            if (0.0f < r2 && r2 < h2) {
+                float32 r = sqrtf(r2);
+                float32 w = h - r;
+                float32 invDensity = 1.0f / sortedDensity[k];
+                pressureAccel += d * ((pressure + sortedPressure[k])
+                    * 0.5f * invDensity * w * w / r);
+                viscosityAccel += (sortedVel[k] - v) * (invDensity * w);
+            }
+        )
+        Vec3 accel = (pressureAccel * grid->pressureCoeff
+            + viscosityAccel * grid->viscosityCoeff) / sortedDensity[j];
+        grid->vel[grid->sorted[j]] += accel * grid->deltaTime;
+    }
+}
+
+internal void SetFluidStep(FluidGrid* grid, const Vec3* pos, Vec3* vel,
+    int count, float32 deltaTime)
+{
+    DEBUG_ASSERT(count <= grid->maxParticles);
+    grid->pos = pos;
+    grid->vel = vel;
+    grid->count = count;
+    grid->deltaTime = deltaTime;
+}
+
+int AddFluidJobs(TaskGraph* graph, FluidGrid* grid,
+    const Vec3* pos, Vec3* vel, int count, float32 deltaTime, int after)
+{
+    SetFluidStep(grid, pos, vel, count, deltaTime);
+
+    int numChunks = (count + FLUID_CHUNK_SIZE - 1) / FLUID_CHUNK_SIZE;
+    int numCellChunks = (grid->numCells + FLUID_CELL_CHUNK_SIZE - 1)
+        / FLUID_CELL_CHUNK_SIZE;
+
+    int binJobs = AddTaskJobChunks(graph, "fluid bin",
+        BinFluidParticles, grid, count, FLUID_CHUNK_SIZE);
+    int sumJob = AddTaskJob(graph, "fluid cell sum",
+        SumFluidCells, grid, 0, grid->numCells);
+    int scatterJobs = AddTaskJobChunks(graph, "fluid scatter",
+        ScatterFluidParticles, grid, count, FLUID_CHUNK_SIZE);
+    int scatterJoin = AddTaskJoin(graph, "fluid scatter done",
+        scatterJobs, numChunks);
+    AddTaskDependency(graph, scatterJoin, sumJob);
+    int sortJobs = AddTaskJobChunks(graph, "fluid cell sort",
+        SortFluidCells, grid, grid->numCells, FLUID_CELL_CHUNK_SIZE);
+    int sortJoin = AddTaskJoin(graph, "fluid cell sort done",
+        sortJobs, numCellChunks);
+    int densityJobs = AddTaskJobChunks(graph, "fluid density",
+        ComputeFluidDensity, grid, count, FLUID_CHUNK_SIZE);
+    int densityJoin = AddTaskJoin(graph, "fluid density done",
+        densityJobs, numChunks);
+    int forceJobs = AddTaskJobChunks(graph, "fluid forces",
+        ApplyFluidForces, grid, count, FLUID_CHUNK_SIZE);
+    int forceJoin = AddTaskJoin(graph, "fluid forces done",
+        forceJobs, numChunks);
+
+    for (int k = 0; k < numChunks; k++) {
+        if (after != -1) {
+            AddTaskDependency(graph, binJobs + k, after);
+        }
+        AddTaskDependency(graph, sumJob, binJobs + k);
+        AddTaskDependency(graph, scatterJobs + k, sumJob);
+        AddTaskDependency(graph, densityJobs + k, sortJoin);
+        AddTaskDependency(graph, forceJobs + k, densityJoin);
+    }
+    if (numChunks == 0 && after != -1) {
+        AddTaskDependency(graph, sumJob, after);
+    }
+    for (int k = 0; k < numCellChunks; k++) {
+        AddTaskDependency(graph, sortJobs + k, scatterJoin);
+    }
+
+    return forceJoin;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "km_math.h"
+#include "task_graph.h"
+
+// Particles per fluid job. Bigger than the regular particle chunks, to keep
+// the job count down when the task graph runs several substeps.
+// Multiple of every SIMD kernel width.
+#define FLUID_CHUNK_SIZE 8192
+#define FLUID_CELL_CHUNK_SIZE 8192
+
+// Smoothed particle hydrodynamics (Muller et al. 2003): density from the
+// poly6 kernel, pressure from the spiky kernel gradient, viscosity from
+// the viscosity kernel laplacian.
+struct FluidParams
+{
+    float32 smoothingRadius;
+    float32 particleMass;
+    float32 restDensity;
+    float32 stiffness; // pressure = stiffness * (density - restDensity)
+    float32 viscosity;
+    int substeps; // per particle system update
+
+    // Cell list bounds. Particles outside are kept in the edge cells,
+    // which stays correct but gets slow if many of them leave.
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+};
+
+// Uniform grid cell list and per-particle SPH state. Particles are
+// counting-sorted into cells every step and their positions and velocities
+// copied out in cell order, so the neighbor loops read contiguous memory.
+struct FluidGrid
+{
+    FluidParams params;
+    Vec3 origin;
+    float32 cellSize;
+    int dims[3];
+    int numCells;
+    int maxParticles;
+
+    float32 densityCoeff;
+    float32 pressureCoeff;
+    float32 viscosityCoeff;
+
+    // The step being computed
+    const Vec3* pos;
+    Vec3* vel;
+    int count;
+    float32 deltaTime;
+
+    uint32* cellCounts; // per cell, zero between steps
+    int* cellStart; // numCells + 1 prefix sums
+    int* particleCell;
+    int* sorted; // particle indices in cell order
+    Vec3* sortedPos;
+    Vec3* sortedVel;
+    float32* sortedDensity;
+    float32* sortedPressure;
+};
+
+// grid must be zeroed or freed with FreeFluidGrid first
+void InitFluidGrid(FluidGrid* grid, FluidParams params, int maxParticles);
+void FreeFluidGrid(FluidGrid* grid);
+
+// Adds jobs that rebuild the cell list for particles [0, count) and add
+// their pressure and viscosity accelerations over deltaTime to vel,
+// starting after job "after" (-1 for no dependency). Returns the job that
+// finishes the step. pos and vel are read when the jobs run.
+int AddFluidJobs(TaskGraph* graph, FluidGrid* grid,
+    const Vec3* pos, Vec3* vel, int count, float32 deltaTime, int after);
\ No newline at end of file
@@ -1,9 +1,105 @@
 #include "km_lib.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <type_traits>
 
 #define DYNAMIC_ARRAY_START_CAPACITY 10
 
+void InitMemoryArena(MemoryArena* arena, void* base, uint64 size)
+{
+    arena->base = (uint8*)base;
+    arena->size = size;
+    arena->used = 0;
+    arena->highWater = 0;
+    arena->tempCount = 0;
+}
+
+bool32 InitSubArena(MemoryArena* arena, MemoryArena* parent, uint64 size)
+{
+    void* base = PushSize(parent, size);
+    if (!base) {
+        InitMemoryArena(arena, nullptr, 0);
+        return false;
+    }
+
+    InitMemoryArena(arena, base, size);
+    return true;
+}
+
+internal uint64 GetArenaAlignedOffset(const MemoryArena* arena,
+    uint64 alignment)
+{
+    DEBUG_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    uint64 start = (uint64)(arena->base + arena->used);
+    return ALIGN_POW2(start, alignment) - (uint64)arena->base;
+}
+
+void* PushSize(MemoryArena* arena, uint64 size, uint64 alignment)
+{
+    uint64 offset = GetArenaAlignedOffset(arena, alignment);
+    if (offset + size > arena->size) {
+        return nullptr;
+    }
+
+    arena->used = offset + size;
+    if (arena->used > arena->highWater) {
+        arena->highWater = arena->used;
+    }
+    return arena->base + offset;
+}
+
+void PopSize(MemoryArena* arena, void* ptr)
+{
+    uint64 offset = (uint64)((uint8*)ptr - arena->base);
+    DEBUG_ASSERT(offset <= arena->used);
+    arena->used = offset;
+}
+
+void ResetMemoryArena(MemoryArena* arena)
+{
+    DEBUG_ASSERT(arena->tempCount == 0);
+    arena->used = 0;
+}
+
+uint64 GetArenaRemaining(const MemoryArena* arena, uint64 alignment)
+{
+    uint64 offset = GetArenaAlignedOffset(arena, alignment);
+    return offset < arena->size ? arena->size - offset : 0;
+}
+
+TemporaryMemory BeginTemporaryMemory(MemoryArena* arena)
+{
+    TemporaryMemory temp;
+    temp.arena = arena;
+    temp.used = arena->used;
+    arena->tempCount++;
+    return temp;
+}
+
+void EndTemporaryMemory(TemporaryMemory temp)
+{
+    MemoryArena* arena = temp.arena;
+    DEBUG_ASSERT(arena->used >= temp.used);
+    DEBUG_ASSERT(arena->tempCount > 0);
+    arena->used = temp.used;
+    arena->tempCount--;
+}
+
+// memcpy where T allows it
+template <typename T>
+internal void CopyElements(T* dst, const T* src, uint32 count)
+{
+    if (std::is_trivially_copyable<T>::value) {
+        memcpy(dst, src, sizeof(T) * count);
+    }
+    else {
+        for (uint32 i = 0; i < count; i++) {
+            dst[i] = src[i];
+        }
+    }
+}
+
 template <typename T>
 void DynamicArray<T>::Init()
 {
@@ -12,45 +108,136 @@ void DynamicArray<T>::Init()
 
 template <typename T>
 void DynamicArray<T>::Init(uint32 cap)
+{
+    Init(cap, nullptr);
+}
+
+template <typename T>
+void DynamicArray<T>::Init(uint32 cap, MemoryArena* arena)
 {
     size = 0;
-    this->capacity = cap;
-    data = (T*)malloc(sizeof(T) * cap);
-    if (!data) {
-        // TODO error!
-        printf("ERROR: not enough memory!\n");
-    }
+    capacity = 0;
+    data = nullptr;
+    this->arena = arena;
+    SetCapacity(cap);
 }
 
 template <typename T>
 DynamicArray<T> DynamicArray<T>::Copy() const
 {
-    DynamicArray<T> array(capacity);
+    DynamicArray<T> array;
+    array.Init(capacity, arena);
+    if (array.capacity < size) {
+        // Out of memory, the copy stays empty
+        return array;
+    }
 
     array.size = size;
-    for (uint32 i = 0; i < array.size; i++) {
-        array.data[i] = data[i];
-    }
+    CopyElements(array.data, data, size);
 
     return array;
 }
 
 template <typename T>
-void DynamicArray<T>::Append(T element)
+DynamicArray<T> DynamicArray<T>::Move()
+{
+    DynamicArray<T> array = *this;
+    size = 0;
+    capacity = 0;
+    data = nullptr;
+    return array;
+}
+
+template <typename T>
+bool32 DynamicArray<T>::SetCapacity(uint32 cap)
+{
+    T* newData;
+    if (!arena) {
+        newData = (T*)realloc(data, sizeof(T) * cap);
+    }
+    else if (data && (uint8*)(data + capacity) == arena->base + arena->used) {
+        // Last push on the arena: pop and push again at the new size, which
+        // lands at the same (aligned) address
+        PopSize(arena, data);
+        newData = (T*)PushSize(arena, sizeof(T) * cap);
+        if (!newData) {
+            PushSize(arena, sizeof(T) * capacity);
+        }
+    }
+    else {
+        newData = (T*)PushSize(arena, sizeof(T) * cap);
+        if (newData && data) {
+            CopyElements(newData, data, size < cap ? size : cap);
+        }
+    }
+
+    if (!newData && cap > 0) {
+        // The old block is untouched
+        return false;
+    }
+    data = newData;
+    capacity = cap;
+    if (size > cap) {
+        size = cap;
+    }
+    return true;
+}
+
+template <typename T>
+bool32 DynamicArray<T>::Reserve(uint32 cap)
+{
+    if (cap > capacity) {
+        return SetCapacity(cap);
+    }
+    return true;
+}
+
+template <typename T>
+bool32 DynamicArray<T>::Append(const T& element)
 {
 #if GAME_SLOW
     DEBUG_ASSERT(capacity > 0);
 #endif
 
     if (size >= capacity) {
-        capacity *= 2;
-        data = (T*)realloc(data, sizeof(T) * capacity);
-        if (!data) {
-            // TODO error!
-            printf("ERROR: not enough memory!\n");
+        // element may live in data
+        T copy = element;
+        if (!SetCapacity(capacity > 0 ?
+        capacity * 2 : DYNAMIC_ARRAY_START_CAPACITY)) {
+            return false;
         }
+        data[size++] = copy;
+        return true;
     }
     data[size++] = element;
+    return true;
+}
+
+template <typename T>
+bool32 DynamicArray<T>::AppendN(const T* elements, uint32 count)
+{
+    if (size + count > capacity) {
+        uint32 cap = capacity * 2;
+        if (!Reserve(cap > size + count ? cap : size + count)) {
+            return false;
+        }
+    }
+    CopyElements(data + size, elements, count);
+    size += count;
+    return true;
+}
+
+template <typename T>
+bool32 DynamicArray<T>::Resize(uint32 newSize)
+{
+    if (newSize > capacity) {
+        uint32 cap = capacity * 2;
+        if (!Reserve(cap > newSize ? cap : newSize)) {
+            return false;
+        }
+    }
+    size = newSize;
+    return true;
 }
 
 template <typename T>
@@ -67,6 +254,17 @@ void DynamicArray<T>::Remove(uint32 idx)
     size--;
 }
 
+template <typename T>
+void DynamicArray<T>::RemoveSwap(uint32 idx)
+{
+#if GAME_SLOW
+    DEBUG_ASSERT(idx < size);
+#endif
+
+    data[idx] = data[size - 1];
+    size--;
+}
+
 template <typename T>
 void DynamicArray<T>::Clear()
 {
@@ -76,5 +274,208 @@ void DynamicArray<T>::Clear()
 template <typename T>
 void DynamicArray<T>::Free()
 {
-    free(data);
-}
\ No newline at end of file
+    if (!arena) {
+        free(data);
+    }
+    else if (data && (uint8*)(data + capacity) == arena->base + arena->used) {
+        PopSize(arena, data);
+    }
+    size = 0;
+    capacity = 0;
+    data = nullptr;
+}
+#define HASH_MAP_START_CAPACITY 16
+
+uint32 HashKey(uint32 key)
+{
+    // lowbias32, from Chris Wellons' hash prospector
+    key ^= key >> 16;
+    key *= 0x7feb352d;
+    key ^= key >> 15;
+    key *= 0x846ca68b;
+    key ^= key >> 16;
+    return key;
+}
+
+uint32 HashKey(uint64 key)
+{
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return (uint32)key;
+}
+
+template <typename K, typename V>
+void HashMap<K, V>::Init()
+{
+    Init(HASH_MAP_START_CAPACITY);
+}
+
+template <typename K, typename V>
+void HashMap<K, V>::Init(uint32 cap)
+{
+    Init(cap, nullptr);
+}
+
+template <typename K, typename V>
+void HashMap<K, V>::Init(uint32 cap, MemoryArena* arena)
+{
+    size = 0;
+    capacity = 0;
+    slots = nullptr;
+    this->arena = arena;
+    Reserve(cap);
+}
+
+template <typename K, typename V>
+bool32 HashMap<K, V>::SetCapacity(uint32 cap)
+{
+    DEBUG_ASSERT(cap > 0 && (cap & (cap - 1)) == 0);
+    DEBUG_ASSERT(size <= cap / 4 * 3);
+
+    HashSlot<K, V>* newSlots;
+    if (!arena) {
+        newSlots = (HashSlot<K, V>*)malloc(sizeof(HashSlot<K, V>) * cap);
+    }
+    else {
+        newSlots = (HashSlot<K, V>*)PushSize(arena,
+            sizeof(HashSlot<K, V>) * cap);
+    }
+    if (!newSlots) {
+        return false;
+    }
+    for (uint32 i = 0; i < cap; i++) {
+        newSlots[i].occupied = false;
+    }
+
+    uint32 mask = cap - 1;
+    for (uint32 i = 0; i < capacity; i++) {
+        if (!slots[i].occupied) {
+            continue;
+        }
+        uint32 s = HashKey(slots[i].key) & mask;
+        while (newSlots[s].occupied) {
+            s = (s + 1) & mask;
+        }
+        newSlots[s] = slots[i];
+    }
+
+    // Old arena slots stay behind until the arena releases them
+    if (!arena) {
+        free(slots);
+    }
+    slots = newSlots;
+    capacity = cap;
+    return true;
+}
+
+template <typename K, typename V>
+bool32 HashMap<K, V>::Reserve(uint32 cap)
+{
+    uint32 newCapacity = capacity > 0 ? capacity : HASH_MAP_START_CAPACITY;
+    while (cap > newCapacity / 4 * 3) {
+        newCapacity *= 2;
+    }
+    if (newCapacity > capacity) {
+        return SetCapacity(newCapacity);
+    }
+    return true;
+}
+
+template <typename K, typename V>
+V* HashMap<K, V>::Find(const K& key) const
+{
+    if (capacity == 0) {
+        return nullptr;
+    }
+
+    uint32 mask = capacity - 1;
+    uint32 s = HashKey(key) & mask;
+    while (slots[s].occupied) {
+        if (slots[s].key == key) {
+            return &slots[s].value;
+        }
+        s = (s + 1) & mask;
+    }
+    return nullptr;
+}
+
+template <typename K, typename V>
+HashMapInsert HashMap<K, V>::Insert(const K& key, const V& value)
+{
+    if (!Reserve(size + 1)) {
+        return HASH_MAP_NO_MEMORY;
+    }
+
+    uint32 mask = capacity - 1;
+    uint32 s = HashKey(key) & mask;
+    while (slots[s].occupied) {
+        if (slots[s].key == key) {
+            return HASH_MAP_DUPLICATE;
+        }
+        s = (s + 1) & mask;
+    }
+    slots[s].key = key;
+    slots[s].value = value;
+    slots[s].occupied = true;
+    size++;
+    return HASH_MAP_INSERTED;
+}
+
+template <typename K, typename V>
+bool32 HashMap<K, V>::Remove(const K& key)
+{
+    if (capacity == 0) {
+        return false;
+    }
+
+    uint32 mask = capacity - 1;
+    uint32 s = HashKey(key) & mask;
+    while (slots[s].occupied && !(slots[s].key == key)) {
+        s = (s + 1) & mask;
+    }
+    if (!slots[s].occupied) {
+        return false;
+    }
+
+    // Shift later keys in the probe run back into the hole, so no run is
+    // broken by an empty slot (no tombstones)
+    uint32 hole = s;
+    for (uint32 t = (s + 1) & mask; slots[t].occupied; t = (t + 1) & mask) {
+        uint32 home = HashKey(slots[t].key) & mask;
+        // Distance from home to t, and from home to the hole, wrapping
+        if (((t - home) & mask) >= ((t - hole) & mask)) {
+            slots[hole] = slots[t];
+            hole = t;
+        }
+    }
+    slots[hole].occupied = false;
+    size--;
+    return true;
+}
+
+template <typename K, typename V>
+void HashMap<K, V>::Clear()
+{
+    for (uint32 i = 0; i < capacity; i++) {
+        slots[i].occupied = false;
+    }
+    size = 0;
+}
+
+template <typename K, typename V>
+void HashMap<K, V>::Free()
+{
+    if (!arena) {
+        free(slots);
+    }
+    else if (slots && (uint8*)(slots + capacity) == arena->base + arena->used) {
+        PopSize(arena, slots);
+    }
+    size = 0;
+    capacity = 0;
+    slots = nullptr;
+}
@@ -2,6 +2,53 @@
 
 #include "km_debug.h"
 
+// Cache line, so separate allocations never share one
+#define MEMORY_ARENA_ALIGNMENT 64
+
+// Linear allocator over a fixed block of memory. Memory is released in
+// reverse order of pushing: back to an earlier push (PopSize), at the end
+// of a temporary scope, or all at once (ResetMemoryArena).
+struct MemoryArena
+{
+    uint64 size;
+    uint64 used;
+    uint8* base;
+    // Most bytes ever in use, for sizing the arena
+    uint64 highWater;
+    // Open temporary scopes. The arena can't be reset while any are open.
+    int tempCount;
+};
+
+// Everything pushed since BeginTemporaryMemory is released by
+// EndTemporaryMemory. Scopes on one arena must end in reverse order.
+struct TemporaryMemory
+{
+    MemoryArena* arena;
+    uint64 used;
+};
+
+void InitMemoryArena(MemoryArena* arena, void* base, uint64 size);
+// Carves size bytes off the end of parent's used memory as a new arena.
+// Returns false if parent is out of room.
+bool32 InitSubArena(MemoryArena* arena, MemoryArena* parent, uint64 size);
+// Returns size bytes aligned to alignment (a power of 2), or nullptr if
+// the arena is out of room
+void* PushSize(MemoryArena* arena, uint64 size,
+    uint64 alignment = MEMORY_ARENA_ALIGNMENT);
+// Releases ptr, which must have come from PushSize on arena, along with
+// everything pushed after it
+void PopSize(MemoryArena* arena, void* ptr);
+void ResetMemoryArena(MemoryArena* arena);
+uint64 GetArenaRemaining(const MemoryArena* arena,
+    uint64 alignment = MEMORY_ARENA_ALIGNMENT);
+
+TemporaryMemory BeginTemporaryMemory(MemoryArena* arena);
+void EndTemporaryMemory(TemporaryMemory temp);
+
+#define PUSH_STRUCT(arena, type) ((type*)PushSize((arena), sizeof(type)))
+#define PUSH_ARRAY(arena, type, count) \
+    ((type*)PushSize((arena), sizeof(type) * (count)))
+
 template <typename T>
 struct DynamicArray
 {
@@ -12,17 +59,40 @@ struct DynamicArray
     uint32 capacity;
 #endif
     T* data;
+    // Where data comes from, or null for the heap
+    MemoryArena* arena;
 
     void Init();
     void Init(uint32 cap);
+    // Storage comes from arena. It grows in place while it's the last
+    // thing pushed on arena, and otherwise moves to a new push, leaving the
+    // old block behind until the arena releases it.
+    void Init(uint32 cap, MemoryArena* arena);
 
+    // Copy from the same allocator
     DynamicArray<T> Copy() const;
-    void Append(T element);
+    // Hands the elements over without copying. This array is left empty,
+    // and needs Init before it's used again.
+    DynamicArray<T> Move();
+
+    // Growing can fail when out of memory (most likely on an arena). These
+    // then return false and leave the array as it was.
+
+    // Makes room for at least cap elements
+    bool32 Reserve(uint32 cap);
+    bool32 Append(const T& element);
+    bool32 AppendN(const T* elements, uint32 count);
+    // Elements past the old size are left uninitialized
+    bool32 Resize(uint32 newSize);
     // Slow, linear time
     void Remove(uint32 idx);
+    // Constant time, but moves the last element into idx
+    void RemoveSwap(uint32 idx);
     void Clear();
     void Free();
 
+    bool32 SetCapacity(uint32 cap);
+
     // TODO make inline
     inline T& operator[](int index) const {
 #if GAME_SLOW
@@ -32,25 +102,55 @@ struct DynamicArray
     }
 };
 
-/*
+// Hashes for HashMap keys. Overload for other key types.
+uint32 HashKey(uint32 key);
+uint32 HashKey(uint64 key);
+
 template <typename K, typename V>
-struct HashNode
+struct HashSlot
 {
     K key;
     V value;
-    HashNode* next;
-}
+    bool32 occupied;
+};
 
-template <typename K>
-struct KeyHash
+// What HashMap::Insert did
+enum HashMapInsert
 {
-    unsigned long operator()(const K& key) const;
-}
+    HASH_MAP_INSERTED,
+    // Key already in the map, its old value is kept
+    HASH_MAP_DUPLICATE,
+    // The map was full and couldn't grow
+    HASH_MAP_NO_MEMORY
+};
 
-template <typename K, typename V, typename F = KeyHash<K>>
+// Open addressing with linear probing. Capacity is a power of 2, and the
+// table doubles once it's 3/4 full. Storage comes from an arena or the
+// heap, as with DynamicArray.
+template <typename K, typename V>
 struct HashMap
 {
     uint32 size;
-    HashNode<K, V>* table;
-}
-*/
\ No newline at end of file
+    uint32 capacity;
+    HashSlot<K, V>* slots;
+    // Where slots come from, or null for the heap
+    MemoryArena* arena;
+
+    void Init();
+    // Room for cap keys without growing
+    void Init(uint32 cap);
+    void Init(uint32 cap, MemoryArena* arena);
+
+    // Makes room for at least cap keys without growing. Returns false, with
+    // the map as it was, when out of memory.
+    bool32 Reserve(uint32 cap);
+    // Null if key isn't in the map
+    V* Find(const K& key) const;
+    HashMapInsert Insert(const K& key, const V& value);
+    // Returns false if key isn't in the map
+    bool32 Remove(const K& key);
+    void Clear();
+    void Free();
+
+    bool32 SetCapacity(uint32 cap);
+};
@@ -11,11 +11,12 @@
 //#include <sys/wait.h>     // waitpid
 //#include <unistd.h>       // usleep
 //#include <time.h>         // CLOCK_MONOTONIC, clock_gettime
-//#include <semaphore.h>    // sem_init, sem_wait, sem_post
+#include <semaphore.h>      // sem_init, sem_wait, sem_post
 //#include <alloca.h>       // alloca
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -286,7 +287,9 @@ DEBUG_PLATFORM_WRITE_FILE_FUNC(DEBUGPlatformWriteFile)
     char fullPath[LINUX_STATE_FILE_NAME_COUNT];
     CatStrings(StringLength(pathToApp_), pathToApp_,
         StringLength(fileName), fileName, LINUX_STATE_FILE_NAME_COUNT, fullPath);
-    int32 fileHandle = open(fullPath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    // Truncated like CREATE_ALWAYS on Win32, or a shorter write would keep
+    // the tail of the old file
+    int32 fileHandle = open(fullPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fileHandle >= 0) {
         ssize_t bytesWritten = write(fileHandle, memory, memorySize);
         if (fsync(fileHandle) >= 0) {
@@ -305,8 +308,157 @@ DEBUG_PLATFORM_WRITE_FILE_FUNC(DEBUGPlatformWriteFile)
     return result;
 }
 
+DEBUG_PLATFORM_GET_FILE_INFO_FUNC(DEBUGPlatformGetFileInfo)
+{
+    char fullPath[LINUX_STATE_FILE_NAME_COUNT];
+    CatStrings(StringLength(pathToApp_), pathToApp_,
+        StringLength(fileName), fileName, LINUX_STATE_FILE_NAME_COUNT, fullPath);
+    struct stat fileStat;
+    if (stat(fullPath, &fileStat) != 0) {
+        return false;
+    }
+
+    info->size = (uint64)fileStat.st_size;
+    info->modifiedTime = (uint64)fileStat.st_mtim.tv_sec * 1000000000
+        + (uint64)fileStat.st_mtim.tv_nsec;
+    return true;
+}
+
+DEBUG_PLATFORM_MAP_FILE_FUNC(DEBUGPlatformMapFile)
+{
+    DEBUGReadFileResult result = {};
+
+    char fullPath[LINUX_STATE_FILE_NAME_COUNT];
+    CatStrings(StringLength(pathToApp_), pathToApp_,
+        StringLength(fileName), fileName, LINUX_STATE_FILE_NAME_COUNT, fullPath);
+    int32 fileHandle = open(fullPath, O_RDONLY);
+    if (fileHandle >= 0) {
+        struct stat fileStat;
+        if (fstat(fileHandle, &fileStat) == 0 && fileStat.st_size > 0) {
+            void* data = mmap(NULL, fileStat.st_size, PROT_READ,
+                MAP_PRIVATE, fileHandle, 0);
+            if (data != MAP_FAILED) {
+                result.data = data;
+                result.size = (uint64)fileStat.st_size;
+            }
+        }
+
+        // The mapping keeps its own reference to the file
+        close(fileHandle);
+    }
+
+    return result;
+}
+
+DEBUG_PLATFORM_UNMAP_FILE_FUNC(DEBUGPlatformUnmapFile)
+{
+    if (file->data) {
+        munmap(file->data, file->size);
+        file->data = 0;
+    }
+    file->size = 0;
+}
+
 #endif
 
+// Work queue
+
+PLATFORM_ADD_WORK_ENTRY_FUNC(LinuxAddWorkEntry)
+{
+    uint32 newNextEntryToWrite = (queue->nextEntryToWrite + 1)
+        % ARRAY_COUNT(queue->entries);
+    // Queue is full otherwise. Entries are only added from the main thread.
+    DEBUG_ASSERT(newNextEntryToWrite != queue->nextEntryToRead);
+    PlatformWorkQueueEntry* entry = queue->entries + queue->nextEntryToWrite;
+    entry->callback = callback;
+    entry->data = data;
+    queue->completionGoal++;
+
+    COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_WRITES;
+
+    queue->nextEntryToWrite = newNextEntryToWrite;
+    sem_post(&queue->semaphore);
+}
+
+// Returns true if there was no work to do
+internal bool32 LinuxDoNextWorkQueueEntry(PlatformWorkQueue* queue)
+{
+    bool32 shouldSleep = false;
+
+    uint32 originalNextEntryToRead = queue->nextEntryToRead;
+    uint32 newNextEntryToRead = (originalNextEntryToRead + 1)
+        % ARRAY_COUNT(queue->entries);
+    if (originalNextEntryToRead != queue->nextEntryToWrite) {
+        uint32 index = AtomicCompareExchangeUInt32(&queue->nextEntryToRead,
+            newNextEntryToRead, originalNextEntryToRead);
+        if (index == originalNextEntryToRead) {
+            PlatformWorkQueueEntry entry = queue->entries[index];
+            entry.callback(queue, entry.data);
+            AtomicAddUInt32(&queue->completionCount, 1);
+        }
+    }
+    else {
+        shouldSleep = true;
+    }
+
+    return shouldSleep;
+}
+
+PLATFORM_COMPLETE_ALL_WORK_FUNC(LinuxCompleteAllWork)
+{
+    while (queue->completionGoal != queue->completionCount) {
+        LinuxDoNextWorkQueueEntry(queue);
+    }
+
+    queue->completionGoal = 0;
+    queue->completionCount = 0;
+}
+
+internal void* LinuxWorkerThreadProc(void* param)
+{
+    PlatformWorkQueue* queue = (PlatformWorkQueue*)param;
+    for (;;) {
+        if (LinuxDoNextWorkQueueEntry(queue)) {
+            sem_wait(&queue->semaphore);
+        }
+    }
+
+    return 0;
+}
+
+internal void LinuxMakeWorkQueue(PlatformWorkQueue* queue, int threadCount)
+{
+    queue->completionGoal = 0;
+    queue->completionCount = 0;
+    queue->nextEntryToWrite = 0;
+    queue->nextEntryToRead = 0;
+    sem_init(&queue->semaphore, 0, 0);
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, LinuxWorkerThreadProc, queue)) {
+            DEBUG_PRINT("Failed to create worker thread %d\n", i);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Worker thread count defaults to one per core, minus the main thread.
+// Override with "--threads N" on the command line.
+internal int LinuxGetWorkerThreadCount(int argc, char** argv)
+{
+    int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            // Total thread count, including the main thread
+            threadCount = atoi(argv[i + 1]) - 1;
+        }
+    }
+
+    return ClampInt(threadCount, 0, LINUX_MAX_WORKER_THREADS);
+}
+
 // Dynamic code loading
 internal bool32 LinuxLoadGameCode(
     LinuxGameCode* gameCode, const char* libName, ino_t fileId)
@@ -746,7 +898,7 @@ internal void LinuxBeginRecordingInput(
     // TODO(michiel): mmap to file?
     char FileName[LINUX_STATE_FILE_NAME_COUNT];
     LinuxGetInputFileLocation(state, true, InputRecordingIndex, sizeof(FileName), FileName);
-    state->RecordingHandle = open(FileName, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    state->RecordingHandle = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (state->RecordingHandle >= 0)
     {
         //ssize_t BytesWritten = write(FileHandle, Memory, MemorySize);
@@ -933,6 +1085,19 @@ int main(int argc, char **argv)
 	platformFuncs.DEBUGPlatformFreeFileMemory = DEBUGPlatformFreeFileMemory;
 	platformFuncs.DEBUGPlatformReadFile = DEBUGPlatformReadFile;
 	platformFuncs.DEBUGPlatformWriteFile = DEBUGPlatformWriteFile;
+	platformFuncs.DEBUGPlatformGetFileInfo = DEBUGPlatformGetFileInfo;
+	platformFuncs.DEBUGPlatformMapFile = DEBUGPlatformMapFile;
+	platformFuncs.DEBUGPlatformUnmapFile = DEBUGPlatformUnmapFile;
+
+    PlatformWorkQueue workQueue = {};
+    int workerThreadCount = LinuxGetWorkerThreadCount(argc, argv);
+    LinuxMakeWorkQueue(&workQueue, workerThreadCount);
+    platformFuncs.PlatformAddWorkEntry = LinuxAddWorkEntry;
+    platformFuncs.PlatformCompleteAllWork = LinuxCompleteAllWork;
+    platformFuncs.workQueue = &workQueue;
+    platformFuncs.workerThreadCount = workerThreadCount;
+    DEBUG_PRINT("Started %d worker threads\n", workerThreadCount);
+
     if (!LinuxInitOpenGL(&platformFuncs.glFunctions, display, glWindow,
     screenInfo.size.x, screenInfo.size.y)) {
         return 1;
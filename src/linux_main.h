@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <semaphore.h>
 
 #include "km_defines.h"
 #include "main_platform.h"
@@ -8,6 +9,9 @@
 #define LINUX_STATE_FILE_NAME_COUNT  512
 #define BYTES_PER_PIXEL 4
 
+#define LINUX_MAX_WORKER_THREADS 64
+#define WORK_QUEUE_ENTRY_COUNT 256
+
 struct LinuxWindowDimension
 {
     uint32 Width;
@@ -39,3 +43,21 @@ struct LinuxState
     char exeFilePath[LINUX_STATE_FILE_NAME_COUNT];
     char* exeOnePastLastSlash;
 };
+
+struct PlatformWorkQueueEntry
+{
+    PlatformWorkQueueCallback* callback;
+    void* data;
+};
+
+struct PlatformWorkQueue
+{
+    uint32 volatile completionGoal;
+    uint32 volatile completionCount;
+
+    uint32 volatile nextEntryToWrite;
+    uint32 volatile nextEntryToRead;
+    sem_t semaphore;
+
+    PlatformWorkQueueEntry entries[WORK_QUEUE_ENTRY_COUNT];
+};
@@ -66,9 +66,19 @@ void LoadPNGReadData(png_structp pngPtr,
     inputStream->readInd += readLen;
 }
 
-// TODO pass a custom allocator to libPNG
-GLuint LoadPNGOpenGL(const ThreadContext* thread,
-    const char* fileName,
+// libPNG's allocations all come from the scratch arena, and are released
+// together when loading is done
+png_voidp LoadPNGAlloc(png_structp pngPtr, png_alloc_size_t size)
+{
+    MemoryArena* scratch = (MemoryArena*)png_get_mem_ptr(pngPtr);
+    return PushSize(scratch, size, 16);
+}
+void LoadPNGFree(png_structp pngPtr, png_voidp ptr)
+{
+}
+
+internal GLuint LoadPNGTexture(const ThreadContext* thread,
+    const char* fileName, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory)
 {
@@ -89,8 +99,9 @@ GLuint LoadPNGOpenGL(const ThreadContext* thread,
     errorData.thread = thread;
     errorData.pngFile = &pngFile;
     errorData.DEBUGPlatformFreeFileMemory = DEBUGPlatformFreeFileMemory;
-    png_structp pngPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-        &errorData, &LoadPNGError, &LoadPNGWarning);
+    png_structp pngPtr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+        &errorData, &LoadPNGError, &LoadPNGWarning,
+        scratch, &LoadPNGAlloc, &LoadPNGFree);
     if (!pngPtr) {
         DEBUG_PRINT("png_create_read_struct failed\n");
         DEBUGPlatformFreeFileMemory(thread, &pngFile);
@@ -155,18 +166,17 @@ GLuint LoadPNGOpenGL(const ThreadContext* thread,
     int rowBytes = (int)png_get_rowbytes(pngPtr, infoPtr);
     rowBytes += 3 - ((rowBytes - 1) % 4); // 4-byte align
 
-    // TODO remove this malloc
     // This section of code borrowed from:
     // https://github.com/DavidEGrayson/ahrs-visualizer/blob/master/png_texture.cpp
-    png_byte* data = (png_byte*)malloc(rowBytes * height
-        * sizeof(png_byte) + 15); // TODO what are these 15 bytes?
+    png_byte* data = (png_byte*)PushSize(scratch,
+        rowBytes * height * sizeof(png_byte), 16);
     if (!data) {
         DEBUG_PRINT("Load PNG image data memory allocation failed\n");
         png_destroy_read_struct(&pngPtr, &infoPtr, NULL);
         DEBUGPlatformFreeFileMemory(thread, &pngFile);
         return 0;
     }
-    png_byte** rowPtrs = (png_byte**)malloc(height * sizeof(png_byte*));
+    png_byte** rowPtrs = PUSH_ARRAY(scratch, png_byte*, height);
     if (!rowPtrs) {
         DEBUG_PRINT("Load PNG row pointers memory allocation failed\n");
         png_destroy_read_struct(&pngPtr, &infoPtr, NULL);
@@ -190,4 +200,16 @@ GLuint LoadPNGOpenGL(const ThreadContext* thread,
     png_destroy_read_struct(&pngPtr, &infoPtr, NULL);
     DEBUGPlatformFreeFileMemory(thread, &pngFile);
     return textureID;
+}
+
+GLuint LoadPNGOpenGL(const ThreadContext* thread,
+    const char* fileName, MemoryArena* scratch,
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory)
+{
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    GLuint textureID = LoadPNGTexture(thread, fileName, scratch,
+        DEBUGPlatformReadFile, DEBUGPlatformFreeFileMemory);
+    EndTemporaryMemory(temp);
+    return textureID;
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
 #pragma once
 
+#include "km_lib.h"
 #include "main_platform.h"
 #include "opengl.h"
 
+// Decodes into temporary memory on scratch, released before returning
 GLuint LoadPNGOpenGL(const ThreadContext* thread,
-    const char* fileName,
+    const char* fileName, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory);
\ No newline at end of file
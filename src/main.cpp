@@ -8,6 +8,7 @@
 #include "opengl.h"
 #include "opengl_funcs.h"
 #include "load_png.h"
+#include "particles_simd.h"
 
 #define DEFAULT_CAM_Z 3.0f
 #define CAM_ZOOM_STEP 0.999f
@@ -16,6 +17,11 @@
 #define UI_MARGIN 20
 #define UI_SPACING 6
 
+#define SDF_COLLIDER_RESOLUTION 64
+
+// Gravity constant times the mass of MAX_PARTICLES n-body particles
+#define GALAXY_MASS 4.0f
+
 const char* defaultMesh_ = "bunny.obj";
 
 const Vec4 defaultIdleColor = { 0.2f, 0.2f, 0.2f, 1.0f };
@@ -36,132 +42,239 @@ struct ChangeMeshData
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory;
 };
 
-internal inline float32 RandFloat()
-{
-    return (float32)rand() / RAND_MAX;
-}
-internal inline float32 RandFloat(float32 min, float32 max)
-{
-    DEBUG_ASSERT(max > min);
-    return RandFloat() * (max - min) + min;
-}
-
-internal void InitParticleRandom(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticleRandom(const ParticleSystem* ps, Particle* particle,
+    RandomStream* rng, void* data)
 {
     particle->life = 0.0f;
     particle->pos = Vec3::zero;
     Vec3 randDir = {
-        RandFloat() - 0.5f,
-        RandFloat() - 0.5f,
-        RandFloat() - 0.5f
+        RandomFloat(rng) - 0.5f,
+        RandomFloat(rng) - 0.5f,
+        RandomFloat(rng) - 0.5f
     };
-    float32 speed = RandFloat(0.5f, 1.5f);
+    float32 speed = RandomFloat(rng, 0.5f, 1.5f);
     particle->vel = speed * Normalize(randDir);
     particle->color = {
-        RandFloat(),
-        RandFloat(),
-        RandFloat(),
+        RandomFloat(rng),
+        RandomFloat(rng),
+        RandomFloat(rng),
         1.0f
     };
-    float randSize = RandFloat() * 0.1f + 0.05f;
+    float randSize = RandomFloat(rng) * 0.1f + 0.05f;
     particle->size = { randSize, randSize };
     particle->bounceMult = 1.0f;
     particle->frictionMult = 1.0f;
 }
 
-internal void InitParticleSphere(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticlesSphere(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
 {
     const float32 radius = 2.0f;
 
-    particle->life = 0.0f;
-    Vec3 sphereDir;
-    float32 mag;
-    do {
-        sphereDir.x = RandFloat(-1.0f, 1.0f);
-        sphereDir.y = RandFloat(-1.0f, 1.0f);
-        sphereDir.z = RandFloat(-1.0f, 1.0f);
-        mag = Mag(sphereDir);
-    } while (mag > radius);
-    sphereDir /= mag;
-    particle->pos = sphereDir * radius;
-
-    float32 speed = RandFloat(-0.05f, 0.05f);
-    particle->vel = speed * sphereDir;
-    float32 randColor = RandFloat(0.5f, 1.0f);
-    particle->color = { randColor, randColor, randColor, 1.0f };
-    float randSize = RandFloat() * 0.1f + 0.05f;
-    particle->size = { randSize, randSize };
-    particle->bounceMult = 1.0f;
-    particle->frictionMult = 1.0f;
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    Vec3 sphereDir[SPAWN_CHUNK_SIZE];
+    float32 speed[SPAWN_CHUNK_SIZE];
+    float32 randColor[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomUnitVec3s(&rng, sphereDir);
+    RandomFloats(&rng, -0.05f, 0.05f, speed);
+    RandomFloats(&rng, 0.5f, 1.0f, randColor);
+    RandomFloats(&rng, randSize);
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        ps->life[p] = 0.0f;
+        ps->pos[p] = sphereDir[i] * radius;
+        ps->vel[p] = speed[i] * sphereDir[i];
+        ps->color[p] = { randColor[i], randColor[i], randColor[i], 1.0f };
+        float32 size = randSize[i] * 0.1f + 0.05f;
+        ps->size[p] = { size, size };
+        ps->bounceMult[p] = 1.0f;
+        ps->frictionMult[p] = 1.0f;
+    }
+}
+
+internal void InitParticlesFountain(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
+{
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    float32 spread[SPAWN_CHUNK_SIZE];
+    Vec2 circleDir[SPAWN_CHUNK_SIZE];
+    float32 velY[SPAWN_CHUNK_SIZE];
+    float32 red[SPAWN_CHUNK_SIZE];
+    float32 green[SPAWN_CHUNK_SIZE];
+    float32 blue[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomFloats(&rng, 0.0f, 0.5f, spread);
+    RandomUnitVec2s(&rng, circleDir);
+    RandomFloats(&rng, 1.5f, 3.0f, velY);
+    RandomFloats(&rng, red);
+    RandomFloats(&rng, green);
+    RandomFloats(&rng, blue);
+    RandomFloats(&rng, randSize);
+    RandomFloats(&rng, 0.6f, 1.0f, ps->bounceMult + first);
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        Vec2 circleVel = circleDir[i] * spread[i];
+        ps->life[p] = 0.0f;
+        ps->pos[p] = Vec3::unitY * 0.5f;
+        ps->vel[p] = { circleVel.x, velY[i], circleVel.y };
+        ps->color[p] = { red[i], green[i], blue[i], 1.0f };
+        float32 size = randSize[i] * 0.1f + 0.05f;
+        ps->size[p] = { size, size };
+        ps->frictionMult[p] = 1.0f;
+    }
 }
 
-internal void InitParticleFountain(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticlesBox(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
 {
+    const float32 radius = 2.0f;
+    const float32 thickness = 0.2f;
+
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    Vec2 circleDir[SPAWN_CHUNK_SIZE];
+    float32 diskY[SPAWN_CHUNK_SIZE];
+    float32 speed[SPAWN_CHUNK_SIZE];
+    float32 randColor[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomUnitVec2s(&rng, circleDir);
+    RandomFloats(&rng, -thickness, thickness, diskY);
+    RandomFloats(&rng, -0.05f, 0.05f, speed);
+    RandomFloats(&rng, 0.5f, 1.0f, randColor);
+    RandomFloats(&rng, randSize);
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        Vec3 diskDir = { circleDir[i].x, diskY[i], circleDir[i].y };
+        ps->life[p] = 0.0f;
+        ps->pos[p] = diskDir * radius;
+        ps->vel[p] = speed[i] * diskDir;
+        ps->color[p] = { randColor[i], randColor[i], randColor[i], 1.0f };
+        float32 size = randSize[i] * 0.05f + 0.02f;
+        ps->size[p] = { size, size };
+        ps->bounceMult[p] = 0.8f;
+        ps->frictionMult[p] = 1.0f;
+    }
+}
+
+internal void InitParticleRain(const ParticleSystem* ps, Particle* particle,
+    RandomStream* rng, void* data)
+{
+    const float32 halfWidth = 2.5f;
+
     particle->life = 0.0f;
-    particle->pos = Vec3::unitY * 0.5f;
-    float32 spread = RandFloat(0.0f, 0.5f);
-    Vec2 circleVel = {
-        RandFloat() - 0.5f,
-        RandFloat() - 0.5f
+    particle->pos = {
+        RandomFloat(rng, -halfWidth, halfWidth),
+        4.0f,
+        RandomFloat(rng, -halfWidth, halfWidth)
     };
-    circleVel = Normalize(circleVel) * spread;
     particle->vel = {
-        circleVel.x,
-        RandFloat(1.5f, 3.0f),
-        circleVel.y
+        RandomFloat(rng, -0.1f, 0.1f),
+        RandomFloat(rng, -0.5f, 0.0f),
+        RandomFloat(rng, -0.1f, 0.1f)
     };
     particle->color = {
-        RandFloat(),
-        RandFloat(),
-        RandFloat(),
+        RandomFloat(rng, 0.2f, 0.5f),
+        RandomFloat(rng, 0.5f, 0.8f),
+        1.0f,
         1.0f
     };
-    float randSize = RandFloat() * 0.1f + 0.05f;
+    float randSize = RandomFloat(rng) * 0.03f + 0.02f;
     particle->size = { randSize, randSize };
-    particle->bounceMult = RandFloat(0.6f, 1.0f);
-    particle->frictionMult = 1.0f;
+    particle->bounceMult = RandomFloat(rng, 0.4f, 0.7f);
+    particle->frictionMult = 0.9f;
 }
 
-internal void InitParticleBox(ParticleSystem* ps, Particle* particle,
-    void* data)
+// A stream poured into the fluid tank from one side
+internal void InitParticleFluid(const ParticleSystem* ps, Particle* particle,
+    RandomStream* rng, void* data)
 {
-    const float32 radius = 2.0f;
-    const float32 thickness = 0.2f;
+    particle->life = 0.0f;
+    particle->pos = {
+        RandomFloat(rng, -0.9f, -0.6f),
+        RandomFloat(rng, 0.6f, 0.9f),
+        RandomFloat(rng, -0.15f, 0.15f)
+    };
+    particle->vel = {
+        RandomFloat(rng, 0.8f, 1.0f),
+        RandomFloat(rng, -0.5f, -0.3f),
+        RandomFloat(rng, -0.05f, 0.05f)
+    };
+    particle->color = {
+        RandomFloat(rng, 0.1f, 0.2f),
+        RandomFloat(rng, 0.3f, 0.5f),
+        RandomFloat(rng, 0.8f, 1.0f),
+        1.0f
+    };
+    particle->size = { 0.04f, 0.04f };
+    particle->bounceMult = 0.1f;
+    particle->frictionMult = 0.95f;
+}
 
+// Particle of a disk galaxy of the given mass (times the gravity constant),
+// centered at the origin and spinning in the xz plane
+internal void InitGalaxyDiskParticle(Particle* particle, RandomStream* rng,
+    float32 radius, float32 mass)
+{
+    // Uniform over the disk, so the mass within r is mass * (r / radius)^2
+    float32 r = radius * sqrtf(RandomFloat(rng));
+    Vec2 circleDir = RandomUnitVec2(rng);
+    Vec3 dir = { circleDir.x, 0.0f, circleDir.y };
     particle->life = 0.0f;
-    float32 mag;
-    Vec3 diskDir;
-    do {
-        diskDir.x = RandFloat(-1.0f, 1.0f);
-        diskDir.y = 0.0f;
-        diskDir.z = RandFloat(-1.0f, 1.0f);
-        mag = Mag(diskDir);
-    } while (mag > radius);
-    diskDir /= mag;
-    diskDir.y = RandFloat(-thickness, thickness);
-    particle->pos = diskDir * radius;
-
-    float32 speed = RandFloat(-0.05f, 0.05f);
-    particle->vel = speed * diskDir;
-    float32 randColor = RandFloat(0.5f, 1.0f);
-    particle->color = { randColor, randColor, randColor, 1.0f };
-    float randSize = RandFloat() * 0.05f + 0.02f;
-    particle->size = { randSize, randSize };
-    particle->bounceMult = 0.8f;
+    particle->pos = dir * r;
+    particle->pos.y = RandomFloat(rng, -0.02f, 0.02f) * radius;
+
+    // Circular orbit around the mass within r, with a little scatter
+    float32 speed = sqrtf(mass * r) / radius;
+    particle->vel = Cross(Vec3::unitY, dir) * speed
+        * RandomFloat(rng, 0.9f, 1.0f);
+
+    float32 t = r / radius;
+    particle->color = {
+        Lerp(1.0f, 0.5f, t),
+        Lerp(0.85f, 0.6f, t),
+        Lerp(0.5f, 1.0f, t),
+        1.0f
+    };
+    particle->size = { 0.02f, 0.02f };
+    particle->bounceMult = 1.0f;
     particle->frictionMult = 1.0f;
 }
 
-internal Vec3 RandomPointInTriangle(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 normal)
+internal void InitParticleGalaxy(const ParticleSystem* ps, Particle* particle,
+    RandomStream* rng, void* data)
+{
+    InitGalaxyDiskParticle(particle, rng, 2.0f, GALAXY_MASS);
+}
+
+// Two galaxies of half the particles each, on a tilted collision course
+internal void InitParticleGalaxyCollision(const ParticleSystem* ps,
+    Particle* particle, RandomStream* rng, void* data)
+{
+    InitGalaxyDiskParticle(particle, rng, 1.2f, GALAXY_MASS * 0.5f);
+    Vec3 center = { -2.0f, 0.0f, -0.5f };
+    Vec3 vel = { 0.35f, 0.0f, 0.1f };
+    if (RandomFloat(rng) < 0.5f) {
+        Quat tilt = QuatFromAngleUnitAxis(PI_F / 3.0f, Vec3::unitX);
+        particle->pos = tilt * particle->pos;
+        particle->vel = tilt * particle->vel;
+        particle->color = {
+            particle->color.b, particle->color.g, particle->color.r, 1.0f
+        };
+        center = -center;
+        vel = -vel;
+    }
+    particle->pos += center;
+    particle->vel += vel;
+}
+
+// Point in triangle (v0, v1, v2) from two uniforms in [0, 1)
+internal Vec3 PointInTriangle(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 normal,
+    float32 a1, float32 a2)
 {
     // Picks random point in parallelogram (v0, v1, v2, v1+v2)
     // Source: http://mathworld.wolfram.com/TrianglePointPicking.html
     Vec3 v0v1 = v1 - v0;
     Vec3 v0v2 = v2 - v0;
-    float32 a1 = RandFloat();
-    float32 a2 = RandFloat();
     Vec3 randPt = a1 * v0v1 + a2 * v0v2 + v0;
 
     // "Folds" the outside points into the triangle (my code)
@@ -175,111 +288,116 @@ internal Vec3 RandomPointInTriangle(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 normal)
     return randPt;
 }
 
-internal void InitParticleMesh(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticlesMesh(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
 {
-    Mesh* mesh = ps->mesh;
-    // First, pick a random face, weighted by its area
-    float32 totalArea = 0.0f;
-    for (int i = 0; i < (int)mesh->triangles.size; i++) {
-        totalArea += mesh->triangles[i].area;
-    }
-    float32 randFace = RandFloat(0.0f, totalArea);
-    totalArea = 0.0f;
-    int face = -1;
-    for (int i = 0; i < (int)mesh->triangles.size; i++) {
-        totalArea += mesh->triangles[i].area;
-        if (totalArea >= randFace) {
-            face = i;
-            break;
-        }
+    const Mesh* mesh = ps->mesh;
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    uint32 faceColumn[SPAWN_CHUNK_SIZE];
+    float32 faceKeep[SPAWN_CHUNK_SIZE];
+    float32 a1[SPAWN_CHUNK_SIZE];
+    float32 a2[SPAWN_CHUNK_SIZE];
+    float32 speed[SPAWN_CHUNK_SIZE];
+    float32 red[SPAWN_CHUNK_SIZE];
+    float32 green[SPAWN_CHUNK_SIZE];
+    float32 blue[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomUInt32s(&rng, faceColumn);
+    RandomFloats(&rng, faceKeep);
+    RandomFloats(&rng, a1);
+    RandomFloats(&rng, a2);
+    RandomFloats(&rng, -0.01f, 0.01f, speed);
+    RandomFloats(&rng, red);
+    RandomFloats(&rng, green);
+    RandomFloats(&rng, blue);
+    RandomFloats(&rng, randSize);
+
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        int face = SampleTriangle(*mesh, faceColumn[i], faceKeep[i]);
+        const Triangle& triangle = mesh->triangles[face];
+        Vec3 normal = (triangle.n[0] + triangle.n[1] + triangle.n[2]) / 3.0f;
+        ps->life[p] = 0.0f;
+        ps->pos[p] = PointInTriangle(triangle.v[0], triangle.v[1],
+            triangle.v[2], normal, a1[i], a2[i]);
+        // Minimal velocity
+        ps->vel[p] = speed[i] * normal;
+        ps->color[p] = { red[i], green[i], blue[i], 1.0f };
+        float32 size = randSize[i] * 0.04f + 0.02f;
+        ps->size[p] = { size, size };
+        ps->bounceMult[p] = 1.0f;
+        ps->frictionMult[p] = 1.0f;
     }
-    DEBUG_ASSERT(face != -1);
-
-    Triangle triangle = mesh->triangles[face];
-    Vec3 normal = (triangle.n[0] + triangle.n[1] + triangle.n[2]) / 3.0f;
-    particle->life = 0.0f;
-    particle->pos = RandomPointInTriangle(
-        triangle.v[0], triangle.v[1], triangle.v[2], normal);
-    // Minimal velocity
-    float32 speed = RandFloat(-0.01f, 0.01f);
-    particle->vel = speed * normal;
-    particle->color = { 
-        RandFloat(),
-        RandFloat(),
-        RandFloat(),
-        1.0f
-    };
-    float randSize = RandFloat() * 0.04f + 0.02f;
-    particle->size = { randSize, randSize };
-    particle->bounceMult = 1.0f;
-    particle->frictionMult = 1.0f;
 }
 
-internal void InitParticleSphereJet(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticlesSphereJet(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
 {
-    particle->life = 0.0f;
-    particle->pos = Vec3::unitZ * 3.0f;
-    float32 spread = RandFloat(0.0f, 0.5f);
-    Vec2 circleVel = {
-        RandFloat() - 0.5f,
-        RandFloat() - 0.5f
-    };
-    circleVel = Normalize(circleVel) * spread;
-    particle->vel = {
-        circleVel.x,
-        circleVel.y,
-        -RandFloat(2.0f, 4.0f)
-    };
-    particle->color = {
-        RandFloat(0.6f, 1.0f),
-        RandFloat(0.2f, 1.0f),
-        RandFloat(0.0f, 1.0f),
-        1.0f
-    };
-    float randSize = RandFloat() * 0.1f + 0.05f;
-    particle->size = { randSize, randSize };
-    particle->bounceMult = RandFloat(0.6f, 1.0f);
-    particle->frictionMult = 1.0f;
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    float32 spread[SPAWN_CHUNK_SIZE];
+    Vec2 circleDir[SPAWN_CHUNK_SIZE];
+    float32 speed[SPAWN_CHUNK_SIZE];
+    float32 red[SPAWN_CHUNK_SIZE];
+    float32 green[SPAWN_CHUNK_SIZE];
+    float32 blue[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomFloats(&rng, 0.0f, 0.5f, spread);
+    RandomUnitVec2s(&rng, circleDir);
+    RandomFloats(&rng, 2.0f, 4.0f, speed);
+    RandomFloats(&rng, 0.6f, 1.0f, red);
+    RandomFloats(&rng, 0.2f, 1.0f, green);
+    RandomFloats(&rng, 0.0f, 1.0f, blue);
+    RandomFloats(&rng, randSize);
+    RandomFloats(&rng, 0.6f, 1.0f, ps->bounceMult + first);
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        Vec2 circleVel = circleDir[i] * spread[i];
+        ps->life[p] = 0.0f;
+        ps->pos[p] = Vec3::unitZ * 3.0f;
+        ps->vel[p] = { circleVel.x, circleVel.y, -speed[i] };
+        ps->color[p] = { red[i], green[i], blue[i], 1.0f };
+        float32 size = randSize[i] * 0.1f + 0.05f;
+        ps->size[p] = { size, size };
+        ps->frictionMult[p] = 1.0f;
+    }
 }
 
-internal void InitParticleFireSwirl(ParticleSystem* ps, Particle* particle,
-    void* data)
+internal void InitParticlesFireSwirl(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data)
 {
-    particle->life = 0.0f;
     const float32 radius = 1.0f;
     const float32 thickness = 0.2f;
-
-    particle->life = 0.0f;
-    float32 mag;
-    Vec3 diskDir;
-    do {
-        diskDir.x = RandFloat(-1.0f, 1.0f);
-        diskDir.y = 0.0f;
-        diskDir.z = RandFloat(-1.0f, 1.0f);
-        mag = Mag(diskDir);
-    } while (mag > radius);
-    diskDir /= mag;
-    diskDir.y = RandFloat(-thickness, thickness);
-    particle->pos = diskDir * radius;
-
-    float32 meanSpeed = 1.5f;
-    float32 speedD = 0.1f;
-    float32 speed = RandFloat(meanSpeed - speedD, meanSpeed + speedD);
-    Vec3 tangent = Cross(particle->pos, Vec3::unitY);
-    float velY = 0.1f;
-    tangent.y = RandFloat(-velY, velY);
-    particle->vel = Normalize(tangent) * speed;
-
-    float32 randColor = RandFloat(0.5f, 1.0f);
-    particle->color = { randColor, randColor, randColor, 1.0f };
-
-    float randSize = RandFloat() * 0.1f + 0.05f;
-    particle->size = { randSize, randSize };
-
-    particle->bounceMult = 1.0f;
-    particle->frictionMult = 1.0f;
+    const float32 meanSpeed = 1.5f;
+    const float32 speedD = 0.1f;
+    const float32 velY = 0.1f;
+
+    RandomBatch rng = MakeRandomBatch(ps->seed, spawnIndex, count);
+    Vec2 circleDir[SPAWN_CHUNK_SIZE];
+    float32 diskY[SPAWN_CHUNK_SIZE];
+    float32 speed[SPAWN_CHUNK_SIZE];
+    float32 tangentY[SPAWN_CHUNK_SIZE];
+    float32 randColor[SPAWN_CHUNK_SIZE];
+    float32 randSize[SPAWN_CHUNK_SIZE];
+    RandomUnitVec2s(&rng, circleDir);
+    RandomFloats(&rng, -thickness, thickness, diskY);
+    RandomFloats(&rng, meanSpeed - speedD, meanSpeed + speedD, speed);
+    RandomFloats(&rng, -velY, velY, tangentY);
+    RandomFloats(&rng, 0.5f, 1.0f, randColor);
+    RandomFloats(&rng, randSize);
+    for (int i = 0; i < count; i++) {
+        int p = first + i;
+        Vec3 diskDir = { circleDir[i].x, diskY[i], circleDir[i].y };
+        ps->life[p] = 0.0f;
+        ps->pos[p] = diskDir * radius;
+        Vec3 tangent = Cross(ps->pos[p], Vec3::unitY);
+        tangent.y = tangentY[i];
+        ps->vel[p] = Normalize(tangent) * speed[i];
+        ps->color[p] = { randColor[i], randColor[i], randColor[i], 1.0f };
+        float32 size = randSize[i] * 0.1f + 0.05f;
+        ps->size[p] = { size, size };
+        ps->bounceMult[p] = 1.0f;
+        ps->frictionMult[p] = 1.0f;
+    }
 }
 
 internal void PresetChange(Button* button, void* data)
@@ -300,14 +418,163 @@ internal void PresetChange(Button* button, void* data)
     }
 
     gameState->activePreset = preset;
+    FreeParticleSystem(&gameState->ps);
+    ResetMemoryArena(&gameState->particleArena);
     switch (preset) {
+        case PRESET_MESH_COLLIDER: {
+            PlaneCollider floor;
+            floor.type = COLLIDER_SINK;
+            floor.normal = Vec3::unitY;
+            floor.point = Vec3 { 0.0f, -0.5f, 0.0f };
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
+                MAX_PARTICLES, 30000, 10.0f, Vec3 { 0.0f, -1.0f, 0.0f },
+                0.1f, 0.05f,
+                nullptr, 0, &floor, 1, nullptr, 0, nullptr, 0,
+                InitParticleRain, gameState->pTexBase,
+                nullptr, &gameState->loadedMeshGL);
+            AddMeshCollider(&gameState->ps, &gameState->loadedMesh,
+                COLLIDER_BOUNCE);
+        } break;
+        case PRESET_SDF_COLLIDER: {
+            PlaneCollider floor;
+            floor.type = COLLIDER_SINK;
+            floor.normal = Vec3::unitY;
+            floor.point = Vec3 { 0.0f, -0.5f, 0.0f };
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
+                MAX_PARTICLES, 30000, 10.0f, Vec3 { 0.0f, -1.0f, 0.0f },
+                0.1f, 0.05f,
+                nullptr, 0, &floor, 1, nullptr, 0, nullptr, 0,
+                InitParticleRain, gameState->pTexBase,
+                nullptr, &gameState->loadedMeshGL);
+            SDFGrid sdf = LoadOrBakeSDF(gameState->thread,
+                gameState->loadedMeshFile, &gameState->loadedMesh,
+                SDF_COLLIDER_RESOLUTION, &gameState->threadPool,
+                &gameState->scratchArena,
+                gameState->DEBUGPlatformReadFile,
+                gameState->DEBUGPlatformFreeFileMemory,
+                gameState->DEBUGPlatformWriteFile);
+            AddSDFCollider(&gameState->ps, sdf, COLLIDER_BOUNCE);
+        } break;
+        case PRESET_OBSTACLE_FIELD: {
+            // Layers of alternating boxes and spheres, over a sink floor
+            const int layers = 3;
+            const int dim = 14;
+            const float32 halfWidth = 2.5f;
+            const float32 spacing = halfWidth * 2.0f / (dim - 1);
+            const float32 halfSize = 0.08f;
+            const int numObstacles = layers * dim * dim;
+            AxisBoxCollider boxes[numObstacles];
+            SphereCollider spheres[numObstacles];
+            int numBoxes = 0;
+            int numSpheres = 0;
+            for (int l = 0; l < layers; l++) {
+                // Stagger the layers so nothing falls straight through
+                float32 offset = (l % 2) * spacing * 0.5f;
+                for (int z = 0; z < dim; z++) {
+                    for (int x = 0; x < dim; x++) {
+                        Vec3 center = {
+                            -halfWidth + x * spacing + offset,
+                            1.5f - l * 1.0f,
+                            -halfWidth + z * spacing + offset
+                        };
+                        if ((x + z + l) % 2 == 0) {
+                            boxes[numBoxes].type = COLLIDER_BOUNCE;
+                            boxes[numBoxes].min = center - Vec3::one * halfSize;
+                            boxes[numBoxes].max = center + Vec3::one * halfSize;
+                            numBoxes++;
+                        }
+                        else {
+                            spheres[numSpheres].type = COLLIDER_BOUNCE;
+                            spheres[numSpheres].center = center;
+                            spheres[numSpheres].radius = halfSize * 1.2f;
+                            numSpheres++;
+                        }
+                    }
+                }
+            }
+            PlaneCollider floor;
+            floor.type = COLLIDER_SINK;
+            floor.normal = Vec3::unitY;
+            floor.point = Vec3 { 0.0f, -1.5f, 0.0f };
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
+                MAX_PARTICLES, 4000, 10.0f, Vec3 { 0.0f, -1.0f, 0.0f },
+                0.1f, 0.05f,
+                nullptr, 0, &floor, 1, boxes, numBoxes, spheres, numSpheres,
+                InitParticleRain, gameState->pTexBase,
+                nullptr, nullptr);
+        } break;
         case PRESET_SPHERE: {
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 MAX_PARTICLES, 500, 5.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.0f, 0.0f,
                 nullptr, 0, nullptr, 0, nullptr, 0, nullptr, 0,
-                InitParticleSphere, gameState->pTexSpark,
+                nullptr, gameState->pTexSpark,
+                nullptr, nullptr);
+            SetParticleEmitter(&gameState->ps, InitParticlesSphere);
+        } break;
+        case PRESET_FLUID: {
+            // Open tank, walls as planes, with an obstacle in the middle
+            const float32 halfWidth = 1.0f;
+            const float32 floorY = -1.0f;
+            PlaneCollider walls[5];
+            Vec3 wallNormals[5] = {
+                Vec3::unitY, Vec3::unitX, -Vec3::unitX,
+                Vec3::unitZ, -Vec3::unitZ
+            };
+            for (int i = 0; i < 5; i++) {
+                walls[i].type = COLLIDER_BOUNCE;
+                walls[i].normal = wallNormals[i];
+                walls[i].point = -wallNormals[i] * halfWidth;
+            }
+            walls[0].point = Vec3 { 0.0f, floorY, 0.0f };
+            AxisBoxCollider obstacle;
+            obstacle.type = COLLIDER_BOUNCE;
+            obstacle.min = Vec3 { 0.1f, floorY + 0.3f, -0.3f };
+            obstacle.max = Vec3 { 0.4f, floorY + 0.6f, 0.3f };
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
+                MAX_PARTICLES, 6000, 1e9f, Vec3 { 0.0f, -3.0f, 0.0f },
+                0.0f, 0.0f,
+                nullptr, 0, walls, 5, &obstacle, 1, nullptr, 0,
+                InitParticleFluid, gameState->pTexBase,
+                nullptr, nullptr);
+
+            // Particles start about smoothingRadius / 2 apart
+            const float32 spacing = 0.025f;
+            FluidParams fluid;
+            fluid.smoothingRadius = spacing * 2.0f;
+            fluid.restDensity = 1000.0f;
+            fluid.particleMass = fluid.restDensity
+                * spacing * spacing * spacing;
+            fluid.stiffness = 20.0f;
+            fluid.viscosity = 0.2f;
+            fluid.substeps = 4;
+            fluid.boundsMin = Vec3 {
+                -halfWidth, floorY, -halfWidth
+            } - Vec3::one * spacing;
+            fluid.boundsMax = Vec3 { halfWidth, 1.0f, halfWidth }
+                + Vec3::one * spacing;
+            MakeParticleSystemFluid(&gameState->ps, fluid);
+        } break;
+        case PRESET_GALAXY:
+        case PRESET_GALAXY_COLLISION: {
+            // Spawns as fast as allowed, then the particles live forever
+            InitParticleFunction initFunc = InitParticleGalaxy;
+            if (preset == PRESET_GALAXY_COLLISION) {
+                initFunc = InitParticleGalaxyCollision;
+            }
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
+                MAX_PARTICLES, MAX_PARTICLES * 100, 1e9f, Vec3::zero,
+                0.0f, 0.0f,
+                nullptr, 0, nullptr, 0, nullptr, 0, nullptr, 0,
+                initFunc, gameState->pTexBase,
                 nullptr, nullptr);
+
+            NBodyParams nbody;
+            nbody.theta = 0.7f;
+            nbody.gravityConstant = 1.0f;
+            nbody.particleMass = GALAXY_MASS / MAX_PARTICLES;
+            nbody.softening = 0.05f;
+            MakeParticleSystemNBody(&gameState->ps, nbody);
         } break;
         case PRESET_FOUNTAIN_SINK:
         case PRESET_FOUNTAIN_BOUNCE: {
@@ -321,13 +588,14 @@ internal void PresetChange(Button* button, void* data)
                 groundPlane.type = COLLIDER_BOUNCE;
                 maxParticles = particlesPerSec;
             }
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 maxParticles, particlesPerSec, 15.0f,
                 Vec3 { 0.0f, -1.0f, 0.0f },
                 0.1f, 0.05f,
                 nullptr, 0, &groundPlane, 1, nullptr, 0, nullptr, 0,
-                InitParticleFountain, gameState->pTexBase,
+                nullptr, gameState->pTexBase,
                 nullptr, nullptr);
+            SetParticleEmitter(&gameState->ps, InitParticlesFountain);
         } break;
         case PRESET_BOX_COLLIDERS: {
             Attractor a[2];
@@ -338,12 +606,13 @@ internal void PresetChange(Button* button, void* data)
             boxes[0].type = COLLIDER_BOUNCE;
             boxes[0].min = -Vec3::one;
             boxes[0].max = Vec3::one;
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 MAX_PARTICLES, 100, 5.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.1f, 0.05f,
                 a, 1, nullptr, 0, boxes, 1, nullptr, 0,
-                InitParticleBox, gameState->pTexFire,
+                nullptr, gameState->pTexFire,
                 nullptr, nullptr);
+            SetParticleEmitter(&gameState->ps, InitParticlesBox);
         } break;
         case PRESET_SPHERE_COLLIDERS: {
             SphereCollider spheres[3];
@@ -356,12 +625,13 @@ internal void PresetChange(Button* button, void* data)
             spheres[2].type = COLLIDER_SINK;
             spheres[2].center = { 0.2f, 0.2f, 0.0f };
             spheres[2].radius = 0.25f;
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 MAX_PARTICLES, 500, 6.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.1f, 0.05f,
                 nullptr, 0, nullptr, 0, nullptr, 0, spheres, 3,
-                InitParticleSphereJet, gameState->pTexFire,
+                nullptr, gameState->pTexFire,
                 nullptr, nullptr);
+            SetParticleEmitter(&gameState->ps, InitParticlesSphereJet);
         } break;
         case PRESET_ATTRACTORS: {
             Attractor a[4];
@@ -373,7 +643,7 @@ internal void PresetChange(Button* button, void* data)
             a[2].strength = 4.0f;
             a[3].pos = Vec3 { -5.0f, 5.0, -5.0f };
             a[3].strength = 2.0f;
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 10000, 600, 10.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.2f, 0.2f,
                 a, 4, nullptr, 0, nullptr, 0, nullptr, 0,
@@ -381,15 +651,18 @@ internal void PresetChange(Button* button, void* data)
                 nullptr, nullptr);
         } break;
         case PRESET_MESH: {
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 MAX_PARTICLES, 1000, 2.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.1f, 0.05f,
                 nullptr, 0, nullptr, 0, nullptr, 0, nullptr, 0,
-                InitParticleMesh, gameState->pTexBase,
+                nullptr, gameState->pTexBase,
                 &gameState->loadedMesh, &gameState->loadedMeshGL);
+            SetParticleEmitter(&gameState->ps, InitParticlesMesh);
         } break;
         case PRESET_CLOTH:
-        case PRESET_CLOTH_OFFSET: {
+        case PRESET_CLOTH_OFFSET:
+        case PRESET_CLOTH_XPBD:
+        case PRESET_CLOTH_EXPLICIT: {
             PlaneCollider groundPlane;
             groundPlane.type = COLLIDER_BOUNCE;
             groundPlane.normal = Vec3::unitY;
@@ -401,8 +674,22 @@ internal void PresetChange(Button* button, void* data)
 
             int dim = 70; // dim x dim cloth
             float32 clothLength = 2.0f;
-            float32 hookeK = 1000.0f;
             float32 hookeEqDist = clothLength / dim;
+            ClothSpringParams springs;
+            springs.restLength = hookeEqDist;
+            springs.stiffness = 1000.0f;
+            springs.shearStiffness = 500.0f;
+            springs.bendStiffness = 100.0f;
+            springs.solver = CLOTH_SOLVER_IMPLICIT;
+            springs.maxIterations = 20;
+            springs.tolerance = 1e-3f;
+            springs.iterations = 8;
+            if (preset == PRESET_CLOTH_XPBD) {
+                springs.solver = CLOTH_SOLVER_XPBD;
+            }
+            if (preset == PRESET_CLOTH_EXPLICIT) {
+                springs.solver = CLOTH_SOLVER_EXPLICIT;
+            }
             Vec3 center = Vec3 { 0.0f, 2.0f, 0.0f };
             if (preset == PRESET_CLOTH_OFFSET) {
                 center = Vec3 { 1.3f, 2.0f, 0.1f };
@@ -412,12 +699,27 @@ internal void PresetChange(Button* button, void* data)
             origin.z -= clothLength / 2.0f;
             Vec3 strideX = Vec3 { hookeEqDist, 0.0f, 0.0f };
             Vec3 strideY = Vec3 { 0.0f, 0.0f, hookeEqDist };
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 dim, dim, origin, strideX, strideY,
-                Vec3 { 0.0f, -0.4f, 0.0f }, hookeK, hookeEqDist,
+                Vec3 { 0.0f, -0.4f, 0.0f }, springs,
                 0.1f, 0.05f,
                 nullptr, 0, &groundPlane, 1, nullptr, 0, &sphere, 1,
                 gameState->pTexSphere);
+
+            // Fixed steps, so frame hitches don't change the cloth's motion
+            StepParams stepping = {};
+            stepping.mode = STEP_FIXED;
+            stepping.fixedStep = 1.0f / 60.0f;
+            stepping.maxSteps = 4;
+            stepping.interpolate = true;
+            if (preset == PRESET_CLOTH_EXPLICIT) {
+                // Explicit springs this stiff are only stable at shorter
+                // steps, about 2 per 1/60 s
+                stepping.mode = STEP_ADAPTIVE;
+                stepping.maxSteps = 8;
+                stepping.interpolate = false;
+            }
+            SetParticleStepping(&gameState->ps, stepping);
         } break;
         case PRESET_FIRE_SWIRL: {
             const int attractors = 20;
@@ -430,17 +732,26 @@ internal void PresetChange(Button* button, void* data)
                 a[i].pos = Lerp(start, end, t);
                 a[i].strength = powf(t * 2.0f - 1.0f, 5.0f) + 0.2f;
             }
-            CreateParticleSystem(&gameState->ps,
+            CreateParticleSystem(&gameState->ps, &gameState->particleArena,
                 10000, 500, 20.0f, Vec3 { 0.0f, 0.0f, 0.0f },
                 0.0f, 0.0f,
                 a, attractors, nullptr, 0, nullptr, 0, nullptr, 0,
-                InitParticleFireSwirl, gameState->pTexFire,
+                nullptr, gameState->pTexFire,
                 nullptr, nullptr);
+            SetParticleEmitter(&gameState->ps, InitParticlesFireSwirl);
         } break;
 
         case PRESET_LAST: {
         } break;
     }
+
+    if (!InitParticleSystemDataGL(&gameState->particleDataGL,
+    &gameState->particleArena, gameState->ps.maxParticles)) {
+        // Nowhere to stage its draw data, so keep the system empty
+        gameState->ps.active = 0;
+        gameState->ps.maxParticles = 0;
+    }
+    gameState->ps.kernel = gameState->particleKernel;
 }
 
 internal void UpdatePresetLayout(GameState* gameState, ScreenInfo screenInfo)
@@ -479,16 +790,50 @@ internal void ToggleDrawColliders(Button* button, void* data)
     gameState->drawColliders = !gameState->drawColliders;
 }
 
-internal bool32 IsFile(const ThreadContext* thread, const char* path,
-    DEBUGPlatformReadFileFunc DEBUGPlatformReadFile,
-    DEBUGPlatformFreeFileMemoryFunc DEBUGPlatformFreeFileMemory)
+internal void UpdateKernelButtonText(GameState* gameState)
 {
-    DEBUGReadFileResult objFile = DEBUGPlatformReadFile(thread, path);
-    if (!objFile.data) {
-        return false;
+    sprintf(gameState->kernelButton.text, "Kernel: %s",
+        particleKernelNames_[gameState->particleKernel]);
+}
+
+internal void CycleParticleKernel(Button* button, void* data)
+{
+    GameState* gameState = (GameState*)data;
+    int kernel = gameState->particleKernel;
+    do {
+        kernel = (kernel + 1) % PARTICLE_KERNEL_LAST;
+    } while (!IsParticleKernelSupported((ParticleKernel)kernel));
+
+    gameState->particleKernel = (ParticleKernel)kernel;
+    gameState->ps.kernel = gameState->particleKernel;
+    UpdateKernelButtonText(gameState);
+}
+
+internal void UpdateThreadsButtonText(GameState* gameState)
+{
+    sprintf(gameState->threadsButton.text, "Threads: %d",
+        gameState->threadCount);
+}
+
+// Cycles 1, 2, 4, ... up to every available thread
+internal void CycleThreadCount(Button* button, void* data)
+{
+    GameState* gameState = (GameState*)data;
+    if (gameState->threadCount >= gameState->maxThreadCount) {
+        gameState->threadCount = 1;
+    }
+    else {
+        gameState->threadCount = MinInt(gameState->threadCount * 2,
+            gameState->maxThreadCount);
     }
-    DEBUGPlatformFreeFileMemory(thread, &objFile);
-    return true;
+    UpdateThreadsButtonText(gameState);
+}
+
+internal bool32 IsFile(const ThreadContext* thread, const char* path,
+    DEBUGPlatformGetFileInfoFunc* DEBUGPlatformGetFileInfo)
+{
+    DEBUGFileInfo info;
+    return DEBUGPlatformGetFileInfo(thread, path, &info);
 }
 
 internal void ChangeMesh(InputField* field, void* data)
@@ -499,17 +844,32 @@ internal void ChangeMesh(InputField* field, void* data)
     char meshPath[256];
     sprintf(meshPath, "data/models/%s", field->text);
     if (IsFile(cmData->thread, meshPath,
-    cmData->DEBUGPlatformReadFile, cmData->DEBUGPlatformFreeFileMemory)) {
-        FreeMesh(&gameState->loadedMesh);
+    gameState->DEBUGPlatformGetFileInfo)) {
+        FreeMesh(cmData->thread, &gameState->loadedMesh,
+            gameState->DEBUGPlatformUnmapFile);
         FreeMeshGL(&gameState->loadedMeshGL);
-        gameState->loadedMesh = LoadMeshFromObj(cmData->thread,
-            meshPath,
+        gameState->loadedMesh = LoadMesh(cmData->thread,
+            meshPath, &gameState->threadPool, &gameState->scratchArena,
             cmData->DEBUGPlatformReadFile,
-            cmData->DEBUGPlatformFreeFileMemory);
+            cmData->DEBUGPlatformFreeFileMemory,
+            gameState->DEBUGPlatformWriteFile,
+            gameState->DEBUGPlatformGetFileInfo,
+            gameState->DEBUGPlatformMapFile,
+            gameState->DEBUGPlatformUnmapFile);
         gameState->loadedMeshGL = LoadMeshGL(cmData->thread,
-            gameState->loadedMesh,
+            gameState->loadedMesh, &gameState->scratchArena,
             cmData->DEBUGPlatformReadFile,
             cmData->DEBUGPlatformFreeFileMemory);
+
+        strncpy(gameState->loadedMeshFile, meshPath,
+            sizeof(gameState->loadedMeshFile) - 1);
+
+        if (gameState->activePreset == PRESET_MESH_COLLIDER
+        || gameState->activePreset == PRESET_SDF_COLLIDER) {
+            // Rebuild the collider for the new mesh
+            PresetChange(&gameState->presetButtons[gameState->activePreset],
+                (void*)gameState);
+        }
     }
 }
 
@@ -539,6 +899,22 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
 
         memory->DEBUGShouldInitGlobalFuncs = false;
     }
+    // The queue and platform functions can move when the platform layer
+    // is reloaded. Set before initialization, which can already use them.
+    gameState->threadPool.queue = platformFuncs->workQueue;
+    gameState->threadPool.AddWorkEntry = platformFuncs->PlatformAddWorkEntry;
+    gameState->threadPool.CompleteAllWork =
+        platformFuncs->PlatformCompleteAllWork;
+    gameState->thread = thread;
+    gameState->DEBUGPlatformReadFile = platformFuncs->DEBUGPlatformReadFile;
+    gameState->DEBUGPlatformFreeFileMemory =
+        platformFuncs->DEBUGPlatformFreeFileMemory;
+    gameState->DEBUGPlatformWriteFile = platformFuncs->DEBUGPlatformWriteFile;
+    gameState->DEBUGPlatformGetFileInfo =
+        platformFuncs->DEBUGPlatformGetFileInfo;
+    gameState->DEBUGPlatformMapFile = platformFuncs->DEBUGPlatformMapFile;
+    gameState->DEBUGPlatformUnmapFile = platformFuncs->DEBUGPlatformUnmapFile;
+
 	if (!memory->isInitialized) {
 		glClearColor(0.0f, 0.0f, 0.05f, 0.0f);
 		// Very explicit depth testing setup (DEFAULT VALUES)
@@ -558,6 +934,15 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
         glActiveTexture(GL_TEXTURE0);
         glEnable(GL_TEXTURE_2D);
 
+        // Particle storage and draw staging go in the rest of permanent
+        // storage, and are released whenever the preset changes.
+        // Loaders take their temporary buffers from transient storage.
+        InitMemoryArena(&gameState->particleArena,
+            (uint8*)memory->permanentStorage + sizeof(GameState),
+            memory->permanentStorageSize - sizeof(GameState));
+        InitMemoryArena(&gameState->scratchArena,
+            memory->transientStorage, memory->transientStorageSize);
+
         gameState->cameraPos = { 0.0f, 0.0f, DEFAULT_CAM_Z };
         gameState->modelRot = QuatFromAngleUnitAxis(PI_F / 6.0f, Vec3::unitX)
             * QuatFromAngleUnitAxis(-PI_F / 4.0f, Vec3::unitY);
@@ -585,12 +970,17 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
         gameState->psGL = InitParticleSystemGL(thread,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
-        gameState->sphereMesh = LoadMeshFromObj(thread,
-            "data/models/sphere-2res.obj",
+        gameState->sphereMesh = LoadMesh(thread,
+            "data/models/sphere-2res.obj", &gameState->threadPool,
+            &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
-            platformFuncs->DEBUGPlatformFreeFileMemory);
+            platformFuncs->DEBUGPlatformFreeFileMemory,
+            platformFuncs->DEBUGPlatformWriteFile,
+            platformFuncs->DEBUGPlatformGetFileInfo,
+            platformFuncs->DEBUGPlatformMapFile,
+            platformFuncs->DEBUGPlatformUnmapFile);
         gameState->sphereMeshGL = LoadMeshGL(thread,
-            gameState->sphereMesh,
+            gameState->sphereMesh, &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
 
@@ -600,35 +990,38 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
         }
         gameState->fontFaceSmall = LoadFontFace(thread, gameState->ftLibrary,
             "data/fonts/computer-modern/serif.ttf", 14,
+            &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->fontFaceMedium = LoadFontFace(thread, gameState->ftLibrary,
             "data/fonts/computer-modern/serif.ttf", 18,
+            &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->fontFaceLarge = LoadFontFace(thread, gameState->ftLibrary,
             "data/fonts/computer-modern/serif.ttf", 24,
+            &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
 
         gameState->pTexBase = LoadPNGOpenGL(thread,
-            "data/textures/base.png",
+            "data/textures/base.png", &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->pTexFire = LoadPNGOpenGL(thread,
-            "data/textures/fire.png",
+            "data/textures/fire.png", &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->pTexSmoke = LoadPNGOpenGL(thread,
-            "data/textures/smoke.png",
+            "data/textures/smoke.png", &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->pTexSpark = LoadPNGOpenGL(thread,
-            "data/textures/spark.png",
+            "data/textures/spark.png", &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
         gameState->pTexSphere = LoadPNGOpenGL(thread,
-            "data/textures/sphere.png",
+            "data/textures/sphere.png", &gameState->scratchArena,
             platformFuncs->DEBUGPlatformReadFile,
             platformFuncs->DEBUGPlatformFreeFileMemory);
 
@@ -668,6 +1061,34 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
             defaultIdleColor, defaultHoverColor, defaultPressColor,
             defaultTextColor);
 
+        Vec2Int kernelButtonOrigin = {
+            modelFieldOrigin.x,
+            modelFieldOrigin.y + modelFieldSize.y * 2 + UI_SPACING * 4
+        };
+        gameState->kernelButton = CreateButton(
+            kernelButtonOrigin, drawCollidersSize,
+            "", CycleParticleKernel,
+            defaultIdleColor, defaultHoverColor, defaultPressColor,
+            defaultTextColor
+        );
+        gameState->particleKernel = GetBestParticleKernel();
+        UpdateKernelButtonText(gameState);
+
+        Vec2Int threadsButtonOrigin = {
+            kernelButtonOrigin.x,
+            kernelButtonOrigin.y + drawCollidersSize.y + UI_SPACING
+        };
+        gameState->threadsButton = CreateButton(
+            threadsButtonOrigin, drawCollidersSize,
+            "", CycleThreadCount,
+            defaultIdleColor, defaultHoverColor, defaultPressColor,
+            defaultTextColor
+        );
+        gameState->maxThreadCount = platformFuncs->workerThreadCount + 1;
+        gameState->threadCount = gameState->maxThreadCount;
+        gameState->threadPool.threadCount = gameState->threadCount;
+        UpdateThreadsButtonText(gameState);
+
         ChangeMeshData cmData;
         cmData.gameState = gameState;
         cmData.thread = thread;
@@ -683,6 +1104,13 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
 		memory->isInitialized = true;
 	}
 
+    gameState->maxThreadCount = platformFuncs->workerThreadCount + 1;
+    if (gameState->threadCount > gameState->maxThreadCount) {
+        gameState->threadCount = gameState->maxThreadCount;
+        UpdateThreadsButtonText(gameState);
+    }
+    gameState->threadPool.threadCount = gameState->threadCount;
+
     // Camera control
     if (input->mouseButtons[0].isDown) {
         float speed = 0.01f;
@@ -727,6 +1155,10 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
     }
     UpdateButtons(&gameState->drawCollidersButton, 1,
         input, (void*)gameState);
+    UpdateButtons(&gameState->kernelButton, 1,
+        input, (void*)gameState);
+    UpdateButtons(&gameState->threadsButton, 1,
+        input, (void*)gameState);
     ChangeMeshData cmData;
     cmData.gameState = gameState;
     cmData.thread = thread;
@@ -736,10 +1168,6 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
     UpdateInputFields(&gameState->modelField, 1,
         input, (void*)&cmData);
 
-    UpdateParticleSystem(&gameState->ps, deltaTime, nullptr);
-
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
     Mat4 proj = Projection(110.0f,
         (float32)screenInfo.size.x / (float32)screenInfo.size.y,
         0.1f, 10.0f);
@@ -747,6 +1175,44 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
         * UnitQuatToMat4(gameState->modelRot);
     Mat4 vp = proj * view;
 
+    ParticleSystemDataGL* dataGL = &gameState->particleDataGL;
+
+    // Simulation and draw data preparation, as a graph of jobs per step.
+    // The last graph also prepares the draw data.
+    TaskGraph* taskGraph = &gameState->taskGraph;
+    float32 stepTime;
+    int steps = BeginParticleSteps(&gameState->ps, deltaTime, &stepTime);
+    for (int s = 0; s < steps - 1; s++) {
+        ClearTaskGraph(taskGraph);
+        AddParticleUpdateJobs(taskGraph, &gameState->particleFrame,
+            &gameState->ps, stepTime, nullptr);
+        RunTaskGraph(taskGraph, &gameState->threadPool);
+    }
+    ClearTaskGraph(taskGraph);
+    if (steps > 0) {
+        AddParticleSystemJobs(taskGraph, &gameState->particleFrame,
+            &gameState->ps, stepTime, vp, dataGL, nullptr);
+    }
+    else {
+        AddParticleDrawJobs(taskGraph, &gameState->particleFrame,
+            &gameState->ps, vp, dataGL, -1);
+    }
+    RunTaskGraph(taskGraph, &gameState->threadPool);
+
+#if GAME_INTERNAL
+    if (WasKeyPressed(input, KM_KEY_T)) {
+        local_persist char dumpBuffer[MAX_TASK_JOBS * 128];
+        int dumpLength = DumpTaskGraph(taskGraph,
+            dumpBuffer, (int)sizeof(dumpBuffer));
+        platformFuncs->DEBUGPlatformWriteFile(thread, "task_graph.txt",
+            (uint32)dumpLength, dumpBuffer);
+        DEBUG_PRINT("Wrote task graph dump (%d jobs) to task_graph.txt\n",
+            taskGraph->numJobs);
+    }
+#endif
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
     const float DEBUG_AXES_HALF_LENGTH = 5.0f;
 #if GAME_INTERNAL
     const float DEBUG_AXES_COLOR_MAG = 1.0f;
@@ -776,9 +1242,6 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
     //     -Vec3::unitX * DEBUG_AXES_HALF_LENGTH, Vec3::zero,
     //     Vec4 { 0.5f, 0.0f, 0.0f, 1.0f });
 
-    DEBUG_ASSERT(sizeof(ParticleSystemDataGL) <= memory->transientStorageSize);
-    ParticleSystemDataGL* dataGL = (ParticleSystemDataGL*)
-        memory->transientStorage;
     // Get camera right and up vectors for billboard draw
     Vec3 camRight = { view.e[0][0], view.e[1][0], view.e[2][0] };
     Vec3 camUp = { view.e[0][1], view.e[1][1], view.e[2][1] };
@@ -831,6 +1294,19 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
         Vec2 { 1.0f, 1.0f },
         interestTextColor
     );
+    // Simulation steps this frame
+    sprintf(str, "Steps: %d x %.1f ms", gameState->ps.lastSteps,
+        gameState->ps.lastStepTime * 1000.0f);
+    DrawText(gameState->textGL, gameState->fontFaceMedium, screenInfo,
+        str,
+        Vec2Int {
+            screenInfo.size.x - UI_MARGIN,
+            screenInfo.size.y - UI_MARGIN
+                - ((int)gameState->fontFaceMedium.height + UI_SPACING) * 2
+        },
+        Vec2 { 1.0f, 1.0f },
+        interestTextColor
+    );
 
     DrawButtons(gameState->presetButtons, PRESET_LAST,
         gameState->rectGL, gameState->textGL,
@@ -838,6 +1314,12 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
     DrawButtons(&gameState->drawCollidersButton, 1,
         gameState->rectGL, gameState->textGL,
         gameState->fontFaceMedium, screenInfo);
+    DrawButtons(&gameState->kernelButton, 1,
+        gameState->rectGL, gameState->textGL,
+        gameState->fontFaceMedium, screenInfo);
+    DrawButtons(&gameState->threadsButton, 1,
+        gameState->rectGL, gameState->textGL,
+        gameState->fontFaceMedium, screenInfo);
     Vec2Int modelFieldTextPos = gameState->modelField.box.origin;
     modelFieldTextPos.y += gameState->modelField.box.size.y + UI_SPACING;
     DrawText(gameState->textGL, gameState->fontFaceMedium, screenInfo,
@@ -845,6 +1327,46 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
     DrawInputFields(&gameState->modelField, 1,
         gameState->rectGL, gameState->textGL,
         gameState->fontFaceMedium, screenInfo);
+
+    if (gameState->ps.meshColliders.size > 0) {
+        const MeshCollider& meshCollider = gameState->ps.meshColliders[0];
+        char bvhText[128];
+        sprintf(bvhText, "Mesh BVH: %d tris, %.1f Mcycles, %.1f MB",
+            (int)meshCollider.triangles.size,
+            (float32)meshCollider.buildCycles / 1000000.0f,
+            (float32)meshCollider.memoryBytes / (1024.0f * 1024.0f));
+        Vec2Int bvhTextPos = gameState->threadsButton.box.origin;
+        bvhTextPos.y += gameState->threadsButton.box.size.y + UI_SPACING;
+        DrawText(gameState->textGL, gameState->fontFaceMedium, screenInfo,
+            bvhText, bvhTextPos, defaultTextColor);
+    }
+    if (gameState->ps.springs.params.solver == CLOTH_SOLVER_IMPLICIT) {
+        const SpringNetwork& springs = gameState->ps.springs;
+        char solveText[128];
+        sprintf(solveText, "Cloth solve: %d iterations, residual %.1e",
+            springs.iterations, springs.relativeResidual);
+        Vec2Int solveTextPos = gameState->threadsButton.box.origin;
+        solveTextPos.y += gameState->threadsButton.box.size.y + UI_SPACING;
+        DrawText(gameState->textGL, gameState->fontFaceMedium, screenInfo,
+            solveText, solveTextPos, defaultTextColor);
+    }
+    if (gameState->ps.sdfColliders.size > 0) {
+        const SDFGrid& sdf = gameState->ps.sdfColliders[0].sdf;
+        char sdfText[128];
+        if (sdf.bakeCycles > 0) {
+            sprintf(sdfText, "SDF: %dx%dx%d, baked in %.1f Mcycles",
+                sdf.dims[0], sdf.dims[1], sdf.dims[2],
+                (float32)sdf.bakeCycles / 1000000.0f);
+        }
+        else {
+            sprintf(sdfText, "SDF: %dx%dx%d, cached",
+                sdf.dims[0], sdf.dims[1], sdf.dims[2]);
+        }
+        Vec2Int sdfTextPos = gameState->threadsButton.box.origin;
+        sdfTextPos.y += gameState->threadsButton.box.size.y + UI_SPACING;
+        DrawText(gameState->textGL, gameState->fontFaceMedium, screenInfo,
+            sdfText, sdfTextPos, defaultTextColor);
+    }
 }
 
 #include "km_input.cpp"
@@ -853,5 +1375,15 @@ extern "C" GAME_UPDATE_AND_RENDER_FUNC(GameUpdateAndRender)
 #include "text.cpp"
 #include "gui.cpp"
 #include "load_png.cpp"
+#include "cpu_features.cpp"
+#include "particles_simd.cpp"
+#include "random.cpp"
+#include "thread_pool.cpp"
+#include "task_graph.cpp"
+#include "bvh.cpp"
+#include "fluid.cpp"
+#include "nbody.cpp"
+#include "springs.cpp"
+#include "sdf.cpp"
 #include "particles.cpp"
 #include "mesh.cpp"
\ No newline at end of file
@@ -6,16 +6,26 @@
 #include "gui.h"
 #include "particles.h"
 #include "mesh.h"
+#include "task_graph.h"
+#include "thread_pool.h"
 
 enum Preset
 {
+    PRESET_MESH_COLLIDER,
+    PRESET_SDF_COLLIDER,
+    PRESET_OBSTACLE_FIELD,
     PRESET_FIRE_SWIRL,
     PRESET_CLOTH_OFFSET,
     PRESET_CLOTH,
+    PRESET_CLOTH_XPBD,
+    PRESET_CLOTH_EXPLICIT,
     PRESET_MESH,
     PRESET_ATTRACTORS,
     PRESET_SPHERE_COLLIDERS,
     PRESET_BOX_COLLIDERS,
+    PRESET_FLUID,
+    PRESET_GALAXY,
+    PRESET_GALAXY_COLLISION,
     PRESET_FOUNTAIN_BOUNCE,
     PRESET_FOUNTAIN_SINK,
     PRESET_SPHERE,
@@ -24,13 +34,21 @@ enum Preset
 };
 
 global_var const char* presetNames_[PRESET_LAST] = {
+    "Mesh Collider",
+    "SDF Collider",
+    "Obstacle Field",
     "Fire Swirl",
     "Cloth (Off-Center)",
     "Cloth",
+    "Cloth (XPBD)",
+    "Cloth (Explicit)",
     "Mesh Uniform",
     "Attractors",
     "Sphere Collider",
     "Axis Box Collider",
+    "Fluid Tank",
+    "Galaxy",
+    "Galaxy Collision",
     "Fountain Bounce",
     "Fountain Sink",
     "Sphere Uniform"
@@ -68,9 +86,33 @@ struct GameState
     Button presetButtons[PRESET_LAST];
     Button drawCollidersButton;
     InputField modelField;
+    Button kernelButton;
+    Button threadsButton;
 
+    ParticleKernel particleKernel;
+    // Threads used for the particle update, including the main thread
+    int threadCount;
+    int maxThreadCount;
+    ThreadPool threadPool;
+    // Refreshed every frame too, for callbacks that load or cache files
+    const ThreadContext* thread;
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile;
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory;
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile;
+    DEBUGPlatformGetFileInfoFunc* DEBUGPlatformGetFileInfo;
+    DEBUGPlatformMapFileFunc* DEBUGPlatformMapFile;
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile;
+    TaskGraph taskGraph;
+    ParticleFrame particleFrame;
+
+    // Holds the particle storage and draw staging of the current preset
+    MemoryArena particleArena;
+    // Temporary buffers of loaders, in transient storage
+    MemoryArena scratchArena;
     ParticleSystem ps;
+    ParticleSystemDataGL particleDataGL;
 
     Mesh loadedMesh;
+    char loadedMeshFile[256];
     MeshGL loadedMeshGL;
 };
@@ -35,6 +35,110 @@ typedef DEBUG_PLATFORM_READ_FILE_FUNC(DEBUGPlatformReadFileFunc);
         uint32 memorySize, const void* memory)
 typedef DEBUG_PLATFORM_WRITE_FILE_FUNC(DEBUGPlatformWriteFileFunc);
 
+struct DEBUGFileInfo
+{
+	uint64 size;
+	// Platform units, only good for comparing against each other
+	uint64 modifiedTime;
+};
+
+#define DEBUG_PLATFORM_GET_FILE_INFO_FUNC(name) \
+    bool32 name(const ThreadContext* thread, const char* fileName, \
+        DEBUGFileInfo* info)
+typedef DEBUG_PLATFORM_GET_FILE_INFO_FUNC(DEBUGPlatformGetFileInfoFunc);
+
+// Read-only view of a whole file, paged in as it's touched. Release with
+// DEBUGPlatformUnmapFile, not DEBUGPlatformFreeFileMemory.
+#define DEBUG_PLATFORM_MAP_FILE_FUNC(name) \
+    DEBUGReadFileResult name(const ThreadContext* thread, const char* fileName)
+typedef DEBUG_PLATFORM_MAP_FILE_FUNC(DEBUGPlatformMapFileFunc);
+
+#define DEBUG_PLATFORM_UNMAP_FILE_FUNC(name) \
+    void name(const ThreadContext* thread, DEBUGReadFileResult* file)
+typedef DEBUG_PLATFORM_UNMAP_FILE_FUNC(DEBUGPlatformUnmapFileFunc);
+
+#endif
+
+// ------------------------------- Work queue -------------------------------
+// Multi-threaded work queue, owned by the platform layer. Entries are added
+// from the main thread only, and run on the platform's worker threads.
+// PlatformCompleteAllWork blocks until every added entry has finished,
+// running entries on the calling thread in the meantime.
+struct PlatformWorkQueue;
+
+#define PLATFORM_WORK_QUEUE_CALLBACK(name) \
+    void name(PlatformWorkQueue* queue, void* data)
+typedef PLATFORM_WORK_QUEUE_CALLBACK(PlatformWorkQueueCallback);
+
+#define PLATFORM_ADD_WORK_ENTRY_FUNC(name) \
+    void name(PlatformWorkQueue* queue, \
+        PlatformWorkQueueCallback* callback, void* data)
+typedef PLATFORM_ADD_WORK_ENTRY_FUNC(PlatformAddWorkEntryFunc);
+
+#define PLATFORM_COMPLETE_ALL_WORK_FUNC(name) \
+    void name(PlatformWorkQueue* queue)
+typedef PLATFORM_COMPLETE_ALL_WORK_FUNC(PlatformCompleteAllWorkFunc);
+
+// Atomics, shared by the platform work queue and the game
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+#define COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_WRITES _WriteBarrier()
+#define COMPLETE_PREVIOUS_READS_BEFORE_FUTURE_READS _ReadBarrier()
+#define COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_READS _mm_mfence()
+
+inline uint32 AtomicCompareExchangeUInt32(volatile uint32* value,
+    uint32 newValue, uint32 expected)
+{
+    return (uint32)_InterlockedCompareExchange((volatile long*)value,
+        (long)newValue, (long)expected);
+}
+// Returns the value before the add
+inline uint32 AtomicAddUInt32(volatile uint32* value, uint32 addend)
+{
+    return (uint32)_InterlockedExchangeAdd((volatile long*)value,
+        (long)addend);
+}
+#else
+#define COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_WRITES \
+    asm volatile("" ::: "memory")
+#define COMPLETE_PREVIOUS_READS_BEFORE_FUTURE_READS \
+    asm volatile("" ::: "memory")
+#define COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_READS __sync_synchronize()
+
+inline uint32 AtomicCompareExchangeUInt32(volatile uint32* value,
+    uint32 newValue, uint32 expected)
+{
+    return __sync_val_compare_and_swap(value, expected, newValue);
+}
+// Returns the value before the add
+inline uint32 AtomicAddUInt32(volatile uint32* value, uint32 addend)
+{
+    return __sync_fetch_and_add(value, addend);
+}
+#endif
+
+// Cycle counter for profiling. Shared across cores (invariant TSC) on any
+// CPU this is going to run on. Elsewhere, falls back to nanoseconds.
+#if defined(_MSC_VER)
+inline uint64 ReadCycleCounter()
+{
+    return __rdtsc();
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64 ReadCycleCounter()
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+inline uint64 ReadCycleCounter()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000 + (uint64)ts.tv_nsec;
+}
 #endif
 
 #define MAX_KEYS_PER_FRAME 256
@@ -101,8 +205,17 @@ struct PlatformFunctions
 	DEBUGPlatformFreeFileMemoryFunc*	DEBUGPlatformFreeFileMemory;
 	DEBUGPlatformReadFileFunc*			DEBUGPlatformReadFile;
 	DEBUGPlatformWriteFileFunc*			DEBUGPlatformWriteFile;
+	DEBUGPlatformGetFileInfoFunc*		DEBUGPlatformGetFileInfo;
+	DEBUGPlatformMapFileFunc*			DEBUGPlatformMapFile;
+	DEBUGPlatformUnmapFileFunc*			DEBUGPlatformUnmapFile;
 #endif
 
+    PlatformAddWorkEntryFunc*           PlatformAddWorkEntry;
+    PlatformCompleteAllWorkFunc*        PlatformCompleteAllWork;
+    PlatformWorkQueue*                  workQueue;
+    // Number of worker threads servicing workQueue (not counting main)
+    int                                 workerThreadCount;
+
     OpenGLFunctions glFunctions;
 };
 
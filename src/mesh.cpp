@@ -1,14 +1,19 @@
 #include "mesh.h"
 
 #include <stdio.h>
-#include <map>
+#include <stdlib.h>
+#include <string.h>
 
 #include "km_math.h"
 #include "km_debug.h"
 #include "opengl_funcs.h"
 #include "ogl_base.h"
 
-#define OBJ_LINE_MAX 512
+// OBJ files are split into about this many bytes per job
+#define OBJ_CHUNK_BYTES (256 * 1024)
+#define OBJ_MAX_CHUNKS 64
+// Longest number handed to strtod
+#define OBJ_NUMBER_MAX 64
 
 struct Vertex
 {
@@ -41,64 +46,136 @@ struct HalfEdgeMesh
     DynamicArray<HalfEdge> halfEdges;
 };
 
-internal int GetNextLine(const char* src, char* dst, int dstLen)
+// Powers of 10 that are exact in a float64
+global_var const float64 OBJ_POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+internal inline bool32 IsObjDigit(char c)
 {
-    int read = 0;
-    const char* s = src;
-    while (*s != '\n' && *s != '\0' && read < dstLen - 1) {
-        dst[read++] = *(s++);
-    }
-    dst[read] = '\0';
+    return '0' <= c && c <= '9';
+}
 
-    if (read == 0 && *s == '\0') {
-        return -1;
-    }
-    return read;
+internal inline bool32 IsObjSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
-internal Vec3 ParseVec3(char* str)
-{
-    Vec3 result = { 0.0f, 0.0f, 0.0f };
-    char* el = str;
-    int i = 0;
-    for (char* c = str; *c != '\0'; c++) {
-        if (*c == ' ' || *c == '\n') {
-            char* endptr = el;
-            *c = '\0';
-            result.e[i++] = (float32)strtod(el, &endptr);
-            if (i == 3) {
-                break;
+// Parses the number at *at as (float32)strtod would, and moves *at past it.
+// Decimals whose digits and power of 10 are both exact in a float64 take
+// Clinger's fast path: one correctly rounded multiply or divide, so the
+// result matches strtod bit for bit. Anything else goes to strtod.
+internal float32 ParseObjFloat(const char** at, const char* end)
+{
+    const char* s = *at;
+    bool32 negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+
+    uint64 mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool32 anyDigits = false;
+    for (; s < end && IsObjDigit(*s); s++) {
+        anyDigits = true;
+        if (mantissa > 0 || *s != '0') {
+            significant++;
+        }
+        if (significant <= 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+        }
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && IsObjDigit(*s); s++) {
+            anyDigits = true;
+            if (mantissa > 0 || *s != '0') {
+                significant++;
+            }
+            if (significant <= 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+            }
+            exponent--;
+        }
+    }
+    if (anyDigits && s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        bool32 negativeExponent = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            negativeExponent = *e == '-';
+            e++;
+        }
+        // Otherwise the number ends before the 'e', as in strtod
+        if (e < end && IsObjDigit(*e)) {
+            int value = 0;
+            for (; e < end && IsObjDigit(*e); e++) {
+                if (value < 10000) {
+                    value = value * 10 + (*e - '0');
+                }
             }
-            // TODO: check error
-            el = c + 1;
+            exponent += negativeExponent ? -value : value;
+            s = e;
         }
     }
 
-    return result;
-}
+    if (anyDigits && (s == end || IsObjSpace(*s)) && significant <= 19
+    && mantissa <= (1ull << 53) && -22 <= exponent && exponent <= 22) {
+        float64 value = (float64)mantissa;
+        if (exponent < 0) {
+            value /= OBJ_POW10[-exponent];
+        }
+        else {
+            value *= OBJ_POW10[exponent];
+        }
+        *at = s;
+        return (float32)(negative ? -value : value);
+    }
 
-internal Vec2 ParseVec2(char* str)
-{
-    Vec2 result = { 0.0f, 0.0f };
-    char* el = str;
-    while (*el == ' ') {
-        el++;
-    }
-    int i = 0;
-    for (char* c = str; *c != '\0'; c++) {
-        if (*c == ' ' || *c == '\n') {
-            char* endptr = el;
-            *c = '\0';
-            result.e[i++] = (float32)strtod(el, &endptr);
-            if (i == 2) {
-                break;
-            }
-            // TODO: check error
-            el = c + 1;
+    // Long, tiny or huge numbers, hex, inf, nan
+    char number[OBJ_NUMBER_MAX];
+    int length = 0;
+    for (s = *at; s < end && !IsObjSpace(*s); s++) {
+        if (length == OBJ_NUMBER_MAX - 1) {
+            break;
         }
+        number[length++] = *s;
+    }
+    number[length] = '\0';
+    char* numberEnd;
+    float64 value = strtod(number, &numberEnd);
+    *at += numberEnd - number;
+    return (float32)value;
+}
+
+// Parses the integer at *at as strtol would, and moves *at past it
+internal int ParseObjIndex(const char** at, const char* end)
+{
+    const char* s = *at;
+    bool32 negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+    int value = 0;
+    for (; s < end && IsObjDigit(*s); s++) {
+        value = value * 10 + (*s - '0');
     }
+    *at = s;
+    return negative ? -value : value;
+}
 
-    return result;
+// Up to count space-separated floats from s to end. Missing ones are 0.
+internal void ParseObjFloats(const char* s, const char* end,
+    float32* out, int count)
+{
+    for (int i = 0; i < count; i++) {
+        while (s < end && (*s == ' ' || *s == '\t')) {
+            s++;
+        }
+        out[i] = s < end ? ParseObjFloat(&s, end) : 0.0f;
+    }
 }
 
 internal Vec3 NormalFromTriangle(Vec3 v0, Vec3 v1, Vec3 v2)
@@ -167,152 +244,443 @@ internal void ComputeVertexNormals(HalfEdgeMesh* mesh)
     faces.Free();
 }
 
-internal HalfEdgeMesh HalfEdgeMeshFromObj(const ThreadContext* thread,
-    const char* fileName,
-    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
-    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory)
+internal void FreeHalfEdgeMesh(HalfEdgeMesh* mesh)
 {
-    HalfEdgeMesh mesh;
-    mesh.vertices.Init();
-    mesh.faces.Init();
-    mesh.halfEdges.Init();
+    mesh->vertices.Free();
+    mesh->faces.Free();
+    mesh->halfEdges.Free();
+}
 
-    DEBUGReadFileResult objFile = DEBUGPlatformReadFile(thread, fileName);
-    if (!objFile.data) {
-        DEBUG_PRINT("Failed to open OBJ file at: %s\n", fileName);
-        return mesh;
-    }
+internal inline float32 ComputeTriangleArea(
+    Vec3 v0, Vec3 v1, Vec3 v2)
+{
+    Vec3 v0v1 = v1 - v0;
+    Vec3 v0v2 = v2 - v0;
+    return Mag(Cross(v0v1, v0v2)) / 2.0f;
+}
+
+struct ObjCounts
+{
+    uint32 vertices;
+    uint32 uvs;
+    uint32 normals;
+    uint32 faces;
+    uint32 faceVertices; // summed over all faces
+    uint32 maxFaceVertices;
+    uint32 triangles; // after fan triangulation
+};
 
-    char* fileStr = (char*)objFile.data;
-    int read;
-    char line[OBJ_LINE_MAX];
-    DynamicArray<int> faceInds;
-    faceInds.Init();
-
-    while ((read = GetNextLine(fileStr, line, OBJ_LINE_MAX)) >= 0) {
-        fileStr += read + 1;
-        // TODO: I'm too lazy to fix this
-        line[read] = '\n';
-        line[read + 1] = '\0';
-        //DEBUG_PRINT("line: %s", line);
-        if (line[0] == '#') {
-            continue;
+// Quick pass over the lines of an OBJ file, to size the parse arrays
+internal ObjCounts CountObjElements(const char* data, uint64 size)
+{
+    ObjCounts counts = {};
+    const char* s = data;
+    const char* end = data + size;
+    while (s < end) {
+        const char* lineEnd = (const char*)memchr(s, '\n', end - s);
+        if (!lineEnd) {
+            lineEnd = end;
         }
-        else if (line[0] == 'v') {
-            if (line[1] == ' ') {
-                Vertex vertex;
-                vertex.pos = ParseVec3(&line[2]);
-                vertex.halfEdge = 0; // This is set later
-                vertex.color = Vec3::one;
-                mesh.vertices.Append(vertex);
+        if (lineEnd - s >= 2) {
+            if (s[0] == 'v' && s[1] == ' ') {
+                counts.vertices++;
             }
-            else {
-                // idk
+            else if (s[0] == 'v' && s[1] == 't') {
+                counts.uvs++;
             }
-        }
-        else if (line[0] == 'f') {
-            char* el = &line[2];
-            for (char* c = &line[2]; *c != '\0'; c++) {
-                if (*c == ' ' || *c == '\n') {
-                    char* endptr = el;
-                    *c = '\0';
-                    faceInds.Append((int)strtol(el, &endptr, 10));
-                    // TODO check error
-                    el = c + 1;
+            else if (s[0] == 'v' && s[1] == 'n') {
+                counts.normals++;
+            }
+            else if (s[0] == 'f') {
+                // One vertex per token after the "f"
+                uint32 verts = 0;
+                for (const char* c = s + 2; c < lineEnd; c++) {
+                    if (c[-1] == ' ' && *c != ' ' && *c != '\r') {
+                        verts++;
+                    }
+                }
+                counts.faces++;
+                counts.faceVertices += verts;
+                if (verts > counts.maxFaceVertices) {
+                    counts.maxFaceVertices = verts;
+                }
+                if (verts > 2) {
+                    counts.triangles += verts - 2;
                 }
             }
-            faceInds.Append(-1);
-        }
-        else {
-            // idk
         }
+        s = lineEnd + 1;
     }
 
-    std::map<std::pair<uint32, uint32>, uint32> edgeMap;
+    return counts;
+}
 
-    uint32 faceVerts = 0;
-    for (uint32 i = 0; i < faceInds.size; i++) {
-        if (faceInds[i] == -1 || i == faceInds.size - 1) {
-            // Create face
-            Face face;
-            face.halfEdge = mesh.halfEdges.size - 1;
-            mesh.faces.Append(face);
-            
-            faceVerts = 0;
-            continue;
-        }
+// One face vertex, as 0-based indices into the position, UV and normal
+// arrays. Indices the face doesn't give are -1.
+struct ObjCorner
+{
+    int vertex;
+    int uv;
+    int normal;
+};
 
-        uint32 vertSrc = faceInds[i] - 1;
-        uint32 vertDst = faceInds[i + 1] - 1;
-        if (faceInds[i + 1] == -1) {
-            vertDst = faceInds[i - faceVerts] - 1;
-        }
+// A run of whole lines, parsed by one job
+struct ObjChunk
+{
+    const char* start;
+    const char* end;
+    ObjCounts counts;
+    // Where this chunk's elements start in the whole file's arrays
+    ObjCounts first;
+};
 
-        // Create edge, i -> i + 1
-        // Last edge will have wrong "next"
-        std::pair<int, int> forward(vertSrc, vertDst);
-        std::pair<int, int> backward(vertDst, vertSrc);
-        HalfEdge he;
-        he.next = mesh.halfEdges.size + 1;
-        if (faceInds[i + 1] == -1) {
-            he.next = mesh.halfEdges.size - faceVerts;
-        }
-        auto edgeBackward = edgeMap.find(backward);
-        if (edgeBackward != edgeMap.end()) {
-            he.twin = edgeBackward->second;
-            mesh.halfEdges[edgeBackward->second].twin =
-                mesh.halfEdges.size;
+struct ObjParse
+{
+    ObjChunk* chunks;
+    ObjCounts total;
+
+    Vec3* vertices;
+    Vec2* uvs;
+    // Read from the file, or vertex normals from adjacency if it has none
+    Vec3* normals;
+    bool32 computedVertexNormals;
+    ObjCorner* corners;
+    // First corner of each face, then total.faceVertices
+    uint32* faceFirst;
+
+    Triangle* triangles;
+};
+
+internal PARALLEL_FOR_FUNC(CountObjChunks)
+{
+    ObjParse* parse = (ObjParse*)data;
+    for (int i = begin; i < end; i++) {
+        ObjChunk* chunk = &parse->chunks[i];
+        chunk->counts = CountObjElements(chunk->start,
+            chunk->end - chunk->start);
+    }
+}
+
+// Writes each chunk's elements straight into its slice of the file's
+// arrays, so there's nothing to merge afterwards
+internal PARALLEL_FOR_FUNC(ParseObjChunks)
+{
+    ObjParse* parse = (ObjParse*)data;
+    for (int i = begin; i < end; i++) {
+        const ObjChunk* chunk = &parse->chunks[i];
+        Vec3* vertex = parse->vertices + chunk->first.vertices;
+        Vec2* uv = parse->uvs + chunk->first.uvs;
+        Vec3* normal = parse->normals + chunk->first.normals;
+        ObjCorner* corner = parse->corners + chunk->first.faceVertices;
+        uint32* faceFirst = parse->faceFirst + chunk->first.faces;
+
+        const char* s = chunk->start;
+        while (s < chunk->end) {
+            const char* lineEnd = (const char*)memchr(s, '\n',
+                chunk->end - s);
+            if (!lineEnd) {
+                lineEnd = chunk->end;
+            }
+            // Same line types as CountObjElements
+            if (lineEnd - s >= 2) {
+                if (s[0] == 'v' && s[1] == ' ') {
+                    ParseObjFloats(s + 2, lineEnd, vertex->e, 3);
+                    vertex++;
+                }
+                else if (s[0] == 'v' && s[1] == 't') {
+                    ParseObjFloats(s + 2, lineEnd, uv->e, 2);
+                    // TODO: uvs are flipped vertically here
+                    // BMPs should probably be flipped vertically instead
+                    uv->y = 1.0f - uv->y;
+                    uv++;
+                }
+                else if (s[0] == 'v' && s[1] == 'n') {
+                    Vec3 n;
+                    ParseObjFloats(s + 2, lineEnd, n.e, 3);
+                    *(normal++) = Normalize(n);
+                }
+                else if (s[0] == 'f') {
+                    *(faceFirst++) = (uint32)(corner - parse->corners);
+                    // Same tokens as CountObjElements, each v[/vt[/vn]]
+                    for (const char* c = s + 2; c < lineEnd; c++) {
+                        if (c[-1] != ' ' || *c == ' ' || *c == '\r') {
+                            continue;
+                        }
+                        const char* t = c;
+                        corner->vertex = ParseObjIndex(&t, lineEnd) - 1;
+                        corner->uv = -1;
+                        corner->normal = -1;
+                        if (t < lineEnd && *t == '/') {
+                            t++;
+                            corner->uv = ParseObjIndex(&t, lineEnd) - 1;
+                            if (t < lineEnd && *t == '/') {
+                                t++;
+                                corner->normal =
+                                    ParseObjIndex(&t, lineEnd) - 1;
+                            }
+                        }
+                        corner++;
+                    }
+                }
+            }
+            s = lineEnd + 1;
         }
-        else {
-            he.twin = 0;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(TriangulateObjChunks)
+{
+    const ObjParse* parse = (const ObjParse*)data;
+    const Vec3* vertices = parse->vertices;
+    const Vec2* uvs = parse->uvs;
+    const Vec3* normals = parse->normals;
+    for (int i = begin; i < end; i++) {
+        const ObjChunk* chunk = &parse->chunks[i];
+        Triangle* triangle = parse->triangles + chunk->first.triangles;
+        uint32 endFace = chunk->first.faces + chunk->counts.faces;
+        for (uint32 f = chunk->first.faces; f < endFace; f++) {
+            const ObjCorner* face = parse->corners + parse->faceFirst[f];
+            int numCorners = (int)(parse->faceFirst[f + 1]
+                - parse->faceFirst[f]);
+            DEBUG_ASSERT(numCorners >= 3);
+            if (numCorners < 3) {
+                continue;
+            }
+#if GAME_SLOW
+            for (int c = 0; c < numCorners; c++) {
+                DEBUG_ASSERT((uint32)face[c].vertex < parse->total.vertices);
+                DEBUG_ASSERT(parse->total.uvs == 0
+                    || (uint32)face[c].uv < parse->total.uvs);
+                DEBUG_ASSERT(parse->computedVertexNormals
+                    || (uint32)face[c].normal < parse->total.normals);
+            }
+#endif
+
+            Vec3 flatNormal = NormalFromTriangle(
+                vertices[face[0].vertex],
+                vertices[face[1].vertex],
+                vertices[face[2].vertex]
+            );
+            for (int v = 1; v < numCorners - 1; v++) {
+                triangle->v[0] = vertices[face[0].vertex];
+                triangle->v[1] = vertices[face[v].vertex];
+                triangle->v[2] = vertices[face[v + 1].vertex];
+                if (parse->total.uvs > 0) {
+                    triangle->uv[0] = uvs[face[0].uv];
+                    triangle->uv[1] = uvs[face[v].uv];
+                    triangle->uv[2] = uvs[face[v + 1].uv];
+                }
+                else {
+                    triangle->uv[0] = Vec2::zero;
+                    triangle->uv[1] = Vec2::zero;
+                    triangle->uv[2] = Vec2::zero;
+                }
+                if (!parse->computedVertexNormals) {
+                    triangle->n[0] = normals[face[0].normal];
+                    triangle->n[1] = normals[face[v].normal];
+                    triangle->n[2] = normals[face[v + 1].normal];
+                }
+                else {
+                    // triangle->n[0] = normals[face[0].vertex];
+                    // triangle->n[1] = normals[face[v].vertex];
+                    // triangle->n[2] = normals[face[v + 1].vertex];
+                    triangle->n[0] = flatNormal;
+                    triangle->n[1] = flatNormal;
+                    triangle->n[2] = flatNormal;
+                }
+                triangle->area = ComputeTriangleArea(
+                    triangle->v[0], triangle->v[1], triangle->v[2]);
+                triangle++;
+            }
         }
-        he.vertex = vertDst;
-        he.face = mesh.faces.size;
+    }
+}
 
-        // Assign forward edge i -> i + 1 to vertex i
-        mesh.vertices[vertSrc].halfEdge = mesh.halfEdges.size;
+// Half-edge k runs from corner k's vertex to the next corner's, around
+// its face
+internal HalfEdgeMesh HalfEdgeMeshFromFaces(const ObjParse* parse,
+    MemoryArena* scratch)
+{
+    uint32 numFaces = parse->total.faces;
+    uint32 numHalfEdges = parse->total.faceVertices;
+    HalfEdgeMesh mesh;
+    mesh.vertices.Init(parse->total.vertices, scratch);
+    mesh.faces.Init(numFaces, scratch);
+    mesh.halfEdges.Init(numHalfEdges, scratch);
+
+    for (uint32 v = 0; v < parse->total.vertices; v++) {
+        Vertex vertex;
+        vertex.pos = parse->vertices[v];
+        vertex.halfEdge = 0; // This is set later
+        vertex.color = Vec3::one;
+        mesh.vertices.Append(vertex);
+    }
+
+    // Half-edge index by (source << 32 | destination) vertex
+    HashMap<uint64, uint32> edgeMap;
+    edgeMap.Init(numHalfEdges, scratch);
+    if (edgeMap.capacity == 0) {
+        DEBUG_PRINT("No scratch memory for the edge map, no twins found\n");
+    }
+
+    for (uint32 f = 0; f < numFaces; f++) {
+        uint32 first = parse->faceFirst[f];
+        uint32 end = parse->faceFirst[f + 1];
+        for (uint32 e = first; e < end; e++) {
+            uint32 next = e + 1 < end ? e + 1 : first;
+            uint32 vertSrc = parse->corners[e].vertex;
+            uint32 vertDst = parse->corners[next].vertex;
 
-        // Add edge to edgeMap and mesh.halfEdges array
-        auto res = edgeMap.insert(
-            std::make_pair(forward, mesh.halfEdges.size));
-        if (!res.second) {
-            DEBUG_PRINT("ERROR: Edge already in edgeMap\n");
+            uint64 forward = ((uint64)vertSrc << 32) | vertDst;
+            uint64 backward = ((uint64)vertDst << 32) | vertSrc;
+            HalfEdge he;
+            he.next = next;
+            uint32* edgeBackward = edgeMap.Find(backward);
+            if (edgeBackward) {
+                he.twin = *edgeBackward;
+                mesh.halfEdges[*edgeBackward].twin = e;
+            }
+            else {
+                he.twin = 0;
+            }
+            he.vertex = vertDst;
+            he.face = f;
+
+            mesh.vertices[vertSrc].halfEdge = e;
+
+            if (edgeMap.capacity > 0) {
+                HashMapInsert inserted = edgeMap.Insert(forward, e);
+                // Init made room for every half-edge
+                DEBUG_ASSERT(inserted != HASH_MAP_NO_MEMORY);
+                if (inserted == HASH_MAP_DUPLICATE) {
+                    DEBUG_PRINT("ERROR: Edge already in edgeMap\n");
+                }
+            }
+            mesh.halfEdges.Append(he);
         }
-        mesh.halfEdges.Append(he);
-        faceVerts++;
+
+        Face face;
+        face.halfEdge = mesh.halfEdges.size - 1;
+        mesh.faces.Append(face);
     }
 
-    faceInds.Free();
     ComputeFaceNormals(&mesh);
     ComputeVertexNormals(&mesh);
 
-    DEBUGPlatformFreeFileMemory(thread, &objFile);
-    
     return mesh;
 }
 
-internal void FreeHalfEdgeMesh(HalfEdgeMesh* mesh)
+// Vose's method: each column starts with its triangle's area scaled so the
+// average is 1. Columns under 1 are topped up from columns over 1, which
+// become their aliases, until every column holds exactly 1.
+internal void BuildTriangleAlias(Mesh* mesh, MemoryArena* scratch)
 {
-    mesh->vertices.Free();
-    mesh->faces.Free();
-    mesh->halfEdges.Free();
+    uint32 n = mesh->triangles.size;
+    if (n == 0) {
+        return;
+    }
+
+    float64 totalArea = 0.0;
+    for (uint32 i = 0; i < n; i++) {
+        totalArea += mesh->triangles[i].area;
+    }
+    mesh->totalArea = (float32)totalArea;
+
+    mesh->triangleAlias = (TriangleAlias*)malloc(
+        sizeof(TriangleAlias) * (size_t)n);
+    if (!mesh->triangleAlias) {
+        // SampleTriangle picks triangles uniformly without the table
+        DEBUG_PRINT("No memory for the triangle alias table\n");
+        return;
+    }
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    float64* scaled = PUSH_ARRAY(scratch, float64, n);
+    // Under-full columns fill small from the front, over-full ones from the
+    // back, so one array holds both lists
+    uint32* worklist = PUSH_ARRAY(scratch, uint32, n);
+    if (!scaled || !worklist) {
+        // Still sampleable, just not by area
+        DEBUG_PRINT("No scratch memory for the triangle alias table\n");
+        for (uint32 i = 0; i < n; i++) {
+            mesh->triangleAlias[i].keep = 1.0f;
+            mesh->triangleAlias[i].alias = (int)i;
+        }
+        EndTemporaryMemory(temp);
+        return;
+    }
+    uint32 numSmall = 0;
+    uint32 largeStart = n;
+    for (uint32 i = 0; i < n; i++) {
+        scaled[i] = totalArea > 0.0 ?
+            mesh->triangles[i].area * n / totalArea : 1.0;
+        if (scaled[i] < 1.0) {
+            worklist[numSmall++] = i;
+        }
+        else {
+            worklist[--largeStart] = i;
+        }
+    }
+
+    while (numSmall > 0 && largeStart < n) {
+        uint32 small = worklist[--numSmall];
+        uint32 large = worklist[largeStart];
+        mesh->triangleAlias[small].keep = (float32)scaled[small];
+        mesh->triangleAlias[small].alias = (int)large;
+        scaled[large] -= 1.0 - scaled[small];
+        if (scaled[large] < 1.0) {
+            largeStart++;
+            worklist[numSmall++] = large;
+        }
+    }
+    // Whatever is left holds 1 up to rounding
+    while (numSmall > 0) {
+        uint32 i = worklist[--numSmall];
+        mesh->triangleAlias[i].keep = 1.0f;
+        mesh->triangleAlias[i].alias = (int)i;
+    }
+    for (uint32 i = largeStart; i < n; i++) {
+        mesh->triangleAlias[worklist[i]].keep = 1.0f;
+        mesh->triangleAlias[worklist[i]].alias = (int)worklist[i];
+    }
+
+    EndTemporaryMemory(temp);
 }
 
-internal inline float32 ComputeTriangleArea(
-    Vec3 v0, Vec3 v1, Vec3 v2)
+internal void ComputeMeshBounds(Mesh* mesh)
 {
-    Vec3 v0v1 = v1 - v0;
-    Vec3 v0v2 = v2 - v0;
-    return Mag(Cross(v0v1, v0v2)) / 2.0f;
+    if (mesh->triangles.size == 0) {
+        return;
+    }
+
+    Vec3 boundsMin = mesh->triangles[0].v[0];
+    Vec3 boundsMax = boundsMin;
+    for (uint32 t = 0; t < mesh->triangles.size; t++) {
+        const Triangle& triangle = mesh->triangles[t];
+        for (int v = 0; v < 3; v++) {
+            for (int e = 0; e < 3; e++) {
+                boundsMin.e[e] = MinFloat32(boundsMin.e[e],
+                    triangle.v[v].e[e]);
+                boundsMax.e[e] = MaxFloat32(boundsMax.e[e],
+                    triangle.v[v].e[e]);
+            }
+        }
+    }
+    mesh->boundsMin = boundsMin;
+    mesh->boundsMax = boundsMax;
 }
 
 Mesh LoadMeshFromObj(const ThreadContext* thread,
-    const char* fileName,
+    const char* fileName, const ThreadPool* pool, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory)
 {
     Mesh mesh;
     mesh.triangles.Init();
+    mesh.totalArea = 0.0f;
+    mesh.triangleAlias = nullptr;
+    mesh.boundsMin = Vec3::zero;
+    mesh.boundsMax = Vec3::zero;
+    mesh.cacheFile = {};
 
     DEBUGReadFileResult objFile = DEBUGPlatformReadFile(thread, fileName);
     if (!objFile.data) {
@@ -320,232 +688,330 @@ Mesh LoadMeshFromObj(const ThreadContext* thread,
         return mesh;
     }
 
-    char* fileStr = (char*)objFile.data;
-    int read;
-    char line[OBJ_LINE_MAX];
-    DynamicArray<Vec3> vertices;
-    vertices.Init();
-    DynamicArray<Vec2> uvs;
-    uvs.Init();
-    DynamicArray<Vec3> normals;
-    normals.Init();
-
-    DynamicArray<int> faceVertInds;
-    faceVertInds.Init();
-    DynamicArray<int> faceUVInds;
-    faceUVInds.Init();
-    DynamicArray<int> faceNormInds;
-    faceNormInds.Init();
-
-    while ((read = GetNextLine(fileStr, line, OBJ_LINE_MAX)) >= 0) {
-        fileStr += read + 1;
-        // TODO: I'm too lazy to fix this
-        line[read] = '\n';
-        line[read + 1] = '\0';
-        //DEBUG_PRINT("line: %s", line);
-        if (line[0] == '#') {
-            continue;
-        }
-        else if (line[0] == 'v') {
-            if (line[1] == ' ') {
-                int start = 2;
-                while (line[start] == ' ') {
-                    start++;
-                }
-                Vec3 v = ParseVec3(&line[start]);
-                vertices.Append(v);
-            }
-            else if (line[1] == 't') {
-                int start = 3;
-                while (line[start] == ' ') {
-                    start++;
-                }
-                Vec2 uv = ParseVec2(&line[start]);
-                // TODO: uvs are flipped vertically here
-                // BMPs should probably be flipped vertically instead
-                uv.y = 1.0f - uv.y;
-                uvs.Append(uv);
-            }
-            else if (line[1] == 'n') {
-                int start = 3;
-                while (line[start] == ' ') {
-                    start++;
-                }
-                Vec3 n = ParseVec3(&line[start]);
-                normals.Append(Normalize(n));
-            }
-            else {
-                // idk
-            }
-        }
-        else if (line[0] == 'f') {
-            char* vert = &line[2];
-            char* uv = &line[2];
-            char* norm = &line[2];
-            for (char* c = &line[2]; *c != '\0'; c++) {
-                if (*c == '/') {
-                    if (uv == vert) {
-                        uv = c + 1;
-                        *c = '\0';
-                    }
-                    else if (norm == vert) {
-                        norm = c + 1;
-                        *c = '\0';
-                    }
-                    else {
-                        // idk
-                    }
-                }
-                else if (*c == ' ' || *c == '\n') {
-                    *c = '\0';
-                    char* endptr = vert; // for strtol
-                    faceVertInds.Append((int)strtol(vert, &endptr, 10) - 1);
-                    // TODO: check error
-                    if (uv != vert) {
-                        endptr = uv;
-                        faceUVInds.Append((int)strtol(uv, &endptr, 10) - 1);
-                    }
-                    if (norm != vert) {
-                        endptr = norm;
-                        faceNormInds.Append((int)strtol(norm, &endptr, 10) - 1);
-                    }
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    const char* fileStart = (const char*)objFile.data;
+    const char* fileEnd = fileStart + objFile.size;
+    int numChunks = (int)(objFile.size / OBJ_CHUNK_BYTES) + 1;
+    if (numChunks > OBJ_MAX_CHUNKS) {
+        numChunks = OBJ_MAX_CHUNKS;
+    }
 
-                    vert = c + 1;
-                    uv = c + 1;
-                    norm = c + 1;
-                }
+    ObjParse parse;
+    parse.chunks = PUSH_ARRAY(scratch, ObjChunk, numChunks);
+    if (!parse.chunks) {
+        DEBUG_PRINT("No scratch memory to parse %s\n", fileName);
+        EndTemporaryMemory(temp);
+        DEBUGPlatformFreeFileMemory(thread, &objFile);
+        return mesh;
+    }
+    // Chunks end just past a newline, so no line is split between two
+    const char* chunkStart = fileStart;
+    for (int i = 0; i < numChunks; i++) {
+        const char* chunkEnd = fileEnd;
+        if (i < numChunks - 1) {
+            chunkEnd = fileStart + objFile.size * (i + 1) / numChunks;
+            if (chunkEnd < chunkStart) {
+                chunkEnd = chunkStart;
             }
-            faceVertInds.Append(-1);
-            faceUVInds.Append(-1);
-            faceNormInds.Append(-1);
+            const char* newline = (const char*)memchr(chunkEnd, '\n',
+                fileEnd - chunkEnd);
+            chunkEnd = newline ? newline + 1 : fileEnd;
         }
-        else {
-            // idk
+        parse.chunks[i].start = chunkStart;
+        parse.chunks[i].end = chunkEnd;
+        chunkStart = chunkEnd;
+    }
+
+    ParallelFor(pool, numChunks, 1, CountObjChunks, &parse);
+
+    parse.total = {};
+    for (int i = 0; i < numChunks; i++) {
+        ObjChunk* chunk = &parse.chunks[i];
+        chunk->first = parse.total;
+        parse.total.vertices += chunk->counts.vertices;
+        parse.total.uvs += chunk->counts.uvs;
+        parse.total.normals += chunk->counts.normals;
+        parse.total.faces += chunk->counts.faces;
+        parse.total.faceVertices += chunk->counts.faceVertices;
+        parse.total.triangles += chunk->counts.triangles;
+        if (chunk->counts.maxFaceVertices > parse.total.maxFaceVertices) {
+            parse.total.maxFaceVertices = chunk->counts.maxFaceVertices;
         }
     }
 
-    bool computedVertexNormals = false;
-    if (normals.size == 0) {
-        computedVertexNormals = true;
-        HalfEdgeMesh halfEdgeMesh = HalfEdgeMeshFromObj(thread, fileName,
-            DEBUGPlatformReadFile,
-            DEBUGPlatformFreeFileMemory);
-        DEBUG_ASSERT(halfEdgeMesh.vertices.size == vertices.size);
-        for (int v = 0; v < (int)halfEdgeMesh.vertices.size; v++) {
-            normals.Append(halfEdgeMesh.vertices[v].normal);
+    // Vertex normals are computed if the file has none
+    parse.computedVertexNormals = parse.total.normals == 0;
+    uint32 numNormals = parse.computedVertexNormals ?
+        parse.total.vertices : parse.total.normals;
+    parse.vertices = PUSH_ARRAY(scratch, Vec3, parse.total.vertices);
+    parse.uvs = PUSH_ARRAY(scratch, Vec2, parse.total.uvs);
+    parse.normals = PUSH_ARRAY(scratch, Vec3, numNormals);
+    parse.corners = PUSH_ARRAY(scratch, ObjCorner,
+        parse.total.faceVertices);
+    parse.faceFirst = PUSH_ARRAY(scratch, uint32, parse.total.faces + 1);
+    if (!parse.vertices || !parse.uvs || !parse.normals || !parse.corners
+    || !parse.faceFirst) {
+        DEBUG_PRINT("No scratch memory to parse %s\n", fileName);
+        EndTemporaryMemory(temp);
+        DEBUGPlatformFreeFileMemory(thread, &objFile);
+        return mesh;
+    }
+
+    ParallelFor(pool, numChunks, 1, ParseObjChunks, &parse);
+    parse.faceFirst[parse.total.faces] = parse.total.faceVertices;
+    DEBUGPlatformFreeFileMemory(thread, &objFile);
+
+    if (parse.computedVertexNormals) {
+        HalfEdgeMesh halfEdgeMesh = HalfEdgeMeshFromFaces(&parse, scratch);
+        for (uint32 v = 0; v < halfEdgeMesh.vertices.size; v++) {
+            parse.normals[v] = halfEdgeMesh.vertices[v].normal;
         }
         FreeHalfEdgeMesh(&halfEdgeMesh);
     }
 
-    DynamicArray<int> faceVerts;
-    faceVerts.Init();
-    DynamicArray<int> faceUVs;
-    faceUVs.Init();
-    DynamicArray<int> faceNormals;
-    faceNormals.Init();
-    DEBUG_ASSERT(vertices.size != uvs.size
-        || faceVertInds.size == faceUVInds.size);
-    /*DEBUG_ASSERT(vertices.size != normals.size
-        || faceVertInds.size == faceNormInds.size);*/
-    for (int i = 0; i < (int)faceVertInds.size; i++) {
-        if (faceVertInds[i] == -1) {
-            DEBUG_ASSERT(uvs.size == 0 || faceUVInds[i] == -1);
-            //DEBUG_ASSERT(normals.size == 0 || faceNormInds[i] == -1);
-            DEBUG_ASSERT(faceVerts.size >= 3);
-            Vec3 flatNormal = NormalFromTriangle(
-                vertices[faceVerts[0]],
-                vertices[faceVerts[1]],
-                vertices[faceVerts[2]]
-            );
-            for (int v = 1; v < (int)faceVerts.size - 1; v++) {
-                Vec3 v1 = vertices[faceVerts[v]];
-                Vec3 v2 = vertices[faceVerts[v + 1]];
-                Triangle triangle;
-                triangle.v[0] = vertices[faceVerts[0]];
-                triangle.v[1] = vertices[faceVerts[v]];
-                triangle.v[2] = vertices[faceVerts[v + 1]];
-                if (uvs.size > 0) {
-                    triangle.uv[0] = uvs[faceUVs[0]];
-                    triangle.uv[1] = uvs[faceUVs[v]];
-                    triangle.uv[2] = uvs[faceUVs[v + 1]];
-                }
-                else {
-                    triangle.uv[0] = Vec2::zero;
-                    triangle.uv[1] = Vec2::zero;
-                    triangle.uv[2] = Vec2::zero;
-                }
-                if (!computedVertexNormals) {
-                    triangle.n[0] = normals[faceNormals[0]];
-                    triangle.n[1] = normals[faceNormals[v]];
-                    triangle.n[2] = normals[faceNormals[v + 1]];
-                }
-                else {
-                    // triangle.n[0] = normals[faceVerts[0]];
-                    // triangle.n[1] = normals[faceVerts[v]];
-                    // triangle.n[2] = normals[faceVerts[v + 1]];
-                    triangle.n[0] = flatNormal;
-                    triangle.n[1] = flatNormal;
-                    triangle.n[2] = flatNormal;
-                }
-                triangle.area = ComputeTriangleArea(
-                    triangle.v[0], triangle.v[1], triangle.v[2]);
-                mesh.triangles.Append(triangle);
-            }
-            faceVerts.Clear();
-            faceUVs.Clear();
-            faceNormals.Clear();
-        }
-        else {
-            faceVerts.Append(faceVertInds[i]);
-            if (uvs.size > 0) {
-                faceUVs.Append(faceUVInds[i]);
-            }
-            if (!computedVertexNormals) {
-                faceNormals.Append(faceNormInds[i]);
-            }
+    if (!mesh.triangles.Resize(parse.total.triangles)) {
+        DEBUG_PRINT("No memory for the triangles of %s\n", fileName);
+        EndTemporaryMemory(temp);
+        return mesh;
+    }
+    parse.triangles = mesh.triangles.data;
+    ParallelFor(pool, numChunks, 1, TriangulateObjChunks, &parse);
+    EndTemporaryMemory(temp);
+
+    BuildTriangleAlias(&mesh, scratch);
+    ComputeMeshBounds(&mesh);
+
+    // NOTE: must free mesh after this
+    return mesh;
+}
+
+#define MESH_CACHE_MAGIC 0x4853454d // "MESH"
+#define MESH_CACHE_VERSION 1
+
+// Followed, at MESH_CACHE_DATA_OFFSET, by the mesh's Triangle array and
+// then its TriangleAlias array, both used in place once mapped
+struct MeshCacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    // Catch layout changes the version bump was forgotten for
+    uint32 triangleSize;
+    uint32 aliasSize;
+    // Of the OBJ file the cache was made from
+    uint64 sourceSize;
+    uint64 sourceTime;
+    uint64 dataHash; // of everything from MESH_CACHE_DATA_OFFSET on
+    uint32 triangleCount;
+    float32 totalArea;
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+};
+
+#define MESH_CACHE_DATA_OFFSET ALIGN_POW2(sizeof(MeshCacheHeader), 64)
+
+// FNV-1a over 8-byte words, to catch truncated or corrupt cache files
+internal uint64 HashMeshCacheData(const uint8* data, uint64 size)
+{
+    uint64 hash = 14695981039346656037ull;
+    uint64 i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64 word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+internal void GetMeshCachePath(const char* meshFile, char* path,
+    int pathSize)
+{
+    const char* baseName = meshFile;
+    for (const char* c = meshFile; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            baseName = c + 1;
         }
     }
-    faceVerts.Free();
-    faceNormals.Free();
-    faceUVs.Free();
+    snprintf(path, pathSize, MESH_CACHE_DIR "%s.mesh", baseName);
+}
 
-    faceVertInds.Free();
-    faceUVInds.Free();
-    faceNormInds.Free();
+internal bool32 LoadMeshCache(const ThreadContext* thread,
+    const char* path, DEBUGFileInfo source, Mesh* mesh,
+    DEBUGPlatformMapFileFunc* DEBUGPlatformMapFile,
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile)
+{
+    DEBUGReadFileResult cacheFile = DEBUGPlatformMapFile(thread, path);
+    if (!cacheFile.data) {
+        return false;
+    }
 
-    vertices.Free();
-    uvs.Free();
-    normals.Free();
+    const uint8* data = (const uint8*)cacheFile.data;
+    MeshCacheHeader header;
+    uint64 triangleBytes = 0;
+    bool32 valid = false;
+    if (cacheFile.size >= MESH_CACHE_DATA_OFFSET) {
+        memcpy(&header, data, sizeof(MeshCacheHeader));
+        triangleBytes = (uint64)header.triangleCount * sizeof(Triangle);
+        uint64 dataSize = triangleBytes
+            + (uint64)header.triangleCount * sizeof(TriangleAlias);
+        valid = header.magic == MESH_CACHE_MAGIC
+            && header.version == MESH_CACHE_VERSION
+            && header.triangleSize == sizeof(Triangle)
+            && header.aliasSize == sizeof(TriangleAlias)
+            && header.sourceSize == source.size
+            && header.sourceTime == source.modifiedTime
+            && cacheFile.size == MESH_CACHE_DATA_OFFSET + dataSize
+            && HashMeshCacheData(data + MESH_CACHE_DATA_OFFSET, dataSize)
+            == header.dataHash;
+    }
+    if (!valid) {
+        DEBUGPlatformUnmapFile(thread, &cacheFile);
+        return false;
+    }
 
-    DEBUGPlatformFreeFileMemory(thread, &objFile);
+    const uint8* arrays = data + MESH_CACHE_DATA_OFFSET;
+    mesh->triangles.data = (Triangle*)arrays;
+    mesh->triangles.size = header.triangleCount;
+    mesh->triangles.capacity = header.triangleCount;
+    mesh->triangles.arena = nullptr;
+    mesh->triangleAlias = (TriangleAlias*)(arrays + triangleBytes);
+    mesh->totalArea = header.totalArea;
+    mesh->boundsMin = header.boundsMin;
+    mesh->boundsMax = header.boundsMax;
+    mesh->cacheFile = cacheFile;
+    return true;
+}
+
+internal void WriteMeshCache(const ThreadContext* thread,
+    const char* path, DEBUGFileInfo source, const Mesh* mesh,
+    MemoryArena* scratch,
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile)
+{
+    uint64 triangleBytes = (uint64)mesh->triangles.size * sizeof(Triangle);
+    uint64 dataSize = triangleBytes
+        + (uint64)mesh->triangles.size * sizeof(TriangleAlias);
+    uint64 fileSize = MESH_CACHE_DATA_OFFSET + dataSize;
+
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    uint8* fileData = PUSH_ARRAY(scratch, uint8, fileSize);
+    if (fileData) {
+        uint8* arrays = fileData + MESH_CACHE_DATA_OFFSET;
+        memcpy(arrays, mesh->triangles.data, triangleBytes);
+        memcpy(arrays + triangleBytes, mesh->triangleAlias,
+            dataSize - triangleBytes);
+
+        MeshCacheHeader header;
+        header.magic = MESH_CACHE_MAGIC;
+        header.version = MESH_CACHE_VERSION;
+        header.triangleSize = sizeof(Triangle);
+        header.aliasSize = sizeof(TriangleAlias);
+        header.sourceSize = source.size;
+        header.sourceTime = source.modifiedTime;
+        header.dataHash = HashMeshCacheData(arrays, dataSize);
+        header.triangleCount = mesh->triangles.size;
+        header.totalArea = mesh->totalArea;
+        header.boundsMin = mesh->boundsMin;
+        header.boundsMax = mesh->boundsMax;
+        memset(fileData, 0, MESH_CACHE_DATA_OFFSET);
+        memcpy(fileData, &header, sizeof(MeshCacheHeader));
+    }
+    if (!fileData
+    || !DEBUGPlatformWriteFile(thread, path, (uint32)fileSize, fileData)) {
+        DEBUG_PRINT("Failed to write mesh cache file %s\n", path);
+    }
+    EndTemporaryMemory(temp);
+}
+
+Mesh LoadMesh(const ThreadContext* thread,
+    const char* fileName, const ThreadPool* pool, MemoryArena* scratch,
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory,
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile,
+    DEBUGPlatformGetFileInfoFunc* DEBUGPlatformGetFileInfo,
+    DEBUGPlatformMapFileFunc* DEBUGPlatformMapFile,
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile)
+{
+    char path[512];
+    GetMeshCachePath(fileName, path, (int)sizeof(path));
+
+    DEBUGFileInfo source;
+    bool32 haveSource = DEBUGPlatformGetFileInfo(thread, fileName, &source);
+    if (haveSource) {
+        Mesh mesh;
+        if (LoadMeshCache(thread, path, source, &mesh,
+        DEBUGPlatformMapFile, DEBUGPlatformUnmapFile)) {
+            DEBUG_PRINT("Loaded mesh from %s\n", path);
+            return mesh;
+        }
+    }
+
+    Mesh mesh = LoadMeshFromObj(thread, fileName, pool, scratch,
+        DEBUGPlatformReadFile, DEBUGPlatformFreeFileMemory);
+    if (haveSource && mesh.triangleAlias) {
+        WriteMeshCache(thread, path, source, &mesh, scratch,
+            DEBUGPlatformWriteFile);
+    }
 
-    // NOTE: must free mesh after this
     return mesh;
 }
 
-void FreeMesh(Mesh* mesh)
+void FreeMesh(const ThreadContext* thread, Mesh* mesh,
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile)
 {
-    mesh->triangles.Free();
+    if (mesh->cacheFile.data) {
+        // The arrays live in the mapping
+        DEBUGPlatformUnmapFile(thread, &mesh->cacheFile);
+        mesh->triangles.data = nullptr;
+        mesh->triangles.size = 0;
+        mesh->triangles.capacity = 0;
+    }
+    else {
+        mesh->triangles.Free();
+        free(mesh->triangleAlias);
+    }
+    mesh->triangleAlias = nullptr;
+    mesh->totalArea = 0.0f;
+}
+
+int SampleTriangle(const Mesh& mesh, uint32 r, float32 u)
+{
+    DEBUG_ASSERT(mesh.triangles.size > 0);
+    // High half of r * size, an unbiased enough column for 32-bit r
+    int column = (int)(((uint64)r * mesh.triangles.size) >> 32);
+    if (!mesh.triangleAlias) {
+        return column;
+    }
+    const TriangleAlias& entry = mesh.triangleAlias[column];
+    return u < entry.keep ? column : entry.alias;
 }
 
 MeshGL LoadMeshGL(const ThreadContext* thread, const Mesh& mesh,
+    MemoryArena* scratch,
     DEBUGPlatformReadFileFunc DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc DEBUGPlatformFreeFileMemory)
 {
     MeshGL meshGL;
 
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    uint32 numVertices = mesh.triangles.size * 3;
     DynamicArray<Vec3> vertices;
-    vertices.Init(mesh.triangles.size * 3);
+    vertices.Init(numVertices, scratch);
     DynamicArray<Vec3> normals;
-    normals.Init(mesh.triangles.size * 3);
+    normals.Init(numVertices, scratch);
+    if (!vertices.Resize(numVertices) || !normals.Resize(numVertices)) {
+        // Nothing gets drawn, but the GL names are still valid to free
+        DEBUG_PRINT("No scratch memory for the mesh vertex buffers\n");
+        vertices.size = 0;
+        normals.size = 0;
+    }
     for (uint32 t = 0; t < mesh.triangles.size; t++) {
-        vertices.Append(mesh.triangles[t].v[0]);
-        vertices.Append(mesh.triangles[t].v[1]);
-        vertices.Append(mesh.triangles[t].v[2]);
-
-        normals.Append(mesh.triangles[t].n[0]);
-        normals.Append(mesh.triangles[t].n[1]);
-        normals.Append(mesh.triangles[t].n[2]);
+        const Triangle& triangle = mesh.triangles[t];
+        for (int v = 0; v < 3; v++) {
+            vertices.data[t * 3 + v] = triangle.v[v];
+            normals.data[t * 3 + v] = triangle.n[v];
+        }
     }
 
     glGenVertexArrays(1, &meshGL.vertexArray);
@@ -589,8 +1055,7 @@ MeshGL LoadMeshGL(const ThreadContext* thread, const Mesh& mesh,
 
     meshGL.vertexCount = (int)vertices.size;
 
-    vertices.Free();
-    normals.Free();
+    EndTemporaryMemory(temp);
 
     return meshGL;
 }
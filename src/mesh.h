@@ -3,8 +3,11 @@
 #include "km_lib.h"
 #include "km_math.h"
 #include "main_platform.h"
+#include "thread_pool.h"
 
 #define MAX_TRIANGLES 500000
+// Loaded meshes are cached here as <mesh file>.mesh
+#define MESH_CACHE_DIR "data/cache/"
 
 struct Triangle
 {
@@ -14,9 +17,27 @@ struct Triangle
     float32 area;
 };
 
+// One column of a Walker alias table: the column's own triangle is kept
+// with probability keep, otherwise alias is taken
+struct TriangleAlias
+{
+    float32 keep;
+    int alias;
+};
+
 struct Mesh
 {
     DynamicArray<Triangle> triangles;
+    float32 totalArea;
+    // Samples triangles by area in constant time. Built on load, null if
+    // there was no memory for it.
+    TriangleAlias* triangleAlias;
+    Vec3 boundsMin;
+    Vec3 boundsMax;
+
+    // If the mesh came from the cache, triangles and triangleAlias point
+    // into this read-only mapping of the cache file
+    DEBUGReadFileResult cacheFile;
 };
 
 struct MeshGL
@@ -28,13 +49,35 @@ struct MeshGL
     int vertexCount;
 };
 
+// Large files are parsed in pieces spread over pool. Temporary buffers
+// come from scratch, and are released before returning.
 Mesh LoadMeshFromObj(const ThreadContext* thread,
-    const char* fileName,
+    const char* fileName, const ThreadPool* pool, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory);
-void FreeMesh(Mesh* mesh);
+// Maps the OBJ file fileName's binary cache and uses it in place, or
+// parses the OBJ and writes the cache. A cache whose source file changed
+// size or modification time, or whose contents don't match their hash,
+// is rewritten. The cache file is staged on scratch.
+Mesh LoadMesh(const ThreadContext* thread,
+    const char* fileName, const ThreadPool* pool, MemoryArena* scratch,
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory,
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile,
+    DEBUGPlatformGetFileInfoFunc* DEBUGPlatformGetFileInfo,
+    DEBUGPlatformMapFileFunc* DEBUGPlatformMapFile,
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile);
+void FreeMesh(const ThreadContext* thread, Mesh* mesh,
+    DEBUGPlatformUnmapFileFunc* DEBUGPlatformUnmapFile);
+
+// Random triangle, weighted by area, from a uniform 32-bit integer r and a
+// uniform float u in [0, 1). The mesh must have triangles. Uniform over
+// triangles if the mesh has no alias table.
+int SampleTriangle(const Mesh& mesh, uint32 r, float32 u);
 
+// Vertex staging comes from scratch, and is released before returning
 MeshGL LoadMeshGL(const ThreadContext* thread, const Mesh& mesh,
+    MemoryArena* scratch,
     DEBUGPlatformReadFileFunc DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc DEBUGPlatformFreeFileMemory);
 void DrawMeshGL(const MeshGL& meshGL, Mat4 proj, Mat4 view, Vec4 color);
@@ -0,0 +1,600 @@
+#include "nbody.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "km_debug.h"
+
+// SSE2 is part of the x86-64 baseline, so it needs no runtime check
+#if defined(__x86_64__) || defined(_M_X64)
+#define NBODY_SSE 1
+#include <emmintrin.h>
+#else
+#define NBODY_SSE 0
+#endif
+
+#define NBODY_RADIX_DIGITS (1 << NBODY_RADIX_BITS)
+// Every node pushes at most 8 children, and the tree is at most
+// NBODY_MORTON_BITS deep
+#define NBODY_STACK_SIZE (8 * (NBODY_MORTON_BITS + 1))
+// Interactions gathered before they're applied to a group
+#define NBODY_LIST_SIZE 1024
+
+void InitNBodyTree(NBodyTree* tree, NBodyParams params, int maxParticles)
+{
+    DEBUG_ASSERT(params.theta >= 0.0f);
+    // Also keeps a particle's pull on itself at 0 instead of 0 / 0
+    DEBUG_ASSERT(params.softening > 0.0f);
+
+    tree->params = params;
+    tree->maxParticles = maxParticles;
+
+    int maxChunks = MaxInt(
+        (maxParticles + NBODY_CHUNK_SIZE - 1) / NBODY_CHUNK_SIZE, 1);
+    tree->chunkMin = (Vec3*)malloc(sizeof(Vec3) * maxChunks);
+    tree->chunkMax = (Vec3*)malloc(sizeof(Vec3) * maxChunks);
+    tree->digitCounts = (uint32*)malloc(sizeof(uint32) * maxChunks
+        * NBODY_RADIX_DIGITS);
+    for (int i = 0; i < 2; i++) {
+        tree->codes[i] = (uint32*)malloc(sizeof(uint32) * maxParticles);
+        tree->indices[i] = (int*)malloc(sizeof(int) * maxParticles);
+    }
+    for (int p = 0; p < NBODY_RADIX_PASSES; p++) {
+        NBodySortPass* pass = &tree->sortPasses[p];
+        pass->tree = tree;
+        pass->shift = p * NBODY_RADIX_BITS;
+        pass->keysIn = tree->codes[p % 2];
+        pass->valuesIn = tree->indices[p % 2];
+        pass->keysOut = tree->codes[(p + 1) % 2];
+        pass->valuesOut = tree->indices[(p + 1) % 2];
+    }
+    tree->sortedCodes = tree->codes[NBODY_RADIX_PASSES % 2];
+    tree->sorted = tree->indices[NBODY_RADIX_PASSES % 2];
+    tree->sortedPos = (Vec3*)malloc(sizeof(Vec3) * maxParticles);
+
+    tree->nodes.Init();
+    tree->subtreeRoots.Init();
+    tree->subtreeDepths.Init();
+    for (int k = 0; k < NBODY_BUILD_JOBS; k++) {
+        tree->buildJobs[k].nodes.Init();
+    }
+}
+
+void FreeNBodyTree(NBodyTree* tree)
+{
+    free(tree->chunkMin);
+    free(tree->chunkMax);
+    free(tree->digitCounts);
+    for (int i = 0; i < 2; i++) {
+        free(tree->codes[i]);
+        free(tree->indices[i]);
+    }
+    free(tree->sortedPos);
+    tree->nodes.Free();
+    tree->subtreeRoots.Free();
+    tree->subtreeDepths.Free();
+    for (int k = 0; k < NBODY_BUILD_JOBS; k++) {
+        tree->buildJobs[k].nodes.Free();
+    }
+    *tree = {};
+}
+
+internal PARALLEL_FOR_FUNC(ComputeNBodyChunkBounds)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    Vec3 boundsMin = tree->pos[begin];
+    Vec3 boundsMax = boundsMin;
+    for (int i = begin + 1; i < end; i++) {
+        Vec3 p = tree->pos[i];
+        for (int e = 0; e < 3; e++) {
+            boundsMin.e[e] = MinFloat32(boundsMin.e[e], p.e[e]);
+            boundsMax.e[e] = MaxFloat32(boundsMax.e[e], p.e[e]);
+        }
+    }
+    int chunk = begin / NBODY_CHUNK_SIZE;
+    tree->chunkMin[chunk] = boundsMin;
+    tree->chunkMax[chunk] = boundsMax;
+}
+
+// Cube around all particles, from the per-chunk bounds
+internal void GetNBodyBounds(const NBodyTree* tree,
+    Vec3* boundsMin, float32* size)
+{
+    int numChunks = (tree->count + NBODY_CHUNK_SIZE - 1) / NBODY_CHUNK_SIZE;
+    Vec3 min = tree->chunkMin[0];
+    Vec3 max = tree->chunkMax[0];
+    for (int k = 1; k < numChunks; k++) {
+        for (int e = 0; e < 3; e++) {
+            min.e[e] = MinFloat32(min.e[e], tree->chunkMin[k].e[e]);
+            max.e[e] = MaxFloat32(max.e[e], tree->chunkMax[k].e[e]);
+        }
+    }
+    float32 extent = MaxFloat32(MaxFloat32(max.x - min.x, max.y - min.y),
+        max.z - min.z);
+    *boundsMin = min;
+    *size = MaxFloat32(extent, 1e-6f);
+}
+
+// Spreads the low 10 bits of x out to every third bit
+internal inline uint32 SpreadMortonBits(uint32 x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+internal PARALLEL_FOR_FUNC(ComputeNBodyCodes)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    Vec3 boundsMin;
+    float32 size;
+    GetNBodyBounds(tree, &boundsMin, &size);
+
+    const int maxCoord = (1 << NBODY_MORTON_BITS) - 1;
+    float32 scale = (float32)(1 << NBODY_MORTON_BITS) / size;
+    for (int i = begin; i < end; i++) {
+        Vec3 p = (tree->pos[i] - boundsMin) * scale;
+        uint32 x = (uint32)ClampInt((int)p.x, 0, maxCoord);
+        uint32 y = (uint32)ClampInt((int)p.y, 0, maxCoord);
+        uint32 z = (uint32)ClampInt((int)p.z, 0, maxCoord);
+        tree->codes[0][i] = (SpreadMortonBits(x) << 2)
+            | (SpreadMortonBits(y) << 1) | SpreadMortonBits(z);
+        tree->indices[0][i] = i;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(CountNBodyDigits)
+{
+    NBodySortPass* pass = (NBodySortPass*)data;
+    int chunk = begin / NBODY_CHUNK_SIZE;
+    uint32* counts = pass->tree->digitCounts + chunk * NBODY_RADIX_DIGITS;
+    for (int d = 0; d < NBODY_RADIX_DIGITS; d++) {
+        counts[d] = 0;
+    }
+    for (int i = begin; i < end; i++) {
+        uint32 digit = (pass->keysIn[i] >> pass->shift)
+            & (NBODY_RADIX_DIGITS - 1);
+        counts[digit]++;
+    }
+}
+
+// Stable: every chunk writes its particles after those of the same digit
+// in earlier chunks, so the order doesn't depend on the thread count.
+internal PARALLEL_FOR_FUNC(ScatterNBodyDigits)
+{
+    NBodySortPass* pass = (NBodySortPass*)data;
+    const NBodyTree* tree = pass->tree;
+    int numChunks = (tree->count + NBODY_CHUNK_SIZE - 1) / NBODY_CHUNK_SIZE;
+    int chunk = begin / NBODY_CHUNK_SIZE;
+
+    uint32 offsets[NBODY_RADIX_DIGITS];
+    uint32 sum = 0;
+    for (int d = 0; d < NBODY_RADIX_DIGITS; d++) {
+        for (int k = 0; k < numChunks; k++) {
+            if (k == chunk) {
+                offsets[d] = sum;
+            }
+            sum += tree->digitCounts[k * NBODY_RADIX_DIGITS + d];
+        }
+    }
+    for (int i = begin; i < end; i++) {
+        uint32 key = pass->keysIn[i];
+        uint32 digit = (key >> pass->shift) & (NBODY_RADIX_DIGITS - 1);
+        uint32 slot = offsets[digit]++;
+        pass->keysOut[slot] = key;
+        pass->valuesOut[slot] = pass->valuesIn[i];
+    }
+}
+
+// Appends the non-empty octants of node (at the given depth) to nodes, and
+// links them as its children. node must not point into nodes, which may
+// reallocate.
+internal void SplitNBodyNode(const NBodyTree* tree, NBodyNode* node,
+    int depth, DynamicArray<NBodyNode>* nodes)
+{
+    int shift = 3 * (NBODY_MORTON_BITS - 1 - depth);
+    const uint32* codes = tree->sortedCodes;
+    float32 offset = node->size * 0.25f;
+
+    node->firstChild = (int)nodes->size;
+    node->numChildren = 0;
+    int end = node->first + node->count;
+    int childFirst = node->first;
+    while (childFirst < end) {
+        // Codes share the node's prefix, so octants come in sorted runs
+        uint32 octant = (codes[childFirst] >> shift) & 7;
+        int lo = childFirst + 1;
+        int hi = end;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (((codes[mid] >> shift) & 7) == octant) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+
+        NBodyNode child = {};
+        child.size = node->size * 0.5f;
+        child.center = node->center + Vec3 {
+            (octant & 4) ? offset : -offset,
+            (octant & 2) ? offset : -offset,
+            (octant & 1) ? offset : -offset
+        };
+        child.firstChild = -1;
+        child.first = childFirst;
+        child.count = lo - childFirst;
+        nodes->Append(child);
+        node->numChildren++;
+        childFirst = lo;
+    }
+}
+
+internal void SplitNBodyTop(NBodyTree* tree, int index, int depth,
+    int maxSubtreeCount)
+{
+    if (tree->nodes[index].count <= maxSubtreeCount
+    || depth == NBODY_MORTON_BITS) {
+        tree->subtreeRoots.Append(index);
+        tree->subtreeDepths.Append(depth);
+        return;
+    }
+
+    NBodyNode node = tree->nodes[index];
+    SplitNBodyNode(tree, &node, depth, &tree->nodes);
+    tree->nodes[index] = node;
+    for (int c = 0; c < node.numChildren; c++) {
+        SplitNBodyTop(tree, node.firstChild + c, depth + 1, maxSubtreeCount);
+    }
+}
+
+// Builds the top of the tree, down to subtrees small enough for one job,
+// and hands those out to the build jobs.
+internal PARALLEL_FOR_FUNC(BuildNBodyTop)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    tree->nodes.Clear();
+    tree->subtreeRoots.Clear();
+    tree->subtreeDepths.Clear();
+
+    int count = tree->count;
+    if (count > 0) {
+        Vec3 boundsMin;
+        float32 size;
+        GetNBodyBounds(tree, &boundsMin, &size);
+
+        NBodyNode root = {};
+        root.size = size;
+        root.center = boundsMin + Vec3 { size, size, size } * 0.5f;
+        root.firstChild = -1;
+        root.first = 0;
+        root.count = count;
+        tree->nodes.Append(root);
+        SplitNBodyTop(tree, 0, 0,
+            MaxInt(count / NBODY_SUBTREE_SPLIT, NBODY_LEAF_SIZE));
+    }
+    tree->numTopNodes = (int)tree->nodes.size;
+
+    // Subtrees are in Morton order. Give each job a run of them covering
+    // about the same number of particles.
+    int s = 0;
+    int numSubtrees = (int)tree->subtreeRoots.size;
+    for (int k = 0; k < NBODY_BUILD_JOBS; k++) {
+        int endParticle = (int)((int64)count * (k + 1) / NBODY_BUILD_JOBS);
+        tree->buildJobs[k].firstSubtree = s;
+        while (s < numSubtrees
+        && tree->nodes[tree->subtreeRoots[s]].first < endParticle) {
+            s++;
+        }
+        tree->buildJobs[k].endSubtree = s;
+    }
+}
+
+// Returns node with its children built (appended to nodes) and its
+// center of mass filled in.
+internal NBodyNode BuildNBodyNode(const NBodyTree* tree, NBodyNode node,
+    int depth, DynamicArray<NBodyNode>* nodes)
+{
+    Vec3 sum = Vec3::zero;
+    if (node.count <= NBODY_LEAF_SIZE || depth == NBODY_MORTON_BITS) {
+        for (int j = node.first; j < node.first + node.count; j++) {
+            sum += tree->sortedPos[j];
+        }
+    }
+    else {
+        SplitNBodyNode(tree, &node, depth, nodes);
+        for (int c = 0; c < node.numChildren; c++) {
+            int child = node.firstChild + c;
+            NBodyNode built = BuildNBodyNode(tree, (*nodes)[child],
+                depth + 1, nodes);
+            (*nodes)[child] = built;
+            sum += built.centerOfMass * (float32)built.count;
+        }
+    }
+    node.centerOfMass = sum / (float32)node.count;
+    return node;
+}
+
+internal PARALLEL_FOR_FUNC(BuildNBodySubtrees)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    for (int k = begin; k < end; k++) {
+        NBodyBuildJob* job = &tree->buildJobs[k];
+        job->nodes.Clear();
+        for (int s = job->firstSubtree; s < job->endSubtree; s++) {
+            int root = tree->subtreeRoots[s];
+            NBodyNode node = tree->nodes[root];
+            for (int j = node.first; j < node.first + node.count; j++) {
+                tree->sortedPos[j] = tree->pos[tree->sorted[j]];
+            }
+            // Child indices are into job->nodes until LinkNBodyTree
+            tree->nodes[root] = BuildNBodyNode(tree, node,
+                tree->subtreeDepths[s], &job->nodes);
+        }
+    }
+}
+
+// Appends the build jobs' nodes to the tree, then fills in the centers of
+// mass above the subtrees.
+internal PARALLEL_FOR_FUNC(LinkNBodyTree)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    int numTopNodes = tree->numTopNodes;
+    uint32 numNodes = tree->nodes.size;
+    for (int k = 0; k < NBODY_BUILD_JOBS; k++) {
+        numNodes += tree->buildJobs[k].nodes.size;
+    }
+    if (!tree->nodes.Reserve(numNodes)) {
+        // Keep the top of the tree and treat each subtree as one big leaf.
+        // Slower, since its bodies get summed one by one, but still right.
+        DEBUG_PRINT("No memory to link the n-body subtrees\n");
+        for (uint32 s = 0; s < tree->subtreeRoots.size; s++) {
+            NBodyNode* root = &tree->nodes[tree->subtreeRoots[s]];
+            root->firstChild = -1;
+            root->numChildren = 0;
+        }
+    }
+    else {
+        for (int k = 0; k < NBODY_BUILD_JOBS; k++) {
+            NBodyBuildJob* job = &tree->buildJobs[k];
+            int offset = (int)tree->nodes.size;
+            for (int s = job->firstSubtree; s < job->endSubtree; s++) {
+                NBodyNode* root = &tree->nodes[tree->subtreeRoots[s]];
+                if (root->firstChild != -1) {
+                    root->firstChild += offset;
+                }
+            }
+            // Fits in what was reserved above, so this can't fail
+            tree->nodes.AppendN(job->nodes.data, job->nodes.size);
+            for (uint32 n = offset; n < tree->nodes.size; n++) {
+                if (tree->nodes[n].firstChild != -1) {
+                    tree->nodes[n].firstChild += offset;
+                }
+            }
+        }
+    }
+
+    // Children come after their parents
+    for (int n = numTopNodes - 1; n >= 0; n--) {
+        NBodyNode* node = &tree->nodes[n];
+        if (node->firstChild == -1 || node->firstChild >= numTopNodes) {
+            // Leaf or subtree root, done by its build job
+            continue;
+        }
+        Vec3 sum = Vec3::zero;
+        for (int c = 0; c < node->numChildren; c++) {
+            const NBodyNode* child = &tree->nodes[node->firstChild + c];
+            sum += child->centerOfMass * (float32)child->count;
+        }
+        node->centerOfMass = sum / (float32)node->count;
+    }
+}
+
+// A body, or a far node as one body at its center of mass
+struct NBodyInteraction
+{
+    Vec3 pos;
+    float32 count;
+};
+
+// Adds count * d / |d|^3 of every interaction to the pull of each particle
+internal void ApplyNBodyInteractions(const NBodyInteraction* list,
+    int listSize, const Vec3* groupPos, Vec3* groupPull, int groupSize,
+    float32 softening2)
+{
+    int g = 0;
+#if NBODY_SSE
+    // Four particles at a time, same operations in the same order as the
+    // scalar loop below, so the results match it exactly
+    const __m128 soft = _mm_set1_ps(softening2);
+    for (; g + 4 <= groupSize; g += 4) {
+        const Vec3* p = groupPos + g;
+        __m128 px = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+        __m128 py = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+        __m128 pz = _mm_setr_ps(p[0].z, p[1].z, p[2].z, p[3].z);
+        __m128 ax = _mm_setzero_ps();
+        __m128 ay = _mm_setzero_ps();
+        __m128 az = _mm_setzero_ps();
+        for (int l = 0; l < listSize; l++) {
+            __m128 dx = _mm_sub_ps(_mm_set1_ps(list[l].pos.x), px);
+            __m128 dy = _mm_sub_ps(_mm_set1_ps(list[l].pos.y), py);
+            __m128 dz = _mm_sub_ps(_mm_set1_ps(list[l].pos.z), pz);
+            __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                _mm_mul_ps(dz, dz)), soft);
+            __m128 scale = _mm_div_ps(_mm_set1_ps(list[l].count),
+                _mm_mul_ps(r2, _mm_sqrt_ps(r2)));
+            ax = _mm_add_ps(ax, _mm_mul_ps(dx, scale));
+            ay = _mm_add_ps(ay, _mm_mul_ps(dy, scale));
+            az = _mm_add_ps(az, _mm_mul_ps(dz, scale));
+        }
+        float32 x[4], y[4], z[4];
+        _mm_storeu_ps(x, ax);
+        _mm_storeu_ps(y, ay);
+        _mm_storeu_ps(z, az);
+        for (int k = 0; k < 4; k++) {
+            groupPull[g + k] += Vec3 { x[k], y[k], z[k] };
+        }
+    }
+#endif
+    for (; g < groupSize; g++) {
+        Vec3 p = groupPos[g];
+        Vec3 pull = Vec3::zero;
+        for (int l = 0; l < listSize; l++) {
+            Vec3 d = list[l].pos - p;
+            float32 r2 = Dot(d, d) + softening2;
+            pull += d * (list[l].count / (r2 * sqrtf(r2)));
+        }
+        groupPull[g] += pull;
+    }
+}
+
+// Walks the tree once per group of particles that are next to each other
+// in Morton order, opening nodes by their distance to the group's bounds.
+// The group shares the resulting interaction list.
+internal PARALLEL_FOR_FUNC(ApplyNBodyForces)
+{
+    NBodyTree* tree = (NBodyTree*)data;
+    const NBodyNode* nodes = tree->nodes.data;
+    const Vec3* sortedPos = tree->sortedPos;
+    float32 theta2 = tree->params.theta * tree->params.theta;
+    float32 softening2 = tree->params.softening * tree->params.softening;
+    float32 accelCoeff = tree->params.gravityConstant
+        * tree->params.particleMass * tree->deltaTime;
+
+    int stack[NBODY_STACK_SIZE];
+    NBodyInteraction list[NBODY_LIST_SIZE];
+    Vec3 pull[NBODY_GROUP_SIZE];
+    for (int group = begin; group < end; group += NBODY_GROUP_SIZE) {
+        int groupSize = MinInt(NBODY_GROUP_SIZE, end - group);
+        const Vec3* groupPos = sortedPos + group;
+        Vec3 boxMin = groupPos[0];
+        Vec3 boxMax = groupPos[0];
+        for (int g = 0; g < groupSize; g++) {
+            for (int e = 0; e < 3; e++) {
+                boxMin.e[e] = MinFloat32(boxMin.e[e], groupPos[g].e[e]);
+                boxMax.e[e] = MaxFloat32(boxMax.e[e], groupPos[g].e[e]);
+            }
+            pull[g] = Vec3::zero;
+        }
+
+        int listSize = 0;
+        int stackSize = 1;
+        stack[0] = 0;
+        while (stackSize > 0) {
+            const NBodyNode* node = &nodes[stack[--stackSize]];
+            // Nodes overlapping the group are always opened, so a particle
+            // never gets pulled by a node it's part of.
+            float32 halfSize = node->size * 0.5f;
+            float32 dist2 = 0.0f;
+            bool32 overlaps = true;
+            for (int e = 0; e < 3; e++) {
+                float32 c = node->centerOfMass.e[e];
+                float32 d = MaxFloat32(MaxFloat32(boxMin.e[e] - c,
+                    c - boxMax.e[e]), 0.0f);
+                dist2 += d * d;
+                if (node->center.e[e] + halfSize < boxMin.e[e]
+                || node->center.e[e] - halfSize > boxMax.e[e]) {
+                    overlaps = false;
+                }
+            }
+
+            if (!overlaps && node->size * node->size < theta2 * dist2) {
+                if (listSize == NBODY_LIST_SIZE) {
+                    ApplyNBodyInteractions(list, listSize,
+                        groupPos, pull, groupSize, softening2);
+                    listSize = 0;
+                }
+                list[listSize].pos = node->centerOfMass;
+                list[listSize].count = (float32)node->count;
+                listSize++;
+            }
+            else if (node->firstChild == -1) {
+                int leafEnd = node->first + node->count;
+                for (int k = node->first; k < leafEnd; k++) {
+                    if (listSize == NBODY_LIST_SIZE) {
+                        ApplyNBodyInteractions(list, listSize,
+                            groupPos, pull, groupSize, softening2);
+                        listSize = 0;
+                    }
+                    // Includes the group's own particles, which pull on
+                    // themselves with d = 0
+                    list[listSize].pos = sortedPos[k];
+                    list[listSize].count = 1.0f;
+                    listSize++;
+                }
+            }
+            else {
+                DEBUG_ASSERT(stackSize + node->numChildren
+                    <= NBODY_STACK_SIZE);
+                for (int c = node->numChildren - 1; c >= 0; c--) {
+                    stack[stackSize++] = node->firstChild + c;
+                }
+            }
+        }
+        ApplyNBodyInteractions(list, listSize,
+            groupPos, pull, groupSize, softening2);
+
+        for (int g = 0; g < groupSize; g++) {
+            tree->vel[tree->sorted[group + g]] += pull[g] * accelCoeff;
+        }
+    }
+}
+
+internal void SetNBodyStep(NBodyTree* tree, const Vec3* pos, Vec3* vel,
+    int count, float32 deltaTime)
+{
+    DEBUG_ASSERT(count <= tree->maxParticles);
+    tree->pos = pos;
+    tree->vel = vel;
+    tree->count = count;
+    tree->deltaTime = deltaTime;
+}
+
+// Adds one job per chunk of [0, count), all starting after job "after".
+// Returns a join that finishes after all of them.
+internal int AddNBodyPass(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int count, int chunkSize, int after)
+{
+    int numJobs = (count + chunkSize - 1) / chunkSize;
+    int jobs = AddTaskJobChunks(graph, name, func, data, count, chunkSize);
+    for (int k = 0; k < numJobs; k++) {
+        AddTaskDependency(graph, jobs + k, after);
+    }
+    int join = AddTaskJoin(graph, "nbody pass done", jobs, numJobs);
+    if (numJobs == 0) {
+        AddTaskDependency(graph, join, after);
+    }
+    return join;
+}
+
+int AddNBodyJobs(TaskGraph* graph, NBodyTree* tree,
+    const Vec3* pos, Vec3* vel, int count, float32 deltaTime)
+{
+    SetNBodyStep(tree, pos, vel, count, deltaTime);
+
+    int numChunks = (count + NBODY_CHUNK_SIZE - 1) / NBODY_CHUNK_SIZE;
+    int boundsJobs = AddTaskJobChunks(graph, "nbody bounds",
+        ComputeNBodyChunkBounds, tree, count, NBODY_CHUNK_SIZE);
+    int done = AddTaskJoin(graph, "nbody pass done", boundsJobs, numChunks);
+    done = AddNBodyPass(graph, "nbody codes", ComputeNBodyCodes, tree,
+        count, NBODY_CHUNK_SIZE, done);
+    for (int p = 0; p < NBODY_RADIX_PASSES; p++) {
+        done = AddNBodyPass(graph, "nbody sort count", CountNBodyDigits,
+            &tree->sortPasses[p], count, NBODY_CHUNK_SIZE, done);
+        done = AddNBodyPass(graph, "nbody sort scatter", ScatterNBodyDigits,
+            &tree->sortPasses[p], count, NBODY_CHUNK_SIZE, done);
+    }
+    int topJob = AddTaskJob(graph, "nbody build top",
+        BuildNBodyTop, tree, 0, 1);
+    AddTaskDependency(graph, topJob, done);
+    done = AddNBodyPass(graph, "nbody build", BuildNBodySubtrees, tree,
+        NBODY_BUILD_JOBS, 1, topJob);
+    int linkJob = AddTaskJob(graph, "nbody link", LinkNBodyTree, tree, 0, 1);
+    AddTaskDependency(graph, linkJob, done);
+    return AddNBodyPass(graph, "nbody forces", ApplyNBodyForces, tree,
+        count, NBODY_CHUNK_SIZE, linkJob);
+}
\ No newline at end of file
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "km_math.h"
+#include "km_lib.h"
+#include "task_graph.h"
+
+// Particles per n-body job. Multiple of NBODY_GROUP_SIZE.
+#define NBODY_CHUNK_SIZE 8192
+// Particles that share one tree walk in the force pass
+#define NBODY_GROUP_SIZE 16
+// Morton code bits per axis, which is also the deepest octree level
+#define NBODY_MORTON_BITS 10
+// Radix sort digits per pass. Three passes cover a 30-bit Morton code.
+#define NBODY_RADIX_BITS 10
+#define NBODY_RADIX_PASSES 3
+#define NBODY_LEAF_SIZE 8
+// The octree is split into subtrees of at most 1 / NBODY_SUBTREE_SPLIT of
+// the particles, which NBODY_BUILD_JOBS jobs then build in parallel.
+#define NBODY_SUBTREE_SPLIT 256
+#define NBODY_BUILD_JOBS 16
+
+struct NBodyParams
+{
+    // Nodes with size / distance below this are treated as a single body.
+    // 0 is exact (and O(N^2)), higher is faster and less accurate.
+    float32 theta;
+    float32 gravityConstant;
+    float32 particleMass;
+    float32 softening; // Plummer softening length
+};
+
+// Octree cell. Internal nodes have numChildren > 0 non-empty children at
+// firstChild, firstChild + 1, ... Every node covers the particles
+// [first, first + count) in Morton order.
+struct NBodyNode
+{
+    Vec3 centerOfMass;
+    float32 size; // cell edge length
+    Vec3 center;
+    int firstChild;
+    int numChildren;
+    int first;
+    int count;
+};
+
+struct NBodyBuildJob
+{
+    int firstSubtree;
+    int endSubtree;
+    // Nodes below this job's subtree roots, copied into the tree once all
+    // jobs are done. Kept between steps so they stop reallocating.
+    DynamicArray<NBodyNode> nodes;
+};
+
+struct NBodyTree;
+
+// Data for the jobs of one radix sort pass
+struct NBodySortPass
+{
+    NBodyTree* tree;
+    int shift;
+    const uint32* keysIn;
+    const int* valuesIn;
+    uint32* keysOut;
+    int* valuesOut;
+};
+
+// Barnes-Hut octree over the particles, rebuilt every step from their
+// Morton codes: a parallel radix sort orders the particles, the top of the
+// tree is split serially, and the subtrees below it in parallel.
+struct NBodyTree
+{
+    NBodyParams params;
+    int maxParticles;
+
+    // The step being computed
+    const Vec3* pos;
+    Vec3* vel;
+    int count;
+    float32 deltaTime;
+
+    Vec3* chunkMin; // particle bounds, per chunk
+    Vec3* chunkMax;
+    uint32* digitCounts; // per chunk, per radix digit
+
+    // Morton codes and particle indices, ping-ponged by the radix sort
+    uint32* codes[2];
+    int* indices[2];
+    NBodySortPass sortPasses[NBODY_RADIX_PASSES];
+    const uint32* sortedCodes;
+    const int* sorted; // particle indices in Morton order
+    Vec3* sortedPos;
+
+    // Node 0 is the root. The top of the tree comes first, then the nodes
+    // of each build job in turn.
+    DynamicArray<NBodyNode> nodes;
+    int numTopNodes;
+    DynamicArray<int> subtreeRoots; // in Morton order
+    DynamicArray<int> subtreeDepths;
+    NBodyBuildJob buildJobs[NBODY_BUILD_JOBS];
+};
+
+// tree must be zeroed or freed with FreeNBodyTree first
+void InitNBodyTree(NBodyTree* tree, NBodyParams params, int maxParticles);
+void FreeNBodyTree(NBodyTree* tree);
+
+// Adds jobs that rebuild the octree over particles [0, count) and add
+// their mutual gravitational accelerations over deltaTime to vel. Returns
+// the job that finishes the step. pos and vel are read when the jobs run.
+int AddNBodyJobs(TaskGraph* graph, NBodyTree* tree,
+    const Vec3* pos, Vec3* vel, int count, float32 deltaTime);
\ No newline at end of file
@@ -5,8 +5,12 @@
 #include "km_debug.h"
 #include "ogl_base.h"
 #include "opengl_funcs.h"
+#include "particles_simd.h"
 
 #define PARTICLE_EPS 0.0001f
+#define COLLIDER_QUERY_MAX 64
+#define COLLIDER_QUERY_MARGIN 0.0001f
+
 #define BOUNCE_MARGIN 0.001f
 
 ParticleSystemGL InitParticleSystemGL(const ThreadContext* thread,
@@ -113,8 +117,405 @@ ParticleSystemGL InitParticleSystemGL(const ThreadContext* thread,
     return psGL;
 }
 
-void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
-    int particlesPerSec, float32 maxLife, Vec3 gravity,
+internal void InitColliders(ParticleSystem* ps,
+    PlaneCollider* planeColliders, int numPlaneColliders,
+    AxisBoxCollider* boxColliders, int numBoxColliders,
+    SphereCollider* sphereColliders, int numSphereColliders)
+{
+    DEBUG_ASSERT(numPlaneColliders >= 0);
+    DEBUG_ASSERT(numBoxColliders >= 0);
+    DEBUG_ASSERT(numSphereColliders >= 0);
+
+    ps->planeColliders.Init();
+    for (int i = 0; i < numPlaneColliders; i++) {
+        ps->planeColliders.Append(planeColliders[i]);
+    }
+    ps->boxColliders.Init();
+    for (int i = 0; i < numBoxColliders; i++) {
+        ps->boxColliders.Append(boxColliders[i]);
+    }
+    ps->sphereColliders.Init();
+    for (int i = 0; i < numSphereColliders; i++) {
+        ps->sphereColliders.Append(sphereColliders[i]);
+    }
+
+    ps->meshColliders.Init();
+    ps->sdfColliders.Init();
+
+    ps->colliderBVH = {};
+    ps->collidersDirty = true;
+    UpdateColliderBVH(ps);
+}
+
+void UpdateColliderBVH(ParticleSystem* ps)
+{
+    if (!ps->collidersDirty) {
+        return;
+    }
+
+    int numBoxes = (int)ps->boxColliders.size;
+    int numSpheres = (int)ps->sphereColliders.size;
+    int count = numBoxes + numSpheres;
+    AABB* bounds = (AABB*)malloc(sizeof(AABB) * MaxInt(count, 1));
+    for (int c = 0; c < numBoxes; c++) {
+        bounds[c].min = ps->boxColliders[c].min;
+        bounds[c].max = ps->boxColliders[c].max;
+    }
+    ps->maxSphereRadius = 0.0f;
+    for (int c = 0; c < numSpheres; c++) {
+        Vec3 center = ps->sphereColliders[c].center;
+        float32 radius = ps->sphereColliders[c].radius;
+        bounds[numBoxes + c].min = center - Vec3::one * radius;
+        bounds[numBoxes + c].max = center + Vec3::one * radius;
+        ps->maxSphereRadius = MaxFloat32(ps->maxSphereRadius, radius);
+    }
+
+    FreeBVH(&ps->colliderBVH);
+    BuildBVH(&ps->colliderBVH, bounds, count, COLLIDER_BVH_LEAF_SIZE);
+    free(bounds);
+
+    ps->collidersDirty = false;
+}
+
+// Exact pull of every attractor at p
+internal Vec3 EvaluateAttractors(const ParticleSystem* ps, Vec3 p)
+{
+    Vec3 attract = Vec3::zero;
+    for (int a = 0; a < ps->numAttractors; a++) {
+        Vec3 toAttractor = ps->attractors[a].pos - p;
+        float32 distToAttractor = Mag(toAttractor);
+        if (distToAttractor < PARTICLE_EPS) {
+            continue;
+        }
+        toAttractor /= distToAttractor;
+        float32 attractMag = ps->attractors[a].strength / distToAttractor;
+        attract += attractMag * toAttractor;
+    }
+
+    return attract;
+}
+
+void UpdateAttractorField(ParticleSystem* ps)
+{
+    if (!ps->attractorsDirty) {
+        return;
+    }
+
+    AttractorField* field = &ps->attractorField;
+    free(field->pull);
+    *field = {};
+    ps->attractorsDirty = false;
+    if (ps->numAttractors < ATTRACTOR_FIELD_MIN_COUNT) {
+        return;
+    }
+
+    Vec3 boundsMin = ps->attractors[0].pos;
+    Vec3 boundsMax = boundsMin;
+    for (int a = 1; a < ps->numAttractors; a++) {
+        for (int e = 0; e < 3; e++) {
+            boundsMin.e[e] = MinFloat32(boundsMin.e[e],
+                ps->attractors[a].pos.e[e]);
+            boundsMax.e[e] = MaxFloat32(boundsMax.e[e],
+                ps->attractors[a].pos.e[e]);
+        }
+    }
+    Vec3 extent = boundsMax - boundsMin;
+    float32 maxExtent = MaxFloat32(MaxFloat32(extent.x, extent.y), extent.z);
+    float32 padding = MaxFloat32(maxExtent * ATTRACTOR_FIELD_PADDING, 1.0f);
+    boundsMin -= Vec3::one * padding;
+    extent += Vec3::one * (padding * 2.0f);
+
+    field->origin = boundsMin;
+    field->cellSize = (maxExtent + padding * 2.0f)
+        / ATTRACTOR_FIELD_RESOLUTION;
+    int numPoints = 1;
+    for (int e = 0; e < 3; e++) {
+        field->dims[e] = (int)ceilf(extent.e[e] / field->cellSize) + 1;
+        numPoints *= field->dims[e];
+    }
+    field->pull = (Vec3*)malloc(sizeof(Vec3) * numPoints);
+
+    int p = 0;
+    for (int z = 0; z < field->dims[2]; z++) {
+        for (int y = 0; y < field->dims[1]; y++) {
+            for (int x = 0; x < field->dims[0]; x++) {
+                Vec3 point = field->origin + Vec3 {
+                    (float32)x, (float32)y, (float32)z
+                } * field->cellSize;
+                field->pull[p++] = EvaluateAttractors(ps, point);
+            }
+        }
+    }
+}
+
+// Trilinear pull at p. Returns false if p is outside the field.
+internal bool32 SampleAttractorField(const AttractorField* field, Vec3 p,
+    Vec3* pull)
+{
+    Vec3 g = (p - field->origin) / field->cellSize;
+    int i[3];
+    float32 f[3];
+    for (int e = 0; e < 3; e++) {
+        // Written so NaNs fail the test too
+        if (!(g.e[e] >= 0.0f && g.e[e] < (float32)(field->dims[e] - 1))) {
+            return false;
+        }
+        i[e] = (int)g.e[e];
+        f[e] = g.e[e] - (float32)i[e];
+    }
+
+    int strideY = field->dims[0];
+    int strideZ = field->dims[0] * field->dims[1];
+    const Vec3* c = field->pull + i[2] * strideZ + i[1] * strideY + i[0];
+    // Interpolate along x, then y, then z
+    Vec3 c00 = Lerp(c[0], c[1], f[0]);
+    Vec3 c10 = Lerp(c[strideY], c[strideY + 1], f[0]);
+    Vec3 c01 = Lerp(c[strideZ], c[strideZ + 1], f[0]);
+    Vec3 c11 = Lerp(c[strideZ + strideY], c[strideZ + strideY + 1], f[0]);
+    *pull = Lerp(Lerp(c00, c10, f[1]), Lerp(c01, c11, f[1]), f[2]);
+    return true;
+}
+
+Vec3 GetAttractorPull(const ParticleSystem* ps, Vec3 p)
+{
+    Vec3 pull;
+    if (ps->attractorField.pull
+    && SampleAttractorField(&ps->attractorField, p, &pull)) {
+        return pull;
+    }
+
+    return EvaluateAttractors(ps, p);
+}
+
+internal void UseParticleArrays(ParticleSystem* ps, int which)
+{
+    ParticleArrays* arrays = &ps->arrays[which];
+    ps->life = arrays->life;
+    ps->pos = arrays->pos;
+    ps->vel = arrays->vel;
+    ps->color = arrays->color;
+    ps->size = arrays->size;
+    ps->bounceMult = arrays->bounceMult;
+    ps->frictionMult = arrays->frictionMult;
+    ps->prevPos = arrays->prevPos;
+    ps->currentArrays = which;
+}
+
+internal bool32 PushParticleArrays(ParticleArrays* arrays,
+    MemoryArena* arena, int capacity)
+{
+    arrays->life = PUSH_ARRAY(arena, float32, capacity);
+    arrays->pos = PUSH_ARRAY(arena, Vec3, capacity);
+    arrays->vel = PUSH_ARRAY(arena, Vec3, capacity);
+    arrays->color = PUSH_ARRAY(arena, Vec4, capacity);
+    arrays->size = PUSH_ARRAY(arena, Vec2, capacity);
+    arrays->bounceMult = PUSH_ARRAY(arena, float32, capacity);
+    arrays->frictionMult = PUSH_ARRAY(arena, float32, capacity);
+    arrays->prevPos = PUSH_ARRAY(arena, Vec3, capacity);
+    return arrays->life && arrays->pos && arrays->vel && arrays->color
+        && arrays->size && arrays->bounceMult && arrays->frictionMult
+        && arrays->prevPos;
+}
+
+// Pushes the particle storage of a capacity-particle system onto arena.
+// If it doesn't fit, pushes nothing and leaves room for no particles.
+internal bool32 AllocateParticleStorage(ParticleSystem* ps,
+    MemoryArena* arena, int capacity)
+{
+    uint64 used = arena->used;
+    ps->compactRemap = PUSH_ARRAY(arena, int, capacity);
+    if (!ps->compactRemap
+    || !PushParticleArrays(&ps->arrays[0], arena, capacity)
+    || !PushParticleArrays(&ps->arrays[1], arena, capacity)) {
+        DEBUG_PRINT("ERROR: no room for %d particles (%llu of %llu bytes "
+            "used)\n", capacity, (unsigned long long)used,
+            (unsigned long long)arena->size);
+        arena->used = used;
+        ps->compactRemap = nullptr;
+        ps->arrays[0] = {};
+        ps->arrays[1] = {};
+        UseParticleArrays(ps, 0);
+        return false;
+    }
+
+    UseParticleArrays(ps, 0);
+    return true;
+}
+
+internal void InitDepthSort(ParticleSystem* ps)
+{
+    ps->depthSort = DEPTH_SORT_RADIX;
+    // Skips a generation, so no depth order from an earlier system is
+    // carried over to this one
+    ps->indexGeneration += 2;
+    ps->compactedCount = 0;
+    ps->compactedLive = 0;
+}
+
+void FreeParticleSystem(ParticleSystem* ps)
+{
+    ps->planeColliders.Free();
+    ps->boxColliders.Free();
+    ps->sphereColliders.Free();
+    ps->planeColliders = {};
+    ps->boxColliders = {};
+    ps->sphereColliders = {};
+    FreeBVH(&ps->colliderBVH);
+
+    for (uint32 i = 0; i < ps->meshColliders.size; i++) {
+        FreeBVH(&ps->meshColliders[i].bvh);
+        ps->meshColliders[i].triangles.Free();
+    }
+    ps->meshColliders.Free();
+    ps->meshColliders = {};
+
+    for (uint32 i = 0; i < ps->sdfColliders.size; i++) {
+        FreeSDF(&ps->sdfColliders[i].sdf);
+    }
+    ps->sdfColliders.Free();
+    ps->sdfColliders = {};
+
+    free(ps->attractorField.pull);
+    ps->attractorField = {};
+
+    FreeSpringNetwork(&ps->springs);
+    FreeFluidGrid(&ps->fluid);
+    FreeNBodyTree(&ps->nbody);
+}
+
+void MakeParticleSystemFluid(ParticleSystem* ps, FluidParams params)
+{
+    DEBUG_ASSERT(ps->width == 0 && ps->height == 0);
+    FreeFluidGrid(&ps->fluid);
+    InitFluidGrid(&ps->fluid, params, ps->maxParticles);
+}
+
+void MakeParticleSystemNBody(ParticleSystem* ps, NBodyParams params)
+{
+    DEBUG_ASSERT(ps->width == 0 && ps->height == 0);
+    DEBUG_ASSERT(ps->fluid.numCells == 0);
+    FreeNBodyTree(&ps->nbody);
+    InitNBodyTree(&ps->nbody, params, ps->maxParticles);
+}
+
+void SetParticleEmitter(ParticleSystem* ps, InitParticlesFunction func)
+{
+    ps->initParticlesFunc = func;
+}
+
+void SetParticleStepping(ParticleSystem* ps, StepParams params)
+{
+    DEBUG_ASSERT(params.mode == STEP_VARIABLE
+        || (params.fixedStep > 0.0f && params.maxSteps > 0));
+    ps->stepping = params;
+    ps->stepAccumulator = 0.0f;
+    ps->stepAlpha = 1.0f;
+    ps->lastSteps = 0;
+    ps->lastStepTime = 0.0f;
+}
+
+void AddPlaneCollider(ParticleSystem* ps, PlaneCollider collider)
+{
+    ps->planeColliders.Append(collider);
+}
+void AddBoxCollider(ParticleSystem* ps, AxisBoxCollider collider)
+{
+    ps->boxColliders.Append(collider);
+    ps->collidersDirty = true;
+}
+void AddSphereCollider(ParticleSystem* ps, SphereCollider collider)
+{
+    ps->sphereColliders.Append(collider);
+    ps->collidersDirty = true;
+}
+
+void AddMeshCollider(ParticleSystem* ps, const Mesh* mesh, ColliderType type)
+{
+    uint64 start = ReadCycleCounter();
+    int count = (int)mesh->triangles.size;
+
+    MeshCollider collider = {};
+    collider.type = type;
+    AABB* bounds = (AABB*)malloc(sizeof(AABB) * MaxInt(count, 1));
+    for (int t = 0; t < count; t++) {
+        const Triangle& triangle = mesh->triangles[t];
+        bounds[t].min = triangle.v[0];
+        bounds[t].max = triangle.v[0];
+        for (int v = 1; v < 3; v++) {
+            for (int e = 0; e < 3; e++) {
+                bounds[t].min.e[e] = MinFloat32(bounds[t].min.e[e],
+                    triangle.v[v].e[e]);
+                bounds[t].max.e[e] = MaxFloat32(bounds[t].max.e[e],
+                    triangle.v[v].e[e]);
+            }
+        }
+    }
+    BuildBVH(&collider.bvh, bounds, count, MESH_COLLIDER_BVH_LEAF_SIZE);
+    free(bounds);
+
+    collider.triangles.Init((uint32)MaxInt(count, 1));
+    for (int i = 0; i < count; i++) {
+        const Triangle& triangle = mesh->triangles[collider.bvh.primitives[i]];
+        MeshColliderTriangle tri;
+        tri.v0 = triangle.v[0];
+        tri.edge1 = triangle.v[1] - triangle.v[0];
+        tri.edge2 = triangle.v[2] - triangle.v[0];
+        tri.normal = Cross(tri.edge1, tri.edge2);
+        float32 mag = Mag(tri.normal);
+        if (mag > 0.0f) {
+            tri.normal /= mag;
+        }
+        collider.triangles.Append(tri);
+    }
+
+    collider.buildCycles = ReadCycleCounter() - start;
+    collider.memoryBytes = GetBVHMemory(&collider.bvh)
+        + collider.triangles.capacity * sizeof(MeshColliderTriangle);
+    DEBUG_PRINT("Mesh collider: %d triangles, %d BVH nodes, "
+        "built in %.2f Mcycles, %.1f KB\n",
+        count, (int)collider.bvh.nodes.size,
+        (float32)collider.buildCycles / 1000000.0f,
+        (float32)collider.memoryBytes / 1024.0f);
+
+    ps->meshColliders.Append(collider);
+}
+
+void AddSDFCollider(ParticleSystem* ps, SDFGrid sdf, ColliderType type)
+{
+    SDFCollider collider;
+    collider.type = type;
+    collider.sdf = sdf;
+    ps->sdfColliders.Append(collider);
+}
+
+void RemovePlaneCollider(ParticleSystem* ps, int index)
+{
+    ps->planeColliders.Remove((uint32)index);
+}
+void RemoveBoxCollider(ParticleSystem* ps, int index)
+{
+    ps->boxColliders.Remove((uint32)index);
+    ps->collidersDirty = true;
+}
+void RemoveSphereCollider(ParticleSystem* ps, int index)
+{
+    ps->sphereColliders.Remove((uint32)index);
+    ps->collidersDirty = true;
+}
+void RemoveMeshCollider(ParticleSystem* ps, int index)
+{
+    FreeBVH(&ps->meshColliders[index].bvh);
+    ps->meshColliders[index].triangles.Free();
+    ps->meshColliders.Remove((uint32)index);
+}
+void RemoveSDFCollider(ParticleSystem* ps, int index)
+{
+    FreeSDF(&ps->sdfColliders[index].sdf);
+    ps->sdfColliders.Remove((uint32)index);
+}
+
+bool32 CreateParticleSystem(ParticleSystem* ps, MemoryArena* arena,
+    int maxParticles, int particlesPerSec, float32 maxLife, Vec3 gravity,
     float32 linearDamp, float32 quadraticDamp,
     Attractor* attractors, int numAttractors,
     PlaneCollider* planeColliders, int numPlaneColliders,
@@ -125,8 +526,16 @@ void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
 {
     DEBUG_ASSERT(0 <= maxParticles && maxParticles <= MAX_PARTICLES);
 
+    bool32 allocated = AllocateParticleStorage(ps, arena, maxParticles);
+    if (!allocated) {
+        maxParticles = 0;
+    }
+    InitDepthSort(ps);
     ps->spawnCounter = 0.0f;
     ps->active = 0;
+    ps->seed = 0;
+    ps->spawnIndex = 0;
+    ps->kernel = GetBestParticleKernel();
 
     ps->maxParticles = maxParticles;
     ps->particlesPerSec = particlesPerSec;
@@ -140,27 +549,13 @@ void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
         ps->attractors[i] = attractors[i];
     }
     ps->numAttractors = numAttractors;
+    ps->attractorsDirty = true;
 
-    DEBUG_ASSERT(0 <= numPlaneColliders
-        && numPlaneColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numPlaneColliders; i++) {
-        ps->planeColliders[i] = planeColliders[i];
-    }
-    ps->numPlaneColliders = numPlaneColliders;
-    DEBUG_ASSERT(0 <= numBoxColliders
-        && numBoxColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numBoxColliders; i++) {
-        ps->boxColliders[i] = boxColliders[i];
-    }
-    ps->numBoxColliders = numBoxColliders;
-    DEBUG_ASSERT(0 <= numSphereColliders
-        && numSphereColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numSphereColliders; i++) {
-        ps->sphereColliders[i] = sphereColliders[i];
-    }
-    ps->numSphereColliders = numSphereColliders;
+    InitColliders(ps, planeColliders, numPlaneColliders,
+        boxColliders, numBoxColliders, sphereColliders, numSphereColliders);
 
     ps->initParticleFunc = initParticleFunc;
+    ps->initParticlesFunc = nullptr;
 
     ps->texture = texture;
 
@@ -169,7 +564,12 @@ void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
 
     ps->width = 0;
     ps->height = 0;
-    ps->hookeStrength = 0.0f;
+
+    StepParams stepping = {};
+    stepping.mode = STEP_VARIABLE;
+    SetParticleStepping(ps, stepping);
+
+    return allocated;
 }
 
 internal int IndTo1D(int x, int y, ParticleSystem* ps)
@@ -180,14 +580,10 @@ internal int IndTo1D(Vec2Int i, ParticleSystem* ps)
 {
     return IndTo1D(i.x, i.y, ps);
 }
-internal Vec2Int IndTo2D(int i, ParticleSystem* ps)
-{
-    return { i % ps->width, i / ps->width};
-}
 
-void CreateParticleSystem(ParticleSystem* ps,
+bool32 CreateParticleSystem(ParticleSystem* ps, MemoryArena* arena,
     int width, int height, Vec3 origin, Vec3 strideX, Vec3 strideY,
-    Vec3 gravity, float32 hookeStrength, float32 hookeEqDist,
+    Vec3 gravity, ClothSpringParams springParams,
     float32 linearDamp, float32 quadraticDamp,
     Attractor* attractors, int numAttractors,
     PlaneCollider* planeColliders, int numPlaneColliders,
@@ -198,27 +594,39 @@ void CreateParticleSystem(ParticleSystem* ps,
     DEBUG_ASSERT(width > 0 && height > 0);
     int numParticles = width * height;
     DEBUG_ASSERT(0 <= numParticles && numParticles <= MAX_PARTICLES);
+    bool32 allocated = AllocateParticleStorage(ps, arena, numParticles);
+    if (!allocated) {
+        width = 0;
+        height = 0;
+        numParticles = 0;
+    }
+    InitDepthSort(ps);
     ps->width = width;
     ps->height = height;
-    ps->hookeStrength = hookeStrength;
-    ps->hookeEqDist = hookeEqDist;
+    if (allocated) {
+        InitClothSprings(&ps->springs, width, height, springParams);
+    }
 
     for (int x = 0; x < width; x++) {
         for (int y = 0; y < height; y++) {
             int i = IndTo1D(x, y, ps);
-            ps->particles[i].life = 0.0f;
-            ps->particles[i].pos = origin
+            ps->life[i] = 0.0f;
+            ps->pos[i] = origin
                 + strideX * (float32)x + strideY * (float32)y;
-            ps->particles[i].vel = Vec3::zero;
-            ps->particles[i].color = Vec4::one;
-            ps->particles[i].size = { 0.05f, 0.05f };
-            ps->particles[i].bounceMult = 0.0f;
-            ps->particles[i].frictionMult = 0.25f;
+            ps->prevPos[i] = ps->pos[i];
+            ps->vel[i] = Vec3::zero;
+            ps->color[i] = Vec4::one;
+            ps->size[i] = { 0.05f, 0.05f };
+            ps->bounceMult[i] = 0.0f;
+            ps->frictionMult[i] = 0.25f;
         }
     }
 
     ps->spawnCounter = 0.0f;
     ps->active = numParticles;
+    ps->seed = 0;
+    ps->spawnIndex = 0;
+    ps->kernel = GetBestParticleKernel();
 
     ps->maxParticles = numParticles;
     ps->particlesPerSec = 0;
@@ -232,51 +640,61 @@ void CreateParticleSystem(ParticleSystem* ps,
         ps->attractors[i] = attractors[i];
     }
     ps->numAttractors = numAttractors;
+    ps->attractorsDirty = true;
 
-    DEBUG_ASSERT(0 <= numPlaneColliders
-        && numPlaneColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numPlaneColliders; i++) {
-        ps->planeColliders[i] = planeColliders[i];
-    }
-    ps->numPlaneColliders = numPlaneColliders;
-    DEBUG_ASSERT(0 <= numBoxColliders
-        && numBoxColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numBoxColliders; i++) {
-        ps->boxColliders[i] = boxColliders[i];
-    }
-    ps->numBoxColliders = numBoxColliders;
-    DEBUG_ASSERT(0 <= numSphereColliders
-        && numSphereColliders < MAX_COLLIDERS);
-    for (int i = 0; i < numSphereColliders; i++) {
-        ps->sphereColliders[i] = sphereColliders[i];
-    }
-    ps->numSphereColliders = numSphereColliders;
+    InitColliders(ps, planeColliders, numPlaneColliders,
+        boxColliders, numBoxColliders, sphereColliders, numSphereColliders);
 
     ps->initParticleFunc = nullptr;
+    ps->initParticlesFunc = nullptr;
 
     ps->texture = texture;
 
     ps->mesh = nullptr;
     ps->meshGL = nullptr;
+
+    StepParams stepping = {};
+    stepping.mode = STEP_VARIABLE;
+    SetParticleStepping(ps, stepping);
+
+    return allocated;
+}
+
+Particle GetParticle(const ParticleSystem* ps, int i)
+{
+    Particle particle;
+    particle.life = ps->life[i];
+    particle.pos = ps->pos[i];
+    particle.vel = ps->vel[i];
+    particle.color = ps->color[i];
+    particle.size = ps->size[i];
+    particle.bounceMult = ps->bounceMult[i];
+    particle.frictionMult = ps->frictionMult[i];
+    return particle;
 }
 
-internal Vec3 CalculateHookeForce(ParticleSystem* ps, int i, int neighbor)
+void SetParticle(ParticleSystem* ps, int i, const Particle& particle)
 {
-    Vec3 distVec = ps->particles[neighbor].pos - ps->particles[i].pos;
-    float32 dist = Mag(distVec);
-    distVec /= dist;
-    float32 deltaX = dist - ps->hookeEqDist;
-    return ps->hookeStrength * deltaX * distVec;
+    ps->life[i] = particle.life;
+    ps->pos[i] = particle.pos;
+    ps->prevPos[i] = particle.pos;
+    ps->vel[i] = particle.vel;
+    ps->color[i] = particle.color;
+    ps->size[i] = particle.size;
+    ps->bounceMult[i] = particle.bounceMult;
+    ps->frictionMult[i] = particle.frictionMult;
 }
 
-internal void HandleBounceCollision(Particle* p,
+internal void HandleBounceCollision(ParticleSystem* ps, int i,
     Vec3 intersect, Vec3 normal, float32 deltaTime, float32 offset)
 {
-    Vec3 velNormal = Dot(normal, p->vel) * normal;
-    Vec3 velTangent = p->vel - velNormal;
-    p->vel = velTangent * p->frictionMult - velNormal * p->bounceMult;
-    float32 off = MinFloat32(Mag(p->vel) * deltaTime, offset);
-    p->pos = intersect + normal * offset;
+    Vec3 vel = ps->vel[i];
+    Vec3 velNormal = Dot(normal, vel) * normal;
+    Vec3 velTangent = vel - velNormal;
+    ps->vel[i] = velTangent * ps->frictionMult[i]
+        - velNormal * ps->bounceMult[i];
+    float32 off = MinFloat32(Mag(ps->vel[i]) * deltaTime, offset);
+    ps->pos[i] = intersect + normal * offset;
 }
 
 internal inline bool32 IsInsideBox(Vec3 p, Vec3 boxMin, Vec3 boxMax)
@@ -286,198 +704,611 @@ internal inline bool32 IsInsideBox(Vec3 p, Vec3 boxMin, Vec3 boxMax)
         && boxMin.z <= p.z && p.z <= boxMax.z;
 }
 
-void UpdateParticleSystem(ParticleSystem* ps, float32 deltaTime, void* data)
+// Updates all particle non-position data for particles [begin, end)
+internal void UpdateVelocities(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime, bool32 isGrid)
 {
-    bool32 isGrid = ps->width != 0 && ps->height != 0;
-
-    // Update all particle non-position data
-    for (int i = 0; i < ps->active; i++) {
-        ps->particles[i].life += deltaTime;
+    for (int i = begin; i < end; i++) {
+        ps->life[i] += deltaTime;
 
         // Damping
-        float32 magVel = Mag(ps->particles[i].vel);
+        float32 magVel = Mag(ps->vel[i]);
         Vec3 damp = (ps->linearDamp + ps->quadraticDamp * magVel)
-            * ps->particles[i].vel;
+            * ps->vel[i];
         // Attractors
-        Vec3 attract = Vec3::zero;
-        for (int a = 0; a < ps->numAttractors; a++) {
-            Vec3 toAttractor = ps->attractors[a].pos - ps->particles[i].pos;
-            float32 distToAttractor = Mag(toAttractor);
-            if (distToAttractor < PARTICLE_EPS) {
-                continue;
-            }
-            toAttractor /= distToAttractor;
-            float32 attractMag = ps->attractors[a].strength / distToAttractor;
-            attract += attractMag * toAttractor;
-        }
-        // Hooke forces (grid)
+        Vec3 attract = GetAttractorPull(ps, ps->pos[i]);
+        // Hooke forces (grid), computed per spring beforehand.
+        // XPBD handles springs as constraints instead.
         Vec3 hookeForce = Vec3::zero;
-        if (isGrid) {
-            Vec2Int coords = IndTo2D(i, ps);
-            if (coords.x > 0) {
-                int neighbor = IndTo1D(coords.x - 1, coords.y, ps);
-                hookeForce += CalculateHookeForce(ps, i, neighbor);
-            }
-            if (coords.x < ps->width - 1) {
-                int neighbor = IndTo1D(coords.x + 1, coords.y, ps);
-                hookeForce += CalculateHookeForce(ps, i, neighbor);
-            }
-            if (coords.y > 0) {
-                int neighbor = IndTo1D(coords.x, coords.y - 1, ps);
-                hookeForce += CalculateHookeForce(ps, i, neighbor);
-            }
-            if (coords.y < ps->height - 1) {
-                int neighbor = IndTo1D(coords.x, coords.y + 1, ps);
-                hookeForce += CalculateHookeForce(ps, i, neighbor);
-            }
+        if (isGrid && ps->springs.params.solver != CLOTH_SOLVER_XPBD) {
+            hookeForce = GetSpringForce(&ps->springs, i);
         }
         // Velocity update
-        ps->particles[i].vel += (ps->gravity + attract + hookeForce - damp)
+        ps->vel[i] += (ps->gravity + attract + hookeForce - damp)
             * deltaTime;
 
         if (!isGrid) {
             // Color update
-            float32 alpha = 1.0f - ps->particles[i].life / ps->maxLife;
+            float32 alpha = 1.0f - ps->life[i] / ps->maxLife;
             alpha = sqrtf(alpha);
-            ps->particles[i].color.a = alpha;
+            ps->color[i].a = alpha;
         }
     }
-    // Update all particle position data
-    for (int i = 0; i < ps->active; i++) {
-        // Plane colliders
-        for (int c = 0; c < ps->numPlaneColliders; c++) {
-            Vec3 pos = ps->particles[i].pos;
-            Vec3 dir = ps->particles[i].vel * deltaTime;
-            Vec3 normal = ps->planeColliders[c].normal;
-            Vec3 point = ps->planeColliders[c].point;
+}
 
-            float denom = Dot(normal, dir);
-            if (abs(denom) < PARTICLE_EPS) {
-                // Motion parallel to the plane
-                continue;
-            }
+// Returns true if the particle bounced (its position and velocity changed)
+internal bool32 CollideBox(ParticleSystem* ps, int i, int c,
+    float32 deltaTime)
+{
+    Vec3 pos = ps->pos[i];
+    Vec3 dir = ps->vel[i] * deltaTime;
+    //Vec3 newPos = pos + dir;
+    Vec3 boxMin = ps->boxColliders[c].min;
+    Vec3 boxMax = ps->boxColliders[c].max;
+    bool32 found = false;
+    float tIntMin = 1e6;
+    Vec3 normal = Vec3::unitX;
+    for (int e = 0; e < 3; e++) {
+        float32 tInt1 = (boxMin.e[e] - pos.e[e])
+            / dir.e[e];
+        Vec3 v1 = pos + tInt1 * dir;
+        if (IsInsideBox(v1, boxMin, boxMax)
+        && PARTICLE_EPS < tInt1 && tInt1 < tIntMin) {
+            tIntMin = tInt1;
+            Vec3 n = Vec3::zero;
+            n.e[e] = -1.0f;
+            normal = n;
+            found = true;
+        }
+        float32 tInt2 = (boxMax.e[e] - pos.e[e])
+            / dir.e[e];
+        Vec3 v2 = pos + tInt2 * dir;
+        if (IsInsideBox(v2, boxMin, boxMax)
+        && PARTICLE_EPS < tInt2 && tInt2 < tIntMin) {
+            tIntMin = tInt2;
+            Vec3 n = Vec3::zero;
+            n.e[e] = 1.0f;
+            normal = n;
+            found = true;
+        }
+    }
+    if (found && 0.0f <= tIntMin && tIntMin <= 1.0f) {
+        switch (ps->boxColliders[c].type) {
+            case COLLIDER_SINK: {
+                ps->life[i] = ps->maxLife + PARTICLE_EPS;
+            } break;
+            case COLLIDER_BOUNCE: {
+                Vec3 intersect = pos + dir * tIntMin;
+                normal *= 1.1f;
+                HandleBounceCollision(ps, i,
+                    intersect, normal, deltaTime, BOUNCE_MARGIN);
+                return true;
+            } break;
+        }
+    }
+
+    return false;
+}
+
+// Returns true if the particle bounced (its position and velocity changed)
+internal bool32 CollideSphere(ParticleSystem* ps, int i, int c,
+    float32 deltaTime)
+{
+    // From Assignment 3, sphere + ray collision
+    Vec3 pos = ps->pos[i];
+    Vec3 dir = ps->vel[i] * deltaTime;
+    Vec3 center = ps->sphereColliders[c].center;
+    float32 radius = ps->sphereColliders[c].radius;
 
-            float32 t = Dot(point - pos, normal) / denom;
-            if (-PARTICLE_EPS <= t && t < 1.0f) {
-                switch (ps->planeColliders[c].type) {
-                    case COLLIDER_SINK: {
-                        ps->particles[i].life = ps->maxLife + PARTICLE_EPS;
-                    } break;
-                    case COLLIDER_BOUNCE: {
-                        Vec3 intersect = pos + t * dir;
-                        HandleBounceCollision(&ps->particles[i],
-                            intersect, normal, deltaTime, BOUNCE_MARGIN);
-                    } break;
+    Vec3 toSphere = center - pos;
+    float32 tClosest = Dot(toSphere, dir);
+    Vec3 closest = pos + dir * tClosest;
+    float32 dist = Mag(closest - center);
+    if (dist > radius) {
+        return false;
+    }
+
+    switch (ps->sphereColliders[c].type) {
+        case COLLIDER_SINK: {
+            ps->life[i] = ps->maxLife + PARTICLE_EPS;
+        } break;
+        case COLLIDER_BOUNCE: {
+            float32 tOffset = sqrtf(radius * radius - dist * dist);
+            float32 tInt = tClosest - tOffset;
+            if (tInt < PARTICLE_EPS) {
+                tInt = tClosest + tOffset;
+                if (tInt < PARTICLE_EPS) {
+                    return false;
                 }
             }
-        }
-        // Box colliders
-        for (int c = 0; c < ps->numBoxColliders; c++) {
-            Vec3 pos = ps->particles[i].pos;
-            Vec3 dir = ps->particles[i].vel * deltaTime;
-            //Vec3 newPos = pos + dir;
-            Vec3 boxMin = ps->boxColliders[c].min;
-            Vec3 boxMax = ps->boxColliders[c].max;
-            bool32 found = false;
-            float tIntMin = 1e6;
-            Vec3 normal = Vec3::unitX;
-            for (int e = 0; e < 3; e++) {
-                float32 tInt1 = (boxMin.e[e] - pos.e[e])
-                    / dir.e[e];
-                Vec3 v1 = pos + tInt1 * dir;
-                if (IsInsideBox(v1, boxMin, boxMax)
-                && PARTICLE_EPS < tInt1 && tInt1 < tIntMin) {
-                    tIntMin = tInt1;
-                    Vec3 n = Vec3::zero;
-                    n.e[e] = -1.0f;
-                    normal = n;
-                    found = true;
+            Vec3 intersect = pos + dir * tInt;
+            Vec3 normal = Normalize(intersect - center);
+            HandleBounceCollision(ps, i,
+                intersect, normal, deltaTime, BOUNCE_MARGIN);
+            return true;
+        } break;
+    }
+
+    return false;
+}
+
+// Collider c indexes boxes, then spheres (same as the collider BVH)
+internal inline bool32 CollideBoxOrSphere(ParticleSystem* ps, int i, int c,
+    float32 deltaTime)
+{
+    int numBoxes = (int)ps->boxColliders.size;
+    if (c < numBoxes) {
+        return CollideBox(ps, i, c, deltaTime);
+    }
+    else {
+        return CollideSphere(ps, i, c - numBoxes, deltaTime);
+    }
+}
+
+internal int IntComparator(const void* p, const void* q)
+{
+    return *(const int*)p - *(const int*)q;
+}
+
+// Bounds that contain every box or sphere particle i could hit this step.
+// Box hits lie on the segment from pos to pos + vel * dt. The sphere test
+// only looks at a point within |dir|^2 * D of pos, where D is the distance
+// to the center, so a hit means D <= r / (1 - |dir|^2).
+// Returns false if the step is too long to bound usefully.
+internal bool32 GetCollisionQueryBounds(const ParticleSystem* ps, int i,
+    float32 deltaTime, AABB* box)
+{
+    Vec3 pos = ps->pos[i];
+    Vec3 dir = ps->vel[i] * deltaTime;
+    float32 dirMagSq = Dot(dir, dir);
+    if (dirMagSq >= 0.5f) {
+        return false;
+    }
+
+    float32 margin = COLLIDER_QUERY_MARGIN;
+    if (ps->sphereColliders.size > 0) {
+        margin += ps->maxSphereRadius * dirMagSq / (1.0f - dirMagSq);
+    }
+    for (int e = 0; e < 3; e++) {
+        box->min.e[e] = MinFloat32(pos.e[e], pos.e[e] + dir.e[e]) - margin;
+        box->max.e[e] = MaxFloat32(pos.e[e], pos.e[e] + dir.e[e]) + margin;
+    }
+    return true;
+}
+
+struct MeshColliderHit
+{
+    const MeshCollider* collider;
+    int slot;
+    float32 t;
+};
+
+// Segment/triangle test (Moller-Trumbore), keeps the closest hit
+internal BVH_SEGMENT_FUNC(HitMeshColliderTriangle)
+{
+    MeshColliderHit* hit = (MeshColliderHit*)data;
+    const MeshColliderTriangle& tri = hit->collider->triangles.data[slot];
+
+    Vec3 p = Cross(dir, tri.edge2);
+    float32 det = Dot(tri.edge1, p);
+    if (det > -1e-12f && det < 1e-12f) {
+        // Parallel to the triangle, or degenerate triangle
+        return;
+    }
+    float32 invDet = 1.0f / det;
+    Vec3 s = origin - tri.v0;
+    float32 u = Dot(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f) {
+        return;
+    }
+    Vec3 q = Cross(s, tri.edge1);
+    float32 v = Dot(dir, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) {
+        return;
+    }
+    float32 t = Dot(tri.edge2, q) * invDet;
+    if (0.0f <= t && t <= *tMax) {
+        *tMax = t;
+        hit->slot = slot;
+        hit->t = t;
+    }
+}
+
+internal void CollideMesh(ParticleSystem* ps, int i, int c, float32 deltaTime)
+{
+    const MeshCollider* collider = &ps->meshColliders[c];
+    Vec3 pos = ps->pos[i];
+    Vec3 dir = ps->vel[i] * deltaTime;
+
+    MeshColliderHit hit;
+    hit.collider = collider;
+    hit.slot = -1;
+    hit.t = 1.0f;
+    TraceBVHSegment(&collider->bvh, pos, dir, 1.0f,
+        HitMeshColliderTriangle, &hit);
+    if (hit.slot == -1) {
+        return;
+    }
+
+    switch (collider->type) {
+        case COLLIDER_SINK: {
+            ps->life[i] = ps->maxLife + PARTICLE_EPS;
+        } break;
+        case COLLIDER_BOUNCE: {
+            Vec3 normal = collider->triangles.data[hit.slot].normal;
+            if (Dot(normal, dir) > 0.0f) {
+                // Hit from the back side
+                normal = -normal;
+            }
+            Vec3 intersect = pos + dir * hit.t;
+            HandleBounceCollision(ps, i,
+                intersect, normal, deltaTime, BOUNCE_MARGIN);
+        } break;
+    }
+}
+
+// Tests where the particle would end up this step, so fast particles can
+// tunnel through features thinner than their step
+internal void CollideSDF(ParticleSystem* ps, int i, int c, float32 deltaTime)
+{
+    const SDFCollider* collider = &ps->sdfColliders[c];
+    Vec3 end = ps->pos[i] + ps->vel[i] * deltaTime;
+
+    float32 dist;
+    Vec3 gradient;
+    if (!SampleSDF(&collider->sdf, end, &dist, &gradient) || dist >= 0.0f) {
+        return;
+    }
+
+    switch (collider->type) {
+        case COLLIDER_SINK: {
+            ps->life[i] = ps->maxLife + PARTICLE_EPS;
+        } break;
+        case COLLIDER_BOUNCE: {
+            float32 gradMag = Mag(gradient);
+            if (gradMag < PARTICLE_EPS) {
+                return;
+            }
+            Vec3 normal = gradient / gradMag;
+            if (Dot(ps->vel[i], normal) >= 0.0f) {
+                // Already on its way out
+                return;
+            }
+            // Project the end point back out to the surface
+            Vec3 intersect = end - normal * dist;
+            HandleBounceCollision(ps, i,
+                intersect, normal, deltaTime, BOUNCE_MARGIN);
+        } break;
+    }
+}
+
+// Updates all particle collisions for particles [begin, end)
+internal void ResolveCollisions(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    int numBoxOrSphere = (int)(ps->boxColliders.size
+        + ps->sphereColliders.size);
+    bool32 useBVH = numBoxOrSphere >= COLLIDER_BVH_MIN_COUNT;
+    DEBUG_ASSERT(!useBVH || !ps->collidersDirty);
+
+    for (int i = begin; i < end; i++) {
+        // Plane colliders, nearest crossing first. A bounce changes the
+        // particle's segment, so the planes are tested again after one
+        // (corners of a tank).
+        int numPlanes = (int)ps->planeColliders.size;
+        for (int pass = 0; pass < numPlanes; pass++) {
+            Vec3 pos = ps->pos[i];
+            Vec3 dir = ps->vel[i] * deltaTime;
+            int hit = -1;
+            float32 tHit = 1.0f;
+            for (int c = 0; c < numPlanes; c++) {
+                Vec3 normal = ps->planeColliders[c].normal;
+                Vec3 point = ps->planeColliders[c].point;
+
+                float denom = Dot(normal, dir);
+                if (denom == 0.0f) {
+                    // Motion parallel to the plane. Slow particles still
+                    // need the test below, or they sink through resting
+                    // contacts.
+                    continue;
                 }
-                float32 tInt2 = (boxMax.e[e] - pos.e[e])
-                    / dir.e[e];
-                Vec3 v2 = pos + tInt2 * dir;
-                if (IsInsideBox(v2, boxMin, boxMax)
-                && PARTICLE_EPS < tInt2 && tInt2 < tIntMin) {
-                    tIntMin = tInt2;
-                    Vec3 n = Vec3::zero;
-                    n.e[e] = 1.0f;
-                    normal = n;
-                    found = true;
+
+                float32 t = Dot(point - pos, normal) / denom;
+                if (-PARTICLE_EPS <= t && t < tHit) {
+                    hit = c;
+                    tHit = t;
                 }
             }
-            if (found && 0.0f <= tIntMin && tIntMin <= 1.0f) {
-                switch (ps->boxColliders[c].type) {
-                    case COLLIDER_SINK: {
-                        ps->particles[i].life = ps->maxLife + PARTICLE_EPS;
-                    } break;
-                    case COLLIDER_BOUNCE: {
-                        Vec3 intersect = pos + dir * tIntMin;
-                        normal *= 1.1f;
-                        HandleBounceCollision(&ps->particles[i],
-                            intersect, normal, deltaTime, BOUNCE_MARGIN);
-                    } break;
-                }
+            if (hit == -1) {
+                break;
             }
+
+            if (ps->planeColliders[hit].type == COLLIDER_SINK) {
+                ps->life[i] = ps->maxLife + PARTICLE_EPS;
+                break;
+            }
+            Vec3 intersect = pos + tHit * dir;
+            HandleBounceCollision(ps, i, intersect,
+                ps->planeColliders[hit].normal, deltaTime, BOUNCE_MARGIN);
         }
-        // Sphere colliders
-        for (int c = 0; c < ps->numSphereColliders; c++) {
-            // From Assignment 3, sphere + ray collision
-            Vec3 pos = ps->particles[i].pos;
-            Vec3 dir = ps->particles[i].vel * deltaTime;
-            Vec3 center = ps->sphereColliders[c].center;
-            float32 radius = ps->sphereColliders[c].radius;
-
-            Vec3 toSphere = center - pos;
-            float32 tClosest = Dot(toSphere, dir);
-            Vec3 closest = pos + dir * tClosest;
-            float32 dist = Mag(closest - center);
-            if (dist > radius) {
-                continue;
+
+        // Box colliders, then sphere colliders, in order. A bounce changes
+        // the particle's segment, so the BVH is queried again for the
+        // colliders that come after the one it bounced off.
+        int next = 0;
+        while (next < numBoxOrSphere) {
+            int candidates[COLLIDER_QUERY_MAX];
+            int numCandidates = COLLIDER_QUERY_MAX + 1;
+            AABB queryBox;
+            if (useBVH && GetCollisionQueryBounds(ps, i, deltaTime, &queryBox)) {
+                numCandidates = QueryBVH(&ps->colliderBVH, queryBox,
+                    candidates, COLLIDER_QUERY_MAX);
             }
 
-            switch (ps->sphereColliders[c].type) {
-                case COLLIDER_SINK: {
-                    ps->particles[i].life = ps->maxLife + PARTICLE_EPS;
-                } break;
-                case COLLIDER_BOUNCE: {
-                    float32 tOffset = sqrtf(radius * radius - dist * dist);
-                    float32 tInt = tClosest - tOffset;
-                    if (tInt < PARTICLE_EPS) {
-                        tInt = tClosest + tOffset;
-                        if (tInt < PARTICLE_EPS) {
-                            continue;
-                        }
+            bool32 bounced = false;
+            if (numCandidates > COLLIDER_QUERY_MAX) {
+                // Too many to gather, test them all
+                for (int c = next; c < numBoxOrSphere && !bounced; c++) {
+                    bounced = CollideBoxOrSphere(ps, i, c, deltaTime);
+                    next = c + 1;
+                }
+            }
+            else {
+                qsort(candidates, numCandidates, sizeof(int), IntComparator);
+                for (int k = 0; k < numCandidates && !bounced; k++) {
+                    int c = candidates[k];
+                    if (c < next) {
+                        continue;
                     }
-                    Vec3 intersect = pos + dir * tInt;
-                    Vec3 normal = Normalize(intersect - center);
-                    HandleBounceCollision(&ps->particles[i],
-                        intersect, normal, deltaTime, BOUNCE_MARGIN);
-                } break;
+                    bounced = CollideBoxOrSphere(ps, i, c, deltaTime);
+                    next = c + 1;
+                }
+            }
+            if (!bounced) {
+                break;
             }
         }
 
-        // Position update
-        ps->particles[i].pos += ps->particles[i].vel * deltaTime;
+        // Mesh colliders
+        for (int c = 0; c < (int)ps->meshColliders.size; c++) {
+            CollideMesh(ps, i, c, deltaTime);
+        }
+        for (int c = 0; c < (int)ps->sdfColliders.size; c++) {
+            CollideSDF(ps, i, c, deltaTime);
+        }
+    }
+}
+
+internal void IntegratePositions(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    for (int i = begin; i < end; i++) {
+        ps->pos[i] += ps->vel[i] * deltaTime;
+    }
+}
+
+// Velocity pass for [begin, end), SIMD kernel first, then the scalar tail
+internal void UpdateVelocitiesRange(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime, bool32 isGrid)
+{
+    // The SIMD kernels handle everything except grid (Hooke) forces,
+    // and leave any leftover particles to the scalar path.
+    int scalarStart = begin;
+    if (!isGrid) {
+        switch (ps->kernel) {
+            case PARTICLE_KERNEL_SSE: {
+                scalarStart = UpdateVelocitiesSSE(ps, begin, end, deltaTime);
+            } break;
+            case PARTICLE_KERNEL_AVX2: {
+                scalarStart = UpdateVelocitiesAVX2(ps, begin, end, deltaTime);
+            } break;
+            default: {
+            } break;
+        }
+    }
+    UpdateVelocities(ps, scalarStart, end, deltaTime, isGrid);
+}
+
+// Collision and integration passes for [begin, end)
+internal void MoveParticlesRange(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    ResolveCollisions(ps, begin, end, deltaTime);
+
+    int scalarStart = begin;
+    switch (ps->kernel) {
+        case PARTICLE_KERNEL_SSE: {
+            scalarStart = IntegratePositionsSSE(ps, begin, end, deltaTime);
+        } break;
+        case PARTICLE_KERNEL_AVX2: {
+            scalarStart = IntegratePositionsAVX2(ps, begin, end, deltaTime);
+        } break;
+        default: {
+        } break;
     }
+    IntegratePositions(ps, scalarStart, end, deltaTime);
+}
+
+internal bool32 IsInterpolated(const ParticleSystem* ps)
+{
+    return ps->stepping.mode == STEP_FIXED && ps->stepping.interpolate;
+}
+
+// Counts the survivors of update chunk [begin, end), while the chunk is
+// still in cache
+internal void CountLiveParticles(ParticleFrame* frame, int begin, int end)
+{
+    const ParticleSystem* ps = frame->ps;
+    int live = 0;
+    for (int i = begin; i < end; i++) {
+        live += ps->life[i] <= ps->maxLife;
+    }
+    frame->liveCounts[begin / frame->liveChunkSize] = live;
+}
+
+internal PARALLEL_FOR_FUNC(UpdateParticlesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    UpdateVelocitiesRange(frame->ps, begin, end,
+        frame->deltaTime, frame->isGrid);
+    MoveParticlesRange(frame->ps, begin, end, frame->deltaTime);
+    if (!frame->isGrid) {
+        CountLiveParticles(frame, begin, end);
+    }
+}
+
+// Same as UpdateParticlesChunk, over one fluid substep. The last substep's
+// live counts are the ones that stand.
+internal PARALLEL_FOR_FUNC(UpdateFluidParticlesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    float32 stepTime = frame->deltaTime / frame->ps->fluid.params.substeps;
+    UpdateVelocitiesRange(frame->ps, begin, end, stepTime, false);
+    MoveParticlesRange(frame->ps, begin, end, stepTime);
+    CountLiveParticles(frame, begin, end);
+}
 
-    if (isGrid) {
+internal PARALLEL_FOR_FUNC(UpdateVelocitiesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    UpdateVelocitiesRange(frame->ps, begin, end,
+        frame->deltaTime, frame->isGrid);
+}
+
+internal PARALLEL_FOR_FUNC(MoveParticlesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    MoveParticlesRange(frame->ps, begin, end, frame->deltaTime);
+}
+
+internal PARALLEL_FOR_FUNC(SpringForcesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    ComputeSpringForces(&frame->ps->springs, frame->ps->pos, begin, end);
+}
+
+// Exclusive prefix sum of the update chunks' live counts, which places
+// each chunk's survivors and gives the live count
+internal void SumLiveCounts(ParticleFrame* frame)
+{
+    int active = frame->ps->active;
+    int numChunks = (active + frame->liveChunkSize - 1)
+        / frame->liveChunkSize;
+    DEBUG_ASSERT(numChunks <= MAX_LIVE_CHUNKS);
+    int sum = 0;
+    for (int k = 0; k < numChunks; k++) {
+        frame->liveOffsets[k] = sum;
+        sum += frame->liveCounts[k];
+    }
+    frame->liveCount = sum;
+}
+
+internal PARALLEL_FOR_FUNC(SumLiveCountsJob)
+{
+    SumLiveCounts((ParticleFrame*)data);
+}
+
+#define COMPACT_GATHER_SIZE 1024
+
+// Gathers the survivors of update chunk [begin, end) into the other set of
+// particle arrays, at the chunk's offset, in order. Does nothing when no
+// particle expired.
+internal PARALLEL_FOR_FUNC(GatherLiveParticlesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    ParticleSystem* ps = frame->ps;
+    if (frame->liveCount == ps->active) {
         return;
     }
-    // Remove expired particles
-    int p = 0;
-    int active = ps->active;
-    while (p < active) {
-        if (ps->particles[p].life > ps->maxLife) {
-            ps->particles[p] = ps->particles[active - 1];
-            active--;
-            continue;
+    ParticleArrays* next = &ps->arrays[1 - ps->currentArrays];
+    bool32 interpolated = IsInterpolated(ps);
+    int chunk = begin / frame->liveChunkSize;
+    int dst = frame->liveOffsets[chunk];
+    if (ps->depthSort == DEPTH_SORT_INCREMENTAL) {
+        // Where each particle went, for carrying the depth order over
+        int write = dst;
+        for (int i = begin; i < end; i++) {
+            bool32 live = ps->life[i] <= ps->maxLife;
+            ps->compactRemap[i] = live ? write : -1;
+            write += live;
+        }
+    }
+    if (frame->liveCounts[chunk] == end - begin) {
+        // Everything survived, so the chunk moves as a block
+        int n = end - begin;
+        memcpy(next->life + dst, ps->life + begin, sizeof(float32) * n);
+        memcpy(next->pos + dst, ps->pos + begin, sizeof(Vec3) * n);
+        memcpy(next->vel + dst, ps->vel + begin, sizeof(Vec3) * n);
+        memcpy(next->color + dst, ps->color + begin, sizeof(Vec4) * n);
+        memcpy(next->size + dst, ps->size + begin, sizeof(Vec2) * n);
+        memcpy(next->bounceMult + dst, ps->bounceMult + begin,
+            sizeof(float32) * n);
+        memcpy(next->frictionMult + dst, ps->frictionMult + begin,
+            sizeof(float32) * n);
+        if (interpolated) {
+            memcpy(next->prevPos + dst, ps->prevPos + begin,
+                sizeof(Vec3) * n);
+        }
+        return;
+    }
+
+    for (int first = begin; first < end; first += COMPACT_GATHER_SIZE) {
+        int last = MinInt(first + COMPACT_GATHER_SIZE, end);
+        int live[COMPACT_GATHER_SIZE];
+        int n = 0;
+        for (int i = first; i < last; i++) {
+            live[n] = i;
+            n += ps->life[i] <= ps->maxLife;
+        }
+        // One field at a time, so each pass streams through one array
+        for (int j = 0; j < n; j++) {
+            next->life[dst + j] = ps->life[live[j]];
+        }
+        for (int j = 0; j < n; j++) {
+            next->pos[dst + j] = ps->pos[live[j]];
+        }
+        for (int j = 0; j < n; j++) {
+            next->vel[dst + j] = ps->vel[live[j]];
         }
-        p++;
+        for (int j = 0; j < n; j++) {
+            next->color[dst + j] = ps->color[live[j]];
+        }
+        for (int j = 0; j < n; j++) {
+            next->size[dst + j] = ps->size[live[j]];
+        }
+        for (int j = 0; j < n; j++) {
+            next->bounceMult[dst + j] = ps->bounceMult[live[j]];
+        }
+        for (int j = 0; j < n; j++) {
+            next->frictionMult[dst + j] = ps->frictionMult[live[j]];
+        }
+        if (interpolated) {
+            for (int j = 0; j < n; j++) {
+                next->prevPos[dst + j] = ps->prevPos[live[j]];
+            }
+        }
+        dst += n;
+    }
+}
+
+// Switches to the compacted particle arrays, if any particle expired, then
+// reserves the slots for this step's new particles, which
+// SpawnParticlesChunk fills in
+internal void ReserveSpawn(ParticleFrame* frame)
+{
+    ParticleSystem* ps = frame->ps;
+    if (frame->liveCount < ps->active) {
+        UseParticleArrays(ps, 1 - ps->currentArrays);
+        ps->indexGeneration++;
+        ps->compactedCount = ps->active;
+        ps->compactedLive = frame->liveCount;
+        ps->active = frame->liveCount;
     }
-    ps->active = active;
 
-    // Spawn new particles
-    ps->spawnCounter += (float32)ps->particlesPerSec * deltaTime;
+    frame->spawnFirst = ps->active;
+    frame->spawnCount = 0;
+    frame->spawnIndex = ps->spawnIndex;
+    ps->spawnCounter += (float32)ps->particlesPerSec * frame->deltaTime;
     int spawn = (int)ps->spawnCounter;
     if (spawn == 0) {
         // Nothing to spawn yet
@@ -488,28 +1319,660 @@ void UpdateParticleSystem(ParticleSystem* ps, float32 deltaTime, void* data)
     }
     ps->spawnCounter -= (float32)spawn;
     if (ps->active + spawn >= ps->maxParticles) {
-        spawn = ps->maxParticles - ps->active - 1;
+        spawn = MaxInt(ps->maxParticles - ps->active - 1, 0);
+    }
+    frame->spawnCount = spawn;
+    ps->active += spawn;
+    ps->spawnIndex += (uint32)spawn;
+}
+
+internal PARALLEL_FOR_FUNC(ReserveSpawnJob)
+{
+    ReserveSpawn((ParticleFrame*)data);
+}
+
+// Job ranges cover MAX_SPAWN, and clamp to the particles actually spawned
+internal PARALLEL_FOR_FUNC(SpawnParticlesChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    ParticleSystem* ps = frame->ps;
+    end = MinInt(end, frame->spawnCount);
+    if (begin >= end) {
+        return;
+    }
+
+    if (ps->initParticlesFunc) {
+        int first = frame->spawnFirst + begin;
+        ps->initParticlesFunc(ps, first, end - begin,
+            frame->spawnIndex + (uint32)begin, frame->spawnData);
+        memcpy(ps->prevPos + first, ps->pos + first,
+            sizeof(Vec3) * (end - begin));
+        return;
+    }
+
+    // One at a time, through the per-particle function
+    for (int i = begin; i < end; i++) {
+        RandomStream rng = MakeRandomStream(ps->seed,
+            frame->spawnIndex + (uint32)i);
+        Particle particle;
+        ps->initParticleFunc(ps, &particle, &rng, frame->spawnData);
+        SetParticle(ps, frame->spawnFirst + i, particle);
+    }
+}
+
+// Longest adaptive step: the fastest particle moves at most maxStepDistance,
+// and explicit springs stay under their stability limit
+internal float32 GetAdaptiveStepLimit(const ParticleSystem* ps)
+{
+    float32 limit = ps->stepping.fixedStep;
+    if (ps->stepping.maxStepDistance > 0.0f) {
+        float32 maxSpeedSq = 0.0f;
+        for (int i = 0; i < ps->active; i++) {
+            maxSpeedSq = MaxFloat32(maxSpeedSq, MagSq(ps->vel[i]));
+        }
+        if (maxSpeedSq > 0.0f) {
+            limit = MinFloat32(limit,
+                ps->stepping.maxStepDistance / sqrtf(maxSpeedSq));
+        }
+    }
+
+    bool32 isGrid = ps->width != 0 && ps->height != 0;
+    if (isGrid && ps->springs.params.solver == CLOTH_SOLVER_EXPLICIT
+    && ps->springs.maxStiffness > 0.0f) {
+        // Symplectic Euler is stable for steps under 2 / w. With unit
+        // masses, w^2 is at most twice the stiffness at any one particle.
+        float32 stable = sqrtf(2.0f / ps->springs.maxStiffness);
+        limit = MinFloat32(limit, stable * ADAPTIVE_STEP_SAFETY);
+    }
+
+    return limit;
+}
+
+int BeginParticleSteps(ParticleSystem* ps, float32 frameTime,
+    float32* stepTime)
+{
+    const StepParams& params = ps->stepping;
+    int steps = 1;
+    *stepTime = frameTime;
+    ps->stepAlpha = 1.0f;
+    switch (params.mode) {
+        case STEP_VARIABLE: {
+        } break;
+        case STEP_FIXED: {
+            float32 maxTime = params.fixedStep * (float32)params.maxSteps;
+            ps->stepAccumulator = MinFloat32(ps->stepAccumulator + frameTime,
+                maxTime);
+            steps = (int)(ps->stepAccumulator / params.fixedStep);
+            ps->stepAccumulator -= params.fixedStep * (float32)steps;
+            *stepTime = params.fixedStep;
+            ps->stepAlpha = ClampFloat32(
+                ps->stepAccumulator / params.fixedStep, 0.0f, 1.0f);
+        } break;
+        case STEP_ADAPTIVE: {
+            float32 limit = GetAdaptiveStepLimit(ps);
+            steps = (int)ceilf(frameTime / limit);
+            steps = ClampInt(steps, 1, params.maxSteps);
+            *stepTime = MinFloat32(frameTime / (float32)steps, limit);
+        } break;
+    }
+
+    ps->lastSteps = steps;
+    ps->lastStepTime = *stepTime;
+    return steps;
+}
+
+// Keeps the positions from before this step for interpolated drawing.
+// Called between steps, so nothing else is touching them.
+internal void SavePreviousPositions(ParticleSystem* ps)
+{
+    if (IsInterpolated(ps)) {
+        memcpy(ps->prevPos, ps->pos, sizeof(Vec3) * ps->active);
+    }
+}
+
+#define DEPTH_RADIX_DIGITS (1 << DEPTH_RADIX_BITS)
+#define DEPTH_KEY_MAX ((1u << (DEPTH_RADIX_BITS * DEPTH_RADIX_PASSES)) - 1)
+
+// Farthest depth first
+internal inline uint32 GetDepthKey(const ParticleFrame* frame, float32 depth)
+{
+    float32 key = (frame->maxDepth - depth) * frame->depthScale;
+    return (uint32)ClampFloat32(key, 0.0f, (float32)DEPTH_KEY_MAX);
+}
+
+internal int DepthKeyComparator(const void* p, const void* q)
+{
+    const ParticleDepth* depthP = (const ParticleDepth*)p;
+    const ParticleDepth* depthQ = (const ParticleDepth*)q;
+    if (depthP->key != depthQ->key) {
+        return depthP->key < depthQ->key ? -1 : 1;
+    }
+    return depthP->index - depthQ->index;
+}
+
+// Computes view depths for one chunk, and their range.
+// Job ranges cover every slot the spawn step could have filled.
+internal PARALLEL_FOR_FUNC(ComputeDepthsChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    const ParticleSystem* ps = frame->ps;
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    end = MinInt(end, ps->active);
+    float32 minDepth = INFINITY;
+    float32 maxDepth = -INFINITY;
+    for (int i = begin; i < end; i++) {
+        Vec4 transformed = frame->vp * ToVec4(ps->pos[i], 1.0f);
+        float32 depth = transformed.z;
+        dataGL->depth[i] = depth;
+        minDepth = MinFloat32(minDepth, depth);
+        maxDepth = MaxFloat32(maxDepth, depth);
+    }
+    int chunk = begin / DEPTH_SORT_CHUNK_SIZE;
+    dataGL->chunkMinDepth[chunk] = minDepth;
+    dataGL->chunkMaxDepth[chunk] = maxDepth;
+}
+
+// Orders the particles starting from the last frame's order.
+// Returns false, having changed nothing that matters, if that order can't
+// be carried over or is too far from sorted.
+internal bool32 SortDepthsIncremental(ParticleFrame* frame)
+{
+    const ParticleSystem* ps = frame->ps;
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    if (ps->depthSort != DEPTH_SORT_INCREMENTAL || dataGL->sortedCount == 0) {
+        return false;
+    }
+    if (dataGL->incrementalRetry > 0) {
+        dataGL->incrementalRetry--;
+        return false;
+    }
+
+    // Particles [0, firstNew) were in the last frame's order, and
+    // [firstNew, active) have spawned since
+    int firstNew;
+    const int* remap = nullptr;
+    if (ps->indexGeneration == dataGL->sortedGeneration) {
+        firstNew = dataGL->sortedCount;
     }
-    for (int i = 0; i < spawn; i++) {
-        int ind = ps->active;
-        ps->initParticleFunc(ps, &ps->particles[ind], data);
-        ps->active++;
+    else if (ps->indexGeneration == dataGL->sortedGeneration + 1
+    && ps->compactedCount == dataGL->sortedCount) {
+        remap = ps->compactRemap;
+        firstNew = ps->compactedLive;
+    }
+    else {
+        return false;
+    }
+    int active = ps->active;
+    if (firstNew > active) {
+        return false;
+    }
+
+    const ParticleDepth* last = dataGL->depthOrder[dataGL->sortedBuffer];
+    ParticleDepth* order = dataGL->depthOrder[1 - dataGL->sortedBuffer];
+    int n = 0;
+    for (int i = 0; i < dataGL->sortedCount; i++) {
+        int index = last[i].index;
+        if (remap) {
+            index = remap[index];
+            if (index < 0) {
+                continue;
+            }
+        }
+        order[n].key = GetDepthKey(frame, dataGL->depth[index]);
+        order[n].index = index;
+        n++;
+    }
+    DEBUG_ASSERT(n == firstNew);
+
+    int64 moves = 0;
+    int64 maxMoves = (int64)n * DEPTH_INCREMENTAL_MAX_MOVES;
+    for (int i = 1; i < n; i++) {
+        ParticleDepth item = order[i];
+        int j = i;
+        while (j > 0 && order[j - 1].key > item.key) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = item;
+        moves += i - j;
+        if (moves > maxMoves) {
+            dataGL->incrementalRetry = DEPTH_INCREMENTAL_RETRY_FRAMES;
+            return false;
+        }
+    }
+
+    int result = 1 - dataGL->sortedBuffer;
+    if (firstNew < active) {
+        ParticleDepth* spawned = order + n;
+        int numSpawned = active - firstNew;
+        for (int i = 0; i < numSpawned; i++) {
+            spawned[i].key = GetDepthKey(frame, dataGL->depth[firstNew + i]);
+            spawned[i].index = firstNew + i;
+        }
+        qsort(spawned, numSpawned, sizeof(ParticleDepth), DepthKeyComparator);
+
+        // The last frame's order is used up, so merge into its buffer
+        ParticleDepth* merged = dataGL->depthOrder[dataGL->sortedBuffer];
+        int a = 0;
+        int b = 0;
+        for (int i = 0; i < active; i++) {
+            if (b >= numSpawned || (a < n && order[a].key <= spawned[b].key)) {
+                merged[i] = order[a++];
+            }
+            else {
+                merged[i] = spawned[b++];
+            }
+        }
+        result = dataGL->sortedBuffer;
+    }
+
+    frame->sortedDepth = dataGL->depthOrder[result];
+    dataGL->sortedBuffer = result;
+    return true;
+}
+
+// Finds the depth range that keys are quantized over, then tries the
+// incremental sort, leaving the particles to the radix sort if it can't
+internal PARALLEL_FOR_FUNC(OrderDepthsJob)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    const ParticleSystem* ps = frame->ps;
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    int active = ps->active;
+    int numChunks = (active + DEPTH_SORT_CHUNK_SIZE - 1)
+        / DEPTH_SORT_CHUNK_SIZE;
+    float32 minDepth = INFINITY;
+    float32 maxDepth = -INFINITY;
+    for (int k = 0; k < numChunks; k++) {
+        minDepth = MinFloat32(minDepth, dataGL->chunkMinDepth[k]);
+        maxDepth = MaxFloat32(maxDepth, dataGL->chunkMaxDepth[k]);
+    }
+    frame->maxDepth = maxDepth;
+    frame->depthScale = 0.0f;
+    if (maxDepth > minDepth) {
+        frame->depthScale = (float32)DEPTH_KEY_MAX / (maxDepth - minDepth);
+    }
+
+    frame->depthSorted = SortDepthsIncremental(frame);
+    dataGL->incrementalSorted = frame->depthSorted;
+    if (!frame->depthSorted) {
+        frame->sortedDepth = dataGL->depthOrder[DEPTH_RADIX_PASSES % 2];
+        dataGL->sortedBuffer = DEPTH_RADIX_PASSES % 2;
+    }
+    dataGL->sortedCount = active;
+    dataGL->sortedGeneration = ps->indexGeneration;
+}
+
+// The radix sort jobs below skip themselves if the incremental sort worked
+
+internal PARALLEL_FOR_FUNC(ComputeDepthKeysChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    const ParticleSystemDataGL* dataGL = frame->dataGL;
+    end = MinInt(end, frame->ps->active);
+    if (frame->depthSorted) {
+        return;
+    }
+    ParticleDepth* keys = frame->dataGL->depthOrder[0];
+    for (int i = begin; i < end; i++) {
+        keys[i].key = GetDepthKey(frame, dataGL->depth[i]);
+        keys[i].index = i;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(CountDepthDigits)
+{
+    DepthSortPass* pass = (DepthSortPass*)data;
+    ParticleFrame* frame = pass->frame;
+    end = MinInt(end, frame->ps->active);
+    if (frame->depthSorted || begin >= end) {
+        return;
+    }
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    const ParticleDepth* keysIn = dataGL->depthOrder[pass->pass % 2];
+    int shift = pass->pass * DEPTH_RADIX_BITS;
+    int chunk = begin / DEPTH_SORT_CHUNK_SIZE;
+    uint32* counts = dataGL->digitCounts + chunk * DEPTH_RADIX_DIGITS;
+    for (int d = 0; d < DEPTH_RADIX_DIGITS; d++) {
+        counts[d] = 0;
+    }
+    for (int i = begin; i < end; i++) {
+        counts[(keysIn[i].key >> shift) & (DEPTH_RADIX_DIGITS - 1)]++;
+    }
+}
+
+// Stable: every chunk writes its particles after those of the same digit
+// in earlier chunks, so the order doesn't depend on the thread count.
+internal PARALLEL_FOR_FUNC(ScatterDepthDigits)
+{
+    DepthSortPass* pass = (DepthSortPass*)data;
+    ParticleFrame* frame = pass->frame;
+    int active = frame->ps->active;
+    end = MinInt(end, active);
+    if (frame->depthSorted || begin >= end) {
+        return;
+    }
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    const ParticleDepth* keysIn = dataGL->depthOrder[pass->pass % 2];
+    ParticleDepth* keysOut = dataGL->depthOrder[(pass->pass + 1) % 2];
+    int shift = pass->pass * DEPTH_RADIX_BITS;
+    int numChunks = (active + DEPTH_SORT_CHUNK_SIZE - 1)
+        / DEPTH_SORT_CHUNK_SIZE;
+    int chunk = begin / DEPTH_SORT_CHUNK_SIZE;
+
+    uint32 offsets[DEPTH_RADIX_DIGITS];
+    uint32 sum = 0;
+    for (int d = 0; d < DEPTH_RADIX_DIGITS; d++) {
+        for (int k = 0; k < numChunks; k++) {
+            if (k == chunk) {
+                offsets[d] = sum;
+            }
+            sum += dataGL->digitCounts[k * DEPTH_RADIX_DIGITS + d];
+        }
+    }
+    for (int i = begin; i < end; i++) {
+        uint32 digit = (keysIn[i].key >> shift) & (DEPTH_RADIX_DIGITS - 1);
+        keysOut[offsets[digit]++] = keysIn[i];
+    }
+}
+
+// Copies draw data for one chunk into dataGL, in depth order if sorted
+internal PARALLEL_FOR_FUNC(GatherDrawDataChunk)
+{
+    ParticleFrame* frame = (ParticleFrame*)data;
+    const ParticleSystem* ps = frame->ps;
+    ParticleSystemDataGL* dataGL = frame->dataGL;
+    end = MinInt(end, ps->active);
+
+    if (frame->isGrid) {
+        for (int i = begin; i < end; i++) {
+            dataGL->pos[i] = ps->pos[i];
+            dataGL->color[i] = ps->color[i];
+            dataGL->size[i] = ps->size[i];
+        }
+    }
+    else {
+        for (int i = begin; i < end; i++) {
+            int ind = frame->sortedDepth[i].index;
+            dataGL->pos[i] = ps->pos[ind];
+            dataGL->color[i] = ps->color[ind];
+            dataGL->size[i] = ps->size[ind];
+        }
+    }
+
+    if (IsInterpolated(ps)) {
+        // Lerp back from pos, which is exact when the frame ends on a step
+        float32 t = 1.0f - ps->stepAlpha;
+        for (int i = begin; i < end; i++) {
+            int ind = frame->isGrid ? i : frame->sortedDepth[i].index;
+            dataGL->pos[i] = Lerp(dataGL->pos[i], ps->prevPos[ind], t);
+        }
     }
 }
 
-internal int DepthComparator(const void* p, const void* q)
+int AddParticleUpdateJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, float32 deltaTime, void* data)
 {
-    float32 depthP = ((Particle*)p)->depth;
-    float32 depthQ = ((Particle*)q)->depth;
-    if (depthP > depthQ) {
-        return -1;
+    UpdateColliderBVH(ps);
+    UpdateAttractorField(ps);
+    SavePreviousPositions(ps);
+
+    frame->ps = ps;
+    frame->deltaTime = deltaTime;
+    frame->isGrid = ps->width != 0 && ps->height != 0;
+    frame->isFluid = ps->fluid.numCells > 0;
+    frame->isNBody = ps->nbody.maxParticles > 0;
+    frame->spawnData = data;
+    frame->liveChunkSize = frame->isFluid ? FLUID_CHUNK_SIZE
+        : PARTICLE_CHUNK_SIZE;
+
+    const int chunk = PARTICLE_CHUNK_SIZE;
+    int active = ps->active;
+    int numChunks = (active + chunk - 1) / chunk;
+
+    if (frame->isGrid) {
+        ClothSolver solver = ps->springs.params.solver;
+        int springsDone = -1;
+        if (solver != CLOTH_SOLVER_XPBD) {
+            // Springs read positions from anywhere in the grid, so all
+            // their forces have to be in before anything moves
+            int numSprings = ps->springs.numSprings;
+            int numSpringChunks = (numSprings + SPRING_CHUNK_SIZE - 1)
+                / SPRING_CHUNK_SIZE;
+            int springJobs = AddTaskJobChunks(graph, "ps springs",
+                SpringForcesChunk, frame, numSprings, SPRING_CHUNK_SIZE);
+            springsDone = AddTaskJoin(graph, "ps springs done",
+                springJobs, numSpringChunks);
+        }
+        if (solver == CLOTH_SOLVER_EXPLICIT) {
+            int updateJobs = AddTaskJobChunks(graph, "ps update",
+                UpdateParticlesChunk, frame, active, chunk);
+            for (int k = 0; k < numChunks; k++) {
+                AddTaskDependency(graph, updateJobs + k, springsDone);
+            }
+            int stepDone = AddTaskJoin(graph, "ps step done",
+                updateJobs, numChunks);
+            AddTaskDependency(graph, stepDone, springsDone);
+            return stepDone;
+        }
+
+        // The implicit solve and XPBD correct the explicit velocities, and
+        // need all of them before anything moves
+        int velocityJobs = AddTaskJobChunks(graph, "ps velocity",
+            UpdateVelocitiesChunk, frame, active, chunk);
+        int velocityDone = AddTaskJoin(graph, "ps velocity done",
+            velocityJobs, numChunks);
+        if (springsDone != -1) {
+            for (int k = 0; k < numChunks; k++) {
+                AddTaskDependency(graph, velocityJobs + k, springsDone);
+            }
+            AddTaskDependency(graph, velocityDone, springsDone);
+        }
+        int solveDone;
+        if (solver == CLOTH_SOLVER_IMPLICIT) {
+            solveDone = AddSpringSolveJobs(graph, &ps->springs,
+                ps->vel, active, deltaTime, velocityDone);
+        }
+        else {
+            solveDone = AddSpringProjectionJobs(graph, &ps->springs,
+                ps->pos, ps->vel, active, deltaTime, velocityDone);
+        }
+        int moveJobs = AddTaskJobChunks(graph, "ps move",
+            MoveParticlesChunk, frame, active, chunk);
+        for (int k = 0; k < numChunks; k++) {
+            AddTaskDependency(graph, moveJobs + k, solveDone);
+        }
+        int stepDone = AddTaskJoin(graph, "ps step done",
+            moveJobs, numChunks);
+        AddTaskDependency(graph, stepDone, solveDone);
+        return stepDone;
     }
-    else if (depthP < depthQ) {
-        return 1;
+
+    int sumJob;
+    if (frame->isFluid) {
+        // Each substep needs every particle's forces from the one before
+        float32 stepTime = deltaTime / ps->fluid.params.substeps;
+        int numFluidChunks = (active + FLUID_CHUNK_SIZE - 1)
+            / FLUID_CHUNK_SIZE;
+        int stepDone = -1;
+        for (int s = 0; s < ps->fluid.params.substeps; s++) {
+            int forcesDone = AddFluidJobs(graph, &ps->fluid,
+                ps->pos, ps->vel, active, stepTime, stepDone);
+            int updateJobs = AddTaskJobChunks(graph, "fluid update",
+                UpdateFluidParticlesChunk, frame, active, FLUID_CHUNK_SIZE);
+            for (int k = 0; k < numFluidChunks; k++) {
+                AddTaskDependency(graph, updateJobs + k, forcesDone);
+            }
+            stepDone = AddTaskJoin(graph, "fluid step done",
+                updateJobs, numFluidChunks);
+            AddTaskDependency(graph, stepDone, forcesDone);
+        }
+        sumJob = AddTaskJob(graph, "ps live sum",
+            SumLiveCountsJob, frame, 0, active);
+        AddTaskDependency(graph, sumJob, stepDone);
     }
     else {
-        return 0;
+        // N-body forces are in every velocity before anything moves
+        int nbodyDone = -1;
+        if (frame->isNBody) {
+            nbodyDone = AddNBodyJobs(graph, &ps->nbody,
+                ps->pos, ps->vel, active, deltaTime);
+        }
+        int updateJobs = AddTaskJobChunks(graph, "ps update",
+            UpdateParticlesChunk, frame, active, chunk);
+        sumJob = AddTaskJob(graph, "ps live sum",
+            SumLiveCountsJob, frame, 0, active);
+        for (int k = 0; k < numChunks; k++) {
+            if (nbodyDone != -1) {
+                AddTaskDependency(graph, updateJobs + k, nbodyDone);
+            }
+            AddTaskDependency(graph, sumJob, updateJobs + k);
+        }
+        if (numChunks == 0 && nbodyDone != -1) {
+            AddTaskDependency(graph, sumJob, nbodyDone);
+        }
+    }
+
+    // Whether anything expired is only known once the live counts are
+    // summed, so the gather jobs are always added, and skip if not
+    int numLiveChunks = (active + frame->liveChunkSize - 1)
+        / frame->liveChunkSize;
+    int gatherJobs = AddTaskJobChunks(graph, "ps gather live",
+        GatherLiveParticlesChunk, frame, active, frame->liveChunkSize);
+    int reserveJob = AddTaskJob(graph, "ps reserve spawn",
+        ReserveSpawnJob, frame, 0, active);
+    for (int k = 0; k < numLiveChunks; k++) {
+        AddTaskDependency(graph, gatherJobs + k, sumJob);
+        AddTaskDependency(graph, reserveJob, gatherJobs + k);
     }
+    AddTaskDependency(graph, reserveJob, sumJob);
+
+    // The spawn count is only known once the reserve job has run, so the
+    // spawn jobs cover MAX_SPAWN and clamp to it
+    int numSpawnChunks = (MAX_SPAWN + SPAWN_CHUNK_SIZE - 1)
+        / SPAWN_CHUNK_SIZE;
+    int spawnJobs = AddTaskJobChunks(graph, "ps spawn",
+        SpawnParticlesChunk, frame, MAX_SPAWN, SPAWN_CHUNK_SIZE);
+    for (int k = 0; k < numSpawnChunks; k++) {
+        AddTaskDependency(graph, spawnJobs + k, reserveJob);
+    }
+    int stepDone = AddTaskJoin(graph, "ps step done",
+        spawnJobs, numSpawnChunks);
+    AddTaskDependency(graph, stepDone, reserveJob);
+    return stepDone;
+}
+
+// Adds one depth sort job per chunk of [0, count), all starting after job
+// "after". Returns a join that finishes after all of them.
+internal int AddDepthSortPass(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int count, int after)
+{
+    int numJobs = (count + DEPTH_SORT_CHUNK_SIZE - 1) / DEPTH_SORT_CHUNK_SIZE;
+    int jobs = AddTaskJobChunks(graph, name, func, data,
+        count, DEPTH_SORT_CHUNK_SIZE);
+    for (int k = 0; k < numJobs; k++) {
+        AddTaskDependency(graph, jobs + k, after);
+    }
+    int join = AddTaskJoin(graph, "ps depth pass done", jobs, numJobs);
+    AddTaskDependency(graph, join, after);
+    return join;
+}
+
+bool32 InitParticleSystemDataGL(ParticleSystemDataGL* dataGL,
+    MemoryArena* arena, int capacity)
+{
+    *dataGL = {};
+    uint64 used = arena->used;
+    dataGL->depthOrder[0] = PUSH_ARRAY(arena, ParticleDepth, capacity);
+    dataGL->depthOrder[1] = PUSH_ARRAY(arena, ParticleDepth, capacity);
+    dataGL->depth = PUSH_ARRAY(arena, float32, capacity);
+    dataGL->pos = PUSH_ARRAY(arena, Vec3, capacity);
+    dataGL->color = PUSH_ARRAY(arena, Vec4, capacity);
+    dataGL->size = PUSH_ARRAY(arena, Vec2, capacity);
+    if (!dataGL->depthOrder[0] || !dataGL->depthOrder[1] || !dataGL->depth
+    || !dataGL->pos || !dataGL->color || !dataGL->size) {
+        DEBUG_PRINT("ERROR: no room for draw data of %d particles\n",
+            capacity);
+        arena->used = used;
+        *dataGL = {};
+        return false;
+    }
+
+    dataGL->capacity = capacity;
+    return true;
+}
+
+void AddParticleDrawJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, Mat4 vp, ParticleSystemDataGL* dataGL, int after)
+{
+    DEBUG_ASSERT(ps->maxParticles <= dataGL->capacity);
+    frame->ps = ps;
+    frame->isGrid = ps->width != 0 && ps->height != 0;
+    frame->vp = vp;
+    frame->dataGL = dataGL;
+    frame->sortedDepth = nullptr;
+
+    // The particle count is only known after spawning, so the draw jobs
+    // cover every slot and clamp to ps->active when they run.
+    const int chunk = PARTICLE_CHUNK_SIZE;
+    int maxParticles = ps->maxParticles;
+    int numDrawChunks = (maxParticles + chunk - 1) / chunk;
+    int gatherJobs;
+    if (frame->isGrid) {
+        // Grids are drawn in their own order
+        dataGL->incrementalSorted = false;
+        gatherJobs = AddTaskJobChunks(graph, "ps gather",
+            GatherDrawDataChunk, frame, maxParticles, chunk);
+        for (int k = 0; k < numDrawChunks; k++) {
+            if (after != -1) {
+                AddTaskDependency(graph, gatherJobs + k, after);
+            }
+        }
+        return;
+    }
+
+    // Depths, then their range, then the incremental sort. The radix sort
+    // jobs are always added, and skip themselves if it worked.
+    const int sortChunk = DEPTH_SORT_CHUNK_SIZE;
+    int numSortChunks = (maxParticles + sortChunk - 1) / sortChunk;
+    int depthJobs = AddTaskJobChunks(graph, "ps depth",
+        ComputeDepthsChunk, frame, maxParticles, sortChunk);
+    int orderJob = AddTaskJob(graph, "ps depth order",
+        OrderDepthsJob, frame, 0, maxParticles);
+    for (int k = 0; k < numSortChunks; k++) {
+        if (after != -1) {
+            AddTaskDependency(graph, depthJobs + k, after);
+        }
+        AddTaskDependency(graph, orderJob, depthJobs + k);
+    }
+    if (numSortChunks == 0 && after != -1) {
+        AddTaskDependency(graph, orderJob, after);
+    }
+    int done = AddDepthSortPass(graph, "ps depth keys",
+        ComputeDepthKeysChunk, frame, maxParticles, orderJob);
+    for (int p = 0; p < DEPTH_RADIX_PASSES; p++) {
+        DepthSortPass* pass = &frame->depthPasses[p];
+        pass->frame = frame;
+        pass->pass = p;
+        done = AddDepthSortPass(graph, "ps depth count",
+            CountDepthDigits, pass, maxParticles, done);
+        done = AddDepthSortPass(graph, "ps depth scatter",
+            ScatterDepthDigits, pass, maxParticles, done);
+    }
+
+    gatherJobs = AddTaskJobChunks(graph, "ps gather",
+        GatherDrawDataChunk, frame, maxParticles, chunk);
+    for (int k = 0; k < numDrawChunks; k++) {
+        AddTaskDependency(graph, gatherJobs + k, done);
+    }
+}
+
+void AddParticleSystemJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, float32 deltaTime, Mat4 vp,
+    ParticleSystemDataGL* dataGL, void* data)
+{
+    int stepDone = AddParticleUpdateJobs(graph, frame, ps, deltaTime, data);
+    AddParticleDrawJobs(graph, frame, ps, vp, dataGL, stepDone);
 }
 
 void DrawParticleSystem(ParticleSystemGL psGL,
@@ -520,21 +1983,7 @@ void DrawParticleSystem(ParticleSystemGL psGL,
     bool32 drawColliders)
 {
     Mat4 vp = proj * view;
-
     int active = (int)ps->active;
-    if (ps->width == 0 && ps->height == 0) {
-        for (int i = 0; i < active; i++) {
-            Vec4 transformed = vp * ToVec4(ps->particles[i].pos, 1.0f);
-            ps->particles[i].depth = transformed.z;
-        }
-        qsort((void*)ps->particles, active, sizeof(Particle),
-            DepthComparator);
-    }
-    for (int i = 0; i < active; i++) {
-        dataGL->pos[i] = ps->particles[i].pos;
-        dataGL->color[i] = ps->particles[i].color;
-        dataGL->size[i] = ps->particles[i].size;
-    }
 
     GLint loc;
     glUseProgram(psGL.programID);
@@ -579,17 +2028,17 @@ void DrawParticleSystem(ParticleSystemGL psGL,
     if (drawColliders) {
         glDisable(GL_DEPTH_TEST);
         Vec4 colliderColor = { 0.4f, 0.4f, 0.4f, 0.3f };
-        for (int i = 0; i < ps->numPlaneColliders; i++) {
+        for (int i = 0; i < (int)ps->planeColliders.size; i++) {
             DrawPlane(planeGL, vp,
                 ps->planeColliders[i].point, ps->planeColliders[i].normal,
                 colliderColor);
         }
-        for (int i = 0; i < ps->numBoxColliders; i++) {
+        for (int i = 0; i < (int)ps->boxColliders.size; i++) {
             DrawBox(boxGL, vp,
                 ps->boxColliders[i].min, ps->boxColliders[i].max,
                 colliderColor);
         }
-        for (int i = 0; i < ps->numSphereColliders; i++) {
+        for (int i = 0; i < (int)ps->sphereColliders.size; i++) {
             Mat4 viewModel = view * Translate(ps->sphereColliders[i].center)
                 * Scale(ps->sphereColliders[i].radius);
             DrawMeshGL(sphereMeshGL, proj, viewModel, colliderColor);
@@ -4,12 +4,110 @@
 #include "opengl.h"
 #include "ogl_base.h"
 #include "main_platform.h"
+#include "bvh.h"
+#include "fluid.h"
 #include "mesh.h"
+#include "nbody.h"
+#include "random.h"
+#include "sdf.h"
+#include "springs.h"
+#include "task_graph.h"
+#include "thread_pool.h"
 
 #define MAX_PARTICLES 100000
 #define MAX_SPAWN (MAX_PARTICLES / 10)
 #define MAX_ATTRACTORS 50
-#define MAX_COLLIDERS 20
+// Systems with fewer attractors than this evaluate them directly
+#define ATTRACTOR_FIELD_MIN_COUNT 8
+// Grid cells along the longest side of the attractor field
+#define ATTRACTOR_FIELD_RESOLUTION 64
+// Space around the attractors covered by the field, as a fraction of the
+// longest side of their bounds
+#define ATTRACTOR_FIELD_PADDING 0.5f
+// Scenes with fewer box and sphere colliders than this skip the BVH
+#define COLLIDER_BVH_MIN_COUNT 8
+#define COLLIDER_BVH_LEAF_SIZE 2
+#define MESH_COLLIDER_BVH_LEAF_SIZE 4
+// Particles per parallel update chunk. Multiple of every SIMD kernel width,
+// so chunk boundaries never split a SIMD block.
+#define PARTICLE_CHUNK_SIZE 2048
+// New particles per parallel spawn chunk
+#define SPAWN_CHUNK_SIZE 1024
+// Update chunks that expired particle compaction keeps live counts for.
+// Update chunks are never smaller than PARTICLE_CHUNK_SIZE.
+#define MAX_LIVE_CHUNKS \
+    ((MAX_PARTICLES + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE)
+// Particles per depth sort job
+#define DEPTH_SORT_CHUNK_SIZE 8192
+#define MAX_DEPTH_CHUNKS \
+    ((MAX_PARTICLES + DEPTH_SORT_CHUNK_SIZE - 1) / DEPTH_SORT_CHUNK_SIZE)
+// Depths are quantized to keys of DEPTH_RADIX_BITS * DEPTH_RADIX_PASSES
+// bits, sorted DEPTH_RADIX_BITS at a time
+#define DEPTH_RADIX_BITS 8
+#define DEPTH_RADIX_PASSES 3
+// Average insertion moves per particle the incremental depth sort makes
+// before it gives up for the radix sort, and the frames it then waits
+// before trying again
+#define DEPTH_INCREMENTAL_MAX_MOVES 4
+#define DEPTH_INCREMENTAL_RETRY_FRAMES 16
+// Fraction of the stability limit that adaptive steps stay under with
+// explicit springs
+#define ADAPTIVE_STEP_SAFETY 0.5f
+
+enum DepthSortMode
+{
+    // Radix sort of the quantized depths, every frame
+    DEPTH_SORT_RADIX,
+    // Starts from the last frame's order and fixes it with insertion
+    // passes. New particles are sorted separately and merged in. Falls
+    // back to the radix sort when the order changed too much. Only pays
+    // off for slow, sparse particles under a slow camera: in dense clouds
+    // small moves still shift depth ranks a long way.
+    DEPTH_SORT_INCREMENTAL
+};
+
+// Implementation used for the velocity and position update passes
+enum ParticleKernel
+{
+    PARTICLE_KERNEL_SCALAR,
+    PARTICLE_KERNEL_SSE,
+    PARTICLE_KERNEL_AVX2,
+
+    PARTICLE_KERNEL_LAST // keep at the end
+};
+
+global_var const char* particleKernelNames_[PARTICLE_KERNEL_LAST] = {
+    "Scalar",
+    "SSE",
+    "AVX2"
+};
+
+// How a frame's time is split into simulation steps
+enum StepMode
+{
+    // One step per frame, as long as the frame
+    STEP_VARIABLE,
+    // Steps of fixedStep. Time left over carries to the next frame.
+    STEP_FIXED,
+    // Equal steps, as many as the fastest particle and the stiffest
+    // explicit springs need, up to fixedStep long
+    STEP_ADAPTIVE
+};
+
+struct StepParams
+{
+    StepMode mode;
+    float32 fixedStep;
+    // Step budget per frame. Frames that need more drop the rest of their
+    // time, so the simulation slows down instead of falling behind.
+    int maxSteps;
+    // Fixed mode: draw particles between their last two steps, at how far
+    // the frame ended into the next step
+    bool32 interpolate;
+    // Adaptive mode: farthest a particle may move in one step, or 0 for
+    // no limit
+    float32 maxStepDistance;
+};
 
 enum ColliderType
 {
@@ -17,6 +115,9 @@ enum ColliderType
     COLLIDER_BOUNCE
 };
 
+// Single-particle view of the system's structure-of-arrays storage.
+// Used to fill in new particles (see InitParticleFunction) and accessed
+// through GetParticle/SetParticle.
 struct Particle
 {
     float32 life;
@@ -26,8 +127,6 @@ struct Particle
     Vec2 size;
     float32 bounceMult;
     float32 frictionMult;
-
-    float32 depth;
 };
 
 struct Attractor
@@ -36,6 +135,17 @@ struct Attractor
     float32 strength;
 };
 
+// Attractor pull sampled at the points of a regular grid, so looking it up
+// costs the same for any number of attractors. Covers the attractors plus
+// some padding; particles outside it evaluate the attractors directly.
+struct AttractorField
+{
+    Vec3 origin; // position of grid point (0, 0, 0)
+    float32 cellSize;
+    int dims[3];
+    Vec3* pull; // x varies fastest, then y, then z
+};
+
 struct PlaneCollider
 {
     ColliderType type;
@@ -58,14 +168,112 @@ struct SphereCollider
     float32 radius;
 };
 
+struct MeshColliderTriangle
+{
+    Vec3 v0;
+    Vec3 edge1;
+    Vec3 edge2;
+    Vec3 normal;
+};
+// Triangle mesh collider, in world space. Keeps its own copy of the
+// triangles, so the Mesh it was built from can be freed afterwards.
+struct MeshCollider
+{
+    ColliderType type;
+
+    BVH bvh;
+    // In BVH leaf order, so leaves read their triangles contiguously
+    DynamicArray<MeshColliderTriangle> triangles;
+
+    uint64 buildCycles;
+    uint64 memoryBytes;
+};
+// Signed distance field collider, in world space. O(1) per particle,
+// but only as detailed as the grid, and only inside the grid bounds.
+struct SDFCollider
+{
+    ColliderType type;
+
+    SDFGrid sdf;
+};
+
 struct ParticleSystem;
-typedef void (*InitParticleFunction)(ParticleSystem*, Particle*, void* data);
+// Fills in a new particle, drawing any random numbers from rng.
+// Spawning runs in parallel, so this has to be thread-safe.
+typedef void (*InitParticleFunction)(const ParticleSystem*, Particle*,
+    RandomStream* rng, void* data);
+// Batch emitter: fills in life, pos, vel, color, size, bounceMult and
+// frictionMult of the new particles [first, first + count), where count is
+// at most SPAWN_CHUNK_SIZE. Particle first + i draws its random numbers
+// from stream spawnIndex + i of ps->seed (see MakeRandomBatch).
+// Spawning runs in parallel, so this has to be thread-safe.
+typedef void (*InitParticlesFunction)(ParticleSystem* ps,
+    int first, int count, uint32 spawnIndex, void* data);
+
+// One full set of particle data, maxParticles long. Expired particle
+// compaction gathers the survivors of a step from one set into the other,
+// in order, then swaps.
+struct ParticleArrays
+{
+    float32* life;
+    Vec3* pos;
+    Vec3* vel;
+    Vec4* color;
+    Vec2* size;
+    float32* bounceMult;
+    float32* frictionMult;
+    Vec3* prevPos;
+};
 
 struct ParticleSystem
 {
-    Particle particles[MAX_PARTICLES];
+    // Particle data, stored as separate contiguous arrays so that each
+    // update pass only pulls the fields it touches through the cache.
+    // These point into arrays[currentArrays]. Both sets, and compactRemap,
+    // are pushed onto the arena the system is created from, so they live
+    // until that arena is reset.
+    float32* life;
+    Vec3* pos;
+    Vec3* vel;
+    Vec4* color;
+    Vec2* size;
+    float32* bounceMult;
+    float32* frictionMult;
+
+    // Positions before the last step, for interpolated drawing
+    Vec3* prevPos;
+
+    ParticleArrays arrays[2];
+    int currentArrays;
+
+    // Defaults to DEPTH_SORT_RADIX
+    DepthSortMode depthSort;
+    // Bumped whenever particles change index other than by spawning, i.e.
+    // by compaction. In incremental mode, compaction also records where
+    // each of its compactedCount particles went (-1 if expired), and that
+    // compactedLive survived.
+    uint32 indexGeneration;
+    int* compactRemap;
+    int compactedCount;
+    int compactedLive;
+
     float32 spawnCounter;
     int active;
+    // Each spawned particle gets the random stream numbered by its spawn
+    // index, so spawning reproduces exactly from seed. Set seed before the
+    // first spawn.
+    uint32 seed;
+    uint32 spawnIndex;
+
+    ParticleKernel kernel;
+
+    // Frame stepping (see BeginParticleSteps). Defaults to STEP_VARIABLE.
+    StepParams stepping;
+    float32 stepAccumulator;
+    float32 stepAlpha; // interpolation from prevPos to pos
+    // Last frame, for profiling
+    int lastSteps;
+    float32 lastStepTime;
 
     int maxParticles;
     int particlesPerSec;
@@ -76,27 +284,44 @@ struct ParticleSystem
 
     Attractor attractors[MAX_ATTRACTORS];
     int numAttractors;
+    // With ATTRACTOR_FIELD_MIN_COUNT or more attractors, their pull is
+    // looked up in attractorField. Set attractorsDirty after editing them;
+    // the field is rebuilt at the start of the next update.
+    AttractorField attractorField;
+    bool32 attractorsDirty;
 
-    PlaneCollider planeColliders[MAX_COLLIDERS];
-    int numPlaneColliders;
-
-    AxisBoxCollider boxColliders[MAX_COLLIDERS];
-    int numBoxColliders;
-
-    SphereCollider sphereColliders[MAX_COLLIDERS];
-    int numSphereColliders;
+    // Planes are unbounded, so they're always tested one by one.
+    // Boxes and spheres are looked up through colliderBVH, which indexes
+    // all boxes followed by all spheres. Set collidersDirty after editing
+    // them in place; the BVH is rebuilt at the start of the next update.
+    DynamicArray<PlaneCollider> planeColliders;
+    DynamicArray<AxisBoxCollider> boxColliders;
+    DynamicArray<SphereCollider> sphereColliders;
+    BVH colliderBVH;
+    float32 maxSphereRadius;
+    bool32 collidersDirty;
+    DynamicArray<MeshCollider> meshColliders;
+    DynamicArray<SDFCollider> sdfColliders;
 
+    // New particles come from initParticlesFunc if set, or else one at a
+    // time from initParticleFunc
     InitParticleFunction initParticleFunc;
+    InitParticlesFunction initParticlesFunc;
 
     GLuint texture;
 
     Mesh* mesh;
     MeshGL* meshGL;
 
-    // Grid mode
+    // Fluid mode, when fluid.numCells > 0 (see MakeParticleSystemFluid)
+    FluidGrid fluid;
+    // N-body mode, when nbody.maxParticles > 0 (see MakeParticleSystemNBody)
+    NBodyTree nbody;
+
+    // Grid mode. Particles are laid out row-major and held together by
+    // springs, built once when the system is created.
     int width, height;
-    float32 hookeEqDist;
-    float32 hookeStrength;
+    SpringNetwork springs;
 };
 
 struct ParticleSystemGL
@@ -110,19 +335,93 @@ struct ParticleSystemGL
     GLuint programID;
 };
 
+struct ParticleDepth
+{
+    uint32 key; // quantized depth, ascending from back to front
+    int index;
+};
+
+// Draw staging for one particle system. Its per-particle arrays are
+// capacity long, pushed onto an arena by InitParticleSystemDataGL.
 struct ParticleSystemDataGL
 {
-    Vec3 pos[MAX_PARTICLES];
-    Vec4 color[MAX_PARTICLES];
-    Vec2 size[MAX_PARTICLES];
+    int capacity;
+    // Depth order, ping-ponged by the sorts. The last frame's order is
+    // depthOrder[sortedBuffer], over sortedCount particles of index
+    // generation sortedGeneration.
+    ParticleDepth* depthOrder[2];
+    int sortedBuffer;
+    int sortedCount;
+    uint32 sortedGeneration;
+    // Per particle view depth, and its range per depth sort chunk
+    float32* depth;
+    float32 chunkMinDepth[MAX_DEPTH_CHUNKS];
+    float32 chunkMaxDepth[MAX_DEPTH_CHUNKS];
+    // Per depth sort chunk, per radix digit
+    uint32 digitCounts[MAX_DEPTH_CHUNKS << DEPTH_RADIX_BITS];
+    int incrementalRetry; // frames until the incremental sort tries again
+    // Last frame, for profiling
+    bool32 incrementalSorted;
+
+    Vec3* pos;
+    Vec4* color;
+    Vec2* size;
+};
+
+struct ParticleFrame;
+
+// Data for the jobs of one depth radix sort pass
+struct DepthSortPass
+{
+    ParticleFrame* frame;
+    int pass;
+};
+
+// State shared by the frame jobs of one particle system.
+// Has to stay alive until the task graph it was added to has run.
+struct ParticleFrame
+{
+    ParticleSystem* ps;
+    float32 deltaTime;
+    bool32 isGrid;
+    bool32 isFluid;
+    bool32 isNBody;
+    void* spawnData;
+    // Expired particle compaction. Each update chunk of liveChunkSize
+    // particles counts its survivors, and their prefix sums (liveOffsets)
+    // say where each chunk's survivors go.
+    int liveChunkSize;
+    int liveCounts[MAX_LIVE_CHUNKS];
+    int liveOffsets[MAX_LIVE_CHUNKS];
+    int liveCount;
+    // Particles spawned this step, in slots [spawnFirst, + spawnCount)
+    int spawnFirst;
+    int spawnCount;
+    uint32 spawnIndex;
+
+    Mat4 vp;
+    ParticleSystemDataGL* dataGL;
+    // Depth keys map [minDepth, maxDepth] onto the key range
+    float32 maxDepth;
+    float32 depthScale;
+    // Set once the incremental sort has ordered the particles, so the
+    // radix sort jobs have nothing to do
+    bool32 depthSorted;
+    DepthSortPass depthPasses[DEPTH_RADIX_PASSES];
+    const ParticleDepth* sortedDepth;
 };
 
 ParticleSystemGL InitParticleSystemGL(const ThreadContext* thread,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory);
 
-void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
-    int particlesPerSec, float32 maxLife, Vec3 gravity,
+// ps must be zeroed or freed with FreeParticleSystem first.
+// Storage for exactly maxParticles (or width * height) particles is pushed
+// onto arena, and released only by resetting the arena, so any number of
+// differently sized systems can share one. Returns false if the arena is
+// out of room, leaving a system that holds no particles.
+bool32 CreateParticleSystem(ParticleSystem* ps, MemoryArena* arena,
+    int maxParticles, int particlesPerSec, float32 maxLife, Vec3 gravity,
     float32 linearDamp, float32 quadraticDamp,
     Attractor* attractors, int numAttractors,
     PlaneCollider* planeColliders, int numPlaneColliders,
@@ -130,16 +429,74 @@ void CreateParticleSystem(ParticleSystem* ps, int maxParticles,
     SphereCollider* sphereColliders, int numSphereColliders,
     InitParticleFunction initParticleFunc, GLuint texture,
     Mesh* mesh, MeshGL* meshGL);
-void CreateParticleSystem(ParticleSystem* ps,
+bool32 CreateParticleSystem(ParticleSystem* ps, MemoryArena* arena,
     int width, int height, Vec3 origin, Vec3 strideX, Vec3 strideY,
-    Vec3 gravity, float32 hookeStrength, float32 hookeEqDist,
+    Vec3 gravity, ClothSpringParams springParams,
     float32 linearDamp, float32 quadraticDamp,
     Attractor* attractors, int numAttractors,
     PlaneCollider* planeColliders, int numPlaneColliders,
     AxisBoxCollider* boxColliders, int numBoxColliders,
     SphereCollider* sphereColliders, int numSphereColliders,
     GLuint texture);
-void UpdateParticleSystem(ParticleSystem* ps, float32 deltaTime, void* data);
+// Turns a (non-grid) particle system into an SPH fluid. Its particles
+// push on each other and still collide with the system's colliders.
+void MakeParticleSystemFluid(ParticleSystem* ps, FluidParams params);
+// Turns a (non-grid, non-fluid) particle system into an n-body system,
+// where every particle pulls on every other through a Barnes-Hut octree.
+void MakeParticleSystemNBody(ParticleSystem* ps, NBodyParams params);
+// Spawns particles in batches through func (see InitParticlesFunction),
+// in place of the per-particle initParticleFunc
+void SetParticleEmitter(ParticleSystem* ps, InitParticlesFunction func);
+// Sets how frames are split into steps (see BeginParticleSteps), and
+// resets the step accumulator
+void SetParticleStepping(ParticleSystem* ps, StepParams params);
+// Frees collider, attractor field, spring, fluid and n-body storage.
+// Particle storage stays on its arena. Safe on a zeroed ParticleSystem.
+void FreeParticleSystem(ParticleSystem* ps);
+
+void AddPlaneCollider(ParticleSystem* ps, PlaneCollider collider);
+void AddBoxCollider(ParticleSystem* ps, AxisBoxCollider collider);
+void AddSphereCollider(ParticleSystem* ps, SphereCollider collider);
+// Builds a BVH over the mesh's triangles. Slow for large meshes.
+void AddMeshCollider(ParticleSystem* ps, const Mesh* mesh, ColliderType type);
+// Takes ownership of sdf, which is freed with the collider
+void AddSDFCollider(ParticleSystem* ps, SDFGrid sdf, ColliderType type);
+void RemovePlaneCollider(ParticleSystem* ps, int index);
+void RemoveBoxCollider(ParticleSystem* ps, int index);
+void RemoveSphereCollider(ParticleSystem* ps, int index);
+void RemoveMeshCollider(ParticleSystem* ps, int index);
+void RemoveSDFCollider(ParticleSystem* ps, int index);
+void UpdateColliderBVH(ParticleSystem* ps);
+void UpdateAttractorField(ParticleSystem* ps);
+// Acceleration from the attractors at p, from the field where there is one
+Vec3 GetAttractorPull(const ParticleSystem* ps, Vec3 p);
+
+Particle GetParticle(const ParticleSystem* ps, int i);
+void SetParticle(ParticleSystem* ps, int i, const Particle& particle);
+
+// Splits a frameTime-long frame into steps, as set by ps->stepping.
+// Returns how many steps to run this frame (possibly 0), each *stepTime
+// long, through the job functions below.
+int BeginParticleSteps(ParticleSystem* ps, float32 frameTime,
+    float32* stepTime);
+// Adds jobs that run one step: per-particle passes, compaction of expired
+// particles and spawning. Returns the job that finishes it.
+int AddParticleUpdateJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, float32 deltaTime, void* data);
+// Pushes draw staging for a system of up to capacity particles onto arena.
+// Returns false if the arena is out of room, leaving capacity 0.
+bool32 InitParticleSystemDataGL(ParticleSystemDataGL* dataGL,
+    MemoryArena* arena, int capacity);
+// Adds jobs that depth-sort ps by vp and pack its draw data into dataGL,
+// ready for DrawParticleSystem, starting after job "after" (may be -1).
+// dataGL must hold at least ps->maxParticles particles.
+void AddParticleDrawJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, Mat4 vp, ParticleSystemDataGL* dataGL, int after);
+// AddParticleUpdateJobs followed by AddParticleDrawJobs
+void AddParticleSystemJobs(TaskGraph* graph, ParticleFrame* frame,
+    ParticleSystem* ps, float32 deltaTime, Mat4 vp,
+    ParticleSystemDataGL* dataGL, void* data);
+// dataGL must have been filled by the jobs from AddParticleSystemJobs
 void DrawParticleSystem(ParticleSystemGL psGL,
     PlaneGL planeGL, BoxGL boxGL, MeshGL sphereMeshGL,
     ParticleSystem* ps,
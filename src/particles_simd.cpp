@@ -0,0 +1,382 @@
+#include "particles_simd.h"
+
+#include "cpu_features.h"
+#include "km_debug.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PARTICLE_SIMD_X86 1
+#else
+#define PARTICLE_SIMD_X86 0
+#endif
+
+#if PARTICLE_SIMD_X86
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+// MSVC allows AVX intrinsics without any special compiler flags
+#define TARGET_AVX2
+#else
+#include <immintrin.h>
+// GCC/Clang need per-function target attributes, since the game library
+// is not compiled with -mavx2 (the AVX2 path is only taken at runtime)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define PARTICLE_EPS_SIMD 0.0001f // keep in sync with PARTICLE_EPS
+
+// ---------------------------- AoS <-> SoA transposes ----------------------------
+// 4 packed Vec3s (12 floats) to/from x, y, z registers.
+internal inline void LoadVec3x4(const float32* src,
+    __m128* x, __m128* y, __m128* z)
+{
+    __m128 x0y0z0x1 = _mm_loadu_ps(src);
+    __m128 y1z1x2y2 = _mm_loadu_ps(src + 4);
+    __m128 z2x3y3z3 = _mm_loadu_ps(src + 8);
+    __m128 x2y2x3y3 = _mm_shuffle_ps(y1z1x2y2, z2x3y3z3,
+        _MM_SHUFFLE(2, 1, 3, 2));
+    __m128 y0z0y1z1 = _mm_shuffle_ps(x0y0z0x1, y1z1x2y2,
+        _MM_SHUFFLE(1, 0, 2, 1));
+    *x = _mm_shuffle_ps(x0y0z0x1, x2y2x3y3, _MM_SHUFFLE(2, 0, 3, 0));
+    *y = _mm_shuffle_ps(y0z0y1z1, x2y2x3y3, _MM_SHUFFLE(3, 1, 2, 0));
+    *z = _mm_shuffle_ps(y0z0y1z1, z2x3y3z3, _MM_SHUFFLE(3, 0, 3, 1));
+}
+internal inline void StoreVec3x4(float32* dst, __m128 x, __m128 y, __m128 z)
+{
+    __m128 x0x2y0y2 = _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 y1y3z1z3 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+    __m128 z0z2x1x3 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_ps(dst, _mm_shuffle_ps(x0x2y0y2, z0z2x1x3,
+        _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(dst + 4, _mm_shuffle_ps(y1y3z1z3, x0x2y0y2,
+        _MM_SHUFFLE(3, 1, 2, 0)));
+    _mm_storeu_ps(dst + 8, _mm_shuffle_ps(z0z2x1x3, y1y3z1z3,
+        _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+// 8 packed Vec3s (24 floats). Particles 0-3 go in the low 128-bit lane and
+// particles 4-7 in the high lane, so the in-lane shuffles from the 4-wide
+// version can be reused as-is.
+TARGET_AVX2
+internal inline void LoadVec3x8(const float32* src,
+    __m256* x, __m256* y, __m256* z)
+{
+    __m256 x0y0z0x1 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(src)),
+        _mm_loadu_ps(src + 12), 1);
+    __m256 y1z1x2y2 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(src + 4)),
+        _mm_loadu_ps(src + 16), 1);
+    __m256 z2x3y3z3 = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(src + 8)),
+        _mm_loadu_ps(src + 20), 1);
+    __m256 x2y2x3y3 = _mm256_shuffle_ps(y1z1x2y2, z2x3y3z3,
+        _MM_SHUFFLE(2, 1, 3, 2));
+    __m256 y0z0y1z1 = _mm256_shuffle_ps(x0y0z0x1, y1z1x2y2,
+        _MM_SHUFFLE(1, 0, 2, 1));
+    *x = _mm256_shuffle_ps(x0y0z0x1, x2y2x3y3, _MM_SHUFFLE(2, 0, 3, 0));
+    *y = _mm256_shuffle_ps(y0z0y1z1, x2y2x3y3, _MM_SHUFFLE(3, 1, 2, 0));
+    *z = _mm256_shuffle_ps(y0z0y1z1, z2x3y3z3, _MM_SHUFFLE(3, 0, 3, 1));
+}
+TARGET_AVX2
+internal inline void StoreVec3x8(float32* dst, __m256 x, __m256 y, __m256 z)
+{
+    __m256 x0x2y0y2 = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 y1y3z1z3 = _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+    __m256 z0z2x1x3 = _mm256_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 a = _mm256_shuffle_ps(x0x2y0y2, z0z2x1x3, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 b = _mm256_shuffle_ps(y1y3z1z3, x0x2y0y2, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 c = _mm256_shuffle_ps(z0z2x1x3, y1y3z1z3, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(dst, _mm256_castps256_ps128(a));
+    _mm_storeu_ps(dst + 4, _mm256_castps256_ps128(b));
+    _mm_storeu_ps(dst + 8, _mm256_castps256_ps128(c));
+    _mm_storeu_ps(dst + 12, _mm256_extractf128_ps(a, 1));
+    _mm_storeu_ps(dst + 16, _mm256_extractf128_ps(b, 1));
+    _mm_storeu_ps(dst + 20, _mm256_extractf128_ps(c, 1));
+}
+
+// ---------------------------------- Kernels ----------------------------------
+int UpdateVelocitiesSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    const __m128 dt = _mm_set1_ps(deltaTime);
+    const __m128 linearDamp = _mm_set1_ps(ps->linearDamp);
+    const __m128 quadraticDamp = _mm_set1_ps(ps->quadraticDamp);
+    const __m128 gx = _mm_set1_ps(ps->gravity.x);
+    const __m128 gy = _mm_set1_ps(ps->gravity.y);
+    const __m128 gz = _mm_set1_ps(ps->gravity.z);
+    const __m128 eps = _mm_set1_ps(PARTICLE_EPS_SIMD);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 maxLife = _mm_set1_ps(ps->maxLife);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 life = _mm_add_ps(_mm_loadu_ps(&ps->life[i]), dt);
+        _mm_storeu_ps(&ps->life[i], life);
+
+        __m128 vx, vy, vz, px, py, pz;
+        LoadVec3x4(&ps->vel[i].x, &vx, &vy, &vz);
+        LoadVec3x4(&ps->pos[i].x, &px, &py, &pz);
+
+        // Damping
+        __m128 magVel = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+        __m128 dampScale = _mm_add_ps(linearDamp,
+            _mm_mul_ps(quadraticDamp, magVel));
+        __m128 dampX = _mm_mul_ps(dampScale, vx);
+        __m128 dampY = _mm_mul_ps(dampScale, vy);
+        __m128 dampZ = _mm_mul_ps(dampScale, vz);
+
+        // Attractors
+        __m128 ax = _mm_setzero_ps();
+        __m128 ay = _mm_setzero_ps();
+        __m128 az = _mm_setzero_ps();
+        if (ps->attractorField.pull) {
+            // Field lookups are gathers, so they're done one by one
+            float32 pull[3][4];
+            for (int k = 0; k < 4; k++) {
+                Vec3 pullK = GetAttractorPull(ps, ps->pos[i + k]);
+                pull[0][k] = pullK.x;
+                pull[1][k] = pullK.y;
+                pull[2][k] = pullK.z;
+            }
+            ax = _mm_loadu_ps(pull[0]);
+            ay = _mm_loadu_ps(pull[1]);
+            az = _mm_loadu_ps(pull[2]);
+        }
+        else {
+            for (int a = 0; a < ps->numAttractors; a++) {
+                Vec3 attractorPos = ps->attractors[a].pos;
+                __m128 tx = _mm_sub_ps(_mm_set1_ps(attractorPos.x), px);
+                __m128 ty = _mm_sub_ps(_mm_set1_ps(attractorPos.y), py);
+                __m128 tz = _mm_sub_ps(_mm_set1_ps(attractorPos.z), pz);
+                __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty)),
+                    _mm_mul_ps(tz, tz)));
+                // Attractors closer than PARTICLE_EPS are skipped (masked out)
+                __m128 valid = _mm_cmpge_ps(dist, eps);
+                __m128 attractMag = _mm_div_ps(
+                    _mm_set1_ps(ps->attractors[a].strength), dist);
+                ax = _mm_add_ps(ax, _mm_and_ps(valid,
+                    _mm_mul_ps(attractMag, _mm_div_ps(tx, dist))));
+                ay = _mm_add_ps(ay, _mm_and_ps(valid,
+                    _mm_mul_ps(attractMag, _mm_div_ps(ty, dist))));
+                az = _mm_add_ps(az, _mm_and_ps(valid,
+                    _mm_mul_ps(attractMag, _mm_div_ps(tz, dist))));
+            }
+        }
+
+        // Velocity update
+        vx = _mm_add_ps(vx, _mm_mul_ps(dt,
+            _mm_sub_ps(_mm_add_ps(gx, ax), dampX)));
+        vy = _mm_add_ps(vy, _mm_mul_ps(dt,
+            _mm_sub_ps(_mm_add_ps(gy, ay), dampY)));
+        vz = _mm_add_ps(vz, _mm_mul_ps(dt,
+            _mm_sub_ps(_mm_add_ps(gz, az), dampZ)));
+        StoreVec3x4(&ps->vel[i].x, vx, vy, vz);
+
+        // Color update
+        float32 alpha[4];
+        _mm_storeu_ps(alpha, _mm_sqrt_ps(
+            _mm_sub_ps(one, _mm_div_ps(life, maxLife))));
+        for (int k = 0; k < 4; k++) {
+            ps->color[i + k].a = alpha[k];
+        }
+    }
+
+    return i;
+}
+
+TARGET_AVX2
+int UpdateVelocitiesAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    const __m256 dt = _mm256_set1_ps(deltaTime);
+    const __m256 linearDamp = _mm256_set1_ps(ps->linearDamp);
+    const __m256 quadraticDamp = _mm256_set1_ps(ps->quadraticDamp);
+    const __m256 gx = _mm256_set1_ps(ps->gravity.x);
+    const __m256 gy = _mm256_set1_ps(ps->gravity.y);
+    const __m256 gz = _mm256_set1_ps(ps->gravity.z);
+    const __m256 eps = _mm256_set1_ps(PARTICLE_EPS_SIMD);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 maxLife = _mm256_set1_ps(ps->maxLife);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 life = _mm256_add_ps(_mm256_loadu_ps(&ps->life[i]), dt);
+        _mm256_storeu_ps(&ps->life[i], life);
+
+        __m256 vx, vy, vz, px, py, pz;
+        LoadVec3x8(&ps->vel[i].x, &vx, &vy, &vz);
+        LoadVec3x8(&ps->pos[i].x, &px, &py, &pz);
+
+        // Damping
+        __m256 magVel = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)),
+            _mm256_mul_ps(vz, vz)));
+        __m256 dampScale = _mm256_add_ps(linearDamp,
+            _mm256_mul_ps(quadraticDamp, magVel));
+        __m256 dampX = _mm256_mul_ps(dampScale, vx);
+        __m256 dampY = _mm256_mul_ps(dampScale, vy);
+        __m256 dampZ = _mm256_mul_ps(dampScale, vz);
+
+        // Attractors
+        __m256 ax = _mm256_setzero_ps();
+        __m256 ay = _mm256_setzero_ps();
+        __m256 az = _mm256_setzero_ps();
+        if (ps->attractorField.pull) {
+            // Field lookups are gathers, so they're done one by one
+            float32 pull[3][8];
+            // GetAttractorPull is SSE code; avoid the AVX/SSE switch penalty
+            _mm256_zeroupper();
+            for (int k = 0; k < 8; k++) {
+                Vec3 pullK = GetAttractorPull(ps, ps->pos[i + k]);
+                pull[0][k] = pullK.x;
+                pull[1][k] = pullK.y;
+                pull[2][k] = pullK.z;
+            }
+            ax = _mm256_loadu_ps(pull[0]);
+            ay = _mm256_loadu_ps(pull[1]);
+            az = _mm256_loadu_ps(pull[2]);
+        }
+        else {
+            for (int a = 0; a < ps->numAttractors; a++) {
+                __m256 tx = _mm256_sub_ps(
+                    _mm256_set1_ps(ps->attractors[a].pos.x), px);
+                __m256 ty = _mm256_sub_ps(
+                    _mm256_set1_ps(ps->attractors[a].pos.y), py);
+                __m256 tz = _mm256_sub_ps(
+                    _mm256_set1_ps(ps->attractors[a].pos.z), pz);
+                __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(tx, tx), _mm256_mul_ps(ty, ty)),
+                    _mm256_mul_ps(tz, tz)));
+                // Attractors closer than PARTICLE_EPS are skipped (masked out)
+                __m256 valid = _mm256_cmp_ps(dist, eps, _CMP_GE_OQ);
+                __m256 attractMag = _mm256_div_ps(
+                    _mm256_set1_ps(ps->attractors[a].strength), dist);
+                ax = _mm256_add_ps(ax, _mm256_and_ps(valid,
+                    _mm256_mul_ps(attractMag, _mm256_div_ps(tx, dist))));
+                ay = _mm256_add_ps(ay, _mm256_and_ps(valid,
+                    _mm256_mul_ps(attractMag, _mm256_div_ps(ty, dist))));
+                az = _mm256_add_ps(az, _mm256_and_ps(valid,
+                    _mm256_mul_ps(attractMag, _mm256_div_ps(tz, dist))));
+            }
+        }
+
+        // Velocity update
+        vx = _mm256_add_ps(vx, _mm256_mul_ps(dt,
+            _mm256_sub_ps(_mm256_add_ps(gx, ax), dampX)));
+        vy = _mm256_add_ps(vy, _mm256_mul_ps(dt,
+            _mm256_sub_ps(_mm256_add_ps(gy, ay), dampY)));
+        vz = _mm256_add_ps(vz, _mm256_mul_ps(dt,
+            _mm256_sub_ps(_mm256_add_ps(gz, az), dampZ)));
+        StoreVec3x8(&ps->vel[i].x, vx, vy, vz);
+
+        // Color update
+        float32 alpha[8];
+        _mm256_storeu_ps(alpha, _mm256_sqrt_ps(
+            _mm256_sub_ps(one, _mm256_div_ps(life, maxLife))));
+        for (int k = 0; k < 8; k++) {
+            ps->color[i + k].a = alpha[k];
+        }
+    }
+
+    return i;
+}
+
+// Positions and velocities are both packed Vec3 arrays, so the integration
+// step is a flat float loop with no transposes needed.
+int IntegratePositionsSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    const __m128 dt = _mm_set1_ps(deltaTime);
+    int count = ((end - begin) / 4) * 4;
+    float32* pos = &ps->pos[begin].x;
+    const float32* vel = &ps->vel[begin].x;
+    for (int f = 0; f < count * 3; f += 4) {
+        __m128 p = _mm_loadu_ps(pos + f);
+        __m128 v = _mm_loadu_ps(vel + f);
+        _mm_storeu_ps(pos + f, _mm_add_ps(p, _mm_mul_ps(dt, v)));
+    }
+
+    return begin + count;
+}
+
+TARGET_AVX2
+int IntegratePositionsAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    const __m256 dt = _mm256_set1_ps(deltaTime);
+    int count = ((end - begin) / 8) * 8;
+    float32* pos = &ps->pos[begin].x;
+    const float32* vel = &ps->vel[begin].x;
+    for (int f = 0; f < count * 3; f += 8) {
+        __m256 p = _mm256_loadu_ps(pos + f);
+        __m256 v = _mm256_loadu_ps(vel + f);
+        _mm256_storeu_ps(pos + f, _mm256_add_ps(p, _mm256_mul_ps(dt, v)));
+    }
+
+    return begin + count;
+}
+
+bool32 IsParticleKernelSupported(ParticleKernel kernel)
+{
+    switch (kernel) {
+        case PARTICLE_KERNEL_SCALAR: {
+            return true;
+        } break;
+        case PARTICLE_KERNEL_SSE: {
+            // SSE2 is part of the x86-64 baseline
+            return true;
+        } break;
+        case PARTICLE_KERNEL_AVX2: {
+            return CPUSupportsAVX2();
+        } break;
+        case PARTICLE_KERNEL_LAST: {
+        } break;
+    }
+
+    return false;
+}
+
+#else
+
+// No SIMD kernels on this architecture; everything runs the scalar path.
+bool32 IsParticleKernelSupported(ParticleKernel kernel)
+{
+    return kernel == PARTICLE_KERNEL_SCALAR;
+}
+
+int UpdateVelocitiesSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    return begin;
+}
+int UpdateVelocitiesAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    return begin;
+}
+int IntegratePositionsSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    return begin;
+}
+int IntegratePositionsAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime)
+{
+    return begin;
+}
+
+#endif
+
+ParticleKernel GetBestParticleKernel()
+{
+    for (int k = PARTICLE_KERNEL_LAST - 1; k > PARTICLE_KERNEL_SCALAR; k--) {
+        if (IsParticleKernelSupported((ParticleKernel)k)) {
+            return (ParticleKernel)k;
+        }
+    }
+
+    return PARTICLE_KERNEL_SCALAR;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "km_defines.h"
+#include "particles.h"
+
+// SIMD versions of the non-grid particle update passes.
+//
+// Each kernel processes particles in blocks of its width (4 for SSE,
+// 8 for AVX2) starting at "begin", and returns the index one past the
+// last particle it updated. The remaining (end - returned) particles are
+// left to the scalar path.
+//
+// The kernels perform the same IEEE operations in the same order as the
+// scalar code (no reciprocal approximations, no FMA contraction), so
+// results are expected to match the scalar path bit for bit. The
+// documented tolerance is 1e-6 relative per step, to leave room for
+// compilers that contract the scalar path into FMAs.
+#define PARTICLE_KERNEL_TOLERANCE 1e-6f
+
+bool32 IsParticleKernelSupported(ParticleKernel kernel);
+ParticleKernel GetBestParticleKernel();
+
+int UpdateVelocitiesSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime);
+int UpdateVelocitiesAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime);
+
+int IntegratePositionsSSE(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime);
+int IntegratePositionsAVX2(ParticleSystem* ps,
+    int begin, int end, float32 deltaTime);
\ No newline at end of file
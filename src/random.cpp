@@ -0,0 +1,362 @@
+#include "random.h"
+
+#include "cpu_features.h"
+#include "km_debug.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RANDOM_SIMD_X86 1
+#else
+#define RANDOM_SIMD_X86 0
+#endif
+
+#if RANDOM_SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define RANDOM_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define RANDOM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Spreads consecutive counters out before they're hashed
+#define RANDOM_WEYL 0x9E3779B9u
+// Values per block in the batch vector functions
+#define RANDOM_BATCH_SIZE 256
+
+// "lowbias32" by Chris Wellons: a bijective 32-bit integer hash
+internal inline uint32 MixRandom(uint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+internal inline uint32 HashRandom(uint32 key, uint32 counter)
+{
+    return MixRandom(key + MixRandom(counter * RANDOM_WEYL));
+}
+
+// Top 24 bits, so the result is exact and below 1
+internal inline float32 ToUnitFloat(uint32 x)
+{
+    return (float32)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+internal inline Vec2 UnitVec2FromUniform(float32 u)
+{
+    float32 angle = u * 2.0f * PI_F;
+    return Vec2 { cosf(angle), sinf(angle) };
+}
+
+internal inline Vec3 UnitVec3FromUniforms(float32 u1, float32 u2)
+{
+    // Uniform height on the sphere is uniform area (Archimedes)
+    float32 z = 1.0f - 2.0f * u1;
+    float32 r = sqrtf(MaxFloat32(1.0f - z * z, 0.0f));
+    float32 angle = u2 * 2.0f * PI_F;
+    return Vec3 { r * cosf(angle), r * sinf(angle), z };
+}
+
+internal inline Vec2 DiskPointFromUniforms(float32 u1, float32 u2)
+{
+    return UnitVec2FromUniform(u2) * sqrtf(u1);
+}
+
+RandomStream MakeRandomStream(uint32 seed, uint32 index)
+{
+    RandomStream rng;
+    rng.key = HashRandom(seed, index);
+    rng.counter = 0;
+    return rng;
+}
+
+uint32 RandomUInt32(RandomStream* rng)
+{
+    return HashRandom(rng->key, rng->counter++);
+}
+
+float32 RandomFloat(RandomStream* rng)
+{
+    return ToUnitFloat(RandomUInt32(rng));
+}
+
+float32 RandomFloat(RandomStream* rng, float32 min, float32 max)
+{
+    DEBUG_ASSERT(max > min);
+    return RandomFloat(rng) * (max - min) + min;
+}
+
+Vec2 RandomUnitVec2(RandomStream* rng)
+{
+    return UnitVec2FromUniform(RandomFloat(rng));
+}
+
+Vec3 RandomUnitVec3(RandomStream* rng)
+{
+    float32 u1 = RandomFloat(rng);
+    float32 u2 = RandomFloat(rng);
+    return UnitVec3FromUniforms(u1, u2);
+}
+
+Vec2 RandomInDisk(RandomStream* rng)
+{
+    float32 u1 = RandomFloat(rng);
+    float32 u2 = RandomFloat(rng);
+    return DiskPointFromUniforms(u1, u2);
+}
+
+#if RANDOM_SIMD_X86
+
+// SSE2 has no 32-bit multiply, so this one multiplies the even and odd
+// lanes into 64 bits and keeps the low halves
+internal inline __m128i MultiplyLow32SSE2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(
+        _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+internal inline __m128i MixRandomSSE2(__m128i x)
+{
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = MultiplyLow32SSE2(x, _mm_set1_epi32(0x7FEB352D));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = MultiplyLow32SSE2(x, _mm_set1_epi32((int)0x846CA68Bu));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    return x;
+}
+
+RANDOM_TARGET_AVX2
+internal inline __m256i MixRandomAVX2(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7FEB352D));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846CA68Bu));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    return x;
+}
+
+// Value number counter of streams index, index + 1, ...
+internal inline __m128i HashAcrossSSE2(__m128i seeds, __m128i indices,
+    __m128i counterHash)
+{
+    const __m128i weyl = _mm_set1_epi32((int)RANDOM_WEYL);
+    __m128i keys = MixRandomSSE2(MultiplyLow32SSE2(indices, weyl));
+    keys = MixRandomSSE2(_mm_add_epi32(seeds, keys));
+    return MixRandomSSE2(_mm_add_epi32(keys, counterHash));
+}
+
+// Each returns the number of values it filled in, a multiple of its width
+internal int RandomFloatsAcrossSSE2(uint32 seed, uint32 index,
+    uint32 counter, float32* out, int count)
+{
+    const __m128i seeds = _mm_set1_epi32((int)seed);
+    const __m128i counterHash = _mm_set1_epi32(
+        (int)MixRandom(counter * RANDOM_WEYL));
+    const __m128i step = _mm_set1_epi32(4);
+    const __m128 scale = _mm_set1_ps(1.0f / 16777216.0f);
+    __m128i indices = _mm_add_epi32(_mm_set1_epi32((int)index),
+        _mm_setr_epi32(0, 1, 2, 3));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i hash = HashAcrossSSE2(seeds, indices, counterHash);
+        __m128 u = _mm_cvtepi32_ps(_mm_srli_epi32(hash, 8));
+        _mm_storeu_ps(out + i, _mm_mul_ps(u, scale));
+        indices = _mm_add_epi32(indices, step);
+    }
+    return i;
+}
+
+internal int RandomUInt32sAcrossSSE2(uint32 seed, uint32 index,
+    uint32 counter, uint32* out, int count)
+{
+    const __m128i seeds = _mm_set1_epi32((int)seed);
+    const __m128i counterHash = _mm_set1_epi32(
+        (int)MixRandom(counter * RANDOM_WEYL));
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i indices = _mm_add_epi32(_mm_set1_epi32((int)index),
+        _mm_setr_epi32(0, 1, 2, 3));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i hash = HashAcrossSSE2(seeds, indices, counterHash);
+        _mm_storeu_si128((__m128i*)(out + i), hash);
+        indices = _mm_add_epi32(indices, step);
+    }
+    return i;
+}
+
+RANDOM_TARGET_AVX2
+internal inline __m256i HashAcrossAVX2(__m256i seeds, __m256i indices,
+    __m256i counterHash)
+{
+    const __m256i weyl = _mm256_set1_epi32((int)RANDOM_WEYL);
+    __m256i keys = MixRandomAVX2(_mm256_mullo_epi32(indices, weyl));
+    keys = MixRandomAVX2(_mm256_add_epi32(seeds, keys));
+    return MixRandomAVX2(_mm256_add_epi32(keys, counterHash));
+}
+
+RANDOM_TARGET_AVX2
+internal int RandomFloatsAcrossAVX2(uint32 seed, uint32 index,
+    uint32 counter, float32* out, int count)
+{
+    const __m256i seeds = _mm256_set1_epi32((int)seed);
+    const __m256i counterHash = _mm256_set1_epi32(
+        (int)MixRandom(counter * RANDOM_WEYL));
+    const __m256i step = _mm256_set1_epi32(8);
+    const __m256 scale = _mm256_set1_ps(1.0f / 16777216.0f);
+    __m256i indices = _mm256_add_epi32(_mm256_set1_epi32((int)index),
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i hash = HashAcrossAVX2(seeds, indices, counterHash);
+        __m256 u = _mm256_cvtepi32_ps(_mm256_srli_epi32(hash, 8));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(u, scale));
+        indices = _mm256_add_epi32(indices, step);
+    }
+    return i;
+}
+
+RANDOM_TARGET_AVX2
+internal int RandomUInt32sAcrossAVX2(uint32 seed, uint32 index,
+    uint32 counter, uint32* out, int count)
+{
+    const __m256i seeds = _mm256_set1_epi32((int)seed);
+    const __m256i counterHash = _mm256_set1_epi32(
+        (int)MixRandom(counter * RANDOM_WEYL));
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i indices = _mm256_add_epi32(_mm256_set1_epi32((int)index),
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i hash = HashAcrossAVX2(seeds, indices, counterHash);
+        _mm256_storeu_si256((__m256i*)(out + i), hash);
+        indices = _mm256_add_epi32(indices, step);
+    }
+    return i;
+}
+
+#endif
+
+internal void RandomFloatsAcross(uint32 seed, uint32 index, uint32 counter,
+    float32* out, int count)
+{
+    int done = 0;
+#if RANDOM_SIMD_X86
+    if (CPUSupportsAVX2()) {
+        done = RandomFloatsAcrossAVX2(seed, index, counter, out, count);
+    }
+    else {
+        done = RandomFloatsAcrossSSE2(seed, index, counter, out, count);
+    }
+#endif
+    for (int i = done; i < count; i++) {
+        uint32 key = HashRandom(seed, index + (uint32)i);
+        out[i] = ToUnitFloat(HashRandom(key, counter));
+    }
+}
+
+internal void RandomUInt32sAcross(uint32 seed, uint32 index, uint32 counter,
+    uint32* out, int count)
+{
+    int done = 0;
+#if RANDOM_SIMD_X86
+    if (CPUSupportsAVX2()) {
+        done = RandomUInt32sAcrossAVX2(seed, index, counter, out, count);
+    }
+    else {
+        done = RandomUInt32sAcrossSSE2(seed, index, counter, out, count);
+    }
+#endif
+    for (int i = done; i < count; i++) {
+        uint32 key = HashRandom(seed, index + (uint32)i);
+        out[i] = HashRandom(key, counter);
+    }
+}
+
+RandomBatch MakeRandomBatch(uint32 seed, uint32 index, int count)
+{
+    RandomBatch batch;
+    batch.seed = seed;
+    batch.index = index;
+    batch.count = count;
+    batch.counter = 0;
+    return batch;
+}
+
+void RandomUInt32s(RandomBatch* batch, uint32* out)
+{
+    RandomUInt32sAcross(batch->seed, batch->index, batch->counter,
+        out, batch->count);
+    batch->counter++;
+}
+
+void RandomFloats(RandomBatch* batch, float32* out)
+{
+    RandomFloatsAcross(batch->seed, batch->index, batch->counter,
+        out, batch->count);
+    batch->counter++;
+}
+
+void RandomFloats(RandomBatch* batch, float32 min, float32 max,
+    float32* out)
+{
+    DEBUG_ASSERT(max > min);
+    RandomFloats(batch, out);
+    for (int i = 0; i < batch->count; i++) {
+        out[i] = out[i] * (max - min) + min;
+    }
+}
+
+void RandomUnitVec2s(RandomBatch* batch, Vec2* out)
+{
+    float32 u[RANDOM_BATCH_SIZE];
+    for (int first = 0; first < batch->count; first += RANDOM_BATCH_SIZE) {
+        int n = MinInt(batch->count - first, RANDOM_BATCH_SIZE);
+        uint32 index = batch->index + (uint32)first;
+        RandomFloatsAcross(batch->seed, index, batch->counter, u, n);
+        for (int i = 0; i < n; i++) {
+            out[first + i] = UnitVec2FromUniform(u[i]);
+        }
+    }
+    batch->counter++;
+}
+
+void RandomUnitVec3s(RandomBatch* batch, Vec3* out)
+{
+    float32 u1[RANDOM_BATCH_SIZE];
+    float32 u2[RANDOM_BATCH_SIZE];
+    for (int first = 0; first < batch->count; first += RANDOM_BATCH_SIZE) {
+        int n = MinInt(batch->count - first, RANDOM_BATCH_SIZE);
+        uint32 index = batch->index + (uint32)first;
+        RandomFloatsAcross(batch->seed, index, batch->counter, u1, n);
+        RandomFloatsAcross(batch->seed, index, batch->counter + 1, u2, n);
+        for (int i = 0; i < n; i++) {
+            out[first + i] = UnitVec3FromUniforms(u1[i], u2[i]);
+        }
+    }
+    batch->counter += 2;
+}
+
+void RandomInDisks(RandomBatch* batch, Vec2* out)
+{
+    float32 u1[RANDOM_BATCH_SIZE];
+    float32 u2[RANDOM_BATCH_SIZE];
+    for (int first = 0; first < batch->count; first += RANDOM_BATCH_SIZE) {
+        int n = MinInt(batch->count - first, RANDOM_BATCH_SIZE);
+        uint32 index = batch->index + (uint32)first;
+        RandomFloatsAcross(batch->seed, index, batch->counter, u1, n);
+        RandomFloatsAcross(batch->seed, index, batch->counter + 1, u2, n);
+        for (int i = 0; i < n; i++) {
+            out[first + i] = DiskPointFromUniforms(u1[i], u2[i]);
+        }
+    }
+    batch->counter += 2;
+}
\ No newline at end of file
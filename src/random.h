@@ -0,0 +1,48 @@
+#pragma once
+
+#include "km_defines.h"
+#include "km_math.h"
+
+// Counter-based random numbers. Every value is a hash of a stream key and
+// the number of values drawn from the stream so far, so streams share no
+// state, and each one reproduces exactly from its key.
+struct RandomStream
+{
+    uint32 key;
+    uint32 counter;
+};
+
+// Stream number index of seed, e.g. one stream per spawned particle
+RandomStream MakeRandomStream(uint32 seed, uint32 index);
+
+uint32 RandomUInt32(RandomStream* rng);
+// Uniform in [0, 1)
+float32 RandomFloat(RandomStream* rng);
+// Uniform in [min, max)
+float32 RandomFloat(RandomStream* rng, float32 min, float32 max);
+// Uniform on the unit circle / sphere
+Vec2 RandomUnitVec2(RandomStream* rng);
+Vec3 RandomUnitVec3(RandomStream* rng);
+// Uniform in the unit disk
+Vec2 RandomInDisk(RandomStream* rng);
+
+// Streams index to index + count - 1 of seed, drawn from side by side
+struct RandomBatch
+{
+    uint32 seed;
+    uint32 index;
+    int count;
+    uint32 counter; // values drawn from each stream so far
+};
+
+RandomBatch MakeRandomBatch(uint32 seed, uint32 index, int count);
+
+// Each sets out[i] to the next value of stream index + i, the same value
+// the matching RandomStream call would give. Hashing runs on SSE2 or AVX2.
+void RandomUInt32s(RandomBatch* batch, uint32* out);
+void RandomFloats(RandomBatch* batch, float32* out);
+void RandomFloats(RandomBatch* batch, float32 min, float32 max,
+    float32* out);
+void RandomUnitVec2s(RandomBatch* batch, Vec2* out);
+void RandomUnitVec3s(RandomBatch* batch, Vec3* out);
+void RandomInDisks(RandomBatch* batch, Vec2* out);
\ No newline at end of file
@@ -0,0 +1,415 @@
+#include "sdf.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "km_debug.h"
+
+#define SDF_BVH_LEAF_SIZE 4
+// Grid rows (runs of x) per parallel bake chunk
+#define SDF_BAKE_ROWS_PER_CHUNK 4
+
+#define SDF_CACHE_MAGIC 0x46445353 // "SSDF"
+#define SDF_CACHE_VERSION 1
+
+struct SDFCacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 meshHash;
+    int32 resolution;
+    int32 triangleCount;
+    Vec3 origin;
+    float32 cellSize;
+    int32 dims[3];
+};
+
+// Slightly skewed, so the parity rays don't run along mesh edges
+// or axis-aligned faces
+global_var const Vec3 sdfSignRays_[3] = {
+    { 1.0f, 0.0017f, 0.0031f },
+    { 0.0023f, 1.0f, 0.0041f },
+    { 0.0037f, 0.0013f, 1.0f }
+};
+
+struct SDFBakeData
+{
+    const Mesh* mesh;
+    BVH bvh;
+    SDFGrid* sdf;
+    float32 rayLength;
+};
+
+struct SDFNearestQuery
+{
+    const SDFBakeData* bake;
+    float32 distSq;
+};
+
+struct SDFParityQuery
+{
+    const SDFBakeData* bake;
+    int hits;
+};
+
+// Closest point on triangle abc to p, from Ericson's Real-Time Collision
+// Detection (5.1.5). Returns the squared distance to it.
+internal float32 DistanceSqToTriangle(Vec3 p, Vec3 a, Vec3 b, Vec3 c)
+{
+    Vec3 ab = b - a;
+    Vec3 ac = c - a;
+    Vec3 ap = p - a;
+    Vec3 closest;
+
+    float32 d1 = Dot(ab, ap);
+    float32 d2 = Dot(ac, ap);
+    Vec3 bp = p - b;
+    float32 d3 = Dot(ab, bp);
+    float32 d4 = Dot(ac, bp);
+    Vec3 cp = p - c;
+    float32 d5 = Dot(ab, cp);
+    float32 d6 = Dot(ac, cp);
+    float32 va = d3 * d6 - d5 * d4;
+    float32 vb = d5 * d2 - d1 * d6;
+    float32 vc = d1 * d4 - d3 * d2;
+
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        closest = a;
+    }
+    else if (d3 >= 0.0f && d4 <= d3) {
+        closest = b;
+    }
+    else if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        closest = a + ab * (d1 / (d1 - d3));
+    }
+    else if (d6 >= 0.0f && d5 <= d6) {
+        closest = c;
+    }
+    else if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        closest = a + ac * (d2 / (d2 - d6));
+    }
+    else if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        closest = b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+    else {
+        float32 denom = va + vb + vc;
+        if (denom == 0.0f) {
+            // Degenerate triangle, its vertices are close enough
+            closest = a;
+        }
+        else {
+            closest = a + ab * (vb / denom) + ac * (vc / denom);
+        }
+    }
+
+    Vec3 d = p - closest;
+    return Dot(d, d);
+}
+
+internal BVH_POINT_FUNC(NearestSDFTriangle)
+{
+    SDFNearestQuery* query = (SDFNearestQuery*)data;
+    const SDFBakeData* bake = query->bake;
+    const Triangle& triangle =
+        bake->mesh->triangles[bake->bvh.primitives.data[slot]];
+    float32 distSq = DistanceSqToTriangle(point,
+        triangle.v[0], triangle.v[1], triangle.v[2]);
+    if (distSq < query->distSq) {
+        query->distSq = distSq;
+        *maxDistSq = distSq;
+    }
+}
+
+// Counts every crossing (Moller-Trumbore), without shortening the segment
+internal BVH_SEGMENT_FUNC(CountSDFCrossing)
+{
+    SDFParityQuery* query = (SDFParityQuery*)data;
+    const SDFBakeData* bake = query->bake;
+    const Triangle& triangle =
+        bake->mesh->triangles[bake->bvh.primitives.data[slot]];
+    Vec3 edge1 = triangle.v[1] - triangle.v[0];
+    Vec3 edge2 = triangle.v[2] - triangle.v[0];
+
+    Vec3 p = Cross(dir, edge2);
+    float32 det = Dot(edge1, p);
+    if (det > -1e-12f && det < 1e-12f) {
+        return;
+    }
+    float32 invDet = 1.0f / det;
+    Vec3 s = origin - triangle.v[0];
+    float32 u = Dot(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f) {
+        return;
+    }
+    Vec3 q = Cross(s, edge1);
+    float32 v = Dot(dir, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) {
+        return;
+    }
+    float32 t = Dot(edge2, q) * invDet;
+    if (0.0f < t && t <= *tMax) {
+        query->hits++;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(BakeSDFRows)
+{
+    const SDFBakeData* bake = (const SDFBakeData*)data;
+    SDFGrid* sdf = bake->sdf;
+
+    for (int row = begin; row < end; row++) {
+        int y = row % sdf->dims[1];
+        int z = row / sdf->dims[1];
+        float32* distances = sdf->distances
+            + (z * sdf->dims[1] + y) * sdf->dims[0];
+        for (int x = 0; x < sdf->dims[0]; x++) {
+            Vec3 point = sdf->origin + Vec3 {
+                (float32)x, (float32)y, (float32)z
+            } * sdf->cellSize;
+
+            SDFNearestQuery nearest;
+            nearest.bake = bake;
+            nearest.distSq = 1e30f;
+            QueryBVHNearest(&bake->bvh, point, nearest.distSq,
+                NearestSDFTriangle, &nearest);
+
+            // Majority vote over a few rays, in case one of them
+            // slips through a crack or grazes an edge
+            int insideVotes = 0;
+            for (int r = 0; r < 3; r++) {
+                SDFParityQuery parity;
+                parity.bake = bake;
+                parity.hits = 0;
+                TraceBVHSegment(&bake->bvh, point,
+                    sdfSignRays_[r] * bake->rayLength, 1.0f,
+                    CountSDFCrossing, &parity);
+                insideVotes += parity.hits % 2;
+            }
+
+            float32 dist = sqrtf(nearest.distSq);
+            distances[x] = insideVotes >= 2 ? -dist : dist;
+        }
+    }
+}
+
+SDFGrid BakeSDF(const Mesh* mesh, int resolution, const ThreadPool* pool)
+{
+    DEBUG_ASSERT(resolution > 0);
+    uint64 start = ReadCycleCounter();
+
+    SDFGrid sdf = {};
+    int count = (int)mesh->triangles.size;
+    if (count == 0) {
+        return sdf;
+    }
+
+    SDFBakeData bake = {};
+    bake.mesh = mesh;
+    bake.sdf = &sdf;
+
+    AABB* bounds = (AABB*)malloc(sizeof(AABB) * count);
+    for (int t = 0; t < count; t++) {
+        const Triangle& triangle = mesh->triangles[t];
+        bounds[t].min = triangle.v[0];
+        bounds[t].max = triangle.v[0];
+        for (int v = 1; v < 3; v++) {
+            for (int e = 0; e < 3; e++) {
+                bounds[t].min.e[e] = MinFloat32(bounds[t].min.e[e],
+                    triangle.v[v].e[e]);
+                bounds[t].max.e[e] = MaxFloat32(bounds[t].max.e[e],
+                    triangle.v[v].e[e]);
+            }
+        }
+    }
+    BuildBVH(&bake.bvh, bounds, count, SDF_BVH_LEAF_SIZE);
+    free(bounds);
+
+    Vec3 extent = mesh->boundsMax - mesh->boundsMin;
+    float32 maxExtent = MaxFloat32(extent.x, MaxFloat32(extent.y, extent.z));
+    sdf.cellSize = MaxFloat32(maxExtent, 1e-6f) / resolution;
+    sdf.origin = mesh->boundsMin
+        - Vec3::one * (sdf.cellSize * SDF_PADDING_CELLS);
+    for (int e = 0; e < 3; e++) {
+        sdf.dims[e] = (int)ceilf(extent.e[e] / sdf.cellSize)
+            + SDF_PADDING_CELLS * 2 + 1;
+    }
+    int numPoints = sdf.dims[0] * sdf.dims[1] * sdf.dims[2];
+    sdf.distances = (float32*)malloc(sizeof(float32) * numPoints);
+
+    // Long enough to leave the mesh from any grid point
+    Vec3 gridExtent = Vec3 {
+        (float32)sdf.dims[0], (float32)sdf.dims[1], (float32)sdf.dims[2]
+    } * sdf.cellSize;
+    bake.rayLength = Mag(gridExtent) * 2.0f;
+
+    ParallelFor(pool, sdf.dims[1] * sdf.dims[2], SDF_BAKE_ROWS_PER_CHUNK,
+        BakeSDFRows, &bake);
+
+    FreeBVH(&bake.bvh);
+    sdf.bakeCycles = ReadCycleCounter() - start;
+    return sdf;
+}
+
+// FNV-1a over the vertex positions
+internal uint32 HashMeshPositions(const Mesh* mesh)
+{
+    uint32 hash = 2166136261u;
+    for (uint32 t = 0; t < mesh->triangles.size; t++) {
+        const uint8* bytes = (const uint8*)mesh->triangles[t].v;
+        for (uint32 b = 0; b < sizeof(mesh->triangles[t].v); b++) {
+            hash ^= bytes[b];
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+internal void GetSDFCachePath(const char* meshFile, int resolution,
+    char* path, int pathSize)
+{
+    const char* baseName = meshFile;
+    for (const char* c = meshFile; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            baseName = c + 1;
+        }
+    }
+    snprintf(path, pathSize, SDF_CACHE_DIR "%s.%d.sdf", baseName, resolution);
+}
+
+SDFGrid LoadOrBakeSDF(const ThreadContext* thread,
+    const char* meshFile, const Mesh* mesh, int resolution,
+    const ThreadPool* pool, MemoryArena* scratch,
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory,
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile)
+{
+    char path[512];
+    GetSDFCachePath(meshFile, resolution, path, (int)sizeof(path));
+    uint32 meshHash = HashMeshPositions(mesh);
+
+    SDFGrid sdf = {};
+    DEBUGReadFileResult cacheFile = DEBUGPlatformReadFile(thread, path);
+    if (cacheFile.data && cacheFile.size >= sizeof(SDFCacheHeader)) {
+        SDFCacheHeader header;
+        memcpy(&header, cacheFile.data, sizeof(SDFCacheHeader));
+        uint64 numPoints = (uint64)header.dims[0] * header.dims[1]
+            * header.dims[2];
+        if (header.magic == SDF_CACHE_MAGIC
+        && header.version == SDF_CACHE_VERSION
+        && header.meshHash == meshHash
+        && header.resolution == resolution
+        && header.triangleCount == (int32)mesh->triangles.size
+        && cacheFile.size == sizeof(SDFCacheHeader)
+        + numPoints * sizeof(float32)) {
+            sdf.origin = header.origin;
+            sdf.cellSize = header.cellSize;
+            for (int e = 0; e < 3; e++) {
+                sdf.dims[e] = header.dims[e];
+            }
+            sdf.distances = (float32*)malloc(sizeof(float32) * numPoints);
+            memcpy(sdf.distances,
+                (uint8*)cacheFile.data + sizeof(SDFCacheHeader),
+                sizeof(float32) * numPoints);
+        }
+    }
+    if (cacheFile.data) {
+        DEBUGPlatformFreeFileMemory(thread, &cacheFile);
+    }
+    if (sdf.distances) {
+        DEBUG_PRINT("Loaded SDF from %s\n", path);
+        return sdf;
+    }
+
+    sdf = BakeSDF(mesh, resolution, pool);
+    if (!sdf.distances) {
+        return sdf;
+    }
+    DEBUG_PRINT("Baked %dx%dx%d SDF in %.2f Mcycles\n",
+        sdf.dims[0], sdf.dims[1], sdf.dims[2],
+        (float32)sdf.bakeCycles / 1000000.0f);
+
+    SDFCacheHeader header;
+    header.magic = SDF_CACHE_MAGIC;
+    header.version = SDF_CACHE_VERSION;
+    header.meshHash = meshHash;
+    header.resolution = resolution;
+    header.triangleCount = (int32)mesh->triangles.size;
+    header.origin = sdf.origin;
+    header.cellSize = sdf.cellSize;
+    for (int e = 0; e < 3; e++) {
+        header.dims[e] = sdf.dims[e];
+    }
+    uint64 dataSize = sizeof(float32) * sdf.dims[0] * sdf.dims[1]
+        * sdf.dims[2];
+    uint64 fileSize = sizeof(SDFCacheHeader) + dataSize;
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    uint8* fileData = PUSH_ARRAY(scratch, uint8, fileSize);
+    if (fileData) {
+        memcpy(fileData, &header, sizeof(SDFCacheHeader));
+        memcpy(fileData + sizeof(SDFCacheHeader), sdf.distances, dataSize);
+    }
+    if (!fileData
+    || !DEBUGPlatformWriteFile(thread, path, (uint32)fileSize, fileData)) {
+        DEBUG_PRINT("Failed to write SDF cache file %s\n", path);
+    }
+    EndTemporaryMemory(temp);
+
+    return sdf;
+}
+
+void FreeSDF(SDFGrid* sdf)
+{
+    free(sdf->distances);
+    *sdf = {};
+}
+
+bool32 SampleSDF(const SDFGrid* sdf, Vec3 p,
+    float32* distance, Vec3* gradient)
+{
+    Vec3 g = (p - sdf->origin) / sdf->cellSize;
+    int i[3];
+    float32 f[3];
+    for (int e = 0; e < 3; e++) {
+        // Written so NaNs fail the test too
+        if (!(g.e[e] >= 0.0f && g.e[e] < (float32)(sdf->dims[e] - 1))) {
+            return false;
+        }
+        i[e] = (int)g.e[e];
+        f[e] = g.e[e] - (float32)i[e];
+    }
+
+    int strideY = sdf->dims[0];
+    int strideZ = sdf->dims[0] * sdf->dims[1];
+    const float32* c = sdf->distances + i[2] * strideZ + i[1] * strideY + i[0];
+    float32 c000 = c[0];
+    float32 c100 = c[1];
+    float32 c010 = c[strideY];
+    float32 c110 = c[strideY + 1];
+    float32 c001 = c[strideZ];
+    float32 c101 = c[strideZ + 1];
+    float32 c011 = c[strideZ + strideY];
+    float32 c111 = c[strideZ + strideY + 1];
+
+    // Interpolate along x, then y, then z
+    float32 c00 = Lerp(c000, c100, f[0]);
+    float32 c10 = Lerp(c010, c110, f[0]);
+    float32 c01 = Lerp(c001, c101, f[0]);
+    float32 c11 = Lerp(c011, c111, f[0]);
+    float32 c0 = Lerp(c00, c10, f[1]);
+    float32 c1 = Lerp(c01, c11, f[1]);
+    *distance = Lerp(c0, c1, f[2]);
+
+    // Derivatives of the trilinear interpolant
+    float32 dx0 = Lerp(c100 - c000, c110 - c010, f[1]);
+    float32 dx1 = Lerp(c101 - c001, c111 - c011, f[1]);
+    float32 dy0 = Lerp(c010 - c000, c110 - c100, f[0]);
+    float32 dy1 = Lerp(c011 - c001, c111 - c101, f[0]);
+    gradient->x = Lerp(dx0, dx1, f[2]);
+    gradient->y = Lerp(dy0, dy1, f[2]);
+    gradient->z = c1 - c0;
+    *gradient /= sdf->cellSize;
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "km_math.h"
+#include "main_platform.h"
+#include "mesh.h"
+#include "thread_pool.h"
+
+// Baked grids are cached here as <mesh file>.<resolution>.sdf
+#define SDF_CACHE_DIR "data/cache/"
+// Empty cells around the mesh bounds, so the outside is sampled too
+#define SDF_PADDING_CELLS 3
+
+// Signed distance to a closed mesh, sampled at the points of a regular
+// grid. Negative inside the mesh.
+struct SDFGrid
+{
+    Vec3 origin; // position of grid point (0, 0, 0)
+    float32 cellSize;
+    int dims[3];
+    float32* distances; // x varies fastest, then y, then z
+
+    uint64 bakeCycles; // 0 if loaded from the cache
+};
+
+// Bakes the SDF of mesh, with resolution cells along the longest side of
+// its bounds. Grid points run in parallel over pool (may be null).
+// The sign comes from ray parity, so the mesh should be closed.
+SDFGrid BakeSDF(const Mesh* mesh, int resolution, const ThreadPool* pool);
+// Loads the SDF baked from meshFile at resolution from the cache, or bakes
+// it and writes it to the cache. Stale cache files (the mesh changed) are
+// detected and rebaked. The cache file is staged on scratch.
+SDFGrid LoadOrBakeSDF(const ThreadContext* thread,
+    const char* meshFile, const Mesh* mesh, int resolution,
+    const ThreadPool* pool, MemoryArena* scratch,
+    DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
+    DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory,
+    DEBUGPlatformWriteFileFunc* DEBUGPlatformWriteFile);
+void FreeSDF(SDFGrid* sdf);
+
+// Trilinear distance at p, and its gradient (not normalized).
+// Returns false if p is outside the grid.
+bool32 SampleSDF(const SDFGrid* sdf, Vec3 p,
+    float32* distance, Vec3* gradient);
\ No newline at end of file
@@ -0,0 +1,616 @@
+#include "springs.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "km_debug.h"
+
+internal void AddSpring(SpringNetwork* net, int a, int b,
+    float32 restLength, float32 stiffness)
+{
+    Spring* spring = &net->springs[net->numSprings++];
+    spring->a = a;
+    spring->b = b;
+    spring->restLength = restLength;
+    spring->stiffness = stiffness;
+}
+
+// Fills the per-particle spring end lists. Ends are listed in spring order,
+// so a particle's forces are always summed in the same order.
+internal void BuildSpringEnds(SpringNetwork* net)
+{
+    int numParticles = net->numParticles;
+    net->endStart = (int*)calloc(numParticles + 1, sizeof(int));
+    net->ends = (SpringEnd*)malloc(sizeof(SpringEnd) * net->numSprings * 2);
+    for (int s = 0; s < net->numSprings; s++) {
+        net->endStart[net->springs[s].a + 1]++;
+        net->endStart[net->springs[s].b + 1]++;
+    }
+    for (int i = 0; i < numParticles; i++) {
+        net->endStart[i + 1] += net->endStart[i];
+    }
+
+    int* next = (int*)malloc(sizeof(int) * numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        next[i] = net->endStart[i];
+    }
+    for (int s = 0; s < net->numSprings; s++) {
+        const Spring& spring = net->springs[s];
+        SpringEnd& endA = net->ends[next[spring.a]++];
+        endA.spring = s;
+        endA.other = spring.b;
+        endA.sign = 1.0f;
+        SpringEnd& endB = net->ends[next[spring.b]++];
+        endB.spring = s;
+        endB.other = spring.a;
+        endB.sign = -1.0f;
+    }
+    free(next);
+
+    net->maxStiffness = 0.0f;
+    for (int i = 0; i < numParticles; i++) {
+        float32 stiffness = 0.0f;
+        for (int e = net->endStart[i]; e < net->endStart[i + 1]; e++) {
+            stiffness += net->springs[net->ends[e].spring].stiffness;
+        }
+        net->maxStiffness = MaxFloat32(net->maxStiffness, stiffness);
+    }
+}
+
+// Greedy coloring: each spring gets the lowest color that neither of its
+// particles has yet. The springs are then sorted by color, stably.
+internal void ColorSprings(SpringNetwork* net)
+{
+    uint64* used = (uint64*)calloc(net->numParticles, sizeof(uint64));
+    uint8* springColor = (uint8*)malloc(net->numSprings);
+    int numColors = 0;
+    for (int s = 0; s < net->numSprings; s++) {
+        const Spring& spring = net->springs[s];
+        uint64 available = ~(used[spring.a] | used[spring.b]);
+        DEBUG_ASSERT(available != 0);
+        int c = 0;
+        while ((available & ((uint64)1 << c)) == 0) {
+            c++;
+        }
+        springColor[s] = (uint8)c;
+        used[spring.a] |= (uint64)1 << c;
+        used[spring.b] |= (uint64)1 << c;
+        numColors = MaxInt(numColors, c + 1);
+    }
+
+    net->numColors = numColors;
+    net->colors = (SpringColor*)malloc(sizeof(SpringColor) * numColors);
+    for (int c = 0; c < numColors; c++) {
+        net->colors[c].net = net;
+        net->colors[c].first = 0;
+        net->colors[c].count = 0;
+    }
+    for (int s = 0; s < net->numSprings; s++) {
+        net->colors[springColor[s]].count++;
+    }
+    for (int c = 1; c < numColors; c++) {
+        net->colors[c].first = net->colors[c - 1].first
+            + net->colors[c - 1].count;
+    }
+
+    Spring* sorted = (Spring*)malloc(sizeof(Spring) * net->numSprings);
+    int* next = (int*)malloc(sizeof(int) * numColors);
+    for (int c = 0; c < numColors; c++) {
+        next[c] = net->colors[c].first;
+    }
+    for (int s = 0; s < net->numSprings; s++) {
+        sorted[next[springColor[s]]++] = net->springs[s];
+    }
+    free(net->springs);
+    net->springs = sorted;
+
+    free(next);
+    free(springColor);
+    free(used);
+}
+
+void InitClothSprings(SpringNetwork* net, int width, int height,
+    ClothSpringParams params)
+{
+    DEBUG_ASSERT(width > 0 && height > 0);
+
+    int maxSprings = (width - 1) * height + width * (height - 1);
+    if (params.shearStiffness != 0.0f) {
+        maxSprings += 2 * (width - 1) * (height - 1);
+    }
+    if (params.bendStiffness != 0.0f) {
+        maxSprings += MaxInt(width - 2, 0) * height
+            + width * MaxInt(height - 2, 0);
+    }
+    int numParticles = width * height;
+    net->params = params;
+    net->numParticles = numParticles;
+    net->numSprings = 0;
+    net->springs = (Spring*)malloc(sizeof(Spring) * maxSprings);
+    net->forces = (Vec3*)malloc(sizeof(Vec3) * maxSprings);
+    if (params.solver == CLOTH_SOLVER_IMPLICIT) {
+        DEBUG_ASSERT(params.maxIterations > 0);
+        net->jacobians = (SpringJacobian*)malloc(
+            sizeof(SpringJacobian) * maxSprings);
+        net->residual = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+        net->invDiagonal = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+        net->precond = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+        net->direction = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+        net->product = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+        net->partialDots[0] = (float32*)malloc(
+            sizeof(float32) * SPRING_SOLVE_MAX_CHUNKS);
+        net->partialDots[1] = (float32*)malloc(
+            sizeof(float32) * SPRING_SOLVE_MAX_CHUNKS);
+    }
+
+    // Structural: rows, then columns
+    float32 length = params.restLength;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width - 1; x++) {
+            int i = y * width + x;
+            AddSpring(net, i, i + 1, length, params.stiffness);
+        }
+    }
+    for (int y = 0; y < height - 1; y++) {
+        for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            AddSpring(net, i, i + width, length, params.stiffness);
+        }
+    }
+    // Shear: both diagonals of every grid square
+    if (params.shearStiffness != 0.0f) {
+        float32 diagonal = length * sqrtf(2.0f);
+        for (int y = 0; y < height - 1; y++) {
+            for (int x = 0; x < width - 1; x++) {
+                int i = y * width + x;
+                AddSpring(net, i, i + width + 1,
+                    diagonal, params.shearStiffness);
+                AddSpring(net, i + 1, i + width,
+                    diagonal, params.shearStiffness);
+            }
+        }
+    }
+    // Bend: every other particle along rows and columns
+    if (params.bendStiffness != 0.0f) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width - 2; x++) {
+                int i = y * width + x;
+                AddSpring(net, i, i + 2,
+                    length * 2.0f, params.bendStiffness);
+            }
+        }
+        for (int y = 0; y < height - 2; y++) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                AddSpring(net, i, i + width * 2,
+                    length * 2.0f, params.bendStiffness);
+            }
+        }
+    }
+    DEBUG_ASSERT(net->numSprings == maxSprings);
+
+    if (params.solver == CLOTH_SOLVER_XPBD) {
+        DEBUG_ASSERT(params.iterations > 0);
+        ColorSprings(net);
+        net->lambdas = (float32*)malloc(sizeof(float32) * maxSprings);
+        net->startPos = (Vec3*)malloc(sizeof(Vec3) * numParticles);
+    }
+    BuildSpringEnds(net);
+}
+
+void FreeSpringNetwork(SpringNetwork* net)
+{
+    free(net->springs);
+    free(net->forces);
+    free(net->endStart);
+    free(net->ends);
+    free(net->jacobians);
+    free(net->residual);
+    free(net->invDiagonal);
+    free(net->precond);
+    free(net->direction);
+    free(net->product);
+    free(net->partialDots[0]);
+    free(net->partialDots[1]);
+    free(net->colors);
+    free(net->lambdas);
+    free(net->startPos);
+    *net = {};
+}
+
+void ComputeSpringForces(SpringNetwork* net, const Vec3* pos,
+    int begin, int end)
+{
+    for (int s = begin; s < end; s++) {
+        Spring spring = net->springs[s];
+        Vec3 distVec = pos[spring.b] - pos[spring.a];
+        float32 dist = Mag(distVec);
+        distVec /= dist;
+        float32 deltaX = dist - spring.restLength;
+        net->forces[s] = spring.stiffness * deltaX * distVec;
+
+        if (net->jacobians) {
+            // k n n^T along the spring, plus k (1 - restLength / dist) across
+            // it. The across term is dropped for compressed springs, where
+            // it would be negative, to keep the system positive definite.
+            float32 across = spring.stiffness
+                * MaxFloat32(1.0f - spring.restLength / dist, 0.0f);
+            float32 along = spring.stiffness - across;
+            SpringJacobian& jacobian = net->jacobians[s];
+            jacobian.xx = across + along * distVec.x * distVec.x;
+            jacobian.yy = across + along * distVec.y * distVec.y;
+            jacobian.zz = across + along * distVec.z * distVec.z;
+            jacobian.xy = along * distVec.x * distVec.y;
+            jacobian.xz = along * distVec.x * distVec.z;
+            jacobian.yz = along * distVec.y * distVec.z;
+        }
+    }
+}
+
+Vec3 GetSpringForce(const SpringNetwork* net, int i)
+{
+    Vec3 force = Vec3::zero;
+    for (int e = net->endStart[i]; e < net->endStart[i + 1]; e++) {
+        SpringEnd end = net->ends[e];
+        force += end.sign * net->forces[end.spring];
+    }
+    return force;
+}
+
+internal inline Vec3 MultiplyJacobian(const SpringJacobian& jacobian, Vec3 v)
+{
+    return Vec3 {
+        jacobian.xx * v.x + jacobian.xy * v.y + jacobian.xz * v.z,
+        jacobian.xy * v.x + jacobian.yy * v.y + jacobian.yz * v.z,
+        jacobian.xz * v.x + jacobian.yz * v.y + jacobian.zz * v.z
+    };
+}
+
+// Springs times v at particle i: the sum of K (v_i - v_j) over its springs,
+// where K is the spring's jacobian and j the particle at the other end
+internal inline Vec3 MultiplySprings(const SpringNetwork* net,
+    const Vec3* v, int i)
+{
+    Vec3 result = Vec3::zero;
+    for (int e = net->endStart[i]; e < net->endStart[i + 1]; e++) {
+        SpringEnd end = net->ends[e];
+        result += MultiplyJacobian(net->jacobians[end.spring],
+            v[i] - v[end.other]);
+    }
+    return result;
+}
+
+internal inline Vec3 MultiplyComponents(Vec3 v1, Vec3 v2)
+{
+    return Vec3 { v1.x * v2.x, v1.y * v2.y, v1.z * v2.z };
+}
+
+// Backward Euler linearized around the start of the step solves
+//   (I + h^2 K) v' = v + h f
+// for the new velocities v', where K is the springs' stiffness matrix and
+// v + h f the explicit Euler velocities, which vel holds to begin with.
+// The solve starts from those, so the first residual is -h^2 K vel.
+// Directions are updated as p = z + beta p, along with their products
+// q = A p as A z + beta q, so each iteration reads other chunks' data (z)
+// only once, right after it's complete.
+internal PARALLEL_FOR_FUNC(StartSpringSolve)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    const Vec3* vel = net->vel;
+    float32 h2 = net->deltaTime * net->deltaTime;
+    float32 rz = 0.0f;
+    float32 rr = 0.0f;
+    for (int i = begin; i < end; i++) {
+        Vec3 diagonal = Vec3::one;
+        for (int e = net->endStart[i]; e < net->endStart[i + 1]; e++) {
+            const SpringJacobian& jacobian
+                = net->jacobians[net->ends[e].spring];
+            diagonal += h2 * Vec3 { jacobian.xx, jacobian.yy, jacobian.zz };
+        }
+        Vec3 invDiagonal = {
+            1.0f / diagonal.x, 1.0f / diagonal.y, 1.0f / diagonal.z
+        };
+        Vec3 residual = -h2 * MultiplySprings(net, vel, i);
+        Vec3 precond = MultiplyComponents(invDiagonal, residual);
+        net->invDiagonal[i] = invDiagonal;
+        net->residual[i] = residual;
+        net->precond[i] = precond;
+        net->direction[i] = Vec3::zero;
+        net->product[i] = Vec3::zero;
+        rz += Dot(residual, precond);
+        rr += Dot(residual, residual);
+    }
+    int chunk = begin / net->chunkSize;
+    net->partialDots[0][chunk] = rz;
+    net->partialDots[1][chunk] = rr;
+}
+
+// Sums the residual dot products and checks for convergence
+internal void SumSpringResidual(SpringNetwork* net, bool32 start)
+{
+    if (net->converged) {
+        return;
+    }
+    int numChunks = (net->count + net->chunkSize - 1) / net->chunkSize;
+    float32 rz = 0.0f;
+    float32 rr = 0.0f;
+    for (int k = 0; k < numChunks; k++) {
+        rz += net->partialDots[0][k];
+        rr += net->partialDots[1][k];
+    }
+
+    if (start) {
+        net->rrStart = rr;
+        net->beta = 0.0f;
+    }
+    else {
+        net->iterations++;
+        net->beta = rz / net->rz;
+    }
+    net->rz = rz;
+    net->rr = rr;
+    net->relativeResidual = 0.0f;
+    if (net->rrStart > 0.0f) {
+        net->relativeResidual = sqrtf(rr / net->rrStart);
+    }
+    float32 tolerance = net->params.tolerance;
+    if (rr <= tolerance * tolerance * net->rrStart
+    || net->iterations >= net->params.maxIterations) {
+        net->converged = true;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(SumSpringStartResidual)
+{
+    SumSpringResidual((SpringNetwork*)data, true);
+}
+
+internal PARALLEL_FOR_FUNC(SumSpringStepResidual)
+{
+    SumSpringResidual((SpringNetwork*)data, false);
+}
+
+internal PARALLEL_FOR_FUNC(UpdateSpringDirection)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    if (net->converged) {
+        return;
+    }
+    float32 h2 = net->deltaTime * net->deltaTime;
+    float32 beta = net->beta;
+    float32 pq = 0.0f;
+    for (int i = begin; i < end; i++) {
+        Vec3 direction = net->precond[i] + beta * net->direction[i];
+        Vec3 product = net->precond[i]
+            + h2 * MultiplySprings(net, net->precond, i)
+            + beta * net->product[i];
+        net->direction[i] = direction;
+        net->product[i] = product;
+        pq += Dot(direction, product);
+    }
+    net->partialDots[0][begin / net->chunkSize] = pq;
+}
+
+internal PARALLEL_FOR_FUNC(SumSpringDirection)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    if (net->converged) {
+        return;
+    }
+    int numChunks = (net->count + net->chunkSize - 1) / net->chunkSize;
+    float32 pq = 0.0f;
+    for (int k = 0; k < numChunks; k++) {
+        pq += net->partialDots[0][k];
+    }
+    if (pq <= 0.0f) {
+        // Only happens once rounding has taken over
+        net->converged = true;
+        return;
+    }
+    net->alpha = net->rz / pq;
+}
+
+internal PARALLEL_FOR_FUNC(StepSpringSolve)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    if (net->converged) {
+        return;
+    }
+    float32 alpha = net->alpha;
+    float32 rz = 0.0f;
+    float32 rr = 0.0f;
+    for (int i = begin; i < end; i++) {
+        net->vel[i] += alpha * net->direction[i];
+        Vec3 residual = net->residual[i] - alpha * net->product[i];
+        Vec3 precond = MultiplyComponents(net->invDiagonal[i], residual);
+        net->residual[i] = residual;
+        net->precond[i] = precond;
+        rz += Dot(residual, precond);
+        rr += Dot(residual, residual);
+    }
+    int chunk = begin / net->chunkSize;
+    net->partialDots[0][chunk] = rz;
+    net->partialDots[1][chunk] = rr;
+}
+
+// Depends only on count, so results don't depend on the thread count
+internal int GetSpringSolveChunkSize(int count)
+{
+    return MaxInt(SPRING_SOLVE_CHUNK_SIZE,
+        (count + SPRING_SOLVE_MAX_CHUNKS - 1) / SPRING_SOLVE_MAX_CHUNKS);
+}
+
+internal void SetSpringSolve(SpringNetwork* net, Vec3* vel, int count,
+    float32 deltaTime)
+{
+    DEBUG_ASSERT(net->jacobians);
+    DEBUG_ASSERT(count <= net->numParticles);
+    net->vel = vel;
+    net->count = count;
+    net->deltaTime = deltaTime;
+    net->chunkSize = GetSpringSolveChunkSize(count);
+    net->converged = count == 0;
+    net->iterations = 0;
+    net->relativeResidual = 0.0f;
+}
+
+int AddSpringSolveJobs(TaskGraph* graph, SpringNetwork* net,
+    Vec3* vel, int count, float32 deltaTime, int after)
+{
+    SetSpringSolve(net, vel, count, deltaTime);
+
+    const int chunk = net->chunkSize;
+    int numChunks = (count + chunk - 1) / chunk;
+    int startJobs = AddTaskJobChunks(graph, "springs solve start",
+        StartSpringSolve, net, count, chunk);
+    int sumJob = AddTaskJob(graph, "springs residual sum",
+        SumSpringStartResidual, net, 0, 0);
+    for (int k = 0; k < numChunks; k++) {
+        AddTaskDependency(graph, startJobs + k, after);
+        AddTaskDependency(graph, sumJob, startJobs + k);
+    }
+    if (numChunks == 0) {
+        AddTaskDependency(graph, sumJob, after);
+    }
+
+    // Jobs past convergence find net->converged set and return right away
+    for (int it = 0; it < net->params.maxIterations; it++) {
+        int directionJobs = AddTaskJobChunks(graph, "springs direction",
+            UpdateSpringDirection, net, count, chunk);
+        int directionSum = AddTaskJob(graph, "springs direction sum",
+            SumSpringDirection, net, 0, 0);
+        int stepJobs = AddTaskJobChunks(graph, "springs solve step",
+            StepSpringSolve, net, count, chunk);
+        int residualSum = AddTaskJob(graph, "springs residual sum",
+            SumSpringStepResidual, net, 0, 0);
+        for (int k = 0; k < numChunks; k++) {
+            AddTaskDependency(graph, directionJobs + k, sumJob);
+            AddTaskDependency(graph, directionSum, directionJobs + k);
+            AddTaskDependency(graph, stepJobs + k, directionSum);
+            AddTaskDependency(graph, residualSum, stepJobs + k);
+        }
+        if (numChunks == 0) {
+            AddTaskDependency(graph, directionSum, sumJob);
+            AddTaskDependency(graph, residualSum, directionSum);
+        }
+        sumJob = residualSum;
+    }
+
+    return sumJob;
+}
+
+internal PARALLEL_FOR_FUNC(PredictSpringPositions)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    float32 deltaTime = net->deltaTime;
+    for (int i = begin; i < end; i++) {
+        net->startPos[i] = net->pos[i];
+        net->pos[i] += net->vel[i] * deltaTime;
+        // Every spring's multiplier is reset by the particle at its a end
+        for (int e = net->endStart[i]; e < net->endStart[i + 1]; e++) {
+            if (net->ends[e].sign > 0.0f) {
+                net->lambdas[net->ends[e].spring] = 0.0f;
+            }
+        }
+    }
+}
+
+// Projects the distance constraints of one color. All particles have unit
+// mass, so each end moves by the same amount.
+internal PARALLEL_FOR_FUNC(ProjectSpringColor)
+{
+    const SpringColor* color = (const SpringColor*)data;
+    SpringNetwork* net = color->net;
+    Vec3* pos = net->pos;
+    float32 invDeltaTime2 = 1.0f / (net->deltaTime * net->deltaTime);
+    for (int s = color->first + begin; s < color->first + end; s++) {
+        Spring spring = net->springs[s];
+        Vec3 distVec = pos[spring.b] - pos[spring.a];
+        float32 dist = Mag(distVec);
+        if (dist == 0.0f) {
+            continue;
+        }
+        float32 compliance = invDeltaTime2 / spring.stiffness;
+        float32 constraint = dist - spring.restLength;
+        float32 deltaLambda = (-constraint - compliance * net->lambdas[s])
+            / (2.0f + compliance);
+        net->lambdas[s] += deltaLambda;
+        Vec3 correction = (deltaLambda / dist) * distVec;
+        pos[spring.a] -= correction;
+        pos[spring.b] += correction;
+    }
+}
+
+internal PARALLEL_FOR_FUNC(FinishSpringProjection)
+{
+    SpringNetwork* net = (SpringNetwork*)data;
+    float32 invDeltaTime = 1.0f / net->deltaTime;
+    for (int i = begin; i < end; i++) {
+        net->vel[i] = (net->pos[i] - net->startPos[i]) * invDeltaTime;
+        net->pos[i] = net->startPos[i];
+    }
+}
+
+internal void SetSpringProjection(SpringNetwork* net, Vec3* pos, Vec3* vel,
+    int count, float32 deltaTime)
+{
+    DEBUG_ASSERT(net->lambdas);
+    // Springs reach every particle, so they can't be projected on a subset
+    DEBUG_ASSERT(count == net->numParticles);
+    net->pos = pos;
+    net->vel = vel;
+    net->count = count;
+    net->deltaTime = deltaTime;
+    net->chunkSize = GetSpringSolveChunkSize(count);
+}
+
+int AddSpringProjectionJobs(TaskGraph* graph, SpringNetwork* net,
+    Vec3* pos, Vec3* vel, int count, float32 deltaTime, int after)
+{
+    SetSpringProjection(net, pos, vel, count, deltaTime);
+
+    const int chunk = net->chunkSize;
+    int numChunks = (count + chunk - 1) / chunk;
+    int predictJobs = AddTaskJobChunks(graph, "springs predict",
+        PredictSpringPositions, net, count, chunk);
+    for (int k = 0; k < numChunks; k++) {
+        AddTaskDependency(graph, predictJobs + k, after);
+    }
+    int done = AddTaskJoin(graph, "springs predict done",
+        predictJobs, numChunks);
+    AddTaskDependency(graph, done, after);
+
+    // Each color waits for the one before it, since they share particles
+    for (int it = 0; it < net->params.iterations; it++) {
+        for (int c = 0; c < net->numColors; c++) {
+            SpringColor* color = &net->colors[c];
+            int colorChunk = MaxInt(SPRING_COLOR_CHUNK_SIZE,
+                (color->count + SPRING_COLOR_MAX_JOBS - 1)
+                / SPRING_COLOR_MAX_JOBS);
+            int numColorChunks = (color->count + colorChunk - 1) / colorChunk;
+            int colorJobs = AddTaskJobChunks(graph, "springs project",
+                ProjectSpringColor, color, color->count, colorChunk);
+            for (int k = 0; k < numColorChunks; k++) {
+                AddTaskDependency(graph, colorJobs + k, done);
+            }
+            if (numColorChunks == 1) {
+                done = colorJobs;
+            }
+            else {
+                done = AddTaskJoin(graph, "springs project done",
+                    colorJobs, numColorChunks);
+            }
+        }
+    }
+
+    int finishJobs = AddTaskJobChunks(graph, "springs finish",
+        FinishSpringProjection, net, count, chunk);
+    for (int k = 0; k < numChunks; k++) {
+        AddTaskDependency(graph, finishJobs + k, done);
+    }
+    int finishDone = AddTaskJoin(graph, "springs finish done",
+        finishJobs, numChunks);
+    AddTaskDependency(graph, finishDone, done);
+
+    return finishDone;
+}
\ No newline at end of file
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "km_math.h"
+#include "task_graph.h"
+
+// Springs per spring force job
+#define SPRING_CHUNK_SIZE 8192
+// Fewest springs per XPBD projection job. Each color of a 70x70 cloth is
+// only a few thousand springs, and has to be split for the color to run
+// in parallel.
+#define SPRING_COLOR_CHUNK_SIZE 512
+// Most projection jobs per color. Bigger cloths get bigger chunks instead,
+// so a 300x300 XPBD step stays around a thousand jobs.
+#define SPRING_COLOR_MAX_JOBS 8
+// Fewest particles per implicit solve or XPBD job. Every implicit solver
+// iteration adds two rounds of jobs, so not too small, but a 70x70 cloth
+// still splits into 5.
+#define SPRING_SOLVE_CHUNK_SIZE 1024
+// Most jobs per round. Bigger cloths get bigger chunks instead, so all
+// maxIterations rounds of a 300x300 implicit solve fit in one task graph.
+#define SPRING_SOLVE_MAX_CHUNKS 16
+
+struct Spring
+{
+    int a, b;
+    float32 restLength;
+    float32 stiffness;
+};
+
+// Symmetric 3x3 matrix: minus the derivative of a spring's force on one
+// end with respect to that end's position
+struct SpringJacobian
+{
+    float32 xx, yy, zz;
+    float32 xy, xz, yz;
+};
+
+// One end of a spring. The spring's force pulls a towards b, so sign is
+// 1 at a and -1 at b.
+struct SpringEnd
+{
+    int spring;
+    int other; // particle at the spring's other end
+    float32 sign;
+};
+
+enum ClothSolver
+{
+    // Spring forces go straight into the velocity update
+    CLOTH_SOLVER_EXPLICIT,
+    // Backward Euler (Baraff & Witkin 1998). The spring forces are
+    // linearized and the new velocities solved for with a Jacobi-
+    // preconditioned conjugate gradient, which stays stable at any
+    // timestep, however stiff the springs.
+    CLOTH_SOLVER_IMPLICIT,
+    // Extended position-based dynamics (Macklin et al. 2016). Springs
+    // become distance constraints with compliance 1 / stiffness, so they
+    // behave the same at any timestep. Constraints are graph-colored, and
+    // each color is projected in parallel.
+    CLOTH_SOLVER_XPBD
+};
+
+struct ClothSpringParams
+{
+    float32 restLength; // between grid neighbors
+    float32 stiffness;
+    // Diagonal (shear) and two-apart (bend) springs, left out when 0
+    float32 shearStiffness;
+    float32 bendStiffness;
+
+    ClothSolver solver;
+    // Implicit: conjugate gradient iteration cap, and tolerance on the
+    // residual relative to the starting residual
+    int maxIterations;
+    float32 tolerance;
+    // XPBD: projection passes over all constraints per step. Fewer passes
+    // are faster, but leave the cloth softer than its stiffness.
+    int iterations;
+};
+
+struct SpringNetwork;
+
+// The springs of one color, none of which share a particle
+struct SpringColor
+{
+    SpringNetwork* net;
+    int first;
+    int count;
+};
+
+// Springs between particles, built once. Each step computes every spring's
+// force once, then each particle sums the forces at its spring ends, which
+// are stored per particle in compressed sparse row form.
+struct SpringNetwork
+{
+    ClothSpringParams params;
+    int numParticles;
+    int numSprings;
+    Spring* springs;
+    Vec3* forces; // per spring, from the last ComputeSpringForces
+    int* endStart; // numParticles + 1 offsets into ends
+    SpringEnd* ends;
+    // Largest total stiffness of the springs at one particle, which bounds
+    // the stable explicit timestep
+    float32 maxStiffness;
+
+    // Implicit mode only. The solve being computed, and its state.
+    // XPBD uses vel, count and deltaTime as well.
+    SpringJacobian* jacobians; // per spring, from the last ComputeSpringForces
+    Vec3* vel;
+    int count;
+    float32 deltaTime;
+    int chunkSize; // particles per job, from count
+    Vec3* residual;
+    Vec3* invDiagonal; // Jacobi preconditioner
+    Vec3* precond; // preconditioned residual
+    Vec3* direction;
+    Vec3* product; // system matrix times direction
+    // Per-chunk dot products, summed in chunk order once all chunks are in
+    float32* partialDots[2];
+    float32 rz, rr, rrStart;
+    float32 alpha, beta;
+    bool32 converged;
+
+    // Last solve, for profiling
+    int iterations;
+    float32 relativeResidual;
+
+    // XPBD only. Springs are sorted by color.
+    int numColors;
+    SpringColor* colors;
+    float32* lambdas; // per spring, Lagrange multipliers of the step
+    Vec3* pos;
+    Vec3* startPos;
+};
+
+// Structural springs between the neighbors of a width x height grid of
+// particles (row-major), plus shear and bend springs if enabled.
+// Colors them for XPBD, which reorders them.
+// net must be zeroed or freed with FreeSpringNetwork first.
+void InitClothSprings(SpringNetwork* net, int width, int height,
+    ClothSpringParams params);
+void FreeSpringNetwork(SpringNetwork* net);
+
+// Computes the forces of springs [begin, end) from the particle positions
+void ComputeSpringForces(SpringNetwork* net, const Vec3* pos,
+    int begin, int end);
+// Sum of the spring forces on particle i, once ComputeSpringForces has run
+// over all its springs
+Vec3 GetSpringForce(const SpringNetwork* net, int i);
+
+// Implicit mode: adds jobs that turn vel, the particles' velocities after
+// an explicit Euler step over deltaTime, into the backward Euler
+// velocities, starting after job "after". Needs ComputeSpringForces over
+// all springs first, at the start-of-step positions. Returns the job that
+// finishes the solve. vel is read when the jobs run.
+// Adds jobs for params.maxIterations iterations; the ones past convergence
+// do nothing.
+int AddSpringSolveJobs(TaskGraph* graph, SpringNetwork* net,
+    Vec3* vel, int count, float32 deltaTime, int after);
+
+// XPBD mode: adds jobs that move particles [0, count) by vel over
+// deltaTime, project the constraints, then put pos back and set vel to the
+// velocity that reaches the projected positions, starting after job
+// "after". Returns the job that finishes the projection. pos and vel are
+// read when the jobs run.
+int AddSpringProjectionJobs(TaskGraph* graph, SpringNetwork* net,
+    Vec3* pos, Vec3* vel, int count, float32 deltaTime, int after);
\ No newline at end of file
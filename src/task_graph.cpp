@@ -0,0 +1,282 @@
+#include "task_graph.h"
+
+#include <stdio.h>
+
+#include "km_debug.h"
+#include "km_math.h"
+
+internal inline int32 AtomicCompareExchangeInt32(volatile int32* value,
+    int32 newValue, int32 expected)
+{
+    return (int32)AtomicCompareExchangeUInt32((volatile uint32*)value,
+        (uint32)newValue, (uint32)expected);
+}
+
+// Owner only
+internal void PushTaskJob(TaskDeque* deque, int job)
+{
+    int32 bottom = deque->bottom;
+    DEBUG_ASSERT(bottom < MAX_TASK_JOBS);
+    deque->jobs[bottom] = job;
+    COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_WRITES;
+    deque->bottom = bottom + 1;
+}
+
+// Owner only. Returns -1 if the deque is empty.
+internal int PopTaskJob(TaskDeque* deque)
+{
+    int32 bottom = deque->bottom - 1;
+    deque->bottom = bottom;
+    // Thieves must see the new bottom before we look at top
+    COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_READS;
+    int32 top = deque->top;
+
+    if (top > bottom) {
+        deque->bottom = top;
+        return -1;
+    }
+
+    int job = deque->jobs[bottom];
+    if (top == bottom) {
+        // Last job: race the thieves for it
+        if (AtomicCompareExchangeInt32(&deque->top, top + 1, top) != top) {
+            job = -1;
+        }
+        deque->bottom = top + 1;
+    }
+
+    return job;
+}
+
+// Any thread. Returns -1 if the deque is empty or the steal lost a race.
+internal int StealTaskJob(TaskDeque* deque)
+{
+    int32 top = deque->top;
+    COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_READS;
+    int32 bottom = deque->bottom;
+    if (top >= bottom) {
+        return -1;
+    }
+
+    int job = deque->jobs[top];
+    if (AtomicCompareExchangeInt32(&deque->top, top + 1, top) != top) {
+        return -1;
+    }
+
+    return job;
+}
+
+internal void RunTaskJob(TaskGraph* graph, int thread, int jobID)
+{
+    TaskJob* job = &graph->jobs[jobID];
+    job->thread = thread;
+    job->startCycles = ReadCycleCounter();
+    job->func(job->begin, job->end, job->data);
+    job->endCycles = ReadCycleCounter();
+
+    TaskDeque* deque = &graph->deques[thread];
+    int dependent = job->firstDependent;
+    while (dependent != -1) {
+        TaskJob* dependentJob = &graph->jobs[graph->dependents[dependent].job];
+        uint32 unfinished = AtomicAddUInt32(
+            (volatile uint32*)&dependentJob->unfinishedDependencies,
+            (uint32)-1);
+        if (unfinished == 1) {
+            PushTaskJob(deque, graph->dependents[dependent].job);
+        }
+        dependent = graph->dependents[dependent].next;
+    }
+
+    AtomicAddUInt32(&graph->jobsRemaining, (uint32)-1);
+}
+
+internal void TaskGraphThread(TaskGraph* graph, int thread)
+{
+    TaskDeque* deque = &graph->deques[thread];
+    while (graph->jobsRemaining > 0) {
+        int job = PopTaskJob(deque);
+        for (int i = 1; job == -1 && i < graph->threadCount; i++) {
+            job = StealTaskJob(&graph->deques[(thread + i)
+                % graph->threadCount]);
+        }
+
+        if (job != -1) {
+            RunTaskJob(graph, thread, job);
+        }
+    }
+}
+
+internal PLATFORM_WORK_QUEUE_CALLBACK(TaskGraphWork)
+{
+    TaskGraph* graph = (TaskGraph*)data;
+    int thread = (int)AtomicAddUInt32(&graph->nextThread, 1);
+    TaskGraphThread(graph, thread);
+}
+
+void ClearTaskGraph(TaskGraph* graph)
+{
+    graph->overflowed = false;
+    graph->numJobs = 0;
+    graph->numDependents = 0;
+}
+
+int AddTaskJob(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int begin, int end)
+{
+    if (graph->numJobs == MAX_TASK_JOBS) {
+        graph->overflowed = true;
+        return -1;
+    }
+
+    int jobID = graph->numJobs++;
+    TaskJob* job = &graph->jobs[jobID];
+    job->name = name;
+    job->func = func;
+    job->data = data;
+    job->begin = begin;
+    job->end = end;
+    job->numDependencies = 0;
+    job->firstDependent = -1;
+    job->thread = -1;
+    job->startCycles = 0;
+    job->endCycles = 0;
+
+    return jobID;
+}
+
+int AddTaskJobChunks(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int count, int chunkSize)
+{
+    DEBUG_ASSERT(chunkSize > 0);
+
+    int first = -1;
+    for (int begin = 0; begin < count; begin += chunkSize) {
+        int job = AddTaskJob(graph, name, func, data,
+            begin, MinInt(begin + chunkSize, count));
+        if (first == -1) {
+            first = job;
+        }
+    }
+
+    return first;
+}
+
+internal PARALLEL_FOR_FUNC(TaskJoinJob)
+{
+}
+
+int AddTaskJoin(TaskGraph* graph, const char* name, int first, int count)
+{
+    int join = AddTaskJob(graph, name, TaskJoinJob, nullptr, 0, 0);
+    for (int i = 0; i < count; i++) {
+        AddTaskDependency(graph, join, first + i);
+    }
+
+    return join;
+}
+
+void AddTaskDependency(TaskGraph* graph, int job, int dependsOn)
+{
+    if (graph->overflowed) {
+        // Job IDs past the overflow are -1, or -1 plus a chunk index
+        return;
+    }
+    DEBUG_ASSERT(0 <= job && job < graph->numJobs);
+    DEBUG_ASSERT(0 <= dependsOn && dependsOn < graph->numJobs);
+    if (graph->numDependents == MAX_TASK_DEPENDENCIES) {
+        graph->overflowed = true;
+        return;
+    }
+
+    int dependent = graph->numDependents++;
+    graph->dependents[dependent].job = job;
+    graph->dependents[dependent].next = graph->jobs[dependsOn].firstDependent;
+    graph->jobs[dependsOn].firstDependent = dependent;
+    graph->jobs[job].numDependencies++;
+}
+
+bool32 RunTaskGraph(TaskGraph* graph, const ThreadPool* pool)
+{
+    if (graph->overflowed) {
+        DEBUG_PRINT("Task graph over %d jobs or %d dependencies, not run\n",
+            MAX_TASK_JOBS, MAX_TASK_DEPENDENCIES);
+        return false;
+    }
+
+    int threadCount = pool ? pool->threadCount : 1;
+    threadCount = ClampInt(threadCount, 1, TASK_GRAPH_MAX_THREADS);
+    graph->threadCount = threadCount;
+    graph->jobsRemaining = graph->numJobs;
+    graph->nextThread = 0;
+    graph->startCycles = ReadCycleCounter();
+
+    for (int i = 0; i < threadCount; i++) {
+        graph->deques[i].top = 0;
+        graph->deques[i].bottom = 0;
+    }
+    // Deal out the jobs that are ready from the start
+    int nextDeque = 0;
+    for (int i = 0; i < graph->numJobs; i++) {
+        TaskJob* job = &graph->jobs[i];
+        job->unfinishedDependencies = job->numDependencies;
+        if (job->numDependencies == 0) {
+            PushTaskJob(&graph->deques[nextDeque], i);
+            nextDeque = (nextDeque + 1) % threadCount;
+        }
+    }
+
+    if (threadCount == 1) {
+        TaskGraphThread(graph, 0);
+    }
+    else {
+        // Any thread that picks up an entry works until the whole graph is
+        // done, so this finishes even if fewer workers show up.
+        for (int i = 0; i < threadCount; i++) {
+            pool->AddWorkEntry(pool->queue, TaskGraphWork, graph);
+        }
+        pool->CompleteAllWork(pool->queue);
+    }
+
+    graph->endCycles = ReadCycleCounter();
+    return true;
+}
+
+int DumpTaskGraph(const TaskGraph* graph, char* buffer, int bufferSize)
+{
+    int length = 0;
+#define DUMP_APPEND(...) \
+    if (length < bufferSize) { \
+        int written = snprintf(buffer + length, bufferSize - length, \
+            __VA_ARGS__); \
+        length = MinInt(length + written, bufferSize - 1); \
+    }
+
+    DUMP_APPEND("Task graph: %d jobs, %d threads, %.1f kcycles\n",
+        graph->numJobs, graph->threadCount,
+        (float32)(graph->endCycles - graph->startCycles) / 1000.0f);
+    DUMP_APPEND("%5s %6s %12s %12s  %-20s %-15s %s\n",
+        "job", "thread", "start (kc)", "length (kc)",
+        "name", "range", "depends on");
+    for (int i = 0; i < graph->numJobs; i++) {
+        const TaskJob* job = &graph->jobs[i];
+        DUMP_APPEND("%5d %6d %12.1f %12.1f  %-20s %6d - %6d ",
+            i, job->thread,
+            (float32)(job->startCycles - graph->startCycles) / 1000.0f,
+            (float32)(job->endCycles - job->startCycles) / 1000.0f,
+            job->name, job->begin, job->end);
+        // Dependencies are stored as forward edges, so search for them
+        for (int j = 0; j < graph->numJobs; j++) {
+            int dependent = graph->jobs[j].firstDependent;
+            while (dependent != -1) {
+                if (graph->dependents[dependent].job == i) {
+                    DUMP_APPEND(" %d", j);
+                }
+                dependent = graph->dependents[dependent].next;
+            }
+        }
+        DUMP_APPEND("\n");
+    }
+
+#undef DUMP_APPEND
+    return length;
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "km_defines.h"
+#include "thread_pool.h"
+
+#define MAX_TASK_JOBS 2048
+#define MAX_TASK_DEPENDENCIES 8192
+#define TASK_GRAPH_MAX_THREADS 64
+
+// A job runs func(begin, end, data), same as one ParallelFor chunk.
+// It becomes ready once every job it depends on has finished.
+struct TaskJob
+{
+    const char* name;
+    ParallelForFunc* func;
+    void* data;
+    int begin, end;
+
+    int numDependencies;
+    int32 volatile unfinishedDependencies;
+    int firstDependent; // into TaskGraph::dependents, -1 terminated
+
+    // Filled in when the graph runs
+    int thread;
+    uint64 startCycles;
+    uint64 endCycles;
+};
+
+struct TaskDependent
+{
+    int job;
+    int next;
+};
+
+// Chase-Lev work-stealing deque. The owning thread pushes and pops at the
+// bottom, other threads steal from the top. Every job is pushed at most
+// once per run, so it never needs to wrap or grow.
+struct TaskDeque
+{
+    int32 volatile top;
+    int32 volatile bottom;
+    int jobs[MAX_TASK_JOBS];
+};
+
+struct TaskGraph
+{
+    // Set once a job or dependency didn't fit. The graph is then incomplete
+    // and won't run.
+    bool32 overflowed;
+    int numJobs;
+    TaskJob jobs[MAX_TASK_JOBS];
+    int numDependents;
+    TaskDependent dependents[MAX_TASK_DEPENDENCIES];
+
+    int threadCount;
+    uint32 volatile jobsRemaining;
+    uint32 volatile nextThread;
+    uint64 startCycles;
+    uint64 endCycles;
+
+    TaskDeque deques[TASK_GRAPH_MAX_THREADS];
+};
+
+void ClearTaskGraph(TaskGraph* graph);
+// Returns the new job's ID, or -1 if the graph is full (MAX_TASK_JOBS).
+// Dependencies added to a full graph are dropped.
+int AddTaskJob(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int begin, int end);
+// Adds one job per chunk of [0, count). Returns the ID of the first one;
+// chunk k gets ID (first + k). Returns -1 if count is 0.
+int AddTaskJobChunks(TaskGraph* graph, const char* name,
+    ParallelForFunc* func, void* data, int count, int chunkSize);
+void AddTaskDependency(TaskGraph* graph, int job, int dependsOn);
+// Adds an empty job that depends on jobs [first, first + count), so later
+// jobs can wait for all of them through a single dependency.
+int AddTaskJoin(TaskGraph* graph, const char* name, int first, int count);
+
+// Runs every job in the graph, spread over pool (may be null).
+// Blocks until all of them are done. Must only be called from the main thread.
+// Returns false, running nothing, if the graph overflowed while being built.
+bool32 RunTaskGraph(TaskGraph* graph, const ThreadPool* pool);
+
+// Writes a text listing of the last run (thread, start, duration,
+// dependencies of every job) into buffer. Returns the length written.
+int DumpTaskGraph(const TaskGraph* graph, char* buffer, int bufferSize);
\ No newline at end of file
@@ -70,7 +70,7 @@ TextGL InitTextGL(const ThreadContext* thread,
 
 FontFace LoadFontFace(const ThreadContext* thread,
     FT_Library library,
-    const char* path, uint32 height,
+    const char* path, uint32 height, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory)
 {
@@ -159,8 +159,13 @@ FontFace LoadFontFace(const ThreadContext* thread,
     //printf("atlasSize: %u x %u\n", atlasWidth, atlasHeight);
 
     // Allocate and initialize atlas texture data.
-    // TODO get rid of this malloc
-    uint8* atlasData = (uint8*)malloc(atlasWidth * atlasHeight);
+    TemporaryMemory temp = BeginTemporaryMemory(scratch);
+    uint8* atlasData = PUSH_ARRAY(scratch, uint8, atlasWidth * atlasHeight);
+    if (!atlasData) {
+        DEBUG_PRINT("Font atlas memory allocation failed\n");
+        EndTemporaryMemory(temp);
+        return face;
+    }
     for (uint32 j = 0; j < atlasHeight; j++) {
         for (uint32 i = 0; i < atlasWidth; i++) {
             atlasData[j * atlasWidth + i] = 0;
@@ -224,7 +229,7 @@ FontFace LoadFontFace(const ThreadContext* thread,
     );
     glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-    free(atlasData);
+    EndTemporaryMemory(temp);
 
     return face;
 }
@@ -8,6 +8,7 @@
 
 #include "opengl.h"
 #include "opengl_funcs.h"
+#include "km_lib.h"
 #include "km_math.h"
 #include "main_platform.h"
 
@@ -41,7 +42,7 @@ TextGL InitTextGL(const ThreadContext* thread,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory);
 FontFace LoadFontFace(const ThreadContext* thread,
     FT_Library library,
-    const char* path, uint32 height,
+    const char* path, uint32 height, MemoryArena* scratch,
     DEBUGPlatformReadFileFunc* DEBUGPlatformReadFile,
     DEBUGPlatformFreeFileMemoryFunc* DEBUGPlatformFreeFileMemory);
 
@@ -0,0 +1,62 @@
+#include "thread_pool.h"
+
+#include "km_debug.h"
+#include "km_math.h"
+
+struct ParallelForJob
+{
+    ParallelForFunc* func;
+    void* data;
+    int count;
+    int chunkSize;
+    int chunkCount;
+
+    uint32 volatile nextChunk;
+};
+
+internal PLATFORM_WORK_QUEUE_CALLBACK(ParallelForWork)
+{
+    ParallelForJob* job = (ParallelForJob*)data;
+    for (;;) {
+        int chunk = (int)AtomicAddUInt32(&job->nextChunk, 1);
+        if (chunk >= job->chunkCount) {
+            break;
+        }
+        int begin = chunk * job->chunkSize;
+        int end = MinInt(begin + job->chunkSize, job->count);
+        job->func(begin, end, job->data);
+    }
+}
+
+void ParallelFor(const ThreadPool* pool, int count, int chunkSize,
+    ParallelForFunc* func, void* data)
+{
+    DEBUG_ASSERT(chunkSize > 0);
+    if (count <= 0) {
+        return;
+    }
+
+    int chunkCount = (count + chunkSize - 1) / chunkSize;
+    int threadCount = pool ? pool->threadCount : 1;
+    if (threadCount <= 1 || chunkCount == 1) {
+        for (int begin = 0; begin < count; begin += chunkSize) {
+            func(begin, MinInt(begin + chunkSize, count), data);
+        }
+        return;
+    }
+
+    ParallelForJob job;
+    job.func = func;
+    job.data = data;
+    job.count = count;
+    job.chunkSize = chunkSize;
+    job.chunkCount = chunkCount;
+    job.nextChunk = 0;
+
+    // One entry per thread; each one keeps pulling chunks until none are left
+    int entries = MinInt(threadCount, chunkCount);
+    for (int i = 0; i < entries; i++) {
+        pool->AddWorkEntry(pool->queue, ParallelForWork, &job);
+    }
+    pool->CompleteAllWork(pool->queue);
+}
\ No newline at end of file
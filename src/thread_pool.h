@@ -0,0 +1,25 @@
+#pragma once
+
+#include "km_defines.h"
+#include "main_platform.h"
+
+// Game-side view of the platform work queue.
+// threadCount is the number of threads a ParallelFor is spread over,
+// including the calling (main) thread.
+struct ThreadPool
+{
+    PlatformWorkQueue* queue;
+    PlatformAddWorkEntryFunc* AddWorkEntry;
+    PlatformCompleteAllWorkFunc* CompleteAllWork;
+    int threadCount;
+};
+
+#define PARALLEL_FOR_FUNC(name) void name(int begin, int end, void* data)
+typedef PARALLEL_FOR_FUNC(ParallelForFunc);
+
+// Runs func over [0, count) in chunks of chunkSize, handing chunks out to
+// threads as they become free. Blocks until every chunk is done.
+// With a null pool or a single thread, chunks run inline and in order.
+// Must only be called from the main thread.
+void ParallelFor(const ThreadPool* pool, int count, int chunkSize,
+    ParallelForFunc* func, void* data);
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <Xinput.h>
 #include <intrin.h> // __rdtsc
 
@@ -359,6 +361,71 @@ DEBUG_PLATFORM_WRITE_FILE_FUNC(DEBUGPlatformWriteFile)
     return bytesWritten == memorySize;
 }
 
+DEBUG_PLATFORM_GET_FILE_INFO_FUNC(DEBUGPlatformGetFileInfo)
+{
+    char fullPath[MAX_PATH];
+    CatStrings(StringLength(pathToApp_), pathToApp_,
+        StringLength(fileName), fileName, MAX_PATH, fullPath);
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(fullPath, GetFileExInfoStandard, &data)) {
+        // TODO log
+        return false;
+    }
+
+    info->size = ((uint64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    info->modifiedTime = ((uint64)data.ftLastWriteTime.dwHighDateTime << 32)
+        | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+DEBUG_PLATFORM_MAP_FILE_FUNC(DEBUGPlatformMapFile)
+{
+    DEBUGReadFileResult result = {};
+
+    char fullPath[MAX_PATH];
+    CatStrings(StringLength(pathToApp_), pathToApp_,
+        StringLength(fileName), fileName, MAX_PATH, fullPath);
+
+    HANDLE hFile = CreateFile(fullPath, GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, NULL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        // TODO log
+        return result;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0) {
+        // TODO log
+        CloseHandle(hFile);
+        return result;
+    }
+
+    // The view keeps the mapping and the file open
+    HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY,
+        0, 0, NULL);
+    CloseHandle(hFile);
+    if (!hMapping) {
+        // TODO log
+        return result;
+    }
+    result.data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if (result.data) {
+        result.size = (uint64)fileSize.QuadPart;
+    }
+    return result;
+}
+
+DEBUG_PLATFORM_UNMAP_FILE_FUNC(DEBUGPlatformUnmapFile)
+{
+    if (file->data) {
+        UnmapViewOfFile(file->data);
+        file->data = 0;
+    }
+    file->size = 0;
+}
+
 #endif
 
 internal void Win32LoadXInput()
@@ -835,6 +902,106 @@ internal bool Win32CreateRC(HWND hWnd,
     return true;
 }
 
+PLATFORM_ADD_WORK_ENTRY_FUNC(Win32AddWorkEntry)
+{
+    uint32 newNextEntryToWrite = (queue->nextEntryToWrite + 1)
+        % ARRAY_COUNT(queue->entries);
+    // Queue is full otherwise. Entries are only added from the main thread.
+    DEBUG_ASSERT(newNextEntryToWrite != queue->nextEntryToRead);
+    PlatformWorkQueueEntry* entry = queue->entries + queue->nextEntryToWrite;
+    entry->callback = callback;
+    entry->data = data;
+    queue->completionGoal++;
+
+    COMPLETE_PREVIOUS_WRITES_BEFORE_FUTURE_WRITES;
+
+    queue->nextEntryToWrite = newNextEntryToWrite;
+    ReleaseSemaphore(queue->semaphoreHandle, 1, 0);
+}
+
+// Returns true if there was no work to do
+internal bool32 Win32DoNextWorkQueueEntry(PlatformWorkQueue* queue)
+{
+    bool32 shouldSleep = false;
+
+    uint32 originalNextEntryToRead = queue->nextEntryToRead;
+    uint32 newNextEntryToRead = (originalNextEntryToRead + 1)
+        % ARRAY_COUNT(queue->entries);
+    if (originalNextEntryToRead != queue->nextEntryToWrite) {
+        uint32 index = AtomicCompareExchangeUInt32(&queue->nextEntryToRead,
+            newNextEntryToRead, originalNextEntryToRead);
+        if (index == originalNextEntryToRead) {
+            PlatformWorkQueueEntry entry = queue->entries[index];
+            entry.callback(queue, entry.data);
+            AtomicAddUInt32(&queue->completionCount, 1);
+        }
+    }
+    else {
+        shouldSleep = true;
+    }
+
+    return shouldSleep;
+}
+
+PLATFORM_COMPLETE_ALL_WORK_FUNC(Win32CompleteAllWork)
+{
+    while (queue->completionGoal != queue->completionCount) {
+        Win32DoNextWorkQueueEntry(queue);
+    }
+
+    queue->completionGoal = 0;
+    queue->completionCount = 0;
+}
+
+DWORD WINAPI Win32WorkerThreadProc(LPVOID lpParameter)
+{
+    PlatformWorkQueue* queue = (PlatformWorkQueue*)lpParameter;
+    for (;;) {
+        if (Win32DoNextWorkQueueEntry(queue)) {
+            WaitForSingleObjectEx(queue->semaphoreHandle, INFINITE, FALSE);
+        }
+    }
+
+    return 0;
+}
+
+internal void Win32MakeWorkQueue(PlatformWorkQueue* queue, int threadCount)
+{
+    queue->completionGoal = 0;
+    queue->completionCount = 0;
+    queue->nextEntryToWrite = 0;
+    queue->nextEntryToRead = 0;
+    queue->semaphoreHandle = CreateSemaphoreEx(0, 0, threadCount + 1,
+        0, 0, SEMAPHORE_ALL_ACCESS);
+
+    for (int i = 0; i < threadCount; i++) {
+        DWORD threadID;
+        HANDLE threadHandle = CreateThread(0, 0, Win32WorkerThreadProc,
+            queue, 0, &threadID);
+        if (!threadHandle) {
+            DEBUG_PRINT("Failed to create worker thread %d\n", i);
+            continue;
+        }
+        CloseHandle(threadHandle);
+    }
+}
+
+// Worker thread count defaults to one per core, minus the main thread.
+// Override with "--threads N" on the command line.
+internal int Win32GetWorkerThreadCount(LPSTR cmdline)
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    int threadCount = (int)systemInfo.dwNumberOfProcessors - 1;
+    const char* threadsArg = strstr(cmdline, "--threads");
+    if (threadsArg) {
+        // Total thread count, including the main thread
+        threadCount = atoi(threadsArg + strlen("--threads")) - 1;
+    }
+
+    return ClampInt(threadCount, 0, WIN32_MAX_WORKER_THREADS);
+}
+
 internal HWND Win32CreateWindow(
     HINSTANCE hInstance,
     const char* className, const char* windowName,
@@ -935,6 +1102,18 @@ int CALLBACK WinMain(
     platformFuncs.DEBUGPlatformFreeFileMemory = DEBUGPlatformFreeFileMemory;
     platformFuncs.DEBUGPlatformReadFile = DEBUGPlatformReadFile;
     platformFuncs.DEBUGPlatformWriteFile = DEBUGPlatformWriteFile;
+    platformFuncs.DEBUGPlatformGetFileInfo = DEBUGPlatformGetFileInfo;
+    platformFuncs.DEBUGPlatformMapFile = DEBUGPlatformMapFile;
+    platformFuncs.DEBUGPlatformUnmapFile = DEBUGPlatformUnmapFile;
+
+    PlatformWorkQueue workQueue = {};
+    int workerThreadCount = Win32GetWorkerThreadCount(cmdline);
+    Win32MakeWorkQueue(&workQueue, workerThreadCount);
+    platformFuncs.PlatformAddWorkEntry = Win32AddWorkEntry;
+    platformFuncs.PlatformCompleteAllWork = Win32CompleteAllWork;
+    platformFuncs.workQueue = &workQueue;
+    platformFuncs.workerThreadCount = workerThreadCount;
+    DEBUG_PRINT("Started %d worker threads\n", workerThreadCount);
 
     // Initialize OpenGL
     if (!Win32InitOpenGL(&platformFuncs.glFunctions,
@@ -38,4 +38,25 @@ struct Win32State
 
 	char exeFilePath[MAX_PATH];
 	char* exeOnePastLastSlash;
+};
+
+#define WIN32_MAX_WORKER_THREADS 64
+#define WORK_QUEUE_ENTRY_COUNT 256
+
+struct PlatformWorkQueueEntry
+{
+	PlatformWorkQueueCallback* callback;
+	void* data;
+};
+
+struct PlatformWorkQueue
+{
+	uint32 volatile completionGoal;
+	uint32 volatile completionCount;
+
+	uint32 volatile nextEntryToWrite;
+	uint32 volatile nextEntryToRead;
+	HANDLE semaphoreHandle;
+
+	PlatformWorkQueueEntry entries[WORK_QUEUE_ENTRY_COUNT];
 };
\ No newline at end of file